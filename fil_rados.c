@@ -1,56 +1,201 @@
 /* vim: ts=4 sts=4 sw=4 expandtab */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <rados/librados.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <fnmatch.h>
 #include <jansson.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "fil_rados.h"
+#include "fil_rados_trace.h"
 
-#define	DEBUG 1
+/* traces of the object removals, build with -DDEBUG to get them */
+#ifndef DEBUG
+#define	DEBUG 0
+#endif
 
 const char *METADATA_OBJECT_NAME = "metadata";
 
+/* object attribute holding the file size, set on the object written
+   by any write extending the file */
+#define FIL_SIZE_XATTR "fil_size"
+
+/* attribute of the first object of a file holding the offset of the
+   object at the end of the file, see _fil_record_eof */
+#define FIL_EOF_XATTR "fil_eof"
+/* format of the offset, of a fixed width so that the attribute compares
+   as a string in the order of the numbers */
+#define FIL_EOF_FORMAT "%020zu"
+
+/* attribute of the first object of a file holding its generation, see
+   _fil_gen_bump */
+#define FIL_GEN_XATTR "fil_gen"
+
+/* time a notification of a catalog change waits for the watchers */
+#ifndef FIL_MD_NOTIFY_TIMEOUT_MS
+#define FIL_MD_NOTIFY_TIMEOUT_MS 5000
+#endif
+
+/* object and attribute holding the id of the next file created in the
+   pool, see _fil_md_take_id */
+#define FIL_MD_ID_OBJECT "metadata.next_id"
+#define FIL_MD_ID_XATTR "fil_next_id"
+
+/* saves of the catalog retried when another client saved it first, see
+   _fil_update_metadata_json */
+#ifndef FIL_MD_UPDATE_RETRIES
+#define FIL_MD_UPDATE_RETRIES 16
+#endif
+
+/* bytes of the metadata object read with its stat, a larger object
+   needs a second read */
+#ifndef FIL_METADATA_READ_HINT
+#define FIL_METADATA_READ_HINT (1024*1024)
+#endif
+
+/* zstd compression level of the compressed files */
+#ifndef FIL_ZSTD_LEVEL
+#define FIL_ZSTD_LEVEL 3
+#endif
+
 json_t *metadata_json = NULL;
 json_error_t error_json;
 
+/* protects metadata_json and its index, recursive since the catalog
+   functions call each other */
+pthread_mutex_t fil_catalog_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
 rados_ioctx_t rados_io_context;
 rados_t ceph_cluster;
 
+/* shards of the client, see fil_rados_init_sharded, shard 0 is
+   ceph_cluster / rados_io_context, the catalog always goes to it */
+#ifndef FIL_MAX_SHARDS
+#define FIL_MAX_SHARDS 64
+#endif
+static rados_t fil_shard_clusters[FIL_MAX_SHARDS];
+static unsigned int fil_n_shards = 1;
+static int fil_shard_mode = FIL_SHARD_BY_FILE;
+/* next shard given to a thread, and the shard of the calling thread,
+   -1 until its first I/O */
+static unsigned int fil_shard_next = 0;
+static __thread int fil_shard_thread = -1;
+
+/* data pools opened by the client, one io context per shard, see
+   fil_placement_add.  Pool 0 is the pool given to fil_rados_init, the
+   files without a pool in the catalog are in it.  The pools are only
+   added, under fil_pool_mutex, until fil_rados_destroy. */
+#ifndef FIL_MAX_POOLS
+#define FIL_MAX_POOLS 16
+#endif
+struct fil_pool {
+	char*		name;	/* name of the pool */
+	rados_ioctx_t	ioctxs[FIL_MAX_SHARDS];	/* io context of each shard */
+	size_t		ec_align;	/* write alignment, see fil_ec_configure */
+};
+static struct fil_pool fil_pools[FIL_MAX_POOLS];
+static unsigned int fil_n_pools = 0;
+static pthread_mutex_t fil_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* placement policy, the first rule matching a new file gives its pool */
+#ifndef FIL_MAX_PLACEMENT_RULES
+#define FIL_MAX_PLACEMENT_RULES 32
+#endif
+struct fil_placement_rule {
+	char*		pattern;	/* fnmatch pattern of the path, NULL for any */
+	os_file_type_t	type;		/* OS_FILE_TYPE_UNKNOWN for any */
+	unsigned int	pool;		/* index in fil_pools */
+};
+static struct fil_placement_rule fil_placement_rules[FIL_MAX_PLACEMENT_RULES];
+static unsigned int fil_n_placement_rules = 0;
+
+/* erasure coded pool, see fil_ec_configure: the write alignment, 0 when
+   writes are not aligned, FIL_EC_WHOLE_OBJECT when the pool takes no
+   partial overwrite and the blocks are always rewritten as a whole */
+#define FIL_EC_WHOLE_OBJECT ((size_t) -1)
+static int fil_ec_mode = FIL_EC_AUTO;
+static size_t fil_ec_stripe_width = 0;
+
+/* local snapshot of the catalog, NULL if disabled, see
+   fil_metadata_cache_configure */
+char *fil_md_cache_path = NULL;
+
+/* change notifications of the catalog, see fil_metadata_watch */
+#define FIL_MD_WATCH_NONE	0
+#define FIL_MD_WATCH_RADOS	1	/* rados watch / notify */
+#define FIL_MD_WATCH_LOOPBACK	2	/* given to a callback, see fil_metadata_watch_loopback */
+static int fil_md_watch_mode = FIL_MD_WATCH_NONE;
+/* version of the metadata object the catalog matches */
+static uint64_t fil_md_version = 0;
+
+static void _fil_md_changed(const char* path, os_file_type_t type);
+static void _fil_md_publish_changes(uint64_t prev_version);
+static void _fil_md_clear_changes();
+static int _fil_md_rebase();
+static void _fil_md_unload();
+static void _fil_lcache_close();
 
-/* Inititialize the rados environment 
-   return 0 if successfull, -1 if error */
-int fil_rados_init(
+
+/*
+        (pseudoPrivate) Create a cluster handle, connect it and open the
+        data pool
+        return 0 if successfull, -1 if error
+*/
+static int _fil_rados_connect(
 	const char* cluster_name, /* name of the cluster */
 	const char* user_name, /* auth user for cephx */
 	const char* pool_name, /* data pool */
-	const char* conf_file /* configuration file */
-	) 
+	const char* conf_file, /* configuration file */
+	rados_t* cluster, /* the new cluster handle */
+	rados_ioctx_t* io /* the new io context */
+	)
 {
 	int err;
-	if ((err = rados_create2(&ceph_cluster, cluster_name, user_name, 0)) < 0) {
+	if ((err = rados_create2(cluster, cluster_name, user_name, 0)) < 0) {
 		fprintf(stderr, "Error %d: could not create the ceph cluster object\n%s\n",-err,strerror(-err));
 		return -1;
 	}
 
 	/* Read a Ceph configuration file to configure the cluster handle. */
-    if ((err = rados_conf_read_file(ceph_cluster, conf_file)) < 0) {
+    if ((err = rados_conf_read_file(*cluster, conf_file)) < 0) {
         fprintf(stderr, "Error %d: cannot read the ceph configuration file\n%s\n", -err, strerror(-err));
-	    rados_shutdown(ceph_cluster);
+	    rados_shutdown(*cluster);
         return -1;
     }
 
 	/* Connecting to the cluster */
-	if ((err = rados_connect(ceph_cluster)) < 0) {
+	if ((err = rados_connect(*cluster)) < 0) {
         fprintf(stderr, "Error %d: cannot connect to the ceph cluster\n%s\n", -err, strerror(-err));
-        rados_shutdown(ceph_cluster);
+        rados_shutdown(*cluster);
         return -1;
 	}
 
 	/* Opening the IO context */
-	if ((err = rados_ioctx_create(ceph_cluster, pool_name, &rados_io_context)) < 0) {
+	if ((err = rados_ioctx_create(*cluster, pool_name, io)) < 0) {
         fprintf(stderr, "Error %d: cannot open rados pool: %s\n%s\n", -err, pool_name, strerror(-err));
-        rados_shutdown(ceph_cluster);
+        rados_shutdown(*cluster);
         return -1;
 	}
 	
@@ -58,852 +203,8639 @@ int fil_rados_init(
 	return 0;
 }
 
-/* Destroy the rados environment 
-   No return value, the only case that could fail is if
-   the environment is not setup */
-void fil_rados_destroy() {
-	rados_ioctx_destroy(rados_io_context);
-    rados_shutdown(ceph_cluster);
+/* Inititialize the rados environment 
+   return 0 if successfull, -1 if error */
+int fil_rados_init(
+	const char* cluster_name, /* name of the cluster */
+	const char* user_name, /* auth user for cephx */
+	const char* pool_name, /* data pool */
+	const char* conf_file /* configuration file */
+	) 
+{
+	return fil_rados_init_sharded(cluster_name, user_name, pool_name, conf_file,
+		1, FIL_SHARD_BY_FILE);
 }
 
-/*  focus on normal io for now 
-
-fil_aio_read() {
+/* Inititialize the rados environment with n_shards cluster handles,
+   each with its own messenger and io context.  The files, or the
+   threads, are spread over them, see FIL_SHARD_BY_FILE and
+   FIL_SHARD_BY_THREAD
+   return 0 if successfull, -1 if error */
+int fil_rados_init_sharded(
+	const char* cluster_name, /* name of the cluster */
+	const char* user_name, /* auth user for cephx */
+	const char* pool_name, /* data pool */
+	const char* conf_file, /* configuration file */
+	unsigned int n_shards, /* number of cluster handles, 1 for a single one */
+	int mode /* FIL_SHARD_BY_FILE or FIL_SHARD_BY_THREAD */
+	)
+{
+	unsigned int i;
+	char *name;
 
-}
+	if (n_shards == 0 || n_shards > FIL_MAX_SHARDS) {
+		fprintf(stderr, "Error: the number of shards must be between 1 and %d\n", FIL_MAX_SHARDS);
+		return -1;
+	}
+	if (mode != FIL_SHARD_BY_FILE && mode != FIL_SHARD_BY_THREAD) {
+		fprintf(stderr, "Error: unknown shard mode %d\n", mode);
+		return -1;
+	}
 
-fil_aio_wait() {
+	if (!(name = strdup(pool_name))) {
+		fprintf(stderr, "Error: unable to allocate memory for the pool name\n");
+		return -1;
+	}
+	_fil_md_unload();
+	if (_fil_rados_connect(cluster_name, user_name, pool_name, conf_file,
+			&ceph_cluster, &rados_io_context) < 0) {
+		free(name);
+		return -1;
+	}
+	fil_shard_clusters[0] = ceph_cluster;
+	fil_pools[0].ioctxs[0] = rados_io_context;
+
+	for (i = 1; i < n_shards; i++) {
+		if (_fil_rados_connect(cluster_name, user_name, pool_name, conf_file,
+				&fil_shard_clusters[i], &fil_pools[0].ioctxs[i]) < 0) {
+			while (i-- > 0) {
+				rados_ioctx_destroy(fil_pools[0].ioctxs[i]);
+				rados_shutdown(fil_shard_clusters[i]);
+			}
+			free(name);
+			return -1;
+		}
+	}
+	fil_pools[0].name = name;
+	fil_pools[0].ec_align = _fil_ec_detect(rados_io_context);
+	fil_n_pools = 1;
+	fil_n_shards = n_shards;
+	fil_shard_mode = mode;
+	fil_shard_next = 0;
 
+	return 0;
 }
 
-fil_aio_write() {
+/*
+        (pseudoPrivate) Shard of the objects of a file, from their prefix
+        return the shard number
+*/
+unsigned int _fil_shard_of(
+	const char*	prefix	/* prefix of the object names of the file */
+	)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
 
+	if (fil_n_shards == 1) {
+		return 0;
+	}
+	for (; *prefix; prefix++) {
+		h = (h ^ (unsigned char) *prefix) * 16777619u;
+	}
+	return h % fil_n_shards;
 }
-*/
 
+/*
+        (pseudoPrivate) io context of the synchronous I/O of a file, the
+        shard of the calling thread with FIL_SHARD_BY_THREAD, the shard of
+        the file otherwise.  The appends and the async requests always use
+        the shard of the file to stay ordered.
+        return the io context
+*/
+rados_ioctx_t _fil_ioctx(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	if (fil_n_shards == 1) {
+		return fil_pools[fp->pool].ioctxs[0];
+	}
+	if (fil_shard_mode == FIL_SHARD_BY_THREAD) {
+		if (fil_shard_thread < 0) {
+			fil_shard_thread = __atomic_fetch_add(&fil_shard_next, 1, __ATOMIC_RELAXED)
+				% fil_n_shards;
+		}
+		return fil_pools[fp->pool].ioctxs[fil_shard_thread];
+	}
+	return fil_pools[fp->pool].ioctxs[fp->shard];
+}
 
-/*      
-        Close a file and free the sturctures
-        return 0 if successfull, -1 if error 
+/*
+        (pseudoPrivate) io context of the appends and the async requests
+        of a file, always on the shard of the file
+        return the io context
 */
-int fil_close(FILErados_t* fp) {
-	
-	if (fp) {
-		if (fp->metadata.name) {
-            /* Decrement number of reference */
-            _fil_decrement_n_ref(fp->metadata.name,fp->metadata.type);
+rados_ioctx_t _fil_file_ioctx(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	return fil_pools[fp->pool].ioctxs[fp->shard];
+}
 
-            json_t *file;
-            file = _fil_get_json_metadata(fp->metadata.name,fp->metadata.type);
-            
-            if (_fil_get_n_ref(file) == 0 && _fil_is_deleted(file) == 1) {
-                /* this was a deleted file kept open, now it is time
-                 * to really delete it
-                 */
-                 fil_delete_file(fp->metadata.name,fp->metadata.type);
-            } 
-            
-			free(fp->metadata.name);
-			fp->metadata.name = NULL;
-		} 
-		
-		free(fp);
-		fp = NULL;
-	} 
+/*
+	Set how the writes are done on an erasure coded pool, to be called
+	before fil_rados_init.  With FIL_EC_AUTO, the default, a pool that
+	only takes aligned appends is detected and its blocks are always
+	rewritten as a whole, with a single write_full.  FIL_EC_ON does the
+	same on any pool, or, given the stripe width of a pool that takes
+	overwrites, widens each write to whole stripes.  FIL_EC_OFF writes
+	as on a replicated pool.
+	return 0 if successfull, -1 if error
+*/
+int fil_ec_configure(
+	int		mode,	/* FIL_EC_AUTO, FIL_EC_ON or FIL_EC_OFF */
+	size_t		stripe_width	/* with FIL_EC_ON, 0 for whole objects */
+	)
+{
+	if (mode != FIL_EC_AUTO && mode != FIL_EC_ON && mode != FIL_EC_OFF) {
+		fprintf(stderr, "Error: unknown erasure coding mode %d\n", mode);
+		return -1;
+	}
+	fil_ec_mode = mode;
+	fil_ec_stripe_width = stripe_width;
 	return 0;
 }
 
+/*
+        (pseudoPrivate) Write alignment of a data pool, from the erasure
+        coding mode and the pool
+        return the alignment, 0 if the writes are not aligned
+*/
+size_t _fil_ec_detect(
+	rados_ioctx_t	io	/* io context of the pool */
+	)
+{
+	int requires = 0;
+	int ret;
 
-/* 	
-	Create and open a new file
-	return the file handle if successfull or NULL if an error occurred 
+	switch (fil_ec_mode) {
+	case FIL_EC_OFF:
+		return 0;
+	case FIL_EC_ON:
+		return fil_ec_stripe_width ? fil_ec_stripe_width : FIL_EC_WHOLE_OBJECT;
+	default:
+		if ((ret = rados_ioctx_pool_requires_alignment2(io, &requires)) < 0) {
+			fprintf(stderr, "Error %d: cannot tell if the pool is erasure coded, writing unaligned\n%s\n",
+				-ret, strerror(-ret));
+			requires = 0;
+		}
+		return requires ? FIL_EC_WHOLE_OBJECT : 0;
+	}
+}
+
+/*
+        (pseudoPrivate) Write alignment of a handle, see fil_ec_configure
+        return the alignment, 0 if the writes are not aligned
 */
-FILErados_t* fil_open_create(
-	char* filepath,   /* file path like sbtest/sbtest.ibd */
-	os_file_type_t type, /* file object type, seen enum def */
-	size_t block_size /* block size to use in rados */
-	) 
-	{  
+size_t _fil_ec_align_of(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	size_t align = fil_pools[fp->pool].ec_align;
 
-	if (!block_size) {
-		fprintf(stderr, "Error: uninitialized block size value, can't be zero\n");
-		return NULL;
+	if (!align) {
+		return 0;
 	}
+	if (align == FIL_EC_WHOLE_OBJECT || align >= fp->metadata.block_size) {
+		return fp->metadata.block_size;
+	}
+	return align;
+}
 
-	if (!filepath) {
-		fprintf(stderr, "Error: uninitialized file path can't be null\n");
-		return NULL;
+/*
+        (pseudoPrivate) Index of a data pool in fil_pools, its io contexts
+        are created, on each shard, on the first use
+        return the index if successfull, -1 if error
+*/
+int _fil_pool_open(
+	const char*	pool_name	/* name of the pool */
+	)
+{
+	struct fil_pool* pool;
+	unsigned int i;
+	int err;
+
+	pthread_mutex_lock(&fil_pool_mutex);
+	for (i = 0; i < fil_n_pools; i++) {
+		if (!strcmp(fil_pools[i].name, pool_name)) {
+			pthread_mutex_unlock(&fil_pool_mutex);
+			return i;
+		}
+	}
+	if (!fil_n_pools || fil_n_pools == FIL_MAX_POOLS) {
+		pthread_mutex_unlock(&fil_pool_mutex);
+		fprintf(stderr, "Error: cannot open pool %s, %s\n", pool_name,
+			fil_n_pools ? "too many pools" : "rados is not initialized");
+		return -1;
 	}
 
-	/* checking if the path exists in the metadata */
-	if (_fil_find_in_metadata(filepath,type) == -1) {
-		/* Adding the path to the metadata */
-		if (_fil_add_file_metadata(filepath,type,0,block_size) < 0) {
-			return NULL;
+	pool = &fil_pools[fil_n_pools];
+	if (!(pool->name = strdup(pool_name))) {
+		pthread_mutex_unlock(&fil_pool_mutex);
+		fprintf(stderr, "Error: unable to allocate memory for the pool name\n");
+		return -1;
+	}
+	for (i = 0; i < fil_n_shards; i++) {
+		if ((err = rados_ioctx_create(fil_shard_clusters[i], pool_name, &pool->ioctxs[i])) < 0) {
+			fprintf(stderr, "Error %d: cannot open rados pool: %s\n%s\n", -err, pool_name, strerror(-err));
+			while (i-- > 0) {
+				rados_ioctx_destroy(pool->ioctxs[i]);
+			}
+			free(pool->name);
+			pool->name = NULL;
+			pthread_mutex_unlock(&fil_pool_mutex);
+			return -1;
 		}
 	}
-	
-	return fil_open(filepath, type);
+	pool->ec_align = _fil_ec_detect(pool->ioctxs[0]);
+	i = fil_n_pools++;
+	pthread_mutex_unlock(&fil_pool_mutex);
+
+	return i;
 }
 
+/*
+        (pseudoPrivate) Data pool of a file from its json element, the
+        files without a pool are in the pool given to fil_rados_init
+        return the index in fil_pools if successfull, -1 if error
+*/
+int _fil_get_pool(
+	json_t *jfile   /* json file element */
+	)
+{
+	json_t *jpool;
 
-/*      
-        Delete a file
-        return 0 if successfull, -1 if error 
+	jpool = json_object_get(jfile,"pool");
+	if (!jpool) {
+		return 0;
+	}
+	if (!json_is_string(jpool)) {
+		fprintf(stderr, "error: pool element is not a string\n");
+		return -1;
+	}
+	return _fil_pool_open(json_string_value(jpool));
+}
+
+/*
+	Add a rule to the placement policy: the files created by
+	fil_open_create with a path matching pattern, see fnmatch(3), and
+	of the given type go to pool_name.  The rules are tried in the order
+	they were added, a file matching none goes to the pool given to
+	fil_rados_init.  To be called after fil_rados_init, the pool must
+	exist.
+	return 0 if successfull, -1 if error
 */
-int fil_delete_file(
-	char* filepath,   /* file path like sbtest/sbtest.ibd */
-	os_file_type_t type /* file object type, seen enum def */
-)
+int fil_placement_add(
+	const char*	pattern,	/* pattern of the path, NULL for any path */
+	os_file_type_t	type,		/* type of the file, OS_FILE_TYPE_UNKNOWN for any */
+	const char*	pool_name	/* data pool of the matching files */
+	)
 {
-	/* checking if the path exists in the metadata */
-	int index = _fil_find_in_metadata(filepath,type);
-	if (index < 0) {
-		fprintf(stderr, "Error: file %s does not exist\n", filepath);
+	struct fil_placement_rule* rule;
+	char *dup = NULL;
+	int pool;
+
+	if (!pool_name) {
+		fprintf(stderr, "Error: uninitialized pool name can't be null\n");
 		return -1;
 	}
-	
-	/* get the json file element */
-	json_t *file;
-	file = json_array_get(metadata_json,index);
-	if (!file) {
-		fprintf(stderr, "Error extracting the file object from the metadata\n");
+	if ((pool = _fil_pool_open(pool_name)) < 0) {
+		return -1;
+	}
+	if (pattern && !(dup = strdup(pattern))) {
+		fprintf(stderr, "Error: unable to allocate memory for a placement rule\n");
 		return -1;
 	}
 
-	if (type == OS_FILE_TYPE_FILE) {
-		
-        if (_fil_get_n_ref(file) == 0) {            
-        	if (_fil_delete_rados_objects(filepath, _fil_get_block_size(file))) {
-                /* if there's an error, it is already reported */
-                json_decref(file);
-                return -1;
-            }
-
-            /* All good to remove the metadata and objects */
-            if (_fil_rm_file_metadata(filepath,type)) {
-                /* if there's an error, it is already reported */
-                json_decref(file);
-                return -1;
-            }
+	pthread_mutex_lock(&fil_pool_mutex);
+	if (fil_n_placement_rules == FIL_MAX_PLACEMENT_RULES) {
+		pthread_mutex_unlock(&fil_pool_mutex);
+		fprintf(stderr, "Error: too many placement rules, the maximum is %d\n", FIL_MAX_PLACEMENT_RULES);
+		free(dup);
+		return -1;
+	}
+	rule = &fil_placement_rules[fil_n_placement_rules++];
+	rule->pattern = dup;
+	rule->type = type;
+	rule->pool = pool;
+	pthread_mutex_unlock(&fil_pool_mutex);
 
-        } else {
-            /* mark as deleted in metadata */
-        	if (_fil_set_deleted(filepath, type)) {
-                /* if there's an error, it is already reported */
-                json_decref(file);
-                return -1;
-            }
-        }
-    }
-    
-    json_decref(file);
-    
-    /* TODO handle of other types, especially  OS_FILE_TYPE_DIR */
-    
 	return 0;
 }
 
-/* Flush all data and wait until done */
-void fil_flush() {
+/* Remove all the rules of the placement policy, the files already
+   created stay in their pool */
+void fil_placement_clear()
+{
+	pthread_mutex_lock(&fil_pool_mutex);
+	while (fil_n_placement_rules > 0) {
+		fil_n_placement_rules--;
+		free(fil_placement_rules[fil_n_placement_rules].pattern);
+		fil_placement_rules[fil_n_placement_rules].pattern = NULL;
+	}
+	pthread_mutex_unlock(&fil_pool_mutex);
+}
 
-	rados_aio_flush(rados_io_context);
+/*
+        (pseudoPrivate) Pool of a new file from the placement policy, the
+        caller must free the string
+        return the name of the pool, NULL if no rule matches or if error
+*/
+char* _fil_placement_of(
+	const char*	filepath,	/* path of the new file */
+	os_file_type_t	type		/* type of the new file */
+	)
+{
+	struct fil_placement_rule* rule;
+	char *pool_name = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&fil_pool_mutex);
+	for (i = 0; i < fil_n_placement_rules; i++) {
+		rule = &fil_placement_rules[i];
+		if ((rule->type == OS_FILE_TYPE_UNKNOWN || rule->type == type)
+				&& (!rule->pattern || fnmatch(rule->pattern, filepath, 0) == 0)) {
+			if (!(pool_name = strdup(fil_pools[rule->pool].name))) {
+				fprintf(stderr, "Error: unable to allocate memory for the pool name\n");
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fil_pool_mutex);
 
+	return pool_name;
 }
 
+/* Destroy the rados environment 
+   No return value, the only case that could fail is if
+   the environment is not setup */
+void fil_rados_destroy() {
+    _fil_aio_merge_stop();
+    fil_metadata_unwatch();
+    _fil_lcache_close();
+    fil_placement_clear();
+    while (fil_n_pools > 0) {
+        unsigned int i;
+        fil_n_pools--;
+        for (i = 0; i < fil_n_shards; i++) {
+            rados_ioctx_destroy(fil_pools[fil_n_pools].ioctxs[i]);
+        }
+        free(fil_pools[fil_n_pools].name);
+        fil_pools[fil_n_pools].name = NULL;
+    }
+    while (fil_n_shards > 1) {
+        fil_n_shards--;
+        rados_shutdown(fil_shard_clusters[fil_n_shards]);
+    }
+    rados_shutdown(ceph_cluster);
+    rados_io_context = NULL;
+    _fil_md_unload();
+    _fil_bufpool_destroy();
+}
 
-/* 	
-	Open an existing file
-	return the file handle if successfull or NULL if an error occurred 
-*/
-FILErados_t* fil_open( 
-	char* filepath,   /* file path like sbtest/sbtest.ibd */
-	os_file_type_t type /* file object type, seen enum def */
-)
-{  
-	/* checking if the path exists in the metadata */
-	if (_fil_find_in_metadata(filepath,type) < 0) {
-		fprintf(stderr, "Error: file %s does not exist\n", filepath);
-		return NULL;
+/*
+ * Buffer pool
+ *
+ * The buffers used on the I/O path (compressed blocks, metadata...) come
+ * from a pool of power of two size classes, from 4 KiB to 64 MiB.  A
+ * buffer is aligned on its class size, so on the block size of a file
+ * when the block size is a power of two.  The classes are carved out of
+ * 2 MiB chunks mapped with mmap, optionally backed by transparent or
+ * explicit huge pages, see fil_bufpool_configure.  Each thread keeps a
+ * small free list per class and only goes to the global lists, under a
+ * mutex, to refill or drain it.  Memory is only returned to the system
+ * by fil_rados_destroy, which bumps the pool epoch: a thread cache of an
+ * older epoch points to unmapped chunks and is emptied on its next use.
+ * Larger buffers are mapped and unmapped directly.
+ */
+#define FIL_BUF_MIN_SHIFT	12	/* 4 KiB */
+#define FIL_BUF_MAX_SHIFT	26	/* 64 MiB */
+#define FIL_BUF_N_CLASSES	(FIL_BUF_MAX_SHIFT - FIL_BUF_MIN_SHIFT + 1)
+#define FIL_BUF_CHUNK_SIZE	(2UL*1024*1024)
+#define FIL_BUF_TCACHE_MAX	16	/* free buffers of a class kept per thread */
+
+struct fil_buf_free {
+	struct fil_buf_free*	next;
+};
+
+struct fil_buf_chunk {
+	void*			addr;
+	size_t			len;
+	struct fil_buf_chunk*	next;
+};
+
+struct fil_buf_tcache {
+	struct fil_buf_free*	head[FIL_BUF_N_CLASSES];
+	unsigned int		count[FIL_BUF_N_CLASSES];
+	unsigned int		registered;
+	unsigned int		epoch;	/* fil_bufpool_epoch of the lists */
+};
+
+static pthread_mutex_t		fil_bufpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fil_buf_free*	fil_bufpool_free[FIL_BUF_N_CLASSES];
+static struct fil_buf_chunk*	fil_bufpool_chunks = NULL;
+static unsigned int		fil_bufpool_flags = 0;
+static pthread_once_t		fil_bufpool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t		fil_bufpool_key;
+static unsigned int		fil_bufpool_epoch = 0;
+static __thread struct fil_buf_tcache fil_bufpool_tcache;
+
+/* size class of a buffer, -1 if too large for the pool */
+static int _fil_buf_class(size_t size)
+{
+	int shift = FIL_BUF_MIN_SHIFT;
+
+	while (shift <= FIL_BUF_MAX_SHIFT && ((size_t) 1 << shift) < size) {
+		shift++;
 	}
+	return shift > FIL_BUF_MAX_SHIFT ? -1 : shift - FIL_BUF_MIN_SHIFT;
+}
 
-	FILErados_t* fp;
-	fp = malloc(sizeof(FILErados_t));
-	if (!fp) {
-		fprintf(stderr, "Error: unable to allocate memory fo file %s handle\n", filepath);
-		return NULL;
-	}	
+/* Forget the buffers of a thread cache filled before _fil_bufpool_destroy */
+static void _fil_buf_tcache_check(struct fil_buf_tcache* tc)
+{
+	unsigned int epoch = __atomic_load_n(&fil_bufpool_epoch, __ATOMIC_ACQUIRE);
 
-	if (_fil_get_file_metadata(filepath,type,fp) < 0) {
-		fprintf(stderr, "Error: unable to initialize the file handle for file %s\n", filepath);
-		free(fp);	
-		return NULL;
+	if (tc->epoch != epoch) {
+		memset(tc->head, 0, sizeof(tc->head));
+		memset(tc->count, 0, sizeof(tc->count));
+		tc->epoch = epoch;
 	}
-    
-    
-    if (_fil_increment_n_ref(filepath,type) < 0) {
-		fprintf(stderr, "Error: couldn't increment n_ref for file %s\n", filepath);
-		free(fp);	
-		return NULL;        
-    }
+}
 
-	/* Initialize the position to 0 */
-	fp->position=0;
+/* Give back the buffers cached by a thread when it exits */
+static void _fil_buf_tcache_flush(void* arg)
+{
+	struct fil_buf_tcache* tc = arg;
+	int c;
+
+	pthread_mutex_lock(&fil_bufpool_mutex);
+	_fil_buf_tcache_check(tc);
+	for (c = 0; c < FIL_BUF_N_CLASSES; c++) {
+		while (tc->head[c]) {
+			struct fil_buf_free* b = tc->head[c];
+			tc->head[c] = b->next;
+			b->next = fil_bufpool_free[c];
+			fil_bufpool_free[c] = b;
+		}
+		tc->count[c] = 0;
+	}
+	pthread_mutex_unlock(&fil_bufpool_mutex);
+}
 
-	return fp;
+static void _fil_buf_key_create(void)
+{
+	pthread_key_create(&fil_bufpool_key, _fil_buf_tcache_flush);
 }
 
-/*      
-        Read from a file in rados 
-        return the number of bytes read if successfull, -1 if error 
+/*
+        (pseudoPrivate) Map len bytes, rounded up to whole pages, aligned
+        on align, a multiple of the page size.  Huge pages are used if
+        configured, explicit ones only up to an alignment of a huge page
+        return the address if successfull, NULL if error
 */
-ssize_t fil_read(
-	FILErados_t*    fp,	/* handle to a file */
-	void*		buf,	/* buffer where to read */
-	size_t		len,	/* number of bytes to read */
-	size_t		offset  /* offset from where to start reading */
-) {
-	size_t bytes_read = 0;
-	size_t total_bytes_read = 0;
-	size_t block_offset;
-	char*	obj_name;  
+static void* _fil_buf_map(size_t len, size_t align)
+{
+	size_t	page = (size_t) sysconf(_SC_PAGESIZE);
+	char*	addr;
+	size_t	lead;
+
+	/* the trimmed tail must start on a page boundary */
+	len = (len + page - 1) & ~(page - 1);
+
+#ifdef MAP_HUGETLB
+	/* a huge page mapping is aligned on the huge page size only */
+	if (fil_bufpool_flags & FIL_BUFPOOL_HUGE_EXPLICIT && len % FIL_BUF_CHUNK_SIZE == 0
+			&& align <= FIL_BUF_CHUNK_SIZE) {
+		addr = mmap(NULL, len, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (addr != MAP_FAILED) {
+			return addr;
+		}
+		/* no huge page reserved, fallback to normal pages */
+	}
+#endif
 
-    /* TODO, implementing aio here could be very efficient on multi block reads */
+	/* over map to be able to align */
+	addr = mmap(NULL, len + align, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		return NULL;
+	}
+	lead = (align - ((uintptr_t) addr & (align - 1))) & (align - 1);
+	if (lead) {
+		munmap(addr, lead);
+	}
+	munmap(addr + lead + len, align - lead);
+	addr += lead;
 
-	if (!fp) {
-		fprintf(stderr, "Error: uninitialized file handle\n");
-		return -1;
+#ifdef MADV_HUGEPAGE
+	if (fil_bufpool_flags & FIL_BUFPOOL_HUGE_THP) {
+		madvise(addr, len, MADV_HUGEPAGE);
 	}
+#endif
+	return addr;
+}
 
-	if (!fp->metadata.block_size) {
-		fprintf(stderr, "Error: uninitialized block size value, can't be zero\n");
+/*
+        Configure the buffer pool, must be called before any I/O
+        flags: FIL_BUFPOOL_HUGE_THP and/or FIL_BUFPOOL_HUGE_EXPLICIT
+        return 0 if successfull, -1 if error
+*/
+int fil_bufpool_configure(
+	unsigned int	flags	/* huge page backing */
+	)
+{
+	pthread_mutex_lock(&fil_bufpool_mutex);
+	if (fil_bufpool_chunks) {
+		pthread_mutex_unlock(&fil_bufpool_mutex);
+		fprintf(stderr, "Error: the buffer pool is already in use, it can't be configured\n");
 		return -1;
 	}
+	fil_bufpool_flags = flags;
+	pthread_mutex_unlock(&fil_bufpool_mutex);
+	return 0;
+}
 
-	if (!fp->metadata.name) {
-		fprintf(stderr, "Error: uninitialized file name, can't be null\n");
-		return -1;
+/*
+        (pseudoPrivate) Get a buffer of at least size bytes from the pool,
+        it must be returned with _fil_buf_free and the same size
+        return the buffer if successfull, NULL if error
+*/
+void* _fil_buf_alloc(
+	size_t	size	/* size of the buffer */
+	)
+{
+	struct fil_buf_tcache*	tc = &fil_bufpool_tcache;
+	struct fil_buf_free*	b;
+	int			c;
+
+	if ((c = _fil_buf_class(size)) < 0) {
+		return _fil_buf_map(size, FIL_BUF_CHUNK_SIZE);
 	}
 
-	block_offset = offset/fp->metadata.block_size;  /* this will cast to int */
-	block_offset = block_offset*fp->metadata.block_size; /* now point to the beginning of a block */
+	_fil_buf_tcache_check(tc);
+	if (!tc->head[c]) {
+		size_t		buf_size = (size_t) 1 << (c + FIL_BUF_MIN_SHIFT);
+		unsigned int	n;
 
-	/* read first object */	
-	obj_name = (char *) (intptr_t) asprintf("%s_%zu",fp->metadata.name,block_offset);
-    if ((fp->metadata.block_size - (offset - block_offset)) > len) {
-        /* all fit in the first block */
-        if ((bytes_read = rados_read(rados_io_context,obj_name,buf,len,
-                offset - block_offset)) < 0) {
-            fprintf(stderr, "Error: Could not read %s at offset %zu\n",obj_name,offset);
-            free(obj_name);
-            return -1;
-        }
-    } else {
-        if ((bytes_read = rados_read(rados_io_context,obj_name,buf,
-                fp->metadata.block_size - offset,offset - block_offset)) < 0) {
-            fprintf(stderr, "Error: Could not read %s at offset %zu\n",obj_name,offset);
-            free(obj_name);
-            return -1;
-        }        
-    }
-	total_bytes_read += bytes_read;
-	free(obj_name);
-    
-    /* now, the offset part is done, just need to care about the 
-     * number of bytes to read 
-     */
-    while (total_bytes_read < len) {
-        /* The next block */
-        block_offset += fp->metadata.block_size;
-        obj_name = (char *) (intptr_t) asprintf("%s_%zu",fp->metadata.name,block_offset);
-        
-        if ((len - total_bytes_read) > fp->metadata.block_size) {
-            /* reading the full block */
-            if ((bytes_read = rados_read(rados_io_context,obj_name,buf+total_bytes_read,
-                    fp->metadata.block_size,0)) < 0) {
-                fprintf(stderr, "Error: Could not read %s\n",obj_name);
-                free(obj_name);
-                return -1;
-            }
-        } else {
-            /* reading the reminder */
-            if ((bytes_read = rados_read(rados_io_context,obj_name,buf+total_bytes_read,
-                    len - total_bytes_read,0)) < 0) {
-                fprintf(stderr, "Error: Could not read %s\n",obj_name);
-                free(obj_name);
-                return -1;
-            }   
-        }
+		if (!tc->registered) {
+			pthread_once(&fil_bufpool_once, _fil_buf_key_create);
+			pthread_setspecific(fil_bufpool_key, tc);
+			tc->registered = 1;
+		}
 
-        total_bytes_read += bytes_read;
-        free(obj_name);
-        
-        /* Maybe we are done */
-        if (bytes_read == 0) {
-            /* no more */
-            break;
-        }
-    }
-    
-    return total_bytes_read;
-    
+		pthread_mutex_lock(&fil_bufpool_mutex);
+		if (!fil_bufpool_free[c]) {
+			/* carve a new chunk for this class */
+			struct fil_buf_chunk* chunk = malloc(sizeof(struct fil_buf_chunk));
+			size_t len = buf_size > FIL_BUF_CHUNK_SIZE ? buf_size : FIL_BUF_CHUNK_SIZE;
+			char* addr;
+
+			if (!chunk || !(addr = _fil_buf_map(len, buf_size < FIL_BUF_CHUNK_SIZE
+					? FIL_BUF_CHUNK_SIZE : buf_size))) {
+				pthread_mutex_unlock(&fil_bufpool_mutex);
+				free(chunk);
+				fprintf(stderr, "Error: unable to allocate memory for the buffer pool\n");
+				return NULL;
+			}
+			chunk->addr = addr;
+			chunk->len = len;
+			chunk->next = fil_bufpool_chunks;
+			fil_bufpool_chunks = chunk;
+
+			for (n = len/buf_size; n > 0; n--) {
+				b = (struct fil_buf_free *) (addr + (n - 1)*buf_size);
+				b->next = fil_bufpool_free[c];
+				fil_bufpool_free[c] = b;
+			}
+		}
+		/* refill half of the thread cache */
+		for (n = 0; n < FIL_BUF_TCACHE_MAX/2 && fil_bufpool_free[c]; n++) {
+			b = fil_bufpool_free[c];
+			fil_bufpool_free[c] = b->next;
+			b->next = tc->head[c];
+			tc->head[c] = b;
+			tc->count[c]++;
+		}
+		pthread_mutex_unlock(&fil_bufpool_mutex);
+	}
+
+	b = tc->head[c];
+	tc->head[c] = b->next;
+	tc->count[c]--;
+	return b;
 }
 
-/*  
- * Write to a file in rados 
- * 
- * Returns the number of bytes written if successfull, -1 if error 
+/*
+        (pseudoPrivate) Return a buffer to the pool
 */
-int fil_write(	
-    FILErados_t*    fp,	/* handle to a file */
-	void*		buf,	/* buffer where to get data to write */
-	size_t		len,    /* number of bytes to write */
-	size_t		offset  /* offset from where to start reading */
-    ) 
+void _fil_buf_free(
+	void*	buf,	/* buffer from _fil_buf_alloc */
+	size_t	size	/* size given to _fil_buf_alloc */
+	)
 {
-	size_t bytes_written = 0;
-	size_t total_bytes_written = 0;
-	size_t block_offset;
-	char*	obj_name;  
+	struct fil_buf_tcache*	tc = &fil_bufpool_tcache;
+	struct fil_buf_free*	b = buf;
+	int			c;
 
-    /* TODO, implementing aio here could be very efficient on multi block writes */
+	if (!buf) {
+		return;
+	}
 
-	if (!fp) {
-		fprintf(stderr, "Error: uninitialized file handle\n");
-		return -1;
+	if ((c = _fil_buf_class(size)) < 0) {
+		munmap(buf, size);
+		return;
 	}
 
-	if (!fp->metadata.block_size) {
-		fprintf(stderr, "Error: uninitialized block size value, can't be zero\n");
-		return -1;
+	_fil_buf_tcache_check(tc);
+	b->next = tc->head[c];
+	tc->head[c] = b;
+	if (++tc->count[c] > FIL_BUF_TCACHE_MAX) {
+		/* drain half of the thread cache */
+		pthread_mutex_lock(&fil_bufpool_mutex);
+		while (tc->count[c] > FIL_BUF_TCACHE_MAX/2) {
+			b = tc->head[c];
+			tc->head[c] = b->next;
+			b->next = fil_bufpool_free[c];
+			fil_bufpool_free[c] = b;
+			tc->count[c]--;
+		}
+		pthread_mutex_unlock(&fil_bufpool_mutex);
 	}
+}
 
-	if (!fp->metadata.name) {
-		fprintf(stderr, "Error: uninitialized file name, can't be null\n");
-		return -1;
+/*
+        (pseudoPrivate) Unmap all the memory of the buffer pool, no buffer
+        must be in use.  The thread caches are emptied lazily, see
+        _fil_buf_tcache_check
+*/
+void _fil_bufpool_destroy()
+{
+	struct fil_buf_chunk* chunk;
+
+	pthread_mutex_lock(&fil_bufpool_mutex);
+	while ((chunk = fil_bufpool_chunks)) {
+		fil_bufpool_chunks = chunk->next;
+		munmap(chunk->addr, chunk->len);
+		free(chunk);
 	}
+	memset(fil_bufpool_free, 0, sizeof(fil_bufpool_free));
+	__atomic_add_fetch(&fil_bufpool_epoch, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&fil_bufpool_mutex);
+}
 
-	block_offset = offset/fp->metadata.block_size;  /* this will cast to int */
-	block_offset = block_offset*fp->metadata.block_size; /* now point to the beginning of the firs
-                                                            block to write to */
+/*
+ * I/O scheduler
+ *
+ * Every data operation sent to the backend goes through _fil_sched_acquire
+ * with the I/O class of the calling thread (see fil_set_io_class), and
+ * gives its slot back with _fil_sched_release when it completes.  A class
+ * can be limited in operations in flight and in bandwidth, with a token
+ * bucket which may go into debt so a large operation is never blocked
+ * forever.  When the total number of operations in flight is limited, a
+ * freed slot goes to the highest priority class waiting for one, so
+ * purges and imports can't starve the foreground.  The catalog operations
+ * are never throttled.  With no limit configured nothing is accounted and
+ * acquire / release cost a load.
+ */
+
+struct fil_sched_class {
+	unsigned int		max_in_flight;	/* 0 = unlimited */
+	unsigned long long	rate;		/* bytes per second, 0 = unlimited */
+	unsigned long long	burst;		/* bucket size in bytes */
+	double			tokens;		/* may be negative */
+	unsigned long long	last_refill;	/* monotonic time in ns */
+	unsigned int		in_flight;
+	unsigned int		waiting_slot;	/* waiting for a global slot only */
+};
+
+static pthread_mutex_t		fil_sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		fil_sched_cond = PTHREAD_COND_INITIALIZER;
+static struct fil_sched_class	fil_sched_classes[FIL_IO_N_CLASSES];
+static unsigned int		fil_sched_max_in_flight = 0;
+static unsigned int		fil_sched_in_flight = 0;
+/* 1 if any limit is set, read without the mutex */
+static volatile int		fil_sched_enabled = 0;
+static __thread fil_io_class_t	fil_sched_thread_class = FIL_IO_FOREGROUND;
+
+static unsigned long long _fil_sched_now()
+{
+	struct timespec ts;
 
-	/* write to the first object */	
-	obj_name = (char *) (intptr_t) asprintf("%s_%zu",fp->metadata.name,block_offset);
-    if ((fp->metadata.block_size - (offset - block_offset)) > len) {
-        /* all fit in the first block */
-        if ((bytes_written = rados_write(rados_io_context,obj_name,buf,
-                len,offset - block_offset)) < 0) {
-            fprintf(stderr, "Error: Could not write %s at offset %zu\n",obj_name,offset);
-            free(obj_name);
-            return -1;
-        }
-    } else {
-        if ((bytes_written = rados_write(rados_io_context,obj_name,
-                buf,fp->metadata.block_size-offset,offset)) < 0) {
-            fprintf(stderr, "Error: Could not write %s at offset %zu\n",obj_name,offset);
-            free(obj_name);
-            return -1;
-        }        
-    }
-	total_bytes_written += bytes_written;
-	free(obj_name);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    /* now, the offset part is done, just need to care about the 
-     * number of bytes to write 
-     */
-    while (total_bytes_written < len) {
-        /* The next block */
-        block_offset += fp->metadata.block_size;
-        obj_name = (char *) (intptr_t) asprintf("%s_%zu",fp->metadata.name,block_offset);
-        
-        if ((len - total_bytes_written) > fp->metadata.block_size) {
-            /* writing a full block */
-            if ((bytes_written = rados_write(rados_io_context,obj_name,buf+total_bytes_written,
-                    fp->metadata.block_size,0)) < 0) {
-                fprintf(stderr, "Error: Could not write %s\n",obj_name);
-                free(obj_name);
-                return -1;
-            }
-        } else {
-            /* writing the reminder */
-            if ((bytes_written = rados_read(rados_io_context,obj_name,buf+total_bytes_written,
-                    len - total_bytes_written,0)) < 0) {
-                fprintf(stderr, "Error: Could not write %s\n",obj_name);
-                free(obj_name);
-                return -1;
-            }   
-        }
+/* fil_sched_mutex held */
+static void _fil_sched_update_enabled()
+{
+	int	i;
+	int	enabled = fil_sched_max_in_flight != 0;
 
-        total_bytes_written += bytes_written;
-        free(obj_name);
-        
-        /* Maybe we are done */
-        if (bytes_written == 0) {
-            /* no more */
-            break;
-        }
-    }
-    
-    return total_bytes_written;
+	for (i = 0; i < FIL_IO_N_CLASSES; i++) {
+		if (fil_sched_classes[i].max_in_flight || fil_sched_classes[i].rate) {
+			enabled = 1;
+		}
+	}
+	fil_sched_enabled = enabled;
+}
+
+/*
+        Limit an I/O class, can be called at any time, the operations
+        already waiting see the new limits at once
+        return 0 if successfull, -1 if error
+*/
+int fil_sched_configure(
+	fil_io_class_t		io_class,	/* class to limit */
+	unsigned int		max_in_flight,	/* operations in flight, 0 = unlimited */
+	unsigned long long	bytes_per_sec,	/* bandwidth cap, 0 = unlimited */
+	unsigned long long	burst		/* bucket size in bytes, 0 = 100ms of bandwidth */
+	)
+{
+	struct fil_sched_class* c;
+
+	if ((unsigned int) io_class >= FIL_IO_N_CLASSES) {
+		fprintf(stderr, "Error: invalid I/O class %d\n", (int) io_class);
+		return -1;
+	}
 
+	pthread_mutex_lock(&fil_sched_mutex);
+	c = &fil_sched_classes[io_class];
+	c->max_in_flight = max_in_flight;
+	c->rate = bytes_per_sec;
+	c->burst = burst ? burst : bytes_per_sec / 10;
+	if (c->burst == 0 && bytes_per_sec) {
+		c->burst = 1;
+	}
+	c->tokens = c->burst;
+	c->last_refill = _fil_sched_now();
+	_fil_sched_update_enabled();
+	pthread_cond_broadcast(&fil_sched_cond);
+	pthread_mutex_unlock(&fil_sched_mutex);
+	return 0;
 }
 
-/* not needed for now 
-fil_update_atime() {
+/*
+        Limit the operations in flight of all the classes together, can be
+        called at any time
+        return 0 if successfull, -1 if error
+*/
+int fil_sched_set_max_in_flight(
+	unsigned int	max_in_flight	/* operations in flight of all classes, 0 = unlimited */
+	)
+{
+	pthread_mutex_lock(&fil_sched_mutex);
+	fil_sched_max_in_flight = max_in_flight;
+	_fil_sched_update_enabled();
+	pthread_cond_broadcast(&fil_sched_cond);
+	pthread_mutex_unlock(&fil_sched_mutex);
+	return 0;
+}
 
-} */
+/*
+        Set the I/O class of the operations of the calling thread
+        return the previous class
+*/
+fil_io_class_t fil_set_io_class(
+	fil_io_class_t	io_class	/* class of the I/O of the calling thread */
+	)
+{
+	fil_io_class_t	prev = fil_sched_thread_class;
 
-/* not needed for now 
-fil_update_mtime() {
+	if ((unsigned int) io_class < FIL_IO_N_CLASSES) {
+		fil_sched_thread_class = io_class;
+	}
+	return prev;
+}
 
-} */
+/*
+        (pseudoPrivate) Wait until the class of the calling thread may send
+        an operation of bytes bytes to the backend
+        return the token to give to _fil_sched_release, 0 if not accounted
+*/
+int _fil_sched_acquire(
+	size_t	bytes	/* bytes moved by the operation */
+	)
+{
+	fil_io_class_t		cls = fil_sched_thread_class;
+	struct fil_sched_class*	c = &fil_sched_classes[cls];
+	unsigned long long	now;
+	unsigned long long	wait_ns;
+	struct timespec		deadline;
+	int			blocked_slot;
+	int			i;
+
+	if (!fil_sched_enabled) {
+		return 0;
+	}
 
+	pthread_mutex_lock(&fil_sched_mutex);
+	for (;;) {
+		wait_ns = 0;
+		blocked_slot = 0;
+
+		if (c->rate) {
+			now = _fil_sched_now();
+			c->tokens += (double) (now - c->last_refill) * c->rate / 1e9;
+			if (c->tokens > c->burst) {
+				c->tokens = c->burst;
+			}
+			c->last_refill = now;
+			if (c->tokens <= 0) {
+				wait_ns = (unsigned long long) (-c->tokens * 1e9 / c->rate) + 1;
+			}
+		}
+
+		if (!wait_ns && (!c->max_in_flight || c->in_flight < c->max_in_flight)) {
+			if (fil_sched_max_in_flight && fil_sched_in_flight >= fil_sched_max_in_flight) {
+				blocked_slot = 1;
+			}
+			for (i = 0; i < (int) cls && !blocked_slot; i++) {
+				if (fil_sched_classes[i].waiting_slot) {
+					blocked_slot = 1;
+				}
+			}
+			if (!blocked_slot) {
+				break;
+			}
+		}
 
+		if (blocked_slot) {
+			c->waiting_slot++;
+		}
+		if (wait_ns) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += wait_ns / 1000000000ULL;
+			deadline.tv_nsec += wait_ns % 1000000000ULL;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&fil_sched_cond, &fil_sched_mutex, &deadline);
+		} else {
+			pthread_cond_wait(&fil_sched_cond, &fil_sched_mutex);
+		}
+		if (blocked_slot) {
+			c->waiting_slot--;
+		}
+	}
 
+	if (c->rate) {
+		c->tokens -= bytes;
+	}
+	c->in_flight++;
+	fil_sched_in_flight++;
+	pthread_mutex_unlock(&fil_sched_mutex);
+	return cls + 1;
+}
 
+/*
+        (pseudoPrivate) Give back the slot of an operation, may be called
+        from a completion callback
+*/
+void _fil_sched_release(
+	int	token	/* returned by _fil_sched_acquire */
+	)
+{
+	if (token == 0) {
+		return;
+	}
 
+	pthread_mutex_lock(&fil_sched_mutex);
+	fil_sched_classes[token - 1].in_flight--;
+	fil_sched_in_flight--;
+	pthread_cond_broadcast(&fil_sched_cond);
+	pthread_mutex_unlock(&fil_sched_mutex);
+}
 
+/* completion callback of the operations holding a scheduler slot only */
+static void _fil_sched_release_cb(rados_completion_t comp, void* arg)
+{
+	(void) comp;
+	_fil_sched_release((int) (intptr_t) arg);
+}
 
+static int _fil_aio_state_create(FILErados_t* fp);
+static void _fil_aio_state_destroy(FILErados_t* fp);
+static void _fil_size_lock(FILErados_t* fp);
+static void _fil_size_unlock(FILErados_t* fp);
+static void _fil_ra_destroy(FILErados_t* fp);
+static ssize_t _fil_ra_read(FILErados_t* fp, char* buf, size_t len,
+	size_t block_offset, size_t obj_offset);
+static void _fil_ra_readahead(FILErados_t* fp, size_t offset, size_t len);
+static void _fil_ra_invalidate(FILErados_t* fp, size_t offset, size_t len);
+static ssize_t _fil_lcache_read(FILErados_t* fp, const char* obj_name, char* buf,
+	size_t len, size_t offset, size_t obj_max);
+static void _fil_lcache_written(FILErados_t* fp, const char* obj_name,
+	const char* buf, size_t len, size_t offset);
+static void _fil_lcache_drop(const char* obj_name);
+static int _fil_lcache_invalidate(FILErados_t* fp, size_t offset, size_t len);
+static int _fil_shared_acquire(FILErados_t* fp);
+static void _fil_shared_release(FILErados_t* fp);
+static int _fil_gen_release(FILErados_t* fp);
+static void _fil_md_publish_gen(const char* prefix, uint64_t gen);
+/* see fil_local_cache_configure */
+static struct fil_lcache* fil_lcache;
 
 
 /*      
-        (pseudoPrivate) Return the block size of the file json 
-        return the block_size if successfull (> 0), -1 if error 
+        Close a file and free the sturctures, the handle is freed even
+        when appended data was lost
+        return 0 if successfull, -1 if error 
 */
-int _fil_get_block_size(
-	json_t *jfile   /* json file element */
-	) 
-{
-    
-    if (json_is_object(jfile)) { 
-        /* get the block_size */
-        unsigned int block_size;
-        json_t *j_block_size;
-        j_block_size = (json_t *) (intptr_t) json_object_get(jfile,"block_size");
-        if(!json_is_integer(j_block_size)) {
-            fprintf(stderr, "error: block_size element returned is not an integer\n");
-            json_decref(j_block_size);
-            return -1;
-        } else {
-            block_size = (unsigned int) json_integer_value(j_block_size);
-        }
-        json_decref(j_block_size);
-        
-        return block_size;
-    } else {
-        return -1;
-    }
+int fil_close(FILErados_t* fp) {
+	int ret = 0;
+	
+	if (fp) {
+		/* the requests in flight use the handle */
+		_fil_aio_state_destroy(fp);
+		_fil_ra_destroy(fp);
+		if (fp->append) {
+			if (fil_append_sync(fp) < 0) {
+				/* appended data was lost, the handle is closed anyway */
+				ret = -1;
+			}
+			free(fp->append);
+			fp->append = NULL;
+		}
+		if (fp->metadata.name && _fil_gen_release(fp) < 0) {
+			ret = -1;
+		}
+		_fil_shared_release(fp);
+		if (fp->metadata.name) {
+            /* The size attribute of the objects is authoritative, the
+             * catalog is only updated when the handle is closed
+             */
+            if (fp->size_dirty) {
+                _fil_update_size(fp->metadata.name,fp->metadata.type,fp->metadata.size);
+                fp->size_dirty = 0;
+            }
+
+            /* Decrement number of reference, the entry is only used
+             * under the catalog mutex, see _fil_get_json_metadata
+             */
+            json_t *file;
+            int last;
+
+            pthread_mutex_lock(&fil_catalog_mutex);
+            _fil_decrement_n_ref(fp->metadata.name,fp->metadata.type);
+            file = _fil_get_json_metadata(fp->metadata.name,fp->metadata.type);
+            last = file && _fil_get_n_ref(file) == 0 && _fil_is_deleted(file) == 1;
+            pthread_mutex_unlock(&fil_catalog_mutex);
+
+            if (last) {
+                /* this was a deleted file kept open, now it is time
+                 * to really delete it, fil_delete_file checks again
+                 */
+                 fil_delete_file(fp->metadata.name,fp->metadata.type);
+            } 
+            
+			free(fp->metadata.name);
+			fp->metadata.name = NULL;
+		} 
+		free(fp->metadata.prefix);
+		fp->metadata.prefix = NULL;
+		
+		free(fp);
+		fp = NULL;
+	} 
+	return ret;
 }
 
-/*      
-        (pseudoPrivate) Return the number of reference of the file json 
-        Returns: number of reference if successfull (> 0), -1 if error 
+
+/* 	
+	Create and open a new file
+	return the file handle if successfull or NULL if an error occurred 
 */
-int _fil_get_n_ref(
-	json_t *jfile   /* json file element */
+FILErados_t* fil_open_create(
+	char* filepath,   /* file path like sbtest/sbtest.ibd */
+	os_file_type_t type, /* file object type, seen enum def */
+	size_t block_size /* block size to use in rados */
 	) 
-{
-    
-    if (json_is_object(jfile)) { 
-        /* get the n_ref */
-        unsigned int n_ref;
-        json_t *j_n_ref;
-        j_n_ref = (json_t *) (intptr_t) json_object_get(jfile,"n_ref");
-        if(!json_is_integer(j_n_ref)) {
-            fprintf(stderr, "error: n_ref element returned is not an integer\n");
-            json_decref(j_n_ref);
-            return -1;
-        } else {
-            n_ref = (unsigned int) json_integer_value(j_n_ref);
-        }
-        json_decref(j_n_ref);
-        
-        return n_ref;
-    } else {
-        return -1;
-    }
+	{  
+
+	if (!block_size) {
+		fprintf(stderr, "Error: uninitialized block size value, can't be zero\n");
+		return NULL;
+	}
+
+	if (!filepath) {
+		fprintf(stderr, "Error: uninitialized file path can't be null\n");
+		return NULL;
+	}
+
+	/* checking if the path exists in the metadata */
+	int index = _fil_find_in_metadata(filepath,type);
+	if (index == -2) {
+		/* a deleted file not purged yet, its objects must be gone
+		 * before the path is reused
+		 */
+		fil_purge_wait();
+		fil_purge_deleted();
+		index = _fil_find_in_metadata(filepath,type);
+	}
+	if (index == -1) {
+		/* Adding the path to the metadata, in the pool given by the
+		 * placement policy
+		 */
+		char *pool_name = _fil_placement_of(filepath,type);
+		if (_fil_add_file_metadata(filepath,type,0,block_size,pool_name) < 0) {
+			free(pool_name);
+			return NULL;
+		}
+		free(pool_name);
+	}
+	
+	return fil_open(filepath, type);
 }
 
 
 /*      
-        (pseudoPrivate) Increment the number of reference of a file
+        Delete a file
         return 0 if successfull, -1 if error 
 */
-int _fil_set_n_ref(
+int fil_delete_file(
 	char* filepath,   /* file path like sbtest/sbtest.ibd */
-	os_file_type_t type,
-    int delta  /* typically 1 or -1 */
-	) 
+	os_file_type_t type /* file object type, seen enum def */
+)
 {
-	/* TODO:  may need a mutex when used with multiple threads */
-	int index = _fil_find_in_metadata(filepath,type);
-	json_t *file = json_array_get(metadata_json,index);
-	if (!file) {
-		fprintf(stderr, "Error extracting the file object from the metadata\n");
-		return -1;
+	if (type == OS_FILE_TYPE_DIR) {
+		return fil_rmdir(filepath);
 	}
 
-    unsigned int n_ref;
-    json_t *j_n_ref;
-    j_n_ref = (json_t *) (intptr_t) json_object_get(file,"n_ref");
-    if(!json_is_number(j_n_ref)) {
-        fprintf(stderr, "error for entry  %d: n_ref is not a number\n", index + 1);
-        json_decref(file);
-        json_decref(j_n_ref);
-        return -1;
-    }
+	/* a deleted file is removed by the close of its last handle */
+	char *prefix;
+	int pool;
+	int block_size;
+	int ret;
 
-    n_ref = (unsigned int) json_integer_value(j_n_ref);
-    json_decref(j_n_ref);
-    
-    n_ref += delta;
-    
-    /* sanity check */
-    if (n_ref < 0) n_ref = 0;
-    
-	if (json_object_set(file,"n_ref",json_integer(n_ref)) < 0) {
-		fprintf(stderr, "Error updating the number of reference of file object\n");
+	if ((ret = _fil_delete_begin(filepath, type, &pool, &prefix, &block_size)) <= 0) {
+		return ret;
+	}
+
+	ret = _fil_delete_rados_objects(pool, prefix, block_size);
+	free(prefix);
+	if (ret) {
+		/* if there's an error, it is already reported */
 		return -1;
 	}
-	
-	if (json_array_set(metadata_json,index,file) < 0) {
-		fprintf(stderr, "Error updating the file object in the metadata\n");
+
+	/* All good to remove the metadata and objects */
+	if (_fil_rm_file_metadata(filepath,type)) {
+		/* if there's an error, it is already reported */
 		return -1;
 	}
 
-	json_decref(file);
-    
-    return 0;
+	return 0;
+}
+
+/* Flush all data and wait until done, for all the files, see fil_fsync
+   to wait for a single file */
+void fil_flush() {
+	unsigned int i, j;
+
+	pthread_mutex_lock(&fil_pool_mutex);
+	for (i = 0; i < fil_n_pools; i++) {
+		for (j = 0; j < fil_n_shards; j++) {
+			rados_aio_flush(fil_pools[i].ioctxs[j]);
+		}
+	}
+	pthread_mutex_unlock(&fil_pool_mutex);
 
-    /* 
-     * We don't need to update metadata on disk, n_ref is useless there
-     * since it is set to 0 on load
-     */
 }
 
-/*      
-        (pseudoPrivate) Increment the number of reference of a file
-        return 0 if successfull, -1 if error 
+
+/* 	
+	Open an existing file
+	return the file handle if successfull or NULL if an error occurred 
 */
-int _fil_increment_n_ref(
+FILErados_t* fil_open( 
 	char* filepath,   /* file path like sbtest/sbtest.ibd */
-	os_file_type_t type
-	) 
+	os_file_type_t type /* file object type, seen enum def */
+)
+{  
+	/* checking if the path exists in the metadata */
+	if (_fil_find_in_metadata(filepath,type) < 0) {
+		fprintf(stderr, "Error: file %s does not exist\n", filepath);
+		return NULL;
+	}
+
+	FILErados_t* fp;
+	fp = calloc(1, sizeof(FILErados_t));
+	if (!fp) {
+		fprintf(stderr, "Error: unable to allocate memory fo file %s handle\n", filepath);
+		return NULL;
+	}	
+
+	if (_fil_get_file_metadata(filepath,type,fp) < 0) {
+		fprintf(stderr, "Error: unable to initialize the file handle for file %s\n", filepath);
+		free(fp);	
+		return NULL;
+	}
+	fp->shard = _fil_shard_of(fp->metadata.prefix);
+	fp->ec_align = _fil_ec_align_of(fp);
+	fp->eof_block = fp->metadata.size ? ((fp->metadata.size - 1)/fp->metadata.block_size)*fp->metadata.block_size : 0;
+	_fil_select_block_io(fp);
+    
+    if (_fil_aio_state_create(fp) < 0) {
+		free(fp->metadata.name);
+		free(fp->metadata.prefix);
+		free(fp);
+		return NULL;
+    }
+
+    if (_fil_shared_acquire(fp) < 0) {
+		_fil_aio_state_destroy(fp);
+		free(fp->metadata.name);
+		free(fp->metadata.prefix);
+		free(fp);
+		return NULL;
+    }
+
+    if (_fil_increment_n_ref(filepath,type) < 0) {
+		fprintf(stderr, "Error: couldn't increment n_ref for file %s\n", filepath);
+		_fil_shared_release(fp);
+		_fil_aio_state_destroy(fp);
+		free(fp->metadata.name);
+		free(fp->metadata.prefix);
+		free(fp);	
+		return NULL;        
+    }
+
+	/* Initialize the position to 0 */
+	fp->position=0;
+
+	return fp;
+}
+
+/*
+        (pseudoPrivate) Fill a write operation recording the end of file
+        at block_offset on the first object of a file.  The OSD compares
+        it with the offset recorded and keeps the larger one, the
+        operation fails with ECANCELED if it is not larger.  With create
+        the object is created, it must not exist.
+*/
+static void _fil_eof_record_op(
+	rados_write_op_t	write_op,	/* operation to fill */
+	size_t		block_offset,	/* offset of the object at the end of the file */
+	int		create	/* 1 if the first object is missing */
+	)
 {
-    return _fil_set_n_ref(filepath,type,1);
+	char	eof_str[24];
+
+	snprintf(eof_str, sizeof(eof_str), FIL_EOF_FORMAT, block_offset);
+	if (create) {
+		rados_write_op_create(write_op, LIBRADOS_CREATE_EXCLUSIVE, NULL);
+	} else {
+		rados_write_op_cmpxattr(write_op, FIL_EOF_XATTR, LIBRADOS_CMPXATTR_OP_GT,
+			eof_str, strlen(eof_str));
+	}
+	rados_write_op_setxattr(write_op, FIL_EOF_XATTR, eof_str, strlen(eof_str));
 }
 
-/*      
-        (pseudoPrivate) Decrement the number of reference of a file
-        return 0 if successfull, -1 if error 
+/* Wait for a synchronous request */
+struct fil_aio_sync {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	int		done;
+	ssize_t		result;
+};
+
+static void _fil_aio_sync_cb(void* arg, ssize_t result)
+{
+	struct fil_aio_sync* sync = arg;
+
+	pthread_mutex_lock(&sync->mutex);
+	sync->result = result;
+	sync->done = 1;
+	pthread_cond_signal(&sync->cond);
+	pthread_mutex_unlock(&sync->mutex);
+}
+
+static ssize_t _fil_aio_sync_wait(struct fil_aio_sync* sync)
+{
+	pthread_mutex_lock(&sync->mutex);
+	while (!sync->done) {
+		pthread_cond_wait(&sync->cond, &sync->mutex);
+	}
+	pthread_mutex_unlock(&sync->mutex);
+	pthread_mutex_destroy(&sync->mutex);
+	pthread_cond_destroy(&sync->cond);
+	return sync->result;
+}
+
+#define FIL_AIO_SYNC_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 }
+
+/* Caller waiting for a record of the end of file */
+struct fil_eof_waiter {
+	fil_aio_cb_t		cb;
+	void*			cb_arg;
+	struct fil_eof_waiter*	next;
+};
+
+/* Record of the end of a file in flight, see _fil_eof_record_start */
+struct fil_eof_record {
+	FILErados_t*		fp;
+	char*			obj_name;	/* first object of the file */
+	size_t			block_offset;	/* offset recorded */
+	int			create;	/* 1 if the first object is created */
+	rados_write_op_t	write_op;
+	rados_completion_t	completion;
+	struct fil_eof_waiter*	waiters;	/* size lock held */
+};
+
+static void _fil_eof_record_complete(rados_completion_t completion, void* arg);
+
+/*
+        (pseudoPrivate) Send the operation of a record of the end of file
+        return 0 if successfull, a negative errno if error
 */
-int _fil_decrement_n_ref(
-	char* filepath,   /* file path like sbtest/sbtest.ibd */
-	os_file_type_t type
-	) 
+static int _fil_eof_record_submit(
+	struct fil_eof_record*	rec	/* record to send */
+	)
 {
-    return _fil_set_n_ref(filepath,type,-1);
+	int	ret;
+
+	if (!(rec->write_op = rados_create_write_op())) {
+		fprintf(stderr, "Error: unable to create the write operation of %s\n", rec->obj_name);
+		return -ENOMEM;
+	}
+	if ((ret = rados_aio_create_completion(rec, _fil_eof_record_complete, NULL, &rec->completion)) < 0) {
+		fprintf(stderr, "Error %d: unable to create a completion for %s\n%s\n", -ret, rec->obj_name, strerror(-ret));
+		rados_release_write_op(rec->write_op);
+		return ret;
+	}
+	_fil_eof_record_op(rec->write_op, rec->block_offset, rec->create);
+	if ((ret = rados_aio_write_op_operate(rec->write_op, _fil_file_ioctx(rec->fp),
+			rec->completion, rec->obj_name, NULL, 0)) < 0) {
+		fprintf(stderr, "Error %d: Could not submit operation on %s\n%s\n", -ret, rec->obj_name, strerror(-ret));
+		rados_aio_release(rec->completion);
+		rados_release_write_op(rec->write_op);
+		return ret;
+	}
+	return 0;
+}
+
+/* A record of the end of file is done, its waiters are called */
+static void _fil_eof_record_done(
+	struct fil_eof_record*	rec,	/* record done */
+	int			ret	/* 0, or a negative errno if error */
+	)
+{
+	FILErados_t* fp = rec->fp;
+	struct fil_eof_waiter *waiters, *next;
+
+	if (ret < 0) {
+		fprintf(stderr, "Error %d: Could not record the end of file on %s\n%s\n", -ret, rec->obj_name, strerror(-ret));
+	}
+	_fil_size_lock(fp);
+	if (ret == 0 && rec->block_offset > fp->eof_block) {
+		fp->eof_block = rec->block_offset;
+	}
+	if (fp->eof_record == rec) {
+		fp->eof_record = NULL;
+	}
+	waiters = rec->waiters;
+	_fil_size_unlock(fp);
+
+	for (; waiters; waiters = next) {
+		next = waiters->next;
+		waiters->cb(waiters->cb_arg, ret < 0 ? -1 : 0);
+		free(waiters);
+	}
+	free(rec->obj_name);
+	free(rec);
 }
 
+/* Completion of a record of the end of file, sent again when the first
+   object was missing or created meanwhile */
+static void _fil_eof_record_complete(rados_completion_t completion, void* arg)
+{
+	struct fil_eof_record* rec = arg;
+	int ret;
+
+	ret = rados_aio_get_return_value(completion);
+	rados_aio_release(completion);
+	rados_release_write_op(rec->write_op);
+
+	/* the first object is created by the first write of the file, or
+	   by the record when it is past the first block */
+	if (ret == -ENOENT || (ret == -EEXIST && rec->create)) {
+		rec->create = ret == -ENOENT;
+		if ((ret = _fil_eof_record_submit(rec)) == 0) {
+			return;
+		}
+	}
+	/* ECANCELED, a larger offset is recorded */
+	_fil_eof_record_done(rec, ret == -ECANCELED ? 0 : ret);
+}
 
 /*
- *     (pseudoPrivate) Return if the file is delete or not in the metadata 
-        Returns: 0 if not deleted, 1 if deleted and -1 on error
+        (pseudoPrivate) Record on the first object of a file the offset of
+        the object holding the new end of the file, once a write made the
+        file grow past the object last recorded by the handle.  It is done
+        once per block of growth, a write waits for the record in flight
+        on the handle if it covers its growth.  The handles of other
+        processes record their own growth, the offset recorded only
+        rises, see _fil_eof_record_op.  cb is called with 0 or -1 once
+        recorded, possibly in a librados thread.  The size lock must not
+        be held.
+        return 1 if cb is to be called, 0 if there is nothing to record,
+        -1 if error (cb is not called)
 */
-unsigned int _fil_is_deleted(
-	json_t *file   /* json file element */
-	) 
+static int _fil_eof_record_start(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		new_size,	/* new size of the file */
+	fil_aio_cb_t	cb,	/* called when recorded */
+	void*		cb_arg	/* passed to cb */
+	)
 {
-    
-    if (json_is_object(file)) { 
-        /* get the n_ref */
-        unsigned int deleted;
-        json_t *j_deleted;
-        j_deleted = (json_t *) (intptr_t) json_object_get(file,"deleted");
-        if(!json_is_integer(j_deleted)) {
-            fprintf(stderr, "error: deleted element returned is not an integer\n");
-            json_decref(j_deleted);
-            return -1;
-        } else {
-            deleted = (unsigned int) json_integer_value(j_deleted);
-        }
-        json_decref(j_deleted);
-        
-        return deleted;
-    } else {
-        return -1;
-    }
+	size_t	block_offset = ((new_size - 1)/fp->metadata.block_size)*fp->metadata.block_size;
+	struct fil_eof_waiter*	waiter;
+	struct fil_eof_record*	rec;
+	int	ret;
+
+	if (!(waiter = calloc(1, sizeof(struct fil_eof_waiter)))) {
+		fprintf(stderr, "Error: unable to allocate memory to record the end of %s\n", fp->metadata.name);
+		return -1;
+	}
+	waiter->cb = cb;
+	waiter->cb_arg = cb_arg;
+
+	_fil_size_lock(fp);
+	if (block_offset <= fp->eof_block) {
+		_fil_size_unlock(fp);
+		free(waiter);
+		return 0;
+	}
+	if (fp->eof_record && fp->eof_record->block_offset >= block_offset) {
+		waiter->next = fp->eof_record->waiters;
+		fp->eof_record->waiters = waiter;
+		_fil_size_unlock(fp);
+		return 1;
+	}
+	_fil_size_unlock(fp);
+
+	if (!(rec = calloc(1, sizeof(struct fil_eof_record)))
+			|| !(rec->obj_name = _fil_get_object_name(fp,0))) {
+		fprintf(stderr, "Error: unable to allocate memory to record the end of %s\n", fp->metadata.name);
+		free(rec);
+		free(waiter);
+		return -1;
+	}
+	rec->fp = fp;
+	rec->block_offset = block_offset;
+	rec->waiters = waiter;
+
+	/* the later writes up to this block wait for it */
+	_fil_size_lock(fp);
+	if (!fp->eof_record || fp->eof_record->block_offset < block_offset) {
+		fp->eof_record = rec;
+	}
+	_fil_size_unlock(fp);
+	if ((ret = _fil_eof_record_submit(rec)) < 0) {
+		_fil_eof_record_done(rec, ret);
+	}
+	return 1;
 }
 
-/*      
-        (pseudoPrivate) Update the size of a file after a write
-        return 0 if successfull, -1 if error 
+/*
+        (pseudoPrivate) Record the end of a file after a write made it
+        grow, and wait for it, see _fil_eof_record_start
+        return 0 if successfull, -1 if error
 */
-int _fil_update_size(
-	char* filepath,   /* file path like sbtest/sbtest.ibd */
-	os_file_type_t type, /* file object type, seen enum def */
-	size_t new_size /* new file size */
-	) 
+static int _fil_record_eof(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		new_size	/* new size of the file */
+	)
 {
-	/* TODO:  may need a mutex when used with multiple threads */
-	int index = _fil_find_in_metadata(filepath,type);
-	json_t *file = (json_t *) (intptr_t) json_array_get(metadata_json,index);
+	struct fil_aio_sync	sync = FIL_AIO_SYNC_INITIALIZER;
+	int	ret;
+
+	if ((ret = _fil_eof_record_start(fp, new_size, _fil_aio_sync_cb, &sync)) <= 0) {
+		pthread_mutex_destroy(&sync.mutex);
+		pthread_cond_destroy(&sync.cond);
+		return ret;
+	}
+	return _fil_aio_sync_wait(&sync) < 0 ? -1 : 0;
+}
+
+/*
+        (pseudoPrivate) Return the new size of a file if a write up to
+        end extends it, 0 if not
+*/
+static size_t _fil_size_extends(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		end	/* end of the write */
+	)
+{
+	size_t	new_size = 0;
+
+	_fil_size_lock(fp);
+	if (end > fp->metadata.size) {
+		new_size = end;
+	}
+	_fil_size_unlock(fp);
+	return new_size;
+}
+
+/*
+        (pseudoPrivate) Raise the size of a file after a write extending
+        it, a concurrent write on the handle may have extended it
+        further.  The catalog is updated lazily, see fil_close.
+*/
+static void _fil_size_grow(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		new_size	/* end of the write */
+	)
+{
+	_fil_size_lock(fp);
+	if (new_size > fp->metadata.size) {
+		fp->metadata.size = new_size;
+		fp->size_dirty = 1;
+	}
+	_fil_size_unlock(fp);
+}
+
+/*
+        (pseudoPrivate) Get the offset of the object at the end of a file
+        recorded by _fil_record_eof, 0 if none was recorded
+        return 0 if successfull, -1 if error
+*/
+static int _fil_get_eof_block(
+	rados_ioctx_t	io,	/* io context of the file */
+	const char*	obj_name,	/* name of the first object of the file */
+	size_t*		eof_block	/* recorded offset */
+	)
+{
+	char	eof_str[24];
+	int	ret;
+
+	*eof_block = 0;
+	ret = rados_getxattr(io, obj_name, FIL_EOF_XATTR, eof_str, sizeof(eof_str) - 1);
+	if (ret >= 0) {
+		eof_str[ret] = '\0';
+		*eof_block = strtoull(eof_str, NULL, 10);
+	} else if (ret != -ENOENT && ret != -ENODATA) {
+		fprintf(stderr, "Error %d: Could not get the end of file of %s\n%s\n", -ret, obj_name, strerror(-ret));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+        (pseudoPrivate) Raise size to the end of the file seen by a block
+        object, from its size attribute
+        return 1 if the object exists, 0 if it is missing, -1 if error
+*/
+static int _fil_probe_object_end(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		block_offset,	/* offset of the object in the file */
+	size_t*		size	/* largest size found so far */
+	)
+{
+	char	size_str[24];
+	char*	obj_name;
+	int	ret;
+
+	if (!(obj_name = _fil_get_object_name(fp,block_offset))) {
+		return -1;
+	}
+
+	ret = rados_getxattr(_fil_ioctx(fp), obj_name, FIL_SIZE_XATTR,
+		size_str, sizeof(size_str) - 1);
+	if (ret == -ENOENT) {
+		free(obj_name);
+		return 0;
+	} else if (ret >= 0) {
+		size_str[ret] = '\0';
+		if ((size_t) strtoull(size_str, NULL, 10) > *size) {
+			*size = strtoull(size_str, NULL, 10);
+		}
+	} else if (ret == -ENODATA && fp->metadata.codec == FIL_CODEC_NONE) {
+		/* object written before the size attribute existed */
+		uint64_t obj_size;
+		time_t obj_mtime;
+		if (rados_stat(_fil_ioctx(fp), obj_name, &obj_size, &obj_mtime) == 0
+				&& block_offset + obj_size > *size) {
+			*size = block_offset + obj_size;
+		}
+	} else if (ret != -ENODATA) {
+		fprintf(stderr, "Error %d: Could not get the size of %s\n%s\n", -ret, obj_name, strerror(-ret));
+		free(obj_name);
+		return -1;
+	}
+	free(obj_name);
+	return 1;
+}
+
+/*
+        (pseudoPrivate) Derive the size of a file from its objects.  The
+        catalog size is a lower bound, a writer may have extended the file
+        without closing it.  The object recorded at the end of the file by
+        _fil_record_eof is checked, then the following ones until one is
+        missing, so a file grows by a few round trips whatever the number
+        of blocks written since the catalog was updated, and a hole in the
+        middle of the file doesn't stop the search.  When the recorded
+        object is missing (its write failed or is still in flight), the
+        objects are checked from the one holding the catalog end of file.
+        The size is the largest size attribute found.
+        return 0 if successfull, -1 if error
+*/
+int _fil_derive_size(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	size_t	block_offset;
+	size_t	eof_block;
+	size_t	size;
+	char*	obj_name;
+	int	ret;
+
+	/* no lock held during the reads, the writes of the handle only
+	   raise the size meanwhile */
+	_fil_size_lock(fp);
+	size = fp->metadata.size;
+	_fil_size_unlock(fp);
+
+	block_offset = size ? ((size - 1)/fp->metadata.block_size)*fp->metadata.block_size : 0;
+
+	if (!(obj_name = _fil_get_object_name(fp,0))) {
+		return -1;
+	}
+	ret = _fil_get_eof_block(_fil_ioctx(fp), obj_name, &eof_block);
+	free(obj_name);
+	if (ret < 0) {
+		return -1;
+	}
+	if (eof_block > block_offset) {
+		if ((ret = _fil_probe_object_end(fp, eof_block, &size)) < 0) {
+			return -1;
+		} else if (ret) {
+			block_offset = eof_block + fp->metadata.block_size;
+		}
+	}
+
+	/* past the last object */
+	while ((ret = _fil_probe_object_end(fp, block_offset, &size)) > 0) {
+		block_offset += fp->metadata.block_size;
+	}
+	if (ret < 0) {
+		return -1;
+	}
+
+	_fil_size_lock(fp);
+	if (size > fp->metadata.size) {
+		fp->metadata.size = size;
+		fp->size_dirty = 1;
+	}
+	if (eof_block > fp->eof_block) {
+		fp->eof_block = eof_block;
+	}
+	fp->size_known = 1;
+	_fil_size_unlock(fp);
+	return 0;
+}
+
+/*
+        Return the size of a file, derived from the objects on the first
+        call, see _fil_derive_size
+        return the size if successfull, -1 if error
+*/
+ssize_t fil_get_size(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	ssize_t	size;
+	unsigned int known;
+
+	if (!fp || !fp->metadata.name || !fp->metadata.block_size) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+
+	_fil_size_lock(fp);
+	known = fp->size_known;
+	_fil_size_unlock(fp);
+	if (!known && _fil_derive_size(fp) < 0) {
+		return -1;
+	}
+	_fil_size_lock(fp);
+	size = fp->metadata.size;
+	_fil_size_unlock(fp);
+	return size;
+}
+
+/*
+        Set the compression codec of a file, the file must be empty
+        return 0 if successfull, -1 if error
+*/
+int fil_set_compression(
+	FILErados_t*    fp,	/* handle to a file */
+	fil_codec_t	codec	/* compression codec */
+	)
+{
+	if (!fp || !fp->metadata.name) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+
+	if (!fil_codec_supported(codec)) {
+		fprintf(stderr, "Error: compression codec %d is not supported by this build\n", codec);
+		return -1;
+	}
+
+	ssize_t size = fil_get_size(fp);
+	if (size < 0) {
+		return -1;
+	}
+	if (size != 0) {
+		fprintf(stderr, "Error: the compression of file %s can't be changed, it is not empty\n", fp->metadata.name);
+		return -1;
+	}
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	json_t *file = _fil_get_json_metadata(fp->metadata.name,fp->metadata.type);
 	if (!file) {
-		fprintf(stderr, "Error extracting the file object from the metadata\n");
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		return -1;
+	}
+
+	if (json_object_set_new(file,"codec",json_integer(codec)) < 0) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error setting codec in the file object\n");
 		return -1;
 	}
+	_fil_md_changed(fp->metadata.name,fp->metadata.type);
+
+	if (_fil_update_metadata_json() < 0) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		return -1;
+	}
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	fp->metadata.codec = codec;
+	return 0;
+}
+
+/*
+        (pseudoPrivate) Read part of a single rados object
+        return the number of bytes read if successfull, the negative rados
+        error otherwise, a missing object (-ENOENT) is not reported
+*/
+ssize_t _fil_rados_read_object(
+	rados_ioctx_t	io,	/* io context of the object, see _fil_ioctx */
+	const char*	obj_name,	/* name of the rados object */
+	char*		buf,	/* buffer where to read */
+	size_t		len,	/* number of bytes to read */
+	size_t		offset  /* offset within the object */
+	)
+{
+	int ret;
+	int token;
+
+	token = _fil_sched_acquire(len);
+	FIL_PROBE3(rados_read_entry, obj_name, offset, len);
+	ret = rados_read(io, obj_name, buf, len, offset);
+	FIL_PROBE4(rados_read_return, obj_name, offset, len, ret);
+	_fil_sched_release(token);
+
+	if (ret < 0 && ret != -ENOENT) {
+		fprintf(stderr, "Error %d: Could not read %s at offset %zu\n%s\n", -ret, obj_name, offset, strerror(-ret));
+	}
+	return ret;
+}
+
+/*
+        (pseudoPrivate) Add the update of the file size attribute to a
+        write operation, the size is stored as a decimal string
+*/
+void _fil_write_op_set_size(
+	rados_write_op_t	write_op,	/* compound write operation */
+	size_t			file_size	/* new size of the file */
+	)
+{
+	char size_str[24];
+	int n;
+
+	n = snprintf(size_str, sizeof(size_str), "%zu", file_size);
+	rados_write_op_setxattr(write_op, FIL_SIZE_XATTR, size_str, n);
+}
+
+/*
+        (pseudoPrivate) Write part of a single rados object.  When file_size
+        is not 0, the write extends the file and the size attribute of the
+        object is updated by the same atomic operation as the data.
+        return the number of bytes written if successfull, -1 if error
+*/
+ssize_t _fil_rados_write_object(
+	rados_ioctx_t	io,	/* io context of the object, see _fil_ioctx */
+	const char*	obj_name,	/* name of the rados object */
+	const char*	buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		offset,  /* offset within the object */
+	size_t		file_size	/* new file size, 0 if not extending */
+	)
+{
+	int ret;
+	int token;
+	rados_write_op_t write_op;
+
+	token = _fil_sched_acquire(len);
+	FIL_PROBE3(rados_write_entry, obj_name, offset, len);
+	if (!file_size) {
+		ret = rados_write(io, obj_name, buf, len, offset);
+	} else if (!(write_op = rados_create_write_op())) {
+		ret = -ENOMEM;
+	} else {
+		rados_write_op_write(write_op, buf, len, offset);
+		_fil_write_op_set_size(write_op, file_size);
+		ret = rados_write_op_operate(write_op, io, obj_name, NULL, 0);
+		rados_release_write_op(write_op);
+	}
+	FIL_PROBE4(rados_write_return, obj_name, offset, len, ret);
+	_fil_sched_release(token);
+
+	if (ret < 0) {
+		fprintf(stderr, "Error %d: Could not write %s at offset %zu\n%s\n", -ret, obj_name, offset, strerror(-ret));
+		return -1;
+	}
+	/* rados_write returns 0 on success */
+	return len;
+}
+
+/*
+        (pseudoPrivate) Replace the content of a single rados object, the
+        size attribute is updated in the same operation when file_size
+        is not 0
+        return the number of bytes written if successfull, -1 if error
+*/
+ssize_t _fil_rados_write_full_object(
+	rados_ioctx_t	io,	/* io context of the object, see _fil_ioctx */
+	const char*	obj_name,	/* name of the rados object */
+	const char*	buf,	/* new content of the object */
+	size_t		len,	/* length of the new content */
+	size_t		file_size	/* new file size, 0 if not extending */
+	)
+{
+	int ret;
+	int token;
+	rados_write_op_t write_op;
+
+	token = _fil_sched_acquire(len);
+	FIL_PROBE3(rados_write_entry, obj_name, 0, len);
+	if (!(write_op = rados_create_write_op())) {
+		ret = -ENOMEM;
+	} else {
+		rados_write_op_write_full(write_op, buf, len);
+		if (file_size) {
+			_fil_write_op_set_size(write_op, file_size);
+		}
+		ret = rados_write_op_operate(write_op, io, obj_name, NULL, 0);
+		rados_release_write_op(write_op);
+	}
+	FIL_PROBE4(rados_write_return, obj_name, 0, len, ret);
+	_fil_sched_release(token);
+
+	if (ret < 0) {
+		fprintf(stderr, "Error %d: Could not write %s\n%s\n", -ret, obj_name, strerror(-ret));
+		return -1;
+	}
+	return len;
+}
+
+/*
+ * Compressed files
+ *
+ * Each block object of a compressed file starts with a header giving the
+ * codec used for the block, the uncompressed length and the length of the
+ * payload following the header.  A block is therefore always read with a
+ * single rados read of the whole object.  When a block doesn't compress,
+ * it is stored with FIL_CODEC_NONE in its header.
+ *
+ *   bytes 0-3    magic "FILZ"
+ *   byte  4      codec
+ *   bytes 5-7    reserved, 0
+ *   bytes 8-11   uncompressed length, little endian
+ *   bytes 12-15  payload length, little endian
+ */
+#define FIL_BLOCK_MAGIC		"FILZ"
+#define FIL_BLOCK_HDR_LEN	16
+
+static void _fil_put_u32(unsigned char* p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t _fil_get_u32(const unsigned char* p)
+{
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8)
+		| ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/*
+        Tell if a codec is available in this build
+        return 1 if available, 0 otherwise
+*/
+int fil_codec_supported(
+	fil_codec_t	codec	/* compression codec */
+	)
+{
+	switch (codec) {
+	case FIL_CODEC_NONE:
+		return 1;
+#ifdef HAVE_LZ4
+	case FIL_CODEC_LZ4:
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	case FIL_CODEC_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/* Worst case compressed length of len bytes */
+static size_t _fil_codec_bound(
+	fil_codec_t	codec,	/* compression codec */
+	size_t		len	/* uncompressed length */
+	)
+{
+	switch (codec) {
+#ifdef HAVE_LZ4
+	case FIL_CODEC_LZ4:
+		return LZ4_compressBound(len);
+#endif
+#ifdef HAVE_ZSTD
+	case FIL_CODEC_ZSTD:
+		return ZSTD_compressBound(len);
+#endif
+	default:
+		return len;
+	}
+}
+
+/*
+        (pseudoPrivate) Compress len bytes of src in dst
+        return the compressed length if successfull, -1 if error
+*/
+static ssize_t _fil_compress(
+	fil_codec_t	codec,	/* compression codec */
+	const char*	src,	/* data to compress */
+	size_t		len,	/* length of the data */
+	char*		dst,	/* destination buffer */
+	size_t		dst_len	/* size of the destination buffer */
+	)
+{
+#if !defined(HAVE_LZ4) && !defined(HAVE_ZSTD)
+	(void) src;
+	(void) len;
+	(void) dst;
+	(void) dst_len;
+#endif
+	switch (codec) {
+#ifdef HAVE_LZ4
+	case FIL_CODEC_LZ4: {
+		int ret = LZ4_compress_default(src, dst, len, dst_len);
+		return ret > 0 ? ret : -1;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case FIL_CODEC_ZSTD: {
+		size_t ret = ZSTD_compress(dst, dst_len, src, len, FIL_ZSTD_LEVEL);
+		return ZSTD_isError(ret) ? -1 : (ssize_t) ret;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
+
+/*
+        (pseudoPrivate) Decompress len bytes of src in dst
+        return the decompressed length if successfull, -1 if error
+*/
+static ssize_t _fil_decompress(
+	fil_codec_t	codec,	/* compression codec */
+	const char*	src,	/* compressed data */
+	size_t		len,	/* length of the compressed data */
+	char*		dst,	/* destination buffer */
+	size_t		dst_len	/* size of the destination buffer */
+	)
+{
+	switch (codec) {
+	case FIL_CODEC_NONE:
+		if (len > dst_len) {
+			return -1;
+		}
+		memcpy(dst, src, len);
+		return len;
+#ifdef HAVE_LZ4
+	case FIL_CODEC_LZ4: {
+		int ret = LZ4_decompress_safe(src, dst, len, dst_len);
+		return ret >= 0 ? ret : -1;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case FIL_CODEC_ZSTD: {
+		size_t ret = ZSTD_decompress(dst, dst_len, src, len);
+		return ZSTD_isError(ret) ? -1 : (ssize_t) ret;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
+
+/*
+        (pseudoPrivate) Return the size of the buffer _fil_encode_block
+        needs for raw_len bytes of a block
+*/
+size_t _fil_block_object_size(
+	fil_codec_t	codec,	/* compression codec */
+	size_t		raw_len	/* uncompressed length of the block */
+	)
+{
+	return FIL_BLOCK_HDR_LEN + _fil_codec_bound(codec, raw_len);
+}
+
+/*
+        (pseudoPrivate) Build the object of a block of a compressed file,
+        the header then the payload.  A block that doesn't compress is
+        stored with FIL_CODEC_NONE.
+        return the length of the object
+*/
+size_t _fil_encode_block(
+	fil_codec_t	codec,	/* compression codec */
+	const char*	block,	/* uncompressed block */
+	size_t		raw_len,	/* uncompressed length of the block */
+	unsigned char*	obj_buf,	/* of _fil_block_object_size bytes */
+	size_t		obj_buf_len	/* size of obj_buf */
+	)
+{
+	ssize_t	payload_len;
+
+	memcpy(obj_buf, FIL_BLOCK_MAGIC, 4);
+	memset(obj_buf + 4, 0, 4);
+	payload_len = _fil_compress(codec, block, raw_len,
+		(char *) obj_buf + FIL_BLOCK_HDR_LEN, obj_buf_len - FIL_BLOCK_HDR_LEN);
+	if (payload_len < 0 || (size_t) payload_len >= raw_len) {
+		/* doesn't compress, store it as is */
+		obj_buf[4] = FIL_CODEC_NONE;
+		memcpy(obj_buf + FIL_BLOCK_HDR_LEN, block, raw_len);
+		payload_len = raw_len;
+	} else {
+		obj_buf[4] = codec;
+	}
+	_fil_put_u32(obj_buf + 8, raw_len);
+	_fil_put_u32(obj_buf + 12, payload_len);
+	return FIL_BLOCK_HDR_LEN + payload_len;
+}
+
+/*
+        (pseudoPrivate) Uncompress the object of a block of a compressed
+        file in block, a buffer of block_size bytes
+        return the uncompressed length if successfull, -1 if the object
+        is not a valid block
+*/
+ssize_t _fil_decode_block(
+	const unsigned char*	obj_buf,	/* object of the block */
+	size_t			obj_len,	/* length of the object */
+	char*			block,	/* where to uncompress the block */
+	size_t			block_size	/* size of block */
+	)
+{
+	uint32_t	payload_len;
+	uint32_t	raw_len;
+
+	if (obj_len < FIL_BLOCK_HDR_LEN || memcmp(obj_buf, FIL_BLOCK_MAGIC, 4)) {
+		return -1;
+	}
+	payload_len = _fil_get_u32(obj_buf + 12);
+	raw_len = _fil_get_u32(obj_buf + 8);
+	if (payload_len > obj_len - FIL_BLOCK_HDR_LEN || raw_len > block_size
+			|| _fil_decompress(obj_buf[4], (const char *) obj_buf + FIL_BLOCK_HDR_LEN,
+				payload_len, block, block_size) != (ssize_t) raw_len) {
+		return -1;
+	}
+	return raw_len;
+}
+
+/*
+        (pseudoPrivate) Read and uncompress a whole block object in block,
+        a buffer of block_size bytes, raw_len is set to the uncompressed
+        length of the block
+        return 0 if successfull, -ENOENT if the object doesn't exist,
+        -1 if error
+*/
+int _fil_load_compressed_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	char*		block,	/* where to uncompress the block */
+	size_t*		raw_len	/* uncompressed length of the block */
+	)
+{
+	unsigned char*	obj_buf;
+	size_t		obj_buf_len;
+	ssize_t		ret;
+
+	obj_buf_len = _fil_block_object_size(fp->metadata.codec, fp->metadata.block_size);
+	if (!(obj_buf = _fil_buf_alloc(obj_buf_len))) {
+		fprintf(stderr, "Error: unable to allocate memory to read %s\n", obj_name);
+		return -1;
+	}
+
+	if ((ret = _fil_lcache_read(fp, obj_name, (char *) obj_buf, obj_buf_len, 0, obj_buf_len)) < 0) {
+		_fil_buf_free(obj_buf, obj_buf_len);
+		return ret == -ENOENT ? -ENOENT : -1;
+	}
+
+	if (ret == 0) {
+		/* a hole */
+		_fil_buf_free(obj_buf, obj_buf_len);
+		*raw_len = 0;
+		return 0;
+	}
+
+	if ((ret = _fil_decode_block(obj_buf, ret, block, fp->metadata.block_size)) < 0) {
+		fprintf(stderr, "Error: object %s is not a valid compressed block\n", obj_name);
+		_fil_buf_free(obj_buf, obj_buf_len);
+		return -1;
+	}
+	*raw_len = ret;
+
+	_fil_buf_free(obj_buf, obj_buf_len);
+	return 0;
+}
+
+/*
+        (pseudoPrivate) Read part of a block of a compressed file
+        return the number of bytes read if successfull, the negative rados
+        error otherwise
+*/
+static ssize_t _fil_read_compressed_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	char*		buf,	/* buffer where to read */
+	size_t		len,	/* number of bytes to read */
+	size_t		offset  /* offset within the block */
+	)
+{
+	char*	block;
+	size_t	raw_len;
+	int	ret;
+
+	if (!(block = _fil_buf_alloc(fp->metadata.block_size))) {
+		fprintf(stderr, "Error: unable to allocate memory to read %s\n", obj_name);
+		return -1;
+	}
+
+	if ((ret = _fil_load_compressed_block(fp, obj_name, block, &raw_len)) < 0) {
+		_fil_buf_free(block, fp->metadata.block_size);
+		return ret;
+	}
+
+	if (offset >= raw_len) {
+		len = 0;
+	} else if (len > raw_len - offset) {
+		len = raw_len - offset;
+	}
+	memcpy(buf, block + offset, len);
+
+	_fil_buf_free(block, fp->metadata.block_size);
+	return len;
+}
+
+/*
+        (pseudoPrivate) Write part of a block of a compressed file, a
+        partial block is read, patched and then compressed again.  The
+        object is always replaced as a whole.
+        return the number of bytes written if successfull, -1 if error
+*/
+static ssize_t _fil_write_compressed_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	const char*	buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		offset,  /* offset within the block */
+	size_t		file_size	/* new file size, 0 if not extending */
+	)
+{
+	char*	block;
+	unsigned char*	obj_buf;
+	size_t	obj_buf_len;
+	size_t	raw_len = 0;
+	size_t	obj_len;
+	int	ret;
+
+	if (!(block = _fil_buf_alloc(fp->metadata.block_size))) {
+		fprintf(stderr, "Error: unable to allocate memory to write %s\n", obj_name);
+		return -1;
+	}
+
+	if (offset || len < fp->metadata.block_size) {
+		/* partial block, need the current content */
+		ret = _fil_load_compressed_block(fp, obj_name, block, &raw_len);
+		if (ret == -ENOENT) {
+			raw_len = 0;
+		} else if (ret < 0) {
+			_fil_buf_free(block, fp->metadata.block_size);
+			return -1;
+		}
+		if (offset > raw_len) {
+			memset(block + raw_len, 0, offset - raw_len);
+		}
+	}
+	memcpy(block + offset, buf, len);
+	if (offset + len > raw_len) {
+		raw_len = offset + len;
+	}
+
+	obj_buf_len = _fil_block_object_size(fp->metadata.codec, raw_len);
+	if (!(obj_buf = _fil_buf_alloc(obj_buf_len))) {
+		fprintf(stderr, "Error: unable to allocate memory to write %s\n", obj_name);
+		_fil_buf_free(block, fp->metadata.block_size);
+		return -1;
+	}
+
+	obj_len = _fil_encode_block(fp->metadata.codec, block, raw_len, obj_buf, obj_buf_len);
+	ret = _fil_rados_write_full_object(_fil_ioctx(fp), obj_name, (char *) obj_buf,
+		obj_len, file_size);
+
+	_fil_buf_free(obj_buf, obj_buf_len);
+	_fil_buf_free(block, fp->metadata.block_size);
+	return ret < 0 ? -1 : (ssize_t) len;
+}
+
+/*
+        (pseudoPrivate) Tell if a buffer is all zeros, the bulk of the
+        buffer is checked with the widest vectors available in the build
+        return 1 if all zeros, 0 otherwise
+*/
+int _fil_is_zero(
+	const void*	buf,	/* buffer to check */
+	size_t		len	/* length of the buffer */
+	)
+{
+	const unsigned char* p = buf;
+	size_t i = 0;
+	uint64_t w;
+
+#if defined(__AVX2__)
+	for (; i + 128 <= len; i += 128) {
+		__m256i v = _mm256_or_si256(
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i *) (p + i)),
+				_mm256_loadu_si256((const __m256i *) (p + i + 32))),
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i *) (p + i + 64)),
+				_mm256_loadu_si256((const __m256i *) (p + i + 96))));
+		if (!_mm256_testz_si256(v, v)) {
+			return 0;
+		}
+	}
+#elif defined(__SSE2__)
+	for (; i + 64 <= len; i += 64) {
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *) (p + i)),
+				_mm_loadu_si128((const __m128i *) (p + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *) (p + i + 32)),
+				_mm_loadu_si128((const __m128i *) (p + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) {
+			return 0;
+		}
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	for (; i + 64 <= len; i += 64) {
+		uint8x16_t v = vorrq_u8(
+			vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+			vorrq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48)));
+		if (vmaxvq_u8(v)) {
+			return 0;
+		}
+	}
+#endif
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		if (w) {
+			return 0;
+		}
+	}
+	for (; i < len; i++) {
+		if (p[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+        (pseudoPrivate) Write a range of zeros in a block without sending
+        the zeros.  A whole block becomes a hole, the object is replaced
+        by an empty one with a zero length write_full, which an erasure
+        coded pool takes as any other full write, unlike a truncate.  A
+        partial range is zeroed by the OSD.  Reads within the file size
+        return zeros past the end of an object, see _fil_fill_hole.
+        return the number of bytes written if successfull, -1 if error
+*/
+static ssize_t _fil_write_zero_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	size_t		len,	/* number of zero bytes to write */
+	size_t		offset,  /* offset within the block */
+	size_t		file_size	/* new file size, 0 if not extending */
+	)
+{
+	rados_write_op_t write_op;
+	int ret;
+	int token;
+
+	/* nothing is transferred */
+	token = _fil_sched_acquire(0);
+	FIL_PROBE3(rados_hole_entry, obj_name, offset, len);
+	if (!(write_op = rados_create_write_op())) {
+		ret = -ENOMEM;
+	} else {
+		if (offset == 0 && len == fp->metadata.block_size) {
+			rados_write_op_write_full(write_op, "", 0);
+		} else {
+			rados_write_op_zero(write_op, offset, len);
+		}
+		if (file_size) {
+			_fil_write_op_set_size(write_op, file_size);
+		}
+		ret = rados_write_op_operate(write_op, _fil_ioctx(fp), obj_name, NULL, 0);
+		rados_release_write_op(write_op);
+	}
+	FIL_PROBE4(rados_hole_return, obj_name, offset, len, ret);
+	_fil_sched_release(token);
+
+	if (ret < 0) {
+		fprintf(stderr, "Error %d: Could not zero %s at offset %zu\n%s\n", -ret, obj_name, offset, strerror(-ret));
+		return -1;
+	}
+	return len;
+}
+
+/*
+        (pseudoPrivate) Complete a short read of a block with zeros up to
+        the file size, the missing part is a hole.  The size is resolved
+        by the caller when the read is issued, no I/O is done here, an
+        asynchronous read is completed in the librados callback.
+        return the number of bytes read including the zeros
+*/
+size_t _fil_fill_hole(
+	char*		buf,	/* buffer of the block read */
+	size_t		len,	/* number of bytes requested */
+	size_t		bytes_read,	/* number of bytes actually read */
+	size_t		file_offset,	/* file offset of buf */
+	size_t		file_size	/* size of the file when the read was issued */
+	)
+{
+	size_t end;
+
+	if (file_size <= file_offset + bytes_read) {
+		return bytes_read;
+	}
+
+	end = file_size - file_offset;
+	if (end > len) {
+		end = len;
+	}
+	memset(buf + bytes_read, 0, end - bytes_read);
+	return end;
+}
+
+/*
+        (pseudoPrivate) Read part of a block of a file, dispatch to the
+        compressed block path when the file is compressed
+        return the number of bytes read if successfull, the negative rados
+        error otherwise
+*/
+ssize_t _fil_read_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	char*		buf,	/* buffer where to read */
+	size_t		len,	/* number of bytes to read */
+	size_t		offset  /* offset within the block */
+	)
+{
+	if (fp->metadata.codec != FIL_CODEC_NONE) {
+		return _fil_read_compressed_block(fp, obj_name, buf, len, offset);
+	}
+	return _fil_lcache_read(fp, obj_name, buf, len, offset, fp->metadata.block_size);
+}
+
+/*
+        (pseudoPrivate) Write part of a block of a file on an erasure coded
+        pool.  The write is widened to the alignment of the handle, the
+        data of the widened parts is read first, only when the write is
+        not aligned.  A write covering the block replaces the whole object.
+        return the number of bytes written if successfull, -1 if error
+*/
+ssize_t _fil_ec_write_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	const char*	buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		offset,  /* offset within the block */
+	size_t		file_size	/* new file size, 0 if not extending */
+	)
+{
+	size_t	bs = fp->metadata.block_size;
+	size_t	align = fp->ec_align;
+	size_t	start = offset - offset % align;
+	size_t	end = (offset + len + align - 1) / align * align;
+	size_t	data_end;
+	char*	tmp;
+	ssize_t	ret;
+
+	if (end > bs) {
+		end = bs;
+	}
+
+	if (start == offset && end == offset + len) {
+		/* aligned, no read */
+		if (start == 0 && end == bs) {
+			ret = _fil_rados_write_full_object(_fil_ioctx(fp), obj_name, buf, len, file_size);
+		} else {
+			ret = _fil_rados_write_object(_fil_ioctx(fp), obj_name, buf, len, offset, file_size);
+		}
+		return ret < 0 ? -1 : (ssize_t) len;
+	}
+
+	if (!(tmp = _fil_buf_alloc(end - start))) {
+		fprintf(stderr, "Error: unable to allocate memory to write %s\n", obj_name);
+		return -1;
+	}
+	if ((ret = _fil_rados_read_object(_fil_ioctx(fp), obj_name, tmp, end - start, start)) == -ENOENT) {
+		ret = 0;
+	} else if (ret < 0) {
+		_fil_buf_free(tmp, end - start);
+		return -1;
+	}
+	/* the object ends before the write: a hole */
+	if ((size_t) ret < offset - start) {
+		memset(tmp + ret, 0, offset - start - ret);
+	}
+	memcpy(tmp + offset - start, buf, len);
+	data_end = start + ret > offset + len ? start + ret : offset + len;
+
+	if (start == 0 && (end == bs || start + ret < end)) {
+		/* the object is rewritten up to its end */
+		ret = _fil_rados_write_full_object(_fil_ioctx(fp), obj_name, tmp, data_end, file_size);
+	} else {
+		ret = _fil_rados_write_object(_fil_ioctx(fp), obj_name, tmp, data_end - start, start, file_size);
+	}
+	_fil_buf_free(tmp, end - start);
+	return ret < 0 ? -1 : (ssize_t) len;
+}
+
+/*
+        (pseudoPrivate) Write part of a block of a file, dispatch to the
+        compressed block path when the file is compressed, to the aligned
+        path on an erasure coded pool.  Zeros are not sent, see
+        _fil_write_zero_block.
+        return the number of bytes written if successfull, -1 if error
+*/
+ssize_t _fil_write_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	const char*	buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		offset,  /* offset within the block */
+	size_t		file_size	/* new file size, 0 if not extending */
+	)
+{
+	ssize_t ret;
+
+	if (_fil_is_zero(buf, len)
+			&& ((fp->metadata.codec == FIL_CODEC_NONE && !fp->ec_align)
+				|| (offset == 0 && len == fp->metadata.block_size))) {
+		ret = _fil_write_zero_block(fp, obj_name, len, offset, file_size);
+	} else if (fp->metadata.codec != FIL_CODEC_NONE) {
+		ret = _fil_write_compressed_block(fp, obj_name, buf, len, offset, file_size);
+	} else if (fp->ec_align) {
+		ret = _fil_ec_write_block(fp, obj_name, buf, len, offset, file_size);
+	} else {
+		ret = _fil_rados_write_object(_fil_ioctx(fp), obj_name, buf, len, offset, file_size);
+	}
+	if (ret >= 0) {
+		/* see fil_local_cache_configure */
+		_fil_lcache_written(fp, obj_name, buf, len, offset);
+	}
+	return ret;
+}
+
+/*
+        (pseudoPrivate) Remove a single rados object
+        return 0 if successfull, the negative rados error otherwise
+*/
+int _fil_rados_remove_object(
+	rados_ioctx_t	io,	/* io context of the object, see _fil_ioctx */
+	const char*	obj_name	/* name of the rados object */
+	)
+{
+	int ret;
+	int token;
+
+	token = _fil_sched_acquire(0);
+	FIL_PROBE1(rados_remove_entry, obj_name);
+	ret = rados_remove(io, obj_name);
+	FIL_PROBE2(rados_remove_return, obj_name, ret);
+	_fil_sched_release(token);
+
+	return ret;
+}
+
+/*
+        (pseudoPrivate) Build the name of the rados object holding the
+        block starting at block_offset, the caller must free the string
+        return the object name if successfull, NULL if error
+*/
+char* _fil_get_object_name(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		block_offset	/* offset of the beginning of the block */
+	)
+{
+	char* obj_name;
+
+	if (asprintf(&obj_name,"%s_%zu",fp->metadata.prefix,block_offset) < 0) {
+		fprintf(stderr, "Error: unable to allocate memory for an object name\n");
+		return NULL;
+	}
+	return obj_name;
+}
+
+/*
+        (pseudoPrivate) Read the part of one block of a file at
+        obj_offset, a missing object or a short one is a hole, see
+        _fil_fill_hole
+        return the number of bytes read if successfull, less than len at
+        the end of the file, -1 if error
+*/
+static inline ssize_t _fil_read_one_block(
+	FILErados_t*    fp,	/* handle to a file */
+	char*		buf,	/* buffer where to read */
+	size_t		len,	/* number of bytes to read */
+	size_t		block_offset,	/* offset of the beginning of the block */
+	size_t		obj_offset	/* offset within the block */
+	)
+{
+	ssize_t	ret;
+	ssize_t	size;
+	char*	obj_name;
+
+	/* blocks read ahead, see fil_advise */
+	if (fp->ra && (ret = _fil_ra_read(fp, buf, len, block_offset, obj_offset)) >= 0) {
+		return ret;
+	}
+	if (!(obj_name = _fil_get_object_name(fp,block_offset))) {
+		return -1;
+	}
+	if ((ret = _fil_read_block(fp,obj_name,buf,len,obj_offset)) == -ENOENT) {
+		/* no such block, a hole or the end of the file */
+		ret = 0;
+	}
+	free(obj_name);
+	if (ret < 0) {
+		return -1;
+	}
+	if ((size_t) ret < len && (size = fil_get_size(fp)) > 0) {
+		ret = _fil_fill_hole(buf,len,ret,block_offset + obj_offset,size);
+	}
+	return ret;
+}
+
+/*
+        (pseudoPrivate) Write the part of one block of a file at
+        obj_offset, file_size is the new size of the file when this part
+        ends the write extending it, 0 otherwise
+        return the number of bytes written if successfull, -1 if error
+*/
+static inline ssize_t _fil_write_one_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		block_offset,	/* offset of the beginning of the block */
+	size_t		obj_offset,	/* offset within the block */
+	size_t		file_size	/* new file size, 0 if not extending */
+	)
+{
+	ssize_t	ret;
+	char*	obj_name;
+
+	if (!(obj_name = _fil_get_object_name(fp,block_offset))) {
+		return -1;
+	}
+	ret = _fil_write_block(fp,obj_name,buf,len,obj_offset,file_size);
+	free(obj_name);
+	return ret < 0 ? -1 : ret;
+}
+
+/* Split [offset, offset + len) in block parts, BLOCK_OF / IN_BLOCK give
+   the block offset / the offset within the block of pos and BS the block
+   size.  A short read stops at the end of the file. */
+#define FIL_BLOCK_READ_LOOP(BLOCK_OF, IN_BLOCK, BS) \
+	size_t done = 0; \
+	while (done < len) { \
+		size_t pos = offset + done; \
+		size_t obj_offset = IN_BLOCK(pos); \
+		size_t chunk = (BS) - obj_offset; \
+		ssize_t ret; \
+		if (chunk > len - done) { \
+			chunk = len - done; \
+		} \
+		if ((ret = _fil_read_one_block(fp, buf + done, chunk, \
+				BLOCK_OF(pos), obj_offset)) < 0) { \
+			return -1; \
+		} \
+		done += ret; \
+		if ((size_t) ret < chunk) { \
+			break; \
+		} \
+	} \
+	return done;
+
+#define FIL_BLOCK_WRITE_LOOP(BLOCK_OF, IN_BLOCK, BS) \
+	size_t done = 0; \
+	while (done < len) { \
+		size_t pos = offset + done; \
+		size_t obj_offset = IN_BLOCK(pos); \
+		size_t chunk = (BS) - obj_offset; \
+		ssize_t ret; \
+		if (chunk > len - done) { \
+			chunk = len - done; \
+		} \
+		if ((ret = _fil_write_one_block(fp, buf + done, chunk, BLOCK_OF(pos), \
+				obj_offset, done + chunk == len ? file_size : 0)) < 0) { \
+			return -1; \
+		} \
+		done += ret; \
+	} \
+	return done;
+
+/* any block size, with divisions */
+#define FIL_GENERIC_BLOCK_OF(pos)	((pos) - (pos) % fp->metadata.block_size)
+#define FIL_GENERIC_IN_BLOCK(pos)	((pos) % fp->metadata.block_size)
+
+static ssize_t _fil_read_blocks_generic(
+	FILErados_t* fp, char* buf, size_t len, size_t offset)
+{
+	FIL_BLOCK_READ_LOOP(FIL_GENERIC_BLOCK_OF, FIL_GENERIC_IN_BLOCK,
+		fp->metadata.block_size)
+}
+
+static ssize_t _fil_write_blocks_generic(
+	FILErados_t* fp, const char* buf, size_t len, size_t offset, size_t file_size)
+{
+	FIL_BLOCK_WRITE_LOOP(FIL_GENERIC_BLOCK_OF, FIL_GENERIC_IN_BLOCK,
+		fp->metadata.block_size)
+}
+
+/* a block size of 1 << SHIFT known at compile time, shifts and masks */
+#define FIL_DEFINE_BLOCK_IO(SHIFT) \
+	static ssize_t _fil_read_blocks_##SHIFT( \
+		FILErados_t* fp, char* buf, size_t len, size_t offset) \
+	{ \
+		FIL_BLOCK_READ_LOOP(FIL_POW2_BLOCK_OF_##SHIFT, \
+			FIL_POW2_IN_BLOCK_##SHIFT, (size_t) 1 << SHIFT) \
+	} \
+	static ssize_t _fil_write_blocks_##SHIFT( \
+		FILErados_t* fp, const char* buf, size_t len, size_t offset, size_t file_size) \
+	{ \
+		FIL_BLOCK_WRITE_LOOP(FIL_POW2_BLOCK_OF_##SHIFT, \
+			FIL_POW2_IN_BLOCK_##SHIFT, (size_t) 1 << SHIFT) \
+	}
+
+#define FIL_POW2_BLOCK_OF_12(pos)	((pos) & ~(((size_t) 1 << 12) - 1))
+#define FIL_POW2_IN_BLOCK_12(pos)	((pos) & (((size_t) 1 << 12) - 1))
+#define FIL_POW2_BLOCK_OF_14(pos)	((pos) & ~(((size_t) 1 << 14) - 1))
+#define FIL_POW2_IN_BLOCK_14(pos)	((pos) & (((size_t) 1 << 14) - 1))
+#define FIL_POW2_BLOCK_OF_16(pos)	((pos) & ~(((size_t) 1 << 16) - 1))
+#define FIL_POW2_IN_BLOCK_16(pos)	((pos) & (((size_t) 1 << 16) - 1))
+#define FIL_POW2_BLOCK_OF_20(pos)	((pos) & ~(((size_t) 1 << 20) - 1))
+#define FIL_POW2_IN_BLOCK_20(pos)	((pos) & (((size_t) 1 << 20) - 1))
+#define FIL_POW2_BLOCK_OF_22(pos)	((pos) & ~(((size_t) 1 << 22) - 1))
+#define FIL_POW2_IN_BLOCK_22(pos)	((pos) & (((size_t) 1 << 22) - 1))
+
+FIL_DEFINE_BLOCK_IO(12)	/* 4K */
+FIL_DEFINE_BLOCK_IO(14)	/* 16K, the InnoDB page */
+FIL_DEFINE_BLOCK_IO(16)	/* 64K */
+FIL_DEFINE_BLOCK_IO(20)	/* 1M */
+FIL_DEFINE_BLOCK_IO(22)	/* 4M, the rados object default */
+
+/*
+        (pseudoPrivate) Pick the functions splitting the reads and the
+        writes of a file in blocks, specialized for the common block
+        sizes, generic otherwise
+*/
+void _fil_select_block_io(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	switch (fp->metadata.block_size) {
+#define FIL_BLOCK_IO_CASE(SHIFT) \
+	case (size_t) 1 << SHIFT: \
+		fp->read_blocks = _fil_read_blocks_##SHIFT; \
+		fp->write_blocks = _fil_write_blocks_##SHIFT; \
+		break;
+	FIL_BLOCK_IO_CASE(12)
+	FIL_BLOCK_IO_CASE(14)
+	FIL_BLOCK_IO_CASE(16)
+	FIL_BLOCK_IO_CASE(20)
+	FIL_BLOCK_IO_CASE(22)
+#undef FIL_BLOCK_IO_CASE
+	default:
+		fp->read_blocks = _fil_read_blocks_generic;
+		fp->write_blocks = _fil_write_blocks_generic;
+	}
+}
+
+/*      
+        Read from a file in rados 
+        return the number of bytes read if successfull, -1 if error 
+*/
+ssize_t fil_read(
+	FILErados_t*    fp,	/* handle to a file */
+	void*		buf,	/* buffer where to read */
+	size_t		len,	/* number of bytes to read */
+	size_t		offset  /* offset from where to start reading */
+) {
+	ssize_t bytes_read = 0;
+
+    /* TODO, implementing aio here could be very efficient on multi block reads */
+
+	if (!fp) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+
+	if (!fp->metadata.block_size) {
+		fprintf(stderr, "Error: uninitialized block size value, can't be zero\n");
+		return -1;
+	}
+
+	if (!fp->metadata.name) {
+		fprintf(stderr, "Error: uninitialized file name, can't be null\n");
+		return -1;
+	}
+
+	FIL_PROBE3(fil_read_entry, fp->metadata.name, offset, len);
+
+	if (fp->ra) {
+		_fil_ra_readahead(fp, offset, len);
+	}
+
+	/* split in blocks, see _fil_select_block_io */
+	if ((bytes_read = fp->read_blocks(fp, buf, len, offset)) < 0) {
+		FIL_PROBE4(fil_read_return, fp->metadata.name, offset, len, -1);
+		return -1;
+	}
+
+    FIL_PROBE4(fil_read_return, fp->metadata.name, offset, len, bytes_read);
+    return bytes_read;
+    
+}
+
+/*  
+ * Write to a file in rados 
+ * 
+ * Returns the number of bytes written if successfull, -1 if error 
+*/
+int fil_write(	
+    FILErados_t*    fp,	/* handle to a file */
+	void*		buf,	/* buffer where to get data to write */
+	size_t		len,    /* number of bytes to write */
+	size_t		offset  /* offset from where to start reading */
+    ) 
+{
+	ssize_t bytes_written = 0;
+	size_t	new_size = 0;
+
+    /* TODO, implementing aio here could be very efficient on multi block writes */
+
+	if (!fp) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+
+	if (!fp->metadata.block_size) {
+		fprintf(stderr, "Error: uninitialized block size value, can't be zero\n");
+		return -1;
+	}
+
+	if (!fp->metadata.name) {
+		fprintf(stderr, "Error: uninitialized file name, can't be null\n");
+		return -1;
+	}
+
+	FIL_PROBE3(fil_write_entry, fp->metadata.name, offset, len);
+	_fil_ra_invalidate(fp, offset, len);
+	if (_fil_lcache_invalidate(fp, offset, len) < 0) {
+		FIL_PROBE4(fil_write_return, fp->metadata.name, offset, len, -1);
+		return -1;
+	}
+
+	/* Does the write extend the file, if so the object holding the new
+	   end of file records the size in the same operation as the data */
+	new_size = _fil_size_extends(fp, offset + len);
+
+	/* split in blocks, see _fil_select_block_io */
+	bytes_written = fp->write_blocks(fp, buf, len, offset, new_size);
+	/* read ahead meanwhile by another handle */
+	_fil_ra_invalidate(fp, offset, len);
+	if (bytes_written < 0 || (new_size && _fil_record_eof(fp, new_size) < 0)) {
+		FIL_PROBE4(fil_write_return, fp->metadata.name, offset, len, -1);
+		return -1;
+	}
+
+    if (new_size) {
+        _fil_size_grow(fp, new_size);
+    }
+
+    FIL_PROBE4(fil_write_return, fp->metadata.name, offset, len, bytes_written);
+    return bytes_written;
+
+}
+
+/*
+	Return the largest write fil_write_atomic accepts on a file, the
+	block size.  Any write of up to this size that does not cross a
+	block boundary (a page of a power of two size dividing the block
+	size, written at a multiple of its size, always qualifies) is done
+	by fil_write_atomic as a single rados object operation.
+	return the atomic write unit if successfull, -1 if error
+*/
+ssize_t fil_atomic_write_unit(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	if (!fp || !fp->metadata.name || !fp->metadata.block_size) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+	return fp->metadata.block_size;
+}
+
+/*
+	Write data held by a single block as one rados object operation,
+	with the new file size if the write extends the file.  After an
+	error or a crash the block holds either all the old or all the
+	new data, never a mix, so a database can write its pages without
+	a doublewrite buffer.  A write crossing a block boundary is
+	refused, see fil_atomic_write_unit.  A partial block of a
+	compressed file is a read-modify-write, the caller must not write
+	the same block from two handles at the same time, as it must not
+	for a page anyway.
+	return the number of bytes written if successfull, -1 if error
+*/
+int fil_write_atomic(
+	FILErados_t*    fp,	/* handle to a file */
+	void*		buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		offset	/* offset in the file */
+	)
+{
+	size_t	block_offset;
+	size_t	new_size = 0;
+	ssize_t	bytes_written;
+	char*	obj_name;
+
+	if (!fp || !fp->metadata.name || !fp->metadata.block_size) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+
+	block_offset = offset - offset % fp->metadata.block_size;
+	if (!len || offset + len > block_offset + fp->metadata.block_size) {
+		fprintf(stderr, "Error: atomic write of %zu bytes at %zu crosses a block boundary of %s\n",
+			len, offset, fp->metadata.name);
+		return -1;
+	}
+
+	FIL_PROBE3(fil_write_entry, fp->metadata.name, offset, len);
+	_fil_ra_invalidate(fp, offset, len);
+	if (_fil_lcache_invalidate(fp, offset, len) < 0) {
+		FIL_PROBE4(fil_write_return, fp->metadata.name, offset, len, -1);
+		return -1;
+	}
+
+	new_size = _fil_size_extends(fp, offset + len);
+
+	if (!(obj_name = _fil_get_object_name(fp,block_offset))) {
+		FIL_PROBE4(fil_write_return, fp->metadata.name, offset, len, -1);
+		return -1;
+	}
+	bytes_written = _fil_write_block(fp, obj_name, buf, len, offset - block_offset, new_size);
+	free(obj_name);
+	_fil_ra_invalidate(fp, offset, len);
+	if (bytes_written < 0 || (new_size && _fil_record_eof(fp, new_size) < 0)) {
+		FIL_PROBE4(fil_write_return, fp->metadata.name, offset, len, -1);
+		return -1;
+	}
+
+	if (new_size) {
+		_fil_size_grow(fp, new_size);
+	}
+
+	FIL_PROBE4(fil_write_return, fp->metadata.name, offset, len, bytes_written);
+	return bytes_written;
+}
+
+/*
+ * Appends
+ *
+ * A log file is written at its end only, fil_append queues each chunk
+ * as an asynchronous write op on the object holding the end of the
+ * file and returns, the next append doesn't wait for it.  Every chunk
+ * is written at its offset in the object, not as a rados append, so a
+ * chunk lands at the right place even if an earlier one failed or the
+ * object was changed by another write.  Each op also sets the size
+ * attribute, the catalog size is only updated on close.  Ops on an object are applied
+ * in the order they were sent, fil_append_sync waits for all of them
+ * and is the durability point.  A chunk making the file grow past the
+ * object last recorded is followed in the pipe by the record of the
+ * end of file, see _fil_eof_record_start.
+ */
+#ifndef FIL_APPEND_MAX_IN_FLIGHT
+#define FIL_APPEND_MAX_IN_FLIGHT 64
+#endif
+
+struct fil_append_io {
+	rados_completion_t	completion;
+	rados_write_op_t	write_op;
+	struct fil_aio_sync*	record;	/* or a record of the end of file */
+};
+
+struct fil_append_state {
+	struct fil_append_io	io[FIL_APPEND_MAX_IN_FLIGHT];	/* oldest first from head */
+	unsigned int		head;
+	unsigned int		count;
+	int			error;	/* first error, returned by fil_append_sync */
+};
+
+/* Wait for the oldest append in flight and release it */
+static void _fil_append_reap_one(struct fil_append_state* append)
+{
+	struct fil_append_io* io = &append->io[append->head];
+	int ret;
+
+	if (io->record) {
+		ret = _fil_aio_sync_wait(io->record) < 0 ? -EIO : 0;
+		free(io->record);
+		io->record = NULL;
+	} else {
+		rados_aio_wait_for_complete(io->completion);
+		ret = rados_aio_get_return_value(io->completion);
+		rados_aio_release(io->completion);
+		rados_release_write_op(io->write_op);
+	}
+	if (ret < 0 && !append->error) {
+		append->error = ret;
+	}
+	append->head = (append->head + 1) % FIL_APPEND_MAX_IN_FLIGHT;
+	append->count--;
+}
+
+/* Reap the appends done, wait for the oldest if the pipe is full */
+static void _fil_append_reap_done(struct fil_append_state* append)
+{
+	while (append->count) {
+		struct fil_append_io* io = &append->io[append->head];
+		int done;
+
+		if (append->count == FIL_APPEND_MAX_IN_FLIGHT) {
+			done = 1;
+		} else if (io->record) {
+			pthread_mutex_lock(&io->record->mutex);
+			done = io->record->done;
+			pthread_mutex_unlock(&io->record->mutex);
+		} else {
+			done = rados_aio_is_complete(io->completion);
+		}
+		if (!done) {
+			break;
+		}
+		_fil_append_reap_one(append);
+	}
+}
+
+/*
+        (pseudoPrivate) Queue the record of the end of file after an
+        append made the file grow, see _fil_eof_record_start, it is
+        waited for with the appends
+        return 0 if successfull, -1 if error
+*/
+static int _fil_append_record_eof(
+	FILErados_t*    fp,	/* handle to a file */
+	struct fil_append_state*	append,	/* appends of the handle */
+	size_t		new_size	/* new size of the file */
+	)
+{
+	struct fil_aio_sync	init = FIL_AIO_SYNC_INITIALIZER;
+	struct fil_aio_sync*	record;
+	int	ret;
+
+	if (append->count == FIL_APPEND_MAX_IN_FLIGHT) {
+		_fil_append_reap_one(append);
+	}
+	if (!(record = malloc(sizeof(struct fil_aio_sync)))) {
+		fprintf(stderr, "Error: unable to allocate memory to record the end of %s\n", fp->metadata.name);
+		return -1;
+	}
+	*record = init;
+	if ((ret = _fil_eof_record_start(fp, new_size, _fil_aio_sync_cb, record)) <= 0) {
+		pthread_mutex_destroy(&record->mutex);
+		pthread_cond_destroy(&record->cond);
+		free(record);
+		return ret;
+	}
+	append->io[(append->head + append->count) % FIL_APPEND_MAX_IN_FLIGHT].record = record;
+	append->count++;
+	return 0;
+}
+
+/* fil_append, in the I/O class of the caller */
+static int _fil_append(
+	FILErados_t*    fp,	/* handle to a file */
+	const void*	buf,	/* buffer where to get data to write */
+	size_t		len	/* number of bytes to append */
+	)
+{
+	struct fil_append_state* append;
+	size_t offset, done = 0;
+	ssize_t size;
+
+	if (!fp || !fp->metadata.name || !fp->metadata.block_size) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+
+	/* the end of the file may have moved since the catalog was saved */
+	if ((size = fil_get_size(fp)) < 0) {
+		return -1;
+	}
+	offset = (size_t) size;
+
+	/* the blocks are rewritten as a whole, appending means rewriting
+	   the last one */
+	if (fp->metadata.codec != FIL_CODEC_NONE || fp->ec_align) {
+		return fil_write(fp, (void *) buf, len, offset);
+	}
+
+	if (!(append = fp->append)) {
+		if (!(append = calloc(1, sizeof(struct fil_append_state)))) {
+			fprintf(stderr, "Error: unable to allocate memory to append to %s\n", fp->metadata.name);
+			return -1;
+		}
+		fp->append = append;
+	}
+	if (append->error) {
+		fprintf(stderr, "Error %d: a previous append to %s failed\n%s\n",
+			-append->error, fp->metadata.name, strerror(-append->error));
+		return -1;
+	}
+
+	FIL_PROBE3(fil_append_entry, fp->metadata.name, offset, len);
+	_fil_ra_invalidate(fp, offset, len);
+	if (_fil_lcache_invalidate(fp, offset, len) < 0) {
+		FIL_PROBE4(fil_append_return, fp->metadata.name, offset, len, -1);
+		return -1;
+	}
+
+	while (done < len) {
+		size_t block_offset = (offset + done) / fp->metadata.block_size * fp->metadata.block_size;
+		size_t obj_offset = offset + done - block_offset;
+		size_t chunk = fp->metadata.block_size - obj_offset;
+		struct fil_append_io* io;
+		char* obj_name;
+		int token;
+		int ret;
+
+		if (chunk > len - done) {
+			chunk = len - done;
+		}
+
+		_fil_append_reap_done(append);
+
+		if (!(obj_name = _fil_get_object_name(fp,block_offset))) {
+			FIL_PROBE4(fil_append_return, fp->metadata.name, offset, len, -1);
+			return -1;
+		}
+		io = &append->io[(append->head + append->count) % FIL_APPEND_MAX_IN_FLIGHT];
+		if (!(io->write_op = rados_create_write_op())) {
+			fprintf(stderr, "Error: unable to create the append operation on %s\n", obj_name);
+			free(obj_name);
+			FIL_PROBE4(fil_append_return, fp->metadata.name, offset, len, -1);
+			return -1;
+		}
+		/* the slot is given back on completion, not when reaped */
+		token = _fil_sched_acquire(chunk);
+		if ((ret = rados_aio_create_completion((void *) (intptr_t) token,
+				_fil_sched_release_cb, NULL, &io->completion)) < 0) {
+			fprintf(stderr, "Error %d: unable to create the append completion on %s\n%s\n", -ret, obj_name, strerror(-ret));
+			_fil_sched_release(token);
+			rados_release_write_op(io->write_op);
+			free(obj_name);
+			FIL_PROBE4(fil_append_return, fp->metadata.name, offset, len, -1);
+			return -1;
+		}
+
+		rados_write_op_write(io->write_op, (const char *) buf + done, chunk, obj_offset);
+		_fil_write_op_set_size(io->write_op, offset + done + chunk);
+
+		FIL_PROBE3(rados_writeop_entry, obj_name, 1, chunk);
+		ret = rados_aio_write_op_operate(io->write_op, _fil_file_ioctx(fp), io->completion, obj_name, NULL, 0);
+		FIL_PROBE4(rados_writeop_return, obj_name, 1, chunk, ret);
+		if (ret < 0) {
+			fprintf(stderr, "Error %d: cannot append to rados object %s\n%s\n", -ret, obj_name, strerror(-ret));
+			_fil_sched_release(token);
+			rados_aio_release(io->completion);
+			rados_release_write_op(io->write_op);
+			free(obj_name);
+			FIL_PROBE4(fil_append_return, fp->metadata.name, offset, len, -1);
+			return -1;
+		}
+		free(obj_name);
+		append->count++;
+
+		done += chunk;
+		_fil_size_grow(fp, offset + done);
+
+		/* behind the data in the pipe */
+		if (_fil_append_record_eof(fp, append, offset + done) < 0) {
+			FIL_PROBE4(fil_append_return, fp->metadata.name, offset, len, -1);
+			return -1;
+		}
+	}
+
+	FIL_PROBE4(fil_append_return, fp->metadata.name, offset, len, done);
+	return done;
+}
+
+/*
+	Append data at the end of a file without waiting for it to be
+	written, the buffer can be reused as soon as the call returns.
+	The data is durable once fil_append_sync returns 0.  A handle
+	must not append from two threads at the same time.  A compressed
+	file is written by fil_write instead.  The appends are scheduled
+	in the FIL_IO_LOG class.
+	return the number of bytes appended if successfull, -1 if error
+*/
+int fil_append(
+	FILErados_t*    fp,	/* handle to a file */
+	const void*	buf,	/* buffer where to get data to write */
+	size_t		len	/* number of bytes to append */
+	)
+{
+	fil_io_class_t prev = fil_set_io_class(FIL_IO_LOG);
+	int ret;
+
+	ret = _fil_append(fp, buf, len);
+	fil_set_io_class(prev);
+	return ret;
+}
+
+/*
+	Wait until all the appends of a handle are written, the data
+	appended before the call is then durable
+	return 0 if successfull, -1 if an append failed
+*/
+int fil_append_sync(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	struct fil_append_state* append;
+	int ret;
+
+	if (!fp) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+	if (!(append = fp->append)) {
+		return 0;
+	}
+
+	FIL_PROBE2(fil_append_sync_entry, fp->metadata.name, append->count);
+	while (append->count) {
+		_fil_append_reap_one(append);
+	}
+	ret = append->error;
+	if (ret < 0) {
+		fprintf(stderr, "Error %d: an append to %s failed\n%s\n", -ret, fp->metadata.name, strerror(-ret));
+		/* the end of the file is unknown, derive it again */
+		append->error = 0;
+		_fil_size_lock(fp);
+		fp->size_known = 0;
+		fp->size_dirty = 0;
+		_fil_size_unlock(fp);
+	}
+	FIL_PROBE2(fil_append_sync_return, fp->metadata.name, ret);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Asynchronous I/O
+ *
+ * A request (fil_aio_read, fil_aio_write, fil_readv, fil_writev...) is
+ * split per block object, each object gets one compound rados operation
+ * with all its extents and all the operations are dispatched in
+ * parallel.  The completion of the last piece finishes the request and
+ * calls its callback, in a librados thread.  The synchronous calls wait
+ * for their request.
+ *
+ * When merging is enabled (fil_aio_merge_configure), the requests of a
+ * handle are held in a plug for a short window and dispatched together:
+ * the pieces of all the requests falling in the same object share one
+ * compound operation, in the order of submission, and each completion
+ * is split back to the requests of its pieces.  The plug is dispatched
+ * when it is full, when its window expires (by a flusher thread), when
+ * a request of the other direction comes, and by the barriers and the
+ * synchronous calls.  A handle dispatches under its dispatch_mutex so
+ * the batches reach rados in the order of submission.
+ *
+ * Each handle tracks its requests in flight: fil_close waits for all of
+ * them and the writes are numbered so a barrier (fil_aio_fsync,
+ * fil_fsync) only waits for the writes submitted before it, not for the
+ * other handles nor for later writes.  A failed write is reported by the
+ * next barrier of the handle.
+ */
+
+struct fil_aio_request;
+
+/*
+ * Piece of an extent that falls in a single block object, an extent
+ * crossing block boundaries is split in multiple pieces
+ */
+struct fil_vec_piece {
+	size_t		block_offset;	/* offset of the block object in the file */
+	size_t		obj_offset;	/* offset within the block object */
+	size_t		len;	/* number of bytes */
+	char*		buf;	/* where to read to / write from */
+	size_t		bytes_read;	/* set by the read op */
+	int		rval;	/* return value of this op step */
+	size_t		new_size;	/* file size recorded by this piece, 0 if none */
+	int		record_eof;	/* 1 if the end of file is recorded once written */
+	size_t		order;	/* order in its request, then in its batch */
+	struct fil_aio_request*	req;	/* request of the piece */
+	struct fil_vec_piece*	next;	/* in its object operation */
+};
+
+/* Compound operation on one object, may serve several requests */
+struct fil_vec_object_op {
+	FILErados_t*		fp;
+	int			is_write;
+	char*			obj_name;
+	rados_read_op_t		read_op;
+	rados_write_op_t	write_op;
+	rados_completion_t	completion;
+	struct fil_vec_piece*	pieces;	/* linked by next, in order */
+	size_t			n_pieces;	/* number of pieces in the op */
+	size_t			len;	/* total bytes in the op */
+	int			sched_token;	/* see _fil_sched_acquire */
+};
+
+/* A read, a write or a barrier in flight */
+struct fil_aio_request {
+	FILErados_t*			fp;
+	int				is_write;	/* 1 for writes, 0 for reads */
+	struct fil_vec_piece*		pieces;
+	size_t				n_pieces;
+	size_t				pieces_len;	/* allocated size of pieces */
+	unsigned int			pending;	/* pieces not completed, +1 until dispatched */
+	ssize_t				total;	/* bytes transferred */
+	int				err;	/* 1 if an op failed */
+	uint64_t			seq;	/* writes and barriers, order of submission */
+	size_t				file_size;	/* reads, size of the file on submission */
+	fil_io_class_t			io_class;	/* I/O class of the submitter */
+	fil_aio_cb_t			cb;
+	void*				cb_arg;
+	struct fil_aio_request*		next;	/* in the barriers or the plug of the handle */
+};
+
+/* Requests in flight on a handle */
+struct fil_aio_state {
+	/* metadata.size, size_known, size_dirty and eof_block of the
+	   handle, see _fil_size_grow */
+	pthread_mutex_t			size_mutex;
+	pthread_mutex_t			mutex;
+	pthread_cond_t			cond;	/* signaled when a request ends */
+	unsigned int			n_reads;
+	unsigned int			n_writes;
+	uint64_t			next_seq;
+	uint64_t*			write_seqs;	/* seq of the writes in flight, unordered */
+	size_t				write_seqs_size;
+	struct fil_aio_request*		barriers;
+	int				error;	/* first error since the last barrier */
+	/* the plug is protected by fil_aio_plug_mutex */
+	pthread_mutex_t			dispatch_mutex;	/* held to detach and dispatch */
+	struct fil_aio_request*		plug;	/* requests held for merging */
+	struct fil_aio_request*		plug_tail;
+	unsigned int			plug_count;
+	unsigned long long		plug_deadline;	/* monotonic time in ns */
+	int				plug_flushing;	/* 1 while the flusher dispatches it */
+	struct fil_aio_state*		plug_next;	/* in fil_aio_plugged */
+};
+
+/* merging of the requests, see fil_aio_merge_configure */
+static pthread_mutex_t		fil_aio_plug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		fil_aio_plug_cond;	/* monotonic clock */
+static int			fil_aio_plug_cond_ready = 0;
+static struct fil_aio_state*	fil_aio_plugged = NULL;	/* handles with a plug */
+static volatile unsigned int	fil_aio_merge_max = 0;	/* requests per plug, 0 = no merging */
+static unsigned long long	fil_aio_merge_window = 0;	/* ns */
+static pthread_t		fil_aio_flusher_thread;
+static int			fil_aio_flusher_running = 0;
+static int			fil_aio_flusher_stop = 0;
+
+static void _fil_aio_dispatch(struct fil_aio_request* reqs);
+
+/*
+        (pseudoPrivate) Allocate the request tracking of a handle
+        return 0 if successfull, -1 if error
+*/
+static int _fil_aio_state_create(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	struct fil_aio_state* aio;
+
+	if (!(aio = calloc(1, sizeof(struct fil_aio_state)))) {
+		fprintf(stderr, "Error: unable to allocate memory for file %s handle\n", fp->metadata.name);
+		return -1;
+	}
+	pthread_mutex_init(&aio->size_mutex, NULL);
+	pthread_mutex_init(&aio->mutex, NULL);
+	pthread_cond_init(&aio->cond, NULL);
+	pthread_mutex_init(&aio->dispatch_mutex, NULL);
+	aio->next_seq = 1;
+	fp->aio = aio;
+	return 0;
+}
+
+/*
+        (pseudoPrivate) Lock the size of a file on a handle, nothing to
+        lock once the handle is being closed
+*/
+static void _fil_size_lock(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	if (fp->aio) {
+		pthread_mutex_lock(&fp->aio->size_mutex);
+	}
+}
+
+static void _fil_size_unlock(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	if (fp->aio) {
+		pthread_mutex_unlock(&fp->aio->size_mutex);
+	}
+}
+
+/* Detach the plug of a handle, fil_aio_plug_mutex held */
+static struct fil_aio_request* _fil_aio_plug_detach(struct fil_aio_state* aio)
+{
+	struct fil_aio_request* reqs = aio->plug;
+	struct fil_aio_state** prev;
+
+	if (!reqs) {
+		return NULL;
+	}
+	for (prev = &fil_aio_plugged; *prev != aio; prev = &(*prev)->plug_next);
+	*prev = aio->plug_next;
+	aio->plug_next = NULL;
+	aio->plug = NULL;
+	aio->plug_tail = NULL;
+	aio->plug_count = 0;
+	return reqs;
+}
+
+/*
+        (pseudoPrivate) Dispatch the requests held in the plug of a handle
+*/
+static void _fil_aio_unplug(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	struct fil_aio_state* aio = fp->aio;
+	struct fil_aio_request* reqs;
+
+	pthread_mutex_lock(&aio->dispatch_mutex);
+	pthread_mutex_lock(&fil_aio_plug_mutex);
+	reqs = _fil_aio_plug_detach(aio);
+	pthread_mutex_unlock(&fil_aio_plug_mutex);
+	if (reqs) {
+		_fil_aio_dispatch(reqs);
+	}
+	pthread_mutex_unlock(&aio->dispatch_mutex);
+}
+
+/*
+        (pseudoPrivate) Wait for the requests of a handle and free its
+        request tracking
+*/
+static void _fil_aio_state_destroy(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	struct fil_aio_state* aio = fp->aio;
+
+	if (!aio) {
+		return;
+	}
+	_fil_aio_unplug(fp);
+
+	/* the flusher may still be leaving the handle, there is neither
+	   flusher nor condition before fil_aio_merge_configure */
+	pthread_mutex_lock(&fil_aio_plug_mutex);
+	while (fil_aio_plug_cond_ready && aio->plug_flushing) {
+		pthread_cond_wait(&fil_aio_plug_cond, &fil_aio_plug_mutex);
+	}
+	pthread_mutex_unlock(&fil_aio_plug_mutex);
+
+	pthread_mutex_lock(&aio->mutex);
+	while (aio->n_reads || aio->n_writes || aio->barriers) {
+		pthread_cond_wait(&aio->cond, &aio->mutex);
+	}
+	pthread_mutex_unlock(&aio->mutex);
+
+	pthread_mutex_destroy(&aio->size_mutex);
+	pthread_mutex_destroy(&aio->mutex);
+	pthread_cond_destroy(&aio->cond);
+	pthread_mutex_destroy(&aio->dispatch_mutex);
+	free(aio->write_seqs);
+	free(aio);
+	fp->aio = NULL;
+}
+
+/* Dispatch the plugs whose window expired */
+static void* _fil_aio_flusher(void* arg)
+{
+	struct fil_aio_state* aio;
+	struct fil_aio_request* reqs;
+	unsigned long long now, next;
+	struct timespec deadline;
+
+	(void) arg;
+	pthread_mutex_lock(&fil_aio_plug_mutex);
+	while (!fil_aio_flusher_stop) {
+		now = _fil_sched_now();
+		next = 0;
+		reqs = NULL;
+		for (aio = fil_aio_plugged; aio; aio = aio->plug_next) {
+			if (aio->plug_deadline <= now) {
+				/* a submitter busy dispatching the handle will
+				   see the plug, retry after another window */
+				if (pthread_mutex_trylock(&aio->dispatch_mutex) == 0) {
+					reqs = _fil_aio_plug_detach(aio);
+					break;
+				}
+				aio->plug_deadline = now + fil_aio_merge_window;
+			}
+			if (!next || aio->plug_deadline < next) {
+				next = aio->plug_deadline;
+			}
+		}
+
+		if (reqs) {
+			aio->plug_flushing = 1;
+			pthread_mutex_unlock(&fil_aio_plug_mutex);
+			_fil_aio_dispatch(reqs);
+			pthread_mutex_unlock(&aio->dispatch_mutex);
+			pthread_mutex_lock(&fil_aio_plug_mutex);
+			aio->plug_flushing = 0;
+			pthread_cond_broadcast(&fil_aio_plug_cond);
+		} else if (next) {
+			deadline.tv_sec = next / 1000000000ULL;
+			deadline.tv_nsec = next % 1000000000ULL;
+			pthread_cond_timedwait(&fil_aio_plug_cond, &fil_aio_plug_mutex, &deadline);
+		} else {
+			pthread_cond_wait(&fil_aio_plug_cond, &fil_aio_plug_mutex);
+		}
+	}
+	pthread_mutex_unlock(&fil_aio_plug_mutex);
+	return NULL;
+}
+
+/*
+        Merge the asynchronous requests of a handle: up to max_requests
+        requests submitted within window_us microseconds of the first are
+        dispatched together, the extents falling in the same object are
+        done by a single rados operation.  0 for either disables merging.
+        Can be called at any time.
+        return 0 if successfull, -1 if error
+*/
+int fil_aio_merge_configure(
+	unsigned int	max_requests,	/* requests merged at most */
+	unsigned int	window_us	/* time a request may be held */
+	)
+{
+	pthread_condattr_t attr;
+	int ret;
+
+	pthread_mutex_lock(&fil_aio_plug_mutex);
+	if (!fil_aio_plug_cond_ready) {
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&fil_aio_plug_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		fil_aio_plug_cond_ready = 1;
+	}
+	if (max_requests > 1 && window_us && !fil_aio_flusher_running) {
+		fil_aio_flusher_stop = 0;
+		if ((ret = pthread_create(&fil_aio_flusher_thread, NULL, _fil_aio_flusher, NULL))) {
+			pthread_mutex_unlock(&fil_aio_plug_mutex);
+			fprintf(stderr, "Error %d: cannot start the aio flusher thread\n%s\n", ret, strerror(ret));
+			return -1;
+		}
+		fil_aio_flusher_running = 1;
+	}
+	/* the plugs already held keep their deadline */
+	fil_aio_merge_window = (unsigned long long) window_us * 1000;
+	fil_aio_merge_max = (max_requests > 1 && window_us) ? max_requests : 0;
+	pthread_cond_broadcast(&fil_aio_plug_cond);
+	pthread_mutex_unlock(&fil_aio_plug_mutex);
+	return 0;
+}
+
+/*
+        (pseudoPrivate) Stop the flusher thread, the handles must be
+        closed
+*/
+void _fil_aio_merge_stop()
+{
+	pthread_mutex_lock(&fil_aio_plug_mutex);
+	if (!fil_aio_flusher_running) {
+		pthread_mutex_unlock(&fil_aio_plug_mutex);
+		return;
+	}
+	fil_aio_merge_max = 0;
+	fil_aio_flusher_stop = 1;
+	pthread_cond_broadcast(&fil_aio_plug_cond);
+	pthread_mutex_unlock(&fil_aio_plug_mutex);
+
+	pthread_join(fil_aio_flusher_thread, NULL);
+	fil_aio_flusher_running = 0;
+}
+
+/* Call the callbacks of the barriers of a list and free them */
+static void _fil_aio_barriers_done(struct fil_aio_request* barriers)
+{
+	while (barriers) {
+		struct fil_aio_request* barrier = barriers;
+
+		barriers = barrier->next;
+		barrier->cb(barrier->cb_arg, barrier->err);
+		free(barrier);
+	}
+}
+
+/*
+        (pseudoPrivate) Register a request in flight on its handle, a
+        write gets the next sequence number
+        return 0 if successfull, -1 if error
+*/
+static int _fil_aio_register(
+	struct fil_aio_request*	req	/* request to submit */
+	)
+{
+	struct fil_aio_state* aio = req->fp->aio;
+
+	pthread_mutex_lock(&aio->mutex);
+	if (req->is_write) {
+		if (aio->n_writes == aio->write_seqs_size) {
+			size_t size = aio->write_seqs_size ? aio->write_seqs_size*2 : 64;
+			uint64_t* seqs = realloc(aio->write_seqs, size*sizeof(uint64_t));
+			if (!seqs) {
+				pthread_mutex_unlock(&aio->mutex);
+				fprintf(stderr, "Error: unable to allocate memory for a write on %s\n", req->fp->metadata.name);
+				return -1;
+			}
+			aio->write_seqs = seqs;
+			aio->write_seqs_size = size;
+		}
+		req->seq = aio->next_seq++;
+		aio->write_seqs[aio->n_writes++] = req->seq;
+	} else {
+		aio->n_reads++;
+	}
+	pthread_mutex_unlock(&aio->mutex);
+	return 0;
+}
+
+/*
+        (pseudoPrivate) Unregister a request from its handle, the barriers
+        waiting for no other write are completed.  The handle can be
+        closed as soon as the request is unregistered.
+*/
+static void _fil_aio_unregister(
+	struct fil_aio_request*	req	/* request done */
+	)
+{
+	struct fil_aio_state* aio = req->fp->aio;
+	struct fil_aio_request *done = NULL, **prev;
+	uint64_t oldest = UINT64_MAX;
+	unsigned int i;
+
+	pthread_mutex_lock(&aio->mutex);
+	if (!req->is_write) {
+		aio->n_reads--;
+	} else {
+		for (i = 0; aio->write_seqs[i] != req->seq; i++);
+		aio->write_seqs[i] = aio->write_seqs[--aio->n_writes];
+		if (req->err && !aio->error) {
+			aio->error = -EIO;
+		}
+
+		/* a barrier is done when the writes before it are */
+		for (i = 0; i < aio->n_writes; i++) {
+			if (aio->write_seqs[i] < oldest) {
+				oldest = aio->write_seqs[i];
+			}
+		}
+		prev = &aio->barriers;
+		while (*prev) {
+			struct fil_aio_request* barrier = *prev;
+			if (barrier->seq < oldest) {
+				*prev = barrier->next;
+				barrier->err = aio->error;
+				aio->error = 0;
+				barrier->next = done;
+				done = barrier;
+			} else {
+				prev = &barrier->next;
+			}
+		}
+	}
+	pthread_cond_broadcast(&aio->cond);
+	pthread_mutex_unlock(&aio->mutex);
+
+	_fil_aio_barriers_done(done);
+}
+
+/* Free a request */
+static void _fil_aio_free(struct fil_aio_request* req)
+{
+	_fil_buf_free(req->pieces, req->pieces_len);
+	free(req);
+}
+
+/* Free an object operation */
+static void _fil_aio_op_free(struct fil_vec_object_op* op)
+{
+	if (op->completion) {
+		rados_aio_release(op->completion);
+	}
+	if (op->write_op) {
+		rados_release_write_op(op->write_op);
+	}
+	if (op->read_op) {
+		rados_release_read_op(op->read_op);
+	}
+	free(op->obj_name);
+	free(op);
+}
+
+/* Account a piece done and drop its reference on the request, the last
+   one finishes it */
+static void _fil_aio_put(
+	struct fil_aio_request*	req,	/* request of the piece */
+	ssize_t			total,	/* bytes transferred by the piece */
+	int			err	/* 1 if the piece failed */
+	)
+{
+	struct fil_aio_state* aio = req->fp->aio;
+	fil_aio_cb_t cb;
+	void* cb_arg;
+	ssize_t result;
+	unsigned int pending;
+
+	pthread_mutex_lock(&aio->mutex);
+	req->total += total;
+	if (err) {
+		req->err = 1;
+	}
+	pending = --req->pending;
+	pthread_mutex_unlock(&aio->mutex);
+	if (pending) {
+		return;
+	}
+
+	/* the callback runs before the request leaves the handle, so it
+	   is done when a barrier completes or fil_close returns */
+	cb = req->cb;
+	cb_arg = req->cb_arg;
+	result = req->err ? -1 : req->total;
+	cb(cb_arg, result);
+	_fil_aio_unregister(req);
+	_fil_aio_free(req);
+}
+
+/* Fail a piece that could not be done, and the record of the end of
+   file it holds */
+static void _fil_aio_put_failed(
+	struct fil_vec_piece*	p	/* piece of a request */
+	)
+{
+	struct fil_aio_request* req = p->req;
+
+	if (p->record_eof) {
+		_fil_aio_put(req, 0, 1);
+	}
+	_fil_aio_put(req, 0, 1);
+}
+
+/* The end of file recorded after a write, see _fil_aio_written */
+static void _fil_aio_eof_recorded(void* arg, ssize_t result)
+{
+	_fil_aio_put(arg, 0, result < 0);
+}
+
+/* A write piece is done, the record of the end of file it holds is sent
+   once its data is written */
+static void _fil_aio_written(
+	struct fil_vec_piece*	p	/* piece of a write request */
+	)
+{
+	struct fil_aio_request* req = p->req;
+	int ret;
+
+	if (p->record_eof && (ret = _fil_eof_record_start(req->fp, p->new_size,
+			_fil_aio_eof_recorded, req)) <= 0) {
+		_fil_aio_put(req, 0, ret < 0);
+	}
+	_fil_aio_put(req, p->len, 0);
+}
+
+/* Completion of the operation on one object, split to the requests of
+   its pieces */
+static void _fil_aio_op_complete(rados_completion_t completion, void* arg)
+{
+	struct fil_vec_object_op* op = arg;
+	struct fil_vec_piece *p, *next;
+	int ret;
+
+	_fil_sched_release(op->sched_token);
+	ret = rados_aio_get_return_value(completion);
+	if (op->is_write) {
+		FIL_PROBE4(rados_writeop_return, op->obj_name, op->n_pieces, op->len, ret);
+	} else {
+		FIL_PROBE4(rados_readop_return, op->obj_name, op->n_pieces, op->len, ret);
+	}
+
+	if (ret == -ENOENT && !op->is_write) {
+		/* a missing object is a hole or past the end of file */
+		for (p = op->pieces; p; p = p->next) {
+			p->rval = 0;
+			p->bytes_read = 0;
+		}
+		ret = 0;
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "Error %d: Could not %s %s\n%s\n", -ret, op->is_write ? "write" : "read",
+			op->obj_name, strerror(-ret));
+	}
+
+	if (op->is_write) {
+		/* a read may have cached the object while it was written */
+		_fil_lcache_drop(op->obj_name);
+		for (p = op->pieces; p; p = p->next) {
+			_fil_ra_invalidate(op->fp, p->block_offset + p->obj_offset, p->len);
+		}
+	}
+
+	/* the request, and its pieces, may be freed by _fil_aio_put */
+	for (p = op->pieces; p; p = next) {
+		next = p->next;
+		if (ret < 0) {
+			_fil_aio_put_failed(p);
+		} else if (op->is_write) {
+			_fil_aio_written(p);
+		} else if (p->rval < 0) {
+			fprintf(stderr, "Error %d: Could not read %s at offset %zu\n%s\n", -p->rval,
+				op->obj_name, p->obj_offset, strerror(-p->rval));
+			_fil_aio_put(p->req, 0, 1);
+		} else {
+			if (p->bytes_read < p->len) {
+				p->bytes_read = _fil_fill_hole(p->buf, p->len, p->bytes_read,
+					p->block_offset + p->obj_offset, p->req->file_size);
+			}
+			_fil_aio_put(p->req, p->bytes_read, 0);
+		}
+	}
+	_fil_aio_op_free(op);
+}
+
+/* order of the pieces of a request: by object, then by extent, so the
+   overlapping extents are written in the order given */
+static int _fil_vec_piece_cmp(const void* a, const void* b)
+{
+	const struct fil_vec_piece* pa = a;
+	const struct fil_vec_piece* pb = b;
+
+	if (pa->block_offset != pb->block_offset) {
+		return pa->block_offset < pb->block_offset ? -1 : 1;
+	}
+	return pa->order < pb->order ? -1 : pa->order > pb->order;
+}
+
+/* order of the pieces of a batch: by object, then by submission */
+static int _fil_vec_piece_order_cmp(const void* a, const void* b)
+{
+	const struct fil_vec_piece* pa = *(struct fil_vec_piece* const *) a;
+	const struct fil_vec_piece* pb = *(struct fil_vec_piece* const *) b;
+
+	if (pa->block_offset != pb->block_offset) {
+		return pa->block_offset < pb->block_offset ? -1 : 1;
+	}
+	return pa->order < pb->order ? -1 : pa->order > pb->order;
+}
+
+/*
+        (pseudoPrivate) Build and dispatch the compound operation on one
+        object for pieces of one or more requests, the pieces are done in
+        the order given so the last write of a range wins.  A piece that
+        could not be dispatched fails its request.
+*/
+static void _fil_aio_dispatch_op(
+	FILErados_t*		fp,	/* handle to a file */
+	int			is_write,	/* 1 for writes, 0 for reads */
+	struct fil_vec_piece**	pieces,	/* pieces of the object */
+	size_t			n_pieces	/* number of pieces */
+	)
+{
+	struct fil_vec_object_op* op;
+	struct fil_vec_piece *p, *next;
+	size_t bs = fp->metadata.block_size;
+	size_t i;
+	int ret;
+
+	if (!(op = calloc(1, sizeof(struct fil_vec_object_op)))) {
+		fprintf(stderr, "Error: unable to allocate memory for an I/O on %s\n", fp->metadata.name);
+		for (i = 0; i < n_pieces; i++) {
+			_fil_aio_put_failed(pieces[i]);
+		}
+		return;
+	}
+	op->fp = fp;
+	op->is_write = is_write;
+	op->n_pieces = n_pieces;
+	for (i = n_pieces; i-- > 0; ) {
+		pieces[i]->next = op->pieces;
+		op->pieces = pieces[i];
+		op->len += pieces[i]->len;
+	}
+
+	if (!(op->obj_name = _fil_get_object_name(fp, op->pieces->block_offset))) {
+		goto fail;
+	}
+	if (is_write) {
+		op->write_op = rados_create_write_op();
+	} else {
+		op->read_op = rados_create_read_op();
+	}
+	if ((is_write && !op->write_op) || (!is_write && !op->read_op)) {
+		fprintf(stderr, "Error: unable to create a rados operation for %s\n", op->obj_name);
+		goto fail;
+	}
+	if ((ret = rados_aio_create_completion(op, _fil_aio_op_complete, NULL, &op->completion)) < 0) {
+		fprintf(stderr, "Error %d: unable to create a completion for %s\n%s\n", -ret, op->obj_name, strerror(-ret));
+		op->completion = NULL;
+		goto fail;
+	}
+
+	for (p = op->pieces; p; p = p->next) {
+		if (is_write) {
+			if (fp->ec_align && p->obj_offset == 0 && p->len == bs
+					&& !_fil_is_zero(p->buf, p->len)) {
+				/* see _fil_ec_write_block */
+				rados_write_op_write_full(op->write_op, p->buf, p->len);
+			} else if (!_fil_is_zero(p->buf, p->len)) {
+				rados_write_op_write(op->write_op, p->buf, p->len, p->obj_offset);
+			} else if (p->obj_offset == 0 && p->len == bs) {
+				/* a hole, see _fil_write_zero_block */
+				rados_write_op_write_full(op->write_op, "", 0);
+			} else {
+				rados_write_op_zero(op->write_op, p->obj_offset, p->len);
+			}
+			if (p->new_size) {
+				_fil_write_op_set_size(op->write_op, p->new_size);
+			}
+		} else {
+			rados_read_op_read(op->read_op, p->obj_offset, p->len,
+				p->buf, &p->bytes_read, &p->rval);
+		}
+	}
+
+	/* the op may be completed and freed as soon as it is dispatched */
+	op->sched_token = _fil_sched_acquire(op->len);
+	if (is_write) {
+		FIL_PROBE3(rados_writeop_entry, op->obj_name, op->n_pieces, op->len);
+		ret = rados_aio_write_op_operate(op->write_op, _fil_file_ioctx(fp),
+			op->completion, op->obj_name, NULL, 0);
+	} else {
+		FIL_PROBE3(rados_readop_entry, op->obj_name, op->n_pieces, op->len);
+		ret = rados_aio_read_op_operate(op->read_op, _fil_file_ioctx(fp),
+			op->completion, op->obj_name, 0);
+	}
+	if (ret < 0) {
+		fprintf(stderr, "Error %d: Could not submit operation on %s\n%s\n", -ret, op->obj_name, strerror(-ret));
+		_fil_sched_release(op->sched_token);
+		goto fail;
+	}
+	return;
+
+fail:
+	for (p = op->pieces; p; p = next) {
+		next = p->next;
+		_fil_aio_put_failed(p);
+	}
+	_fil_aio_op_free(op);
+}
+
+/*
+        (pseudoPrivate) Dispatch a list of requests of the same handle and
+        direction, linked by next, with one operation per object
+*/
+static void _fil_aio_dispatch(
+	struct fil_aio_request*	reqs	/* requests in order of submission */
+	)
+{
+	FILErados_t* fp = reqs->fp;
+	struct fil_aio_request *req, *next;
+	struct fil_vec_piece** pieces;
+	struct fil_vec_piece* single[1];
+	fil_io_class_t prev_class;
+	size_t n_pieces = 0, n_reqs = 0, n_ops = 0;
+	size_t i, j, k = 0;
+
+	for (req = reqs; req; req = req->next) {
+		n_pieces += req->n_pieces;
+		n_reqs++;
+	}
+	if (n_pieces == 1) {
+		pieces = single;
+	} else if (!(pieces = malloc(n_pieces*sizeof(struct fil_vec_piece*)))) {
+		fprintf(stderr, "Error: unable to allocate memory for an I/O on %s\n", fp->metadata.name);
+		for (req = reqs; req; req = req->next) {
+			for (i = 0; i < req->n_pieces; i++) {
+				_fil_aio_put_failed(&req->pieces[i]);
+			}
+		}
+		goto done;
+	}
+
+	/* the pieces of a request are already sorted */
+	for (req = reqs; req; req = req->next) {
+		for (i = 0; i < req->n_pieces; i++, k++) {
+			pieces[k] = &req->pieces[i];
+			pieces[k]->order = k;
+		}
+	}
+	if (n_reqs > 1) {
+		qsort(pieces, n_pieces, sizeof(struct fil_vec_piece*), _fil_vec_piece_order_cmp);
+	}
+
+	prev_class = fil_set_io_class(reqs->io_class);
+	for (i = 0; i < n_pieces; i = j) {
+		for (j = i + 1; j < n_pieces && pieces[j]->block_offset == pieces[i]->block_offset; j++);
+		_fil_aio_dispatch_op(fp, reqs->is_write, pieces + i, j - i);
+		n_ops++;
+	}
+	fil_set_io_class(prev_class);
+	FIL_PROBE3(fil_aio_dispatch, fp->metadata.name, n_reqs, n_ops);
+
+	if (pieces != single) {
+		free(pieces);
+	}
+
+done:
+	/* the ops already dispatched finish the requests, with an error if
+	   the others could not be */
+	for (req = reqs; req; req = next) {
+		next = req->next;
+		_fil_aio_put(req, 0, 0);
+	}
+}
+
+/*
+        (pseudoPrivate) Hold a request in the plug of its handle for
+        merging, or dispatch it right away when merging is disabled,
+        after the requests the plug still holds
+*/
+static void _fil_aio_plug(
+	struct fil_aio_request*	req	/* request registered on its handle */
+	)
+{
+	struct fil_aio_state* aio = req->fp->aio;
+	struct fil_aio_request *before = NULL, *full = NULL;
+
+	pthread_mutex_lock(&aio->dispatch_mutex);
+	pthread_mutex_lock(&fil_aio_plug_mutex);
+	if (!fil_aio_merge_max) {
+		/* merging was switched off, the requests held before go first */
+		before = _fil_aio_plug_detach(aio);
+		pthread_mutex_unlock(&fil_aio_plug_mutex);
+		if (before) {
+			_fil_aio_dispatch(before);
+		}
+		_fil_aio_dispatch(req);
+		pthread_mutex_unlock(&aio->dispatch_mutex);
+		return;
+	}
+	if (aio->plug && aio->plug->is_write != req->is_write) {
+		before = _fil_aio_plug_detach(aio);
+	}
+	if (!aio->plug) {
+		aio->plug = req;
+		aio->plug_deadline = _fil_sched_now() + fil_aio_merge_window;
+		aio->plug_next = fil_aio_plugged;
+		fil_aio_plugged = aio;
+		pthread_cond_broadcast(&fil_aio_plug_cond);
+	} else {
+		aio->plug_tail->next = req;
+	}
+	aio->plug_tail = req;
+	if (++aio->plug_count >= fil_aio_merge_max) {
+		full = _fil_aio_plug_detach(aio);
+	}
+	pthread_mutex_unlock(&fil_aio_plug_mutex);
+
+	if (before) {
+		_fil_aio_dispatch(before);
+	}
+	if (full) {
+		_fil_aio_dispatch(full);
+	}
+	pthread_mutex_unlock(&aio->dispatch_mutex);
+}
+
+/* 1 if the extents can be written as they are on the pool of a handle,
+   see _fil_ec_write_block */
+static int _fil_ec_aligned(
+	FILErados_t*		fp,	/* handle to a file */
+	const struct fil_iovec*	iov,	/* extents */
+	int			iovcnt	/* number of extents */
+	)
+{
+	int i;
+
+	if (!fp->ec_align) {
+		return 1;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].offset % fp->ec_align || iov[i].len % fp->ec_align) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+        (pseudoPrivate) Build and register the request of a read or a
+        write of extents of a file, cb is called with the number of bytes
+        transferred or -1 once all the operations are done.  The buffers
+        must stay valid until then.  A compressed file is done
+        synchronously, or an empty request, cb is called before the return
+        and *reqp is NULL, otherwise *reqp is to be dispatched, see
+        _fil_aio_plug.
+        return 0 if successfull, -1 if error (cb is not called)
+*/
+static int _fil_aio_prepare(
+	FILErados_t*		fp,	/* handle to a file */
+	const struct fil_iovec*	iov,	/* extents */
+	int			iovcnt,	/* number of extents */
+	int			is_write,	/* 1 for writes, 0 for reads */
+	fil_aio_cb_t		cb,	/* called when done */
+	void*			cb_arg,	/* passed to cb */
+	struct fil_aio_request**	reqp	/* the request to dispatch */
+	)
+{
+	struct fil_aio_request*	req;
+	struct fil_vec_piece*	pieces;
+	size_t	n_pieces = 0;
+	size_t	n_records = 0;
+	size_t	new_size = 0;
+	ssize_t	file_size = 0;
+	size_t	bs;
+	size_t	i;
+
+	*reqp = NULL;
+
+	if (!fp || !fp->aio) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+
+	if (!fp->metadata.block_size) {
+		fprintf(stderr, "Error: uninitialized block size value, can't be zero\n");
+		return -1;
+	}
+
+	if (!fp->metadata.name) {
+		fprintf(stderr, "Error: uninitialized file name, can't be null\n");
+		return -1;
+	}
+	bs = fp->metadata.block_size;
+
+	if (!iov || iovcnt <= 0) {
+		cb(cb_arg, 0);
+		return 0;
+	}
+
+	if (is_write) {
+		for (i = 0; i < (size_t) iovcnt; i++) {
+			_fil_ra_invalidate(fp, iov[i].offset, iov[i].len);
+			if (_fil_lcache_invalidate(fp, iov[i].offset, iov[i].len) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	if (fp->metadata.codec != FIL_CODEC_NONE
+			|| (is_write && !_fil_ec_aligned(fp, iov, iovcnt))) {
+		/* compressed blocks are rewritten as a whole, no compound
+		   operation, each extent goes through the regular path, as the
+		   unaligned writes on an erasure coded pool */
+		ssize_t total = 0;
+		for (i = 0; i < (size_t) iovcnt; i++) {
+			ssize_t n = is_write
+				? fil_write(fp, iov[i].buf, iov[i].len, iov[i].offset)
+				: fil_read(fp, iov[i].buf, iov[i].len, iov[i].offset);
+			if (n < 0) {
+				total = -1;
+				break;
+			}
+			total += n;
+		}
+		if (total < 0 && is_write) {
+			pthread_mutex_lock(&fp->aio->mutex);
+			if (!fp->aio->error) {
+				fp->aio->error = -EIO;
+			}
+			pthread_mutex_unlock(&fp->aio->mutex);
+		}
+		cb(cb_arg, total);
+		return 0;
+	}
+
+	/* a short read is completed with zeros up to the end of the file,
+	   resolved here and not in the librados callback.  The size of the
+	   handle is a lower bound, it is derived only for a read past it. */
+	if (!is_write) {
+		size_t end = 0;
+		for (i = 0; i < (size_t) iovcnt; i++) {
+			if (iov[i].offset + iov[i].len > end) {
+				end = iov[i].offset + iov[i].len;
+			}
+		}
+		_fil_size_lock(fp);
+		if (fp->size_known || end <= fp->metadata.size) {
+			file_size = fp->metadata.size;
+		} else {
+			file_size = -1;
+		}
+		_fil_size_unlock(fp);
+		if (file_size < 0 && (file_size = fil_get_size(fp)) < 0) {
+			return -1;
+		}
+	}
+
+	if (!(req = calloc(1, sizeof(struct fil_aio_request)))) {
+		fprintf(stderr, "Error: unable to allocate memory for an I/O on %s\n", fp->metadata.name);
+		return -1;
+	}
+	req->fp = fp;
+	req->file_size = is_write ? 0 : (size_t) file_size;
+	req->is_write = is_write;
+	req->io_class = fil_sched_thread_class;
+	req->cb = cb;
+	req->cb_arg = cb_arg;
+
+	/* count the pieces */
+	for (i = 0; i < (size_t) iovcnt; i++) {
+		if (iov[i].len) {
+			n_pieces += (iov[i].offset + iov[i].len - 1)/bs - iov[i].offset/bs + 1;
+		}
+	}
+	if (!n_pieces) {
+		free(req);
+		cb(cb_arg, 0);
+		return 0;
+	}
+
+	req->pieces_len = n_pieces*sizeof(struct fil_vec_piece);
+	if (!(req->pieces = _fil_buf_alloc(req->pieces_len))) {
+		fprintf(stderr, "Error: unable to allocate memory for an I/O on %s\n", fp->metadata.name);
+		free(req);
+		return -1;
+	}
+	memset(req->pieces, 0, req->pieces_len);
+	pieces = req->pieces;
+
+	/* split the extents on the block boundaries */
+	for (i = 0; i < (size_t) iovcnt; i++) {
+		size_t done = 0;
+		while (done < iov[i].len) {
+			size_t offset = iov[i].offset + done;
+			struct fil_vec_piece* p = &pieces[req->n_pieces++];
+
+			p->block_offset = (offset/bs)*bs;
+			p->obj_offset = offset - p->block_offset;
+			p->len = bs - p->obj_offset;
+			if (p->len > iov[i].len - done) {
+				p->len = iov[i].len - done;
+			}
+			p->buf = (char *) iov[i].buf + done;
+			p->order = req->n_pieces - 1;
+			p->req = req;
+			done += p->len;
+		}
+	}
+	qsort(pieces, n_pieces, sizeof(struct fil_vec_piece), _fil_vec_piece_cmp);
+
+	/* a write extending the file records the new size on the object
+	   holding the new end, in the same operation as the data, and the
+	   end of file on the first object once it is written */
+	if (is_write) {
+		for (i = 0; i < n_pieces; i++) {
+			size_t end = pieces[i].block_offset + pieces[i].obj_offset + pieces[i].len;
+			if (end > new_size) {
+				new_size = end;
+			}
+		}
+		new_size = _fil_size_extends(fp, new_size);
+		for (i = 0; new_size && i < n_pieces; i++) {
+			if (pieces[i].block_offset + pieces[i].obj_offset + pieces[i].len == new_size) {
+				pieces[i].new_size = new_size;
+				pieces[i].record_eof = !n_records++;
+			}
+		}
+	}
+
+	if (_fil_aio_register(req) < 0) {
+		_fil_aio_free(req);
+		return -1;
+	}
+
+	/* the size is known once the write is submitted */
+	if (new_size) {
+		_fil_size_grow(fp, new_size);
+	}
+
+	/* one reference per piece and per record of the end of file, plus
+	   one until dispatched */
+	req->pending = n_pieces + n_records + 1;
+	*reqp = req;
+	return 0;
+}
+
+/*
+        (pseudoPrivate) Submit a read or a write of extents of a file, see
+        _fil_aio_prepare
+        return 0 if submitted, -1 if error (cb is not called)
+*/
+static int _fil_aio_submit(
+	FILErados_t*		fp,	/* handle to a file */
+	const struct fil_iovec*	iov,	/* extents */
+	int			iovcnt,	/* number of extents */
+	int			is_write,	/* 1 for writes, 0 for reads */
+	fil_aio_cb_t		cb,	/* called when done */
+	void*			cb_arg	/* passed to cb */
+	)
+{
+	struct fil_aio_request* req;
+
+	if (_fil_aio_prepare(fp, iov, iovcnt, is_write, cb, cb_arg, &req) < 0) {
+		return -1;
+	}
+	if (req) {
+		_fil_aio_plug(req);
+	}
+	return 0;
+}
+
+/*
+        (pseudoPrivate) Synchronous read or write of extents of a file
+        return the number of bytes transferred if successfull, -1 if error
+*/
+static ssize_t _fil_vec_io(
+	FILErados_t*		fp,	/* handle to a file */
+	const struct fil_iovec*	iov,	/* extents */
+	int			iovcnt,	/* number of extents */
+	int			is_write	/* 1 for writes, 0 for reads */
+	)
+{
+	struct fil_aio_sync sync = FIL_AIO_SYNC_INITIALIZER;
+
+	if (_fil_aio_submit(fp, iov, iovcnt, is_write, _fil_aio_sync_cb, &sync) < 0) {
+		return -1;
+	}
+	/* the caller waits, don't hold the request for merging */
+	_fil_aio_unplug(fp);
+	return _fil_aio_sync_wait(&sync);
+}
+
+/*
+        Read multiple extents of a file in rados, the extents of a block
+        object are read by a single rados operation and all the objects
+        are read in parallel
+        return the number of bytes read if successfull, -1 if error
+*/
+ssize_t fil_readv(
+	FILErados_t*		fp,	/* handle to a file */
+	const struct fil_iovec*	iov,	/* extents to read */
+	int			iovcnt	/* number of extents */
+	)
+{
+	ssize_t ret;
+	const char* name = fp ? fp->metadata.name : NULL;
+
+	FIL_PROBE2(fil_readv_entry, name, iovcnt);
+	ret = _fil_vec_io(fp, iov, iovcnt, 0);
+	FIL_PROBE3(fil_readv_return, name, iovcnt, ret);
+
+	return ret;
+}
+
+/*
+        Write multiple extents of a file in rados, the extents of a block
+        object are written by a single rados operation and all the objects
+        are written in parallel.  Overlapping extents are written in the
+        order of iov, the last one wins.
+        return the number of bytes written if successfull, -1 if error
+*/
+ssize_t fil_writev(
+	FILErados_t*		fp,	/* handle to a file */
+	const struct fil_iovec*	iov,	/* extents to write */
+	int			iovcnt	/* number of extents */
+	)
+{
+	ssize_t ret;
+	const char* name = fp ? fp->metadata.name : NULL;
+
+	FIL_PROBE2(fil_writev_entry, name, iovcnt);
+	ret = _fil_vec_io(fp, iov, iovcnt, 1);
+	FIL_PROBE3(fil_writev_return, name, iovcnt, ret);
+
+	return ret;
+}
+
+/*
+	Read from a file without waiting, cb is called with the number of
+	bytes read or -1, in a librados thread, once the data is in buf.
+	The callback must not block.
+	return 0 if submitted, -1 if error (cb is not called)
+*/
+int fil_aio_read(
+	FILErados_t*    fp,	/* handle to a file */
+	void*		buf,	/* buffer where to read */
+	size_t		len,	/* number of bytes to read */
+	size_t		offset,	/* offset from where to start reading */
+	fil_aio_cb_t	cb,	/* called when done */
+	void*		cb_arg	/* passed to cb */
+	)
+{
+	struct fil_iovec iov = { buf, len, offset };
+
+	if (!cb) {
+		fprintf(stderr, "Error: uninitialized aio callback can't be null\n");
+		return -1;
+	}
+	return _fil_aio_submit(fp, &iov, 1, 0, cb, cb_arg);
+}
+
+/*
+	Write to a file without waiting, cb is called with the number of
+	bytes written or -1, in a librados thread, once the write is
+	durable.  buf must stay valid until then.  The callback must not
+	block.
+	return 0 if submitted, -1 if error (cb is not called)
+*/
+int fil_aio_write(
+	FILErados_t*    fp,	/* handle to a file */
+	const void*	buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		offset,	/* offset in the file */
+	fil_aio_cb_t	cb,	/* called when done */
+	void*		cb_arg	/* passed to cb */
+	)
+{
+	struct fil_iovec iov = { (void *) buf, len, offset };
+
+	if (!cb) {
+		fprintf(stderr, "Error: uninitialized aio callback can't be null\n");
+		return -1;
+	}
+	return _fil_aio_submit(fp, &iov, 1, 1, cb, cb_arg);
+}
+
+/*
+	Barrier on the asynchronous writes of a handle, cb is called with
+	0 once all the writes submitted on the handle before it are done,
+	or with a negative error if one of the writes done since the
+	previous barrier failed.  Later writes and the other handles are
+	not waited for.  The callback may be called before the return.
+	return 0 if submitted, -1 if error (cb is not called)
+*/
+int fil_aio_fsync(
+	FILErados_t*    fp,	/* handle to a file */
+	fil_aio_cb_t	cb,	/* called when done */
+	void*		cb_arg	/* passed to cb */
+	)
+{
+	struct fil_aio_request* barrier;
+	struct fil_aio_state* aio;
+
+	if (!fp || !(aio = fp->aio) || !cb) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+	if (!(barrier = calloc(1, sizeof(struct fil_aio_request)))) {
+		fprintf(stderr, "Error: unable to allocate memory for a barrier on %s\n", fp->metadata.name);
+		return -1;
+	}
+	barrier->fp = fp;
+	barrier->cb = cb;
+	barrier->cb_arg = cb_arg;
+
+	/* the writes held for merging are submitted before the barrier */
+	_fil_aio_unplug(fp);
+
+	pthread_mutex_lock(&aio->mutex);
+	barrier->seq = aio->next_seq++;
+	if (aio->n_writes) {
+		barrier->next = aio->barriers;
+		aio->barriers = barrier;
+		barrier = NULL;
+	} else {
+		barrier->err = aio->error;
+		aio->error = 0;
+	}
+	pthread_mutex_unlock(&aio->mutex);
+
+	if (barrier) {
+		_fil_aio_barriers_done(barrier);
+	}
+	return 0;
+}
+
+/* Common part of fil_fsync and fil_fdatasync */
+static int _fil_fsync(
+	FILErados_t*    fp,	/* handle to a file */
+	int		datasync	/* 1 to skip the catalog */
+	)
+{
+	struct fil_aio_sync sync = FIL_AIO_SYNC_INITIALIZER;
+	size_t size;
+	int ret;
+
+	if (!fp || !fp->metadata.name) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+
+	FIL_PROBE2(fil_fsync_entry, fp->metadata.name, datasync);
+	if (fil_aio_fsync(fp, _fil_aio_sync_cb, &sync) < 0) {
+		FIL_PROBE2(fil_fsync_return, fp->metadata.name, -1);
+		return -1;
+	}
+	ret = (int) _fil_aio_sync_wait(&sync);
+	if (ret < 0) {
+		fprintf(stderr, "Error %d: a write to %s failed\n%s\n", -ret, fp->metadata.name, strerror(-ret));
+	}
+	if (fil_append_sync(fp) < 0) {
+		ret = -1;
+	}
+
+	/* the size attribute of the objects is durable with the data, only
+	   the catalog can be behind */
+	_fil_size_lock(fp);
+	size = fp->size_dirty ? fp->metadata.size : 0;
+	_fil_size_unlock(fp);
+	if (!datasync && size) {
+		if (_fil_update_size(fp->metadata.name, fp->metadata.type, size) < 0) {
+			ret = -1;
+		} else {
+			/* unless a write extended the file meanwhile */
+			_fil_size_lock(fp);
+			if (fp->metadata.size == size) {
+				fp->size_dirty = 0;
+			}
+			_fil_size_unlock(fp);
+		}
+	}
+	FIL_PROBE2(fil_fsync_return, fp->metadata.name, ret);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+	Wait until the writes and appends of a handle are durable and
+	save its size in the catalog.  Only this handle is waited for.
+	return 0 if successfull, -1 if error or if a write of the handle
+	failed since the previous fsync
+*/
+int fil_fsync(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	return _fil_fsync(fp, 0);
+}
+
+/*
+	Same as fil_fsync without saving the size in the catalog, the
+	size of the file is still durable in its objects
+	return 0 if successfull, -1 if error
+*/
+int fil_fdatasync(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	return _fil_fsync(fp, 1);
+}
+
+/*
+ * Submission / completion rings
+ *
+ * The caller fills submission entries, fil_ring_get_sqe, and submits
+ * them together, fil_ring_submit.  The consecutive reads, or writes, of
+ * a handle in a submission are dispatched as one batch, with one rados
+ * operation per object, see _fil_aio_dispatch.  Each entry gets a slot
+ * holding its user_data until its completion is reaped, so there is
+ * always room in the completion ring.  A ring is used by one thread at a
+ * time, the completions are posted by the librados threads.
+ */
+struct fil_ring_slot {
+	struct fil_ring*	ring;
+	uint64_t		user_data;
+	ssize_t			result;
+	unsigned int		next;	/* in the free list or the completions */
+};
+
+struct fil_ring {
+	unsigned int		entries;
+	struct fil_sqe*		sq;
+	unsigned int		sq_head;	/* next entry to submit */
+	unsigned int		sq_tail;	/* next entry given by fil_ring_get_sqe */
+	struct fil_ring_slot*	slots;
+	pthread_mutex_t		mutex;	/* protects the slots and the lists */
+	pthread_cond_t		cond;	/* signaled on completion */
+	unsigned int		free_head;	/* free slots, entries if none */
+	unsigned int		done_head;	/* completed slots, in order */
+	unsigned int		done_tail;
+	unsigned int		n_done;
+	unsigned int		in_flight;	/* submitted, not reaped */
+};
+
+/* Reads or writes of a handle dispatched together */
+struct fil_ring_batch {
+	FILErados_t*		fp;
+	int			is_write;
+	struct fil_aio_request*	head;
+	struct fil_aio_request*	tail;
+};
+
+/*
+	Create a ring of entries submission entries, at most entries of
+	them can be in flight or waiting to be reaped
+	return the ring if successfull, NULL if error
+*/
+struct fil_ring* fil_ring_create(
+	unsigned int	entries	/* size of the rings */
+	)
+{
+	struct fil_ring* ring;
+	unsigned int i;
+
+	if (!entries) {
+		fprintf(stderr, "Error: a ring needs at least one entry\n");
+		return NULL;
+	}
+	if (!(ring = calloc(1, sizeof(struct fil_ring)))
+			|| !(ring->sq = calloc(entries, sizeof(struct fil_sqe)))
+			|| !(ring->slots = calloc(entries, sizeof(struct fil_ring_slot)))) {
+		fprintf(stderr, "Error: unable to allocate memory for a ring of %u entries\n", entries);
+		if (ring) {
+			free(ring->sq);
+			free(ring);
+		}
+		return NULL;
+	}
+	ring->entries = entries;
+	for (i = 0; i < entries; i++) {
+		ring->slots[i].ring = ring;
+		ring->slots[i].next = i + 1;
+	}
+	ring->free_head = 0;
+	ring->done_head = entries;
+	ring->done_tail = entries;
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	return ring;
+}
+
+/*
+	Wait for the entries in flight on a ring and free it, the
+	completions not reaped are lost
+*/
+void fil_ring_destroy(
+	struct fil_ring*	ring	/* ring from fil_ring_create */
+	)
+{
+	if (!ring) {
+		return;
+	}
+	pthread_mutex_lock(&ring->mutex);
+	while (ring->in_flight > ring->n_done) {
+		pthread_cond_wait(&ring->cond, &ring->mutex);
+	}
+	pthread_mutex_unlock(&ring->mutex);
+	pthread_mutex_destroy(&ring->mutex);
+	pthread_cond_destroy(&ring->cond);
+	free(ring->slots);
+	free(ring->sq);
+	free(ring);
+}
+
+/*
+	Get the next free submission entry of a ring, it is submitted by the
+	next fil_ring_submit
+	return the entry if successfull, NULL if the submission ring is full
+*/
+struct fil_sqe* fil_ring_get_sqe(
+	struct fil_ring*	ring	/* ring from fil_ring_create */
+	)
+{
+	struct fil_sqe* sqe;
+
+	if (ring->sq_tail - ring->sq_head == ring->entries) {
+		return NULL;
+	}
+	sqe = &ring->sq[ring->sq_tail++ % ring->entries];
+	memset(sqe, 0, sizeof(struct fil_sqe));
+	return sqe;
+}
+
+/* Post the completion of a slot, in a librados thread or the submitter */
+static void _fil_ring_complete(void* arg, ssize_t result)
+{
+	struct fil_ring_slot* slot = arg;
+	struct fil_ring* ring = slot->ring;
+	unsigned int i = slot - ring->slots;
+
+	pthread_mutex_lock(&ring->mutex);
+	slot->result = result;
+	slot->next = ring->entries;
+	if (ring->done_head == ring->entries) {
+		ring->done_head = i;
+	} else {
+		ring->slots[ring->done_tail].next = i;
+	}
+	ring->done_tail = i;
+	ring->n_done++;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Dispatch a batch after the requests held in the plug of its handle */
+static void _fil_ring_dispatch(struct fil_ring_batch* batch)
+{
+	struct fil_aio_state* aio = batch->fp->aio;
+	struct fil_aio_request* held;
+
+	if (!batch->head) {
+		return;
+	}
+	pthread_mutex_lock(&aio->dispatch_mutex);
+	pthread_mutex_lock(&fil_aio_plug_mutex);
+	held = _fil_aio_plug_detach(aio);
+	pthread_mutex_unlock(&fil_aio_plug_mutex);
+	if (held) {
+		_fil_aio_dispatch(held);
+	}
+	_fil_aio_dispatch(batch->head);
+	pthread_mutex_unlock(&aio->dispatch_mutex);
+	batch->head = NULL;
+	batch->tail = NULL;
+}
+
+/*
+	Submit the entries filled since the previous call, FIL_RING_READ and
+	FIL_RING_WRITE entries are done as fil_aio_read / fil_aio_write and
+	complete with the number of bytes or -1, FIL_RING_FSYNC entries as
+	fil_aio_fsync and complete with 0 or a negative error.  The entries
+	of a handle are done in order: a read after a write sees it.  An
+	entry that cannot be submitted completes with -1.  The entries left
+	when all the slots are taken stay queued for the next call.
+	return the number of entries submitted if successfull, -1 if error
+*/
+int fil_ring_submit(
+	struct fil_ring*	ring	/* ring from fil_ring_create */
+	)
+{
+	struct fil_ring_batch* batches;
+	struct fil_ring_batch* batch;
+	unsigned int n_batches = 0;
+	unsigned int n = 0, b;
+
+	if (!ring) {
+		fprintf(stderr, "Error: uninitialized ring\n");
+		return -1;
+	}
+	if (ring->sq_head == ring->sq_tail) {
+		return 0;
+	}
+	if (!(batches = malloc((ring->sq_tail - ring->sq_head)*sizeof(struct fil_ring_batch)))) {
+		fprintf(stderr, "Error: unable to allocate memory to submit a ring\n");
+		return -1;
+	}
+
+	while (ring->sq_head != ring->sq_tail) {
+		struct fil_sqe* sqe = &ring->sq[ring->sq_head % ring->entries];
+		struct fil_ring_slot* slot;
+		struct fil_aio_request* req;
+		struct fil_iovec iov;
+
+		pthread_mutex_lock(&ring->mutex);
+		if (ring->free_head == ring->entries) {
+			/* all the slots are in flight or to reap */
+			pthread_mutex_unlock(&ring->mutex);
+			break;
+		}
+		slot = &ring->slots[ring->free_head];
+		ring->free_head = slot->next;
+		ring->in_flight++;
+		pthread_mutex_unlock(&ring->mutex);
+		slot->user_data = sqe->user_data;
+		ring->sq_head++;
+		n++;
+
+		if (!sqe->fp || !sqe->fp->aio
+				|| (sqe->opcode != FIL_RING_READ && sqe->opcode != FIL_RING_WRITE
+					&& sqe->opcode != FIL_RING_FSYNC)) {
+			fprintf(stderr, "Error: invalid ring entry\n");
+			_fil_ring_complete(slot, -1);
+			continue;
+		}
+
+		/* the open batch of the handle */
+		for (b = 0, batch = NULL; b < n_batches; b++) {
+			if (batches[b].fp == sqe->fp) {
+				batch = &batches[b];
+				break;
+			}
+		}
+
+		if (sqe->opcode == FIL_RING_FSYNC) {
+			/* the writes before it are dispatched first */
+			if (batch) {
+				_fil_ring_dispatch(batch);
+			}
+			if (fil_aio_fsync(sqe->fp, _fil_ring_complete, slot) < 0) {
+				_fil_ring_complete(slot, -1);
+			}
+			continue;
+		}
+
+		iov.buf = sqe->buf;
+		iov.len = sqe->len;
+		iov.offset = sqe->offset;
+		if (_fil_aio_prepare(sqe->fp, &iov, 1, sqe->opcode == FIL_RING_WRITE,
+				_fil_ring_complete, slot, &req) < 0) {
+			_fil_ring_complete(slot, -1);
+			continue;
+		}
+		if (!req) {
+			/* already done */
+			continue;
+		}
+		if (!batch) {
+			batch = &batches[n_batches++];
+			batch->fp = sqe->fp;
+			batch->head = NULL;
+		} else if (batch->head && batch->is_write != req->is_write) {
+			/* a change of direction ends the batch */
+			_fil_ring_dispatch(batch);
+		}
+		if (!batch->head) {
+			batch->is_write = req->is_write;
+			batch->head = req;
+		} else {
+			batch->tail->next = req;
+		}
+		batch->tail = req;
+	}
+
+	for (b = 0; b < n_batches; b++) {
+		_fil_ring_dispatch(&batches[b]);
+	}
+	free(batches);
+	return (int) n;
+}
+
+/*
+	Reap the completions of a ring, in order of completion, waiting
+	until at least min_complete of them are there (fewer if not as many
+	entries are in flight)
+	return the number of completions copied to cqes
+*/
+int fil_ring_reap(
+	struct fil_ring*	ring,	/* ring from fil_ring_create */
+	struct fil_cqe*		cqes,	/* where to copy the completions */
+	unsigned int		max,	/* size of cqes */
+	unsigned int		min_complete	/* completions to wait for */
+	)
+{
+	unsigned int n = 0;
+
+	if (!ring || (max && !cqes)) {
+		fprintf(stderr, "Error: uninitialized ring\n");
+		return -1;
+	}
+	if (min_complete > max) {
+		min_complete = max;
+	}
+
+	pthread_mutex_lock(&ring->mutex);
+	if (min_complete > ring->in_flight) {
+		min_complete = ring->in_flight;
+	}
+	while (ring->n_done < min_complete) {
+		pthread_cond_wait(&ring->cond, &ring->mutex);
+	}
+	while (n < max && ring->n_done) {
+		unsigned int i = ring->done_head;
+		struct fil_ring_slot* slot = &ring->slots[i];
+
+		cqes[n].user_data = slot->user_data;
+		cqes[n].result = slot->result;
+		n++;
+		ring->done_head = slot->next;
+		if (ring->done_head == ring->entries) {
+			ring->done_tail = ring->entries;
+		}
+		ring->n_done--;
+		ring->in_flight--;
+		slot->next = ring->free_head;
+		ring->free_head = i;
+	}
+	pthread_mutex_unlock(&ring->mutex);
+
+	return (int) n;
+}
+
+/*
+ * State shared by the handles of a file
+ *
+ * The handles of a file in this process share its generation, a value
+ * changed by the first write of every handle, with a flag telling that
+ * the file is being written.  The generation is kept in the
+ * FIL_GEN_XATTR attribute of the first object of the file, read at each
+ * open, and announced to the clients watching the catalog, which update
+ * the handles they have opened, see fil_metadata_receive.  The handle
+ * clears the flag when it is closed, unless another handle changed the
+ * generation meanwhile.  The local cache and the blocks read ahead are
+ * only used at the generation they were read at, and not while another
+ * client writes the file.
+ */
+struct fil_file_shared {
+	char*			prefix;	/* prefix of the block object names, the key */
+	unsigned int		n_ref;	/* handles of the file */
+	uint64_t		gen;	/* generation, the lowest bit set while written */
+	uint64_t		own_gen;	/* last generation set by this process */
+	unsigned int		gen_known;	/* 1 once gen was read or set */
+	pthread_mutex_t		mutex;	/* protects ras */
+	struct fil_ra_state*	ras;	/* blocks read ahead by the handles, see fil_advise */
+	struct fil_file_shared*	next;	/* in its bucket */
+};
+
+/* generation flag of a file being written */
+#define FIL_GEN_WRITING	1ULL
+
+/* buckets of the files opened */
+#ifndef FIL_SHARED_BUCKETS
+#define FIL_SHARED_BUCKETS 1024
+#endif
+
+static struct fil_file_shared*	fil_shared_buckets[FIL_SHARED_BUCKETS];
+static pthread_mutex_t		fil_shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t			fil_gen_counter = 0;
+
+/* Bucket of a file */
+static size_t _fil_shared_bucket(const char* prefix)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+
+	for (; *prefix; prefix++) {
+		h = (h ^ (unsigned char) *prefix) * 16777619u;
+	}
+	return h % FIL_SHARED_BUCKETS;
+}
+
+/* 1 if the catalog is watched, the generations are then announced */
+static int _fil_md_watched()
+{
+	int watched;
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	watched = fil_md_watch_mode != FIL_MD_WATCH_NONE;
+	pthread_mutex_unlock(&fil_catalog_mutex);
+	return watched;
+}
+
+/* State of a file opened by this process, NULL if none, fil_shared_mutex held */
+static struct fil_file_shared* _fil_shared_find(const char* prefix)
+{
+	struct fil_file_shared* sh;
+
+	for (sh = fil_shared_buckets[_fil_shared_bucket(prefix)]; sh; sh = sh->next) {
+		if (!strcmp(sh->prefix, prefix)) {
+			return sh;
+		}
+	}
+	return NULL;
+}
+
+/*
+        (pseudoPrivate) Read the generation of a file, 0 if it was never
+        written with a cache
+        return 0 if successfull, -1 if error
+*/
+static int _fil_gen_read(
+	FILErados_t*    fp,	/* handle to a file */
+	uint64_t*	gen	/* generation */
+	)
+{
+	char	gen_str[24];
+	char*	obj_name;
+	int	ret;
+
+	*gen = 0;
+	if (!(obj_name = _fil_get_object_name(fp,0))) {
+		return -1;
+	}
+	ret = rados_getxattr(_fil_file_ioctx(fp), obj_name, FIL_GEN_XATTR, gen_str, sizeof(gen_str) - 1);
+	if (ret >= 0) {
+		gen_str[ret] = '\0';
+		*gen = strtoull(gen_str, NULL, 10);
+	} else if (ret != -ENOENT && ret != -ENODATA) {
+		fprintf(stderr, "Error %d: Could not get the generation of %s\n%s\n", -ret, obj_name, strerror(-ret));
+		free(obj_name);
+		return -1;
+	}
+	free(obj_name);
+	return 0;
+}
+
+/*
+        (pseudoPrivate) Attach a handle to the state of its file, the
+        generation is read again when there is a local cache or the
+        catalog is watched
+        return 0 if successfull, -1 if error
+*/
+static int _fil_shared_acquire(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	struct fil_file_shared* sh;
+	uint64_t gen = 0;
+	int read_gen = fil_lcache != NULL || _fil_md_watched();
+
+	if (read_gen && _fil_gen_read(fp, &gen) < 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&fil_shared_mutex);
+	if (!(sh = _fil_shared_find(fp->metadata.prefix))) {
+		size_t bucket = _fil_shared_bucket(fp->metadata.prefix);
+		if (!(sh = calloc(1, sizeof(struct fil_file_shared)))
+				|| !(sh->prefix = strdup(fp->metadata.prefix))) {
+			pthread_mutex_unlock(&fil_shared_mutex);
+			free(sh);
+			fprintf(stderr, "Error: unable to allocate memory for file %s\n", fp->metadata.name);
+			return -1;
+		}
+		pthread_mutex_init(&sh->mutex, NULL);
+		sh->next = fil_shared_buckets[bucket];
+		fil_shared_buckets[bucket] = sh;
+	}
+	sh->n_ref++;
+	if (read_gen) {
+		__atomic_store_n(&sh->gen, gen, __ATOMIC_RELEASE);
+		__atomic_store_n(&sh->gen_known, 1, __ATOMIC_RELEASE);
+	}
+	fp->shared = sh;
+	pthread_mutex_unlock(&fil_shared_mutex);
+	return 0;
+}
+
+/* Detach a handle from the state of its file, freed with the last one */
+static void _fil_shared_release(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	struct fil_file_shared *sh = fp->shared, **p;
+
+	if (!sh) {
+		return;
+	}
+	fp->shared = NULL;
+	pthread_mutex_lock(&fil_shared_mutex);
+	if (--sh->n_ref == 0) {
+		for (p = &fil_shared_buckets[_fil_shared_bucket(sh->prefix)]; *p != sh; p = &(*p)->next);
+		*p = sh->next;
+		pthread_mutex_destroy(&sh->mutex);
+		free(sh->prefix);
+		free(sh);
+	}
+	pthread_mutex_unlock(&fil_shared_mutex);
+}
+
+/*
+        (pseudoPrivate) New generation of a file announced by another
+        client, ignored if the file is not opened by this process
+*/
+static void _fil_shared_set_gen(
+	const char*	prefix,	/* prefix of the object names of the file */
+	uint64_t	gen	/* new generation */
+	)
+{
+	struct fil_file_shared* sh;
+
+	pthread_mutex_lock(&fil_shared_mutex);
+	if ((sh = _fil_shared_find(prefix))) {
+		__atomic_store_n(&sh->gen, gen, __ATOMIC_RELEASE);
+		__atomic_store_n(&sh->gen_known, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&fil_shared_mutex);
+}
+
+/*
+        (pseudoPrivate) Generation at which the blocks of a file can be
+        cached: known, and not being written by another client
+        return 1 if they can, 0 if not
+*/
+static int _fil_gen_cacheable(
+	FILErados_t*    fp,	/* handle to a file */
+	uint64_t*	gen	/* generation, without the flag */
+	)
+{
+	struct fil_file_shared* sh = fp->shared;
+	uint64_t cur = __atomic_load_n(&sh->gen, __ATOMIC_ACQUIRE);
+
+	*gen = cur & ~FIL_GEN_WRITING;
+	if (!__atomic_load_n(&sh->gen_known, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	/* the writes of this process drop the blocks they change */
+	return !(cur & FIL_GEN_WRITING) || cur == __atomic_load_n(&sh->own_gen, __ATOMIC_ACQUIRE);
+}
+
+/*
+        (pseudoPrivate) Record the generation of a file, compared with
+        expected unless it is 0, and announce it
+        return 0 if successfull, 1 if it changed meanwhile, -1 if error
+*/
+static int _fil_gen_set(
+	FILErados_t*    fp,	/* handle to a file */
+	uint64_t	gen,	/* new generation, with the flag */
+	uint64_t	expected	/* current generation, 0 for any */
+	)
+{
+	rados_write_op_t	write_op;
+	char		gen_str[24], expected_str[24];
+	char*		obj_name;
+	int		gen_len, expected_len;
+	int		token;
+	int		ret;
+
+	if (!(obj_name = _fil_get_object_name(fp,0))) {
+		return -1;
+	}
+	if (!(write_op = rados_create_write_op())) {
+		fprintf(stderr, "Error: unable to create the write operation of %s\n", obj_name);
+		free(obj_name);
+		return -1;
+	}
+	if (expected) {
+		expected_len = snprintf(expected_str, sizeof(expected_str), "%llu", (unsigned long long) expected);
+		rados_write_op_cmpxattr(write_op, FIL_GEN_XATTR, LIBRADOS_CMPXATTR_OP_EQ,
+			expected_str, expected_len);
+	}
+	gen_len = snprintf(gen_str, sizeof(gen_str), "%llu", (unsigned long long) gen);
+	rados_write_op_setxattr(write_op, FIL_GEN_XATTR, gen_str, gen_len);
+	token = _fil_sched_acquire(0);
+	ret = rados_write_op_operate(write_op, _fil_file_ioctx(fp), obj_name, NULL, 0);
+	_fil_sched_release(token);
+	rados_release_write_op(write_op);
+	if (ret == -ECANCELED && expected) {
+		free(obj_name);
+		return 1;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "Error %d: Could not change the generation of %s\n%s\n", -ret, obj_name, strerror(-ret));
+		free(obj_name);
+		return -1;
+	}
+	free(obj_name);
+
+	pthread_mutex_lock(&fil_shared_mutex);
+	if (!expected || __atomic_load_n(&fp->shared->gen, __ATOMIC_ACQUIRE) == expected) {
+		__atomic_store_n(&fp->shared->own_gen, gen, __ATOMIC_RELEASE);
+		__atomic_store_n(&fp->shared->gen, gen, __ATOMIC_RELEASE);
+		__atomic_store_n(&fp->shared->gen_known, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&fil_shared_mutex);
+	_fil_md_publish_gen(fp->metadata.prefix, gen);
+	return 0;
+}
+
+/*
+        (pseudoPrivate) Change the generation of a file before the first
+        write of a handle, to a value unique to this client, flagged as
+        being written until the handle is closed, see _fil_gen_release
+        return 0 if successfull, -1 if error
+*/
+static int _fil_gen_bump(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	uint64_t gen;
+
+	/* the instance id of the client and a counter, mixed */
+	gen = rados_get_instance_id(ceph_cluster)
+		^ __atomic_add_fetch(&fil_gen_counter, 1, __ATOMIC_RELAXED) * 0x9e3779b97f4a7c15ULL;
+	gen ^= gen >> 33;
+	gen *= 0xff51afd7ed558ccdULL;
+	gen ^= gen >> 33;
+	gen |= FIL_GEN_WRITING;
+
+	if (_fil_gen_set(fp, gen, 0) < 0) {
+		return -1;
+	}
+	__atomic_store_n(&fp->gen_written, gen, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+        (pseudoPrivate) Clear the flag of the generation set by a handle
+        once its writes are done, when it is closed, unless another
+        handle changed the generation since
+        return 0 if successfull, -1 if error
+*/
+static int _fil_gen_release(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	uint64_t gen;
+
+	if (!fp->shared || !(gen = __atomic_exchange_n(&fp->gen_written, 0, __ATOMIC_ACQ_REL))) {
+		return 0;
+	}
+	return _fil_gen_set(fp, gen & ~FIL_GEN_WRITING, gen) < 0 ? -1 : 0;
+}
+
+/*
+ * Access hints and read ahead
+ *
+ * A handle given a hint by fil_advise keeps a few blocks read ahead of
+ * fil_read, each one read by an asynchronous request into a buffer of
+ * the pool.  The handles of a file are listed in its shared state, a
+ * write drops the blocks it changes in all of them, before it is sent
+ * and once it landed, with the short blocks which may have grown.  A
+ * short block is only used for the bytes it holds, not for the end of
+ * the file.  The blocks record the generation of the file, and are not
+ * used once it changed or while another client writes the file.
+ */
+#define FIL_RA_FREE	0	/* slot unused */
+#define FIL_RA_LOADING	1	/* request in flight */
+#define FIL_RA_READY	2	/* data in buf */
+#define FIL_RA_DROPPED	3	/* request in flight, data not wanted anymore */
+
+/* blocks kept by a handle */
+#ifndef FIL_RA_MAX_BLOCKS
+#define FIL_RA_MAX_BLOCKS 32
+#endif
+/* blocks read ahead of a sequential read, 4 times more with
+   FIL_ADV_SEQUENTIAL */
+#ifndef FIL_RA_WINDOW
+#define FIL_RA_WINDOW 4
+#endif
+
+struct fil_ra_block {
+	struct fil_ra_state*	ra;
+	int			state;
+	size_t			block_offset;
+	uint64_t		gen;	/* generation of the file when read */
+	char*			buf;	/* block_size bytes */
+	ssize_t			len;	/* bytes read, short at the end of the file */
+	unsigned long long	used;	/* last use, for the eviction */
+};
+
+struct fil_ra_state {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;	/* signaled when a block is loaded */
+	size_t			block_size;
+	int			hint;	/* FIL_ADV_NORMAL, SEQUENTIAL or RANDOM */
+	size_t			next_offset;	/* end of the previous fil_read */
+	unsigned long long	tick;
+	struct fil_ra_state*	next;	/* of the same file, see fil_file_shared */
+	struct fil_ra_block	blocks[FIL_RA_MAX_BLOCKS];
+};
+
+/* 1 and the generation the blocks are read at, 0 if they can't be used:
+   another client writes the file.  An unknown generation is not checked. */
+static int _fil_ra_gen(FILErados_t* fp, uint64_t* gen)
+{
+	if (!__atomic_load_n(&fp->shared->gen_known, __ATOMIC_ACQUIRE)) {
+		*gen = 0;
+		return 1;
+	}
+	return _fil_gen_cacheable(fp, gen);
+}
+
+/* Block request done, in a librados thread or the submitter */
+static void _fil_ra_loaded(void* arg, ssize_t result)
+{
+	struct fil_ra_block* b = arg;
+	struct fil_ra_state* ra = b->ra;
+
+	pthread_mutex_lock(&ra->mutex);
+	if (b->state == FIL_RA_LOADING && result >= 0) {
+		b->len = result;
+		b->state = FIL_RA_READY;
+	} else {
+		_fil_buf_free(b->buf, ra->block_size);
+		b->buf = NULL;
+		b->state = FIL_RA_FREE;
+	}
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->mutex);
+}
+
+/* Slot of a block, NULL if not there, ra->mutex held */
+static struct fil_ra_block* _fil_ra_find(struct fil_ra_state* ra, size_t block_offset)
+{
+	unsigned int i;
+
+	for (i = 0; i < FIL_RA_MAX_BLOCKS; i++) {
+		if ((ra->blocks[i].state == FIL_RA_LOADING || ra->blocks[i].state == FIL_RA_READY)
+				&& ra->blocks[i].block_offset == block_offset) {
+			return &ra->blocks[i];
+		}
+	}
+	return NULL;
+}
+
+/* Drop a kept block, ra->mutex held */
+static void _fil_ra_release(struct fil_ra_state* ra, struct fil_ra_block* b)
+{
+	if (b->state == FIL_RA_LOADING) {
+		/* freed on completion */
+		b->state = FIL_RA_DROPPED;
+	} else {
+		_fil_buf_free(b->buf, ra->block_size);
+		b->buf = NULL;
+		b->state = FIL_RA_FREE;
+	}
+}
+
+/*
+        (pseudoPrivate) Start reading the blocks of [offset, offset + len)
+        that are not already kept at the current generation, the least
+        recently used blocks make room, the blocks past the end of the
+        file are skipped
+*/
+static void _fil_ra_prefetch(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		offset,	/* offset in the file */
+	size_t		len	/* number of bytes */
+	)
+{
+	struct fil_ra_state* ra = fp->ra;
+	size_t bs = ra->block_size;
+	size_t block_offset, end;
+	ssize_t size;
+	uint64_t gen;
+
+	/* a compressed file would be read synchronously */
+	if (!len || fp->metadata.codec != FIL_CODEC_NONE || !_fil_ra_gen(fp, &gen)
+			|| (size = fil_get_size(fp)) < 0) {
+		return;
+	}
+	end = offset + len < (size_t) size ? offset + len : (size_t) size;
+
+	for (block_offset = offset - offset % bs; block_offset < end; block_offset += bs) {
+		struct fil_ra_block *b = NULL, *lru = NULL;
+		unsigned int i;
+
+		pthread_mutex_lock(&ra->mutex);
+		if ((b = _fil_ra_find(ra, block_offset))) {
+			if (b->gen == gen) {
+				pthread_mutex_unlock(&ra->mutex);
+				continue;
+			}
+			_fil_ra_release(ra, b);
+			b = NULL;
+		}
+		for (i = 0; i < FIL_RA_MAX_BLOCKS && !b; i++) {
+			if (ra->blocks[i].state == FIL_RA_FREE) {
+				b = &ra->blocks[i];
+			} else if (ra->blocks[i].state == FIL_RA_READY
+					&& (!lru || ra->blocks[i].used < lru->used)) {
+				lru = &ra->blocks[i];
+			}
+		}
+		if (!b && (b = lru)) {
+			_fil_buf_free(b->buf, bs);
+			b->buf = NULL;
+		}
+		if (!b) {
+			/* all in flight */
+			pthread_mutex_unlock(&ra->mutex);
+			break;
+		}
+		if (!(b->buf = _fil_buf_alloc(bs))) {
+			b->state = FIL_RA_FREE;
+			pthread_mutex_unlock(&ra->mutex);
+			break;
+		}
+		b->ra = ra;
+		b->state = FIL_RA_LOADING;
+		b->block_offset = block_offset;
+		b->gen = gen;
+		b->len = 0;
+		b->used = ++ra->tick;
+		pthread_mutex_unlock(&ra->mutex);
+
+		if (fil_aio_read(fp, b->buf, bs, block_offset, _fil_ra_loaded, b) < 0) {
+			_fil_ra_loaded(b, -1);
+			break;
+		}
+	}
+
+	/* merged together, not held until a reader waits for them */
+	_fil_aio_unplug(fp);
+}
+
+/*
+        (pseudoPrivate) Read the part of a block at obj_offset from the
+        blocks read ahead, waiting for the block if it is being read
+        return the number of bytes read if the block is kept and holds
+        them, -1 if not
+*/
+static ssize_t _fil_ra_read(
+	FILErados_t*    fp,	/* handle to a file */
+	char*		buf,	/* buffer where to read */
+	size_t		len,	/* number of bytes to read */
+	size_t		block_offset,	/* offset of the beginning of the block */
+	size_t		obj_offset	/* offset within the block */
+	)
+{
+	struct fil_ra_state* ra = fp->ra;
+	struct fil_ra_block* b;
+	ssize_t ret = -1;
+	uint64_t gen;
+	int usable = _fil_ra_gen(fp, &gen);
+
+	pthread_mutex_lock(&ra->mutex);
+	while ((b = _fil_ra_find(ra, block_offset)) && b->state == FIL_RA_LOADING) {
+		pthread_cond_wait(&ra->cond, &ra->mutex);
+	}
+	if (b && (!usable || b->gen != gen)) {
+		/* changed by another client */
+		_fil_ra_release(ra, b);
+	} else if (b && obj_offset + len <= (size_t) b->len) {
+		/* the file may have grown past a short block */
+		memcpy(buf, b->buf + obj_offset, len);
+		b->used = ++ra->tick;
+		ret = len;
+	}
+	pthread_mutex_unlock(&ra->mutex);
+	return ret;
+}
+
+/*
+        (pseudoPrivate) Read ahead of a fil_read of [offset, offset + len)
+        when the hint asks for it: always with FIL_ADV_SEQUENTIAL, when
+        the read follows the previous one with FIL_ADV_NORMAL
+*/
+static void _fil_ra_readahead(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		offset,	/* offset of the read */
+	size_t		len	/* length of the read */
+	)
+{
+	struct fil_ra_state* ra = fp->ra;
+	size_t window = 0;
+
+	pthread_mutex_lock(&ra->mutex);
+	if (ra->hint == FIL_ADV_SEQUENTIAL) {
+		window = 4*FIL_RA_WINDOW;
+	} else if (ra->hint == FIL_ADV_NORMAL && offset == ra->next_offset && offset) {
+		window = FIL_RA_WINDOW;
+	}
+	ra->next_offset = offset + len;
+	pthread_mutex_unlock(&ra->mutex);
+
+	if (window > FIL_RA_MAX_BLOCKS / 2) {
+		/* leave room for the blocks being read */
+		window = FIL_RA_MAX_BLOCKS / 2;
+	}
+	if (window) {
+		/* started before the read, to overlap it */
+		_fil_ra_prefetch(fp, offset + len, window*ra->block_size);
+	}
+}
+
+/*
+        (pseudoPrivate) Drop the blocks of [offset, offset + len), len 0
+        for up to the end of the file, and the short ones which may have
+        grown.  Called on writes, then the blocks are being changed.
+*/
+static void _fil_ra_drop(
+	struct fil_ra_state*	ra,	/* blocks of a handle */
+	size_t		offset,	/* offset in the file */
+	size_t		len,	/* number of bytes, 0 for all */
+	int		short_too	/* 1 to drop the short blocks */
+	)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&ra->mutex);
+	for (i = 0; i < FIL_RA_MAX_BLOCKS; i++) {
+		struct fil_ra_block* b = &ra->blocks[i];
+		if (b->state != FIL_RA_LOADING && b->state != FIL_RA_READY) {
+			continue;
+		}
+		if ((b->block_offset + ra->block_size > offset
+					&& (!len || b->block_offset < offset + len))
+				|| (short_too && (b->state == FIL_RA_LOADING
+					|| (size_t) b->len < ra->block_size))) {
+			_fil_ra_release(ra, b);
+		}
+	}
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->mutex);
+}
+
+/*
+        (pseudoPrivate) Drop the blocks a write changes in all the handles
+        of the file, called before the write is sent and once it landed
+*/
+static void _fil_ra_invalidate(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		offset,	/* offset of the write */
+	size_t		len	/* length of the write */
+	)
+{
+	struct fil_file_shared* sh = fp->shared;
+	struct fil_ra_state* ra;
+
+	if (!sh || !len || !__atomic_load_n(&sh->ras, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	pthread_mutex_lock(&sh->mutex);
+	for (ra = sh->ras; ra; ra = ra->next) {
+		_fil_ra_drop(ra, offset, len, 1);
+	}
+	pthread_mutex_unlock(&sh->mutex);
+}
+
+/*
+        (pseudoPrivate) Free the blocks of a handle, its requests are
+        done, see _fil_aio_state_destroy
+*/
+static void _fil_ra_destroy(
+	FILErados_t*    fp	/* handle to a file */
+	)
+{
+	struct fil_ra_state* ra = fp->ra;
+	struct fil_ra_state** p;
+	unsigned int i;
+
+	if (!ra) {
+		return;
+	}
+	pthread_mutex_lock(&fp->shared->mutex);
+	for (p = &fp->shared->ras; *p != ra; p = &(*p)->next);
+	__atomic_store_n(p, ra->next, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&fp->shared->mutex);
+	for (i = 0; i < FIL_RA_MAX_BLOCKS; i++) {
+		if (ra->blocks[i].buf) {
+			_fil_buf_free(ra->blocks[i].buf, ra->block_size);
+		}
+	}
+	pthread_mutex_destroy(&ra->mutex);
+	pthread_cond_destroy(&ra->cond);
+	free(ra);
+	fp->ra = NULL;
+}
+
+/*
+	Tell how [offset, offset + len) of a file will be read, len 0 for
+	up to the end of the file, as posix_fadvise.  FIL_ADV_WILLNEED
+	starts reading its blocks, FIL_ADV_DONTNEED drops them,
+	FIL_ADV_SEQUENTIAL reads further ahead of fil_read, FIL_ADV_RANDOM
+	does not read ahead and FIL_ADV_NORMAL reads ahead of the reads
+	following each other.  The range only matters for WILLNEED and
+	DONTNEED, the others apply to the whole handle.  Only fil_read uses
+	the blocks read ahead.
+	return 0 if successfull, -1 if error
+*/
+int fil_advise(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		offset,	/* offset in the file */
+	size_t		len,	/* number of bytes, 0 for up to the end */
+	int		hint	/* FIL_ADV_* */
+	)
+{
+	struct fil_ra_state* ra;
+
+	if (!fp || !fp->metadata.name || !fp->metadata.block_size) {
+		fprintf(stderr, "Error: uninitialized file handle\n");
+		return -1;
+	}
+	if (hint < FIL_ADV_NORMAL || hint > FIL_ADV_DONTNEED) {
+		fprintf(stderr, "Error: unknown access hint %d\n", hint);
+		return -1;
+	}
+
+	if (!(ra = fp->ra)) {
+		if (hint == FIL_ADV_DONTNEED) {
+			return 0;
+		}
+		if (!(ra = calloc(1, sizeof(struct fil_ra_state)))) {
+			fprintf(stderr, "Error: unable to allocate memory to read ahead %s\n", fp->metadata.name);
+			return -1;
+		}
+		pthread_mutex_init(&ra->mutex, NULL);
+		pthread_cond_init(&ra->cond, NULL);
+		ra->block_size = fp->metadata.block_size;
+		ra->hint = FIL_ADV_NORMAL;
+		pthread_mutex_lock(&fp->shared->mutex);
+		ra->next = fp->shared->ras;
+		__atomic_store_n(&fp->shared->ras, ra, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&fp->shared->mutex);
+		fp->ra = ra;
+	}
+
+	switch (hint) {
+	case FIL_ADV_WILLNEED:
+		if (!len) {
+			ssize_t size = fil_get_size(fp);
+			len = size > (ssize_t) offset ? (size_t) size - offset : 0;
+		}
+		_fil_ra_prefetch(fp, offset, len);
+		break;
+	case FIL_ADV_DONTNEED:
+		_fil_ra_drop(ra, offset, len, 0);
+		break;
+	default:
+		pthread_mutex_lock(&ra->mutex);
+		ra->hint = hint;
+		pthread_mutex_unlock(&ra->mutex);
+	}
+	return 0;
+}
+
+/*
+ * Local cache tier
+ *
+ * fil_local_cache_configure keeps copies of the block objects in a
+ * directory on a local device, below the blocks read ahead and above
+ * rados.  The directory holds a data file of fixed size slots and an
+ * index file, mapped, with one entry per slot.  The slots are grouped in
+ * sets of FIL_LCACHE_WAYS, an object goes in the set given by the hash of
+ * its name and replaces the least recently used entry of the set.
+ *
+ * An entry records the generation of the file it was read at and is
+ * only used at that generation, see _fil_gen_bump, so the entries kept
+ * across a restart are not used once the file changed.  A file being
+ * written by another client is not cached.  A client sees the new
+ * generation of a file written by another one at its next open of the
+ * file or, when it watches the catalog, once it is announced: a block
+ * may be served stale until then.  The files opened before the cache is
+ * configured are not cached.  Only
+ * the blocks of the synchronous reads are cached, and only the whole
+ * objects.  The index is marked clean when the cache is closed, an index
+ * not closed cleanly is discarded at the next start.
+ */
+#define FIL_LCACHE_MAGIC	"FILLC001"
+#define FIL_LCACHE_NAME_MAX	104
+
+/* entries of a set */
+#ifndef FIL_LCACHE_WAYS
+#define FIL_LCACHE_WAYS 8
+#endif
+/* mutexes of the sets, a set uses the one of its number modulo */
+#ifndef FIL_LCACHE_LOCKS
+#define FIL_LCACHE_LOCKS 256
+#endif
+
+struct fil_lcache_header {
+	char		magic[8];	/* FIL_LCACHE_MAGIC */
+	uint64_t	n_slots;	/* number of slots, a multiple of FIL_LCACHE_WAYS */
+	uint64_t	slot_size;	/* bytes of a slot */
+	uint64_t	clean;		/* 1 if the cache was closed */
+	uint64_t	tick;		/* last use given to an entry */
+};
+
+struct fil_lcache_entry {
+	char		name[FIL_LCACHE_NAME_MAX];	/* object, "" if the slot is free */
+	uint64_t	gen;		/* generation of the file */
+	uint64_t	used;		/* last use, for the replacement */
+	uint32_t	len;		/* bytes of the object */
+	uint32_t	reserved;
+};
+
+struct fil_lcache {
+	int				policy;		/* FIL_LCACHE_WRITE_AROUND or FIL_LCACHE_WRITE_THROUGH */
+	int				index_fd;
+	int				data_fd;
+	size_t				index_len;	/* bytes mapped */
+	struct fil_lcache_header*	hdr;		/* mapped index */
+	struct fil_lcache_entry*	entries;	/* follow the header */
+	size_t				n_sets;
+	size_t				slot_size;
+	pthread_mutex_t			locks[FIL_LCACHE_LOCKS];
+	/* changes of the sets under each mutex, a block read from rados
+	   is not cached if one of its set was dropped meanwhile */
+	uint64_t			drops[FIL_LCACHE_LOCKS];
+};
+
+static struct fil_lcache* fil_lcache = NULL;
+
+/* Set of an object */
+static size_t _fil_lcache_set(const char* obj_name)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+
+	for (; *obj_name; obj_name++) {
+		h = (h ^ (unsigned char) *obj_name) * 16777619u;
+	}
+	return h % fil_lcache->n_sets;
+}
+
+/* Entry of an object in its set, NULL if not there, the mutex of the
+   set held */
+static struct fil_lcache_entry* _fil_lcache_find(size_t set, const char* obj_name)
+{
+	struct fil_lcache_entry* e = &fil_lcache->entries[set * FIL_LCACHE_WAYS];
+	unsigned int i;
+
+	for (i = 0; i < FIL_LCACHE_WAYS; i++) {
+		if (!strcmp(e[i].name, obj_name)) {
+			return &e[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+        (pseudoPrivate) Copy a whole object in the cache, at the generation
+        of its file when it was read.  Not done when its set changed since
+        drops, the object may be stale.
+*/
+static void _fil_lcache_put(
+	const char*	obj_name,	/* name of the rados object */
+	const char*	buf,	/* content of the object */
+	size_t		len,	/* length of the object */
+	uint64_t	gen,	/* generation of the file when the object was read */
+	uint64_t	drops	/* drops of the set when the object was read */
+	)
+{
+	struct fil_lcache* lc = fil_lcache;
+	struct fil_lcache_entry *e, *victim;
+	size_t set, slot;
+	unsigned int i;
+
+	if (len > lc->slot_size || strlen(obj_name) >= FIL_LCACHE_NAME_MAX) {
+		return;
+	}
+	set = _fil_lcache_set(obj_name);
+	pthread_mutex_lock(&lc->locks[set % FIL_LCACHE_LOCKS]);
+	if (lc->drops[set % FIL_LCACHE_LOCKS] != drops) {
+		pthread_mutex_unlock(&lc->locks[set % FIL_LCACHE_LOCKS]);
+		return;
+	}
+	if (!(victim = _fil_lcache_find(set, obj_name))) {
+		e = &lc->entries[set * FIL_LCACHE_WAYS];
+		victim = &e[0];
+		for (i = 0; i < FIL_LCACHE_WAYS && victim->name[0]; i++) {
+			if (!e[i].name[0] || e[i].used < victim->used) {
+				victim = &e[i];
+			}
+		}
+	}
+	slot = victim - lc->entries;
+
+	/* the entry is free while its slot is written */
+	victim->name[0] = '\0';
+	if (pwrite(lc->data_fd, buf, len, (off_t) (slot * lc->slot_size)) == (ssize_t) len) {
+		victim->gen = gen;
+		victim->len = len;
+		victim->used = __atomic_add_fetch(&lc->hdr->tick, 1, __ATOMIC_RELAXED);
+		strcpy(victim->name, obj_name);
+	}
+	pthread_mutex_unlock(&lc->locks[set % FIL_LCACHE_LOCKS]);
+}
+
+/*
+        (pseudoPrivate) Drop an object from the cache
+*/
+static void _fil_lcache_drop(
+	const char*	obj_name	/* name of the rados object */
+	)
+{
+	struct fil_lcache* lc = fil_lcache;
+	struct fil_lcache_entry *e;
+	size_t set;
+
+	if (!lc) {
+		return;
+	}
+	set = _fil_lcache_set(obj_name);
+	pthread_mutex_lock(&lc->locks[set % FIL_LCACHE_LOCKS]);
+	lc->drops[set % FIL_LCACHE_LOCKS]++;
+	if ((e = _fil_lcache_find(set, obj_name))) {
+		e->name[0] = '\0';
+	}
+	pthread_mutex_unlock(&lc->locks[set % FIL_LCACHE_LOCKS]);
+}
+
+/*
+        (pseudoPrivate) Read part of a block object through the cache, on
+        a miss the whole object is read from rados and cached
+        return the number of bytes read if successfull, the negative rados
+        error otherwise, as _fil_rados_read_object
+*/
+static ssize_t _fil_lcache_read(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	char*		buf,	/* buffer where to read */
+	size_t		len,	/* number of bytes to read */
+	size_t		offset,	/* offset within the object */
+	size_t		obj_max	/* largest size of the object */
+	)
+{
+	struct fil_lcache* lc = fil_lcache;
+	struct fil_lcache_entry *e;
+	uint64_t gen, drops;
+	size_t set;
+	ssize_t ret;
+	char *tmp;
+
+	/* before the object is read, a newer generation does not use it */
+	if (!lc || obj_max > lc->slot_size || strlen(obj_name) >= FIL_LCACHE_NAME_MAX
+			|| !_fil_gen_cacheable(fp, &gen)) {
+		return _fil_rados_read_object(_fil_ioctx(fp), obj_name, buf, len, offset);
+	}
+
+	set = _fil_lcache_set(obj_name);
+	pthread_mutex_lock(&lc->locks[set % FIL_LCACHE_LOCKS]);
+	if ((e = _fil_lcache_find(set, obj_name))) {
+		if (e->gen == gen) {
+			ret = offset >= e->len ? 0 : (e->len - offset < len ? e->len - offset : len);
+			if (ret == 0 || pread(lc->data_fd, buf, ret,
+					(off_t) ((e - lc->entries) * lc->slot_size + offset)) == ret) {
+				e->used = __atomic_add_fetch(&lc->hdr->tick, 1, __ATOMIC_RELAXED);
+				pthread_mutex_unlock(&lc->locks[set % FIL_LCACHE_LOCKS]);
+				return ret;
+			}
+		}
+		/* older generation, or the device failed */
+		e->name[0] = '\0';
+	}
+	drops = lc->drops[set % FIL_LCACHE_LOCKS];
+	pthread_mutex_unlock(&lc->locks[set % FIL_LCACHE_LOCKS]);
+
+	if (!(tmp = _fil_buf_alloc(obj_max))) {
+		return _fil_rados_read_object(_fil_ioctx(fp), obj_name, buf, len, offset);
+	}
+	if ((ret = _fil_rados_read_object(_fil_ioctx(fp), obj_name, tmp, obj_max, 0)) >= 0) {
+		/* a short object may still grow, see fil_append */
+		if (fp->metadata.codec != FIL_CODEC_NONE || (size_t) ret == obj_max) {
+			_fil_lcache_put(obj_name, tmp, ret, gen, drops);
+		}
+		ret = offset >= (size_t) ret ? 0 : ((size_t) ret - offset < len ? (size_t) ret - offset : len);
+		memcpy(buf, tmp + offset, ret);
+	}
+	_fil_buf_free(tmp, obj_max);
+	return ret;
+}
+
+/*
+        (pseudoPrivate) Update the cache after a synchronous write of a
+        block, with FIL_LCACHE_WRITE_THROUGH a block written as a whole is
+        cached, otherwise the object is dropped
+*/
+static void _fil_lcache_written(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	const char*	buf,	/* data written */
+	size_t		len,	/* number of bytes written */
+	size_t		offset	/* offset within the block */
+	)
+{
+	uint64_t gen, drops;
+	size_t set;
+
+	if (!fil_lcache) {
+		return;
+	}
+	_fil_lcache_drop(obj_name);
+	if (fil_lcache->policy == FIL_LCACHE_WRITE_THROUGH && fp->metadata.codec == FIL_CODEC_NONE
+			&& offset == 0 && len == fp->metadata.block_size
+			&& _fil_gen_cacheable(fp, &gen)) {
+		set = _fil_lcache_set(obj_name);
+		pthread_mutex_lock(&fil_lcache->locks[set % FIL_LCACHE_LOCKS]);
+		drops = fil_lcache->drops[set % FIL_LCACHE_LOCKS];
+		pthread_mutex_unlock(&fil_lcache->locks[set % FIL_LCACHE_LOCKS]);
+		_fil_lcache_put(obj_name, buf, len, gen, drops);
+	}
+}
+
+/*
+        (pseudoPrivate) Called before a handle writes [offset, offset + len):
+        change the generation of the file before the first write of the
+        handle when it is cached or the catalog is watched, see
+        _fil_gen_bump, and drop the cached blocks of the range
+        return 0 if successfull, -1 if error
+*/
+static int _fil_lcache_invalidate(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		offset,	/* offset in the file */
+	size_t		len	/* number of bytes */
+	)
+{
+	size_t block_offset, end;
+	char* obj_name;
+
+	/* the blocks read ahead by the watching clients use it too */
+	if (!__atomic_load_n(&fp->gen_written, __ATOMIC_ACQUIRE) && (fil_lcache || _fil_md_watched())
+			&& _fil_gen_bump(fp) < 0) {
+		return -1;
+	}
+	if (!fil_lcache) {
+		return 0;
+	}
+
+	if (!len) {
+		return 0;
+	}
+	end = offset + len;
+	for (block_offset = offset - offset % fp->metadata.block_size; block_offset < end;
+			block_offset += fp->metadata.block_size) {
+		if (!(obj_name = _fil_get_object_name(fp,block_offset))) {
+			return -1;
+		}
+		_fil_lcache_drop(obj_name);
+		free(obj_name);
+	}
+	return 0;
+}
+
+/* Close the cache, the index is marked clean */
+static void _fil_lcache_close()
+{
+	struct fil_lcache* lc = fil_lcache;
+	unsigned int i;
+
+	if (!lc) {
+		return;
+	}
+	fil_lcache = NULL;
+	if (fdatasync(lc->data_fd) == 0) {
+		lc->hdr->clean = 1;
+		msync(lc->hdr, lc->index_len, MS_SYNC);
+	}
+	munmap(lc->hdr, lc->index_len);
+	close(lc->index_fd);
+	close(lc->data_fd);
+	for (i = 0; i < FIL_LCACHE_LOCKS; i++) {
+		pthread_mutex_destroy(&lc->locks[i]);
+	}
+	free(lc);
+}
+
+/*
+	Keep a copy of the block objects on a local device, in the directory
+	dir, up to capacity bytes in slots of slot_size bytes, the objects
+	larger than a slot are not cached.  The cache of a previous run is
+	reused when its geometry is the same.  With
+	FIL_LCACHE_WRITE_AROUND the writes drop the blocks from the cache,
+	with FIL_LCACHE_WRITE_THROUGH the blocks written as a whole are
+	cached.  All the clients writing the files must have a cache, see
+	_fil_lcache_invalidate, and watch the catalog to see the changes of
+	the others before they open the files again, see
+	fil_metadata_watch.  A NULL dir closes the cache.  To be called when
+	no I/O is in flight.
+	return 0 if successfull, -1 if error
+*/
+int fil_local_cache_configure(
+	const char*		dir,	/* directory of the cache, NULL to close it */
+	unsigned long long	capacity,	/* bytes of the data file */
+	size_t			slot_size,	/* bytes of a slot, the largest object cached */
+	int			policy	/* FIL_LCACHE_WRITE_AROUND or FIL_LCACHE_WRITE_THROUGH */
+	)
+{
+	struct fil_lcache* lc;
+	struct stat st;
+	char *index_path = NULL, *data_path = NULL;
+	uint64_t n_slots;
+	unsigned int i;
+
+	_fil_lcache_close();
+	if (!dir) {
+		return 0;
+	}
+
+	if (policy != FIL_LCACHE_WRITE_AROUND && policy != FIL_LCACHE_WRITE_THROUGH) {
+		fprintf(stderr, "Error: unknown local cache policy %d\n", policy);
+		return -1;
+	}
+	n_slots = slot_size ? capacity / slot_size / FIL_LCACHE_WAYS * FIL_LCACHE_WAYS : 0;
+	if (!n_slots) {
+		fprintf(stderr, "Error: the local cache must hold at least %d slots\n", FIL_LCACHE_WAYS);
+		return -1;
+	}
+
+	if (!(lc = calloc(1, sizeof(struct fil_lcache)))
+			|| asprintf(&index_path, "%s/index", dir) < 0
+			|| asprintf(&data_path, "%s/data", dir) < 0) {
+		fprintf(stderr, "Error: unable to allocate memory for the local cache\n");
+		free(index_path);
+		free(lc);
+		return -1;
+	}
+	lc->policy = policy;
+	lc->slot_size = slot_size;
+	lc->n_sets = n_slots / FIL_LCACHE_WAYS;
+	lc->index_len = sizeof(struct fil_lcache_header) + n_slots * sizeof(struct fil_lcache_entry);
+	lc->index_fd = -1;
+	lc->data_fd = -1;
+
+	if ((lc->index_fd = open(index_path, O_RDWR | O_CREAT, 0600)) < 0
+			|| (lc->data_fd = open(data_path, O_RDWR | O_CREAT, 0600)) < 0) {
+		fprintf(stderr, "Error %d: cannot open the local cache in %s\n%s\n", errno, dir, strerror(errno));
+		goto err;
+	}
+	/* a single process per cache */
+	if (lockf(lc->index_fd, F_TLOCK, 0) < 0) {
+		fprintf(stderr, "Error %d: the local cache in %s is in use\n%s\n", errno, dir, strerror(errno));
+		goto err;
+	}
+	if (fstat(lc->index_fd, &st) < 0
+			|| ((size_t) st.st_size != lc->index_len && ftruncate(lc->index_fd, lc->index_len) < 0)
+			|| ftruncate(lc->data_fd, (off_t) (n_slots * slot_size)) < 0) {
+		fprintf(stderr, "Error %d: cannot size the local cache in %s\n%s\n", errno, dir, strerror(errno));
+		goto err;
+	}
+	if ((lc->hdr = mmap(NULL, lc->index_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			lc->index_fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "Error %d: cannot map the local cache index in %s\n%s\n", errno, dir, strerror(errno));
+		lc->hdr = NULL;
+		goto err;
+	}
+	lc->entries = (struct fil_lcache_entry*) (lc->hdr + 1);
+
+	if ((size_t) st.st_size != lc->index_len || memcmp(lc->hdr->magic, FIL_LCACHE_MAGIC, 8)
+			|| lc->hdr->n_slots != n_slots || lc->hdr->slot_size != slot_size
+			|| lc->hdr->clean != 1) {
+		/* new cache, other geometry or not closed: start empty */
+		memset(lc->hdr, 0, lc->index_len);
+		memcpy(lc->hdr->magic, FIL_LCACHE_MAGIC, 8);
+		lc->hdr->n_slots = n_slots;
+		lc->hdr->slot_size = slot_size;
+	}
+	/* until closed, a crash leaves the index unclean */
+	lc->hdr->clean = 0;
+	if (msync(lc->hdr, lc->index_len, MS_SYNC) < 0) {
+		fprintf(stderr, "Error %d: cannot write the local cache index in %s\n%s\n", errno, dir, strerror(errno));
+		goto err;
+	}
+
+	for (i = 0; i < FIL_LCACHE_LOCKS; i++) {
+		pthread_mutex_init(&lc->locks[i], NULL);
+	}
+	free(index_path);
+	free(data_path);
+	fil_lcache = lc;
+	return 0;
+
+err:
+	if (lc->hdr) {
+		munmap(lc->hdr, lc->index_len);
+	}
+	if (lc->index_fd >= 0) {
+		close(lc->index_fd);
+	}
+	if (lc->data_fd >= 0) {
+		close(lc->data_fd);
+	}
+	free(index_path);
+	free(data_path);
+	free(lc);
+	return -1;
+}
+
+/* not needed for now 
+fil_update_atime() {
+
+} */
+
+/* not needed for now 
+fil_update_mtime() {
+
+} */
+
+
+
+
+
+
+
+
+
+/*
+ * Catalog index
+ *
+ * metadata_json is an array with one object per file.  To avoid scanning
+ * it, each entry has a node in a hash table keyed on the path and type.
+ * The nodes are also kept in an array parallel to metadata_json so an
+ * entry can be removed by moving the last one in its slot.  The number
+ * of handles opened by this process is only kept in the node, it has no
+ * meaning for other processes.
+ *
+ * The nodes also form a tree: each one is linked in the children list of
+ * the directory holding it, so a directory is listed without looking at
+ * the rest of the catalog.  Files created without a fil_mkdir of their
+ * directory (all the files of older catalogs) get an implicit directory
+ * node, it has no catalog entry and goes away with its last child.
+ *
+ * The catalog mutex is recursive, the catalog functions call each other.
+ */
+struct fil_md_node {
+	char*			path;
+	os_file_type_t		type;
+	size_t			index;	/* position in metadata_json */
+	unsigned int		deleted;	/* 1 once deleted, but still opened */
+	unsigned int		n_ref;	/* handles opened by this process */
+	unsigned int		implicit;	/* directory without catalog entry */
+	struct fil_md_node*	hash_next;
+	struct fil_md_node*	parent;	/* directory holding the node */
+	struct fil_md_node*	children;	/* entries of a directory */
+	struct fil_md_node*	sibling_next;
+	struct fil_md_node*	sibling_prev;
+};
+
+static struct fil_md_node**	fil_md_buckets = NULL;
+static size_t			fil_md_n_buckets = 0;
+static size_t			fil_md_n_hashed = 0;	/* nodes in the hash table */
+static struct fil_md_node**	fil_md_nodes = NULL;
+static size_t			fil_md_n_nodes = 0;
+static size_t			fil_md_nodes_size = 0;
+/* lowest id of the next file created, above all the ids of the
+   catalog, the id is taken from the counter of the pool */
+static unsigned long long	fil_md_next_id = 1;
+/* top directory, parent of the paths without '/' */
+static struct fil_md_node	fil_md_root = { "", OS_FILE_TYPE_DIR, 0, 0, 0, 1, NULL, NULL, NULL, NULL, NULL };
+
+/* FNV-1a of the len first bytes of the path and the type */
+static size_t _fil_md_hash(const char* path, size_t len, os_file_type_t type)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--) {
+		h ^= (unsigned char) *path++;
+		h *= 1099511628211ULL;
+	}
+	h ^= (unsigned int) type;
+	h *= 1099511628211ULL;
+	return (size_t) h;
+}
+
+/* Find the node of the len first bytes of a path, implicit directories
+   included, NULL if not found */
+static struct fil_md_node* _fil_md_find(const char* path, size_t len, os_file_type_t type)
+{
+	struct fil_md_node* node;
+
+	if (!fil_md_n_buckets) {
+		return NULL;
+	}
+	node = fil_md_buckets[_fil_md_hash(path, len, type) & (fil_md_n_buckets - 1)];
+	while (node && (node->type != type || strncmp(node->path, path, len) || node->path[len])) {
+		node = node->hash_next;
+	}
+	return node;
+}
+
+/* Find the node of a file, deleted files included, NULL if not found */
+static struct fil_md_node* _fil_md_lookup(const char* path, os_file_type_t type)
+{
+	struct fil_md_node* node = _fil_md_find(path, strlen(path), type);
+
+	return node && !node->implicit ? node : NULL;
+}
+
+/* Length of the directory part of a path, 0 for the top directory */
+static size_t _fil_md_dir_len(const char* path)
+{
+	const char* slash = strrchr(path, '/');
+
+	return slash ? (size_t) (slash - path) : 0;
+}
+
+/* Double the hash table */
+static int _fil_md_grow_buckets()
+{
+	size_t n_buckets = fil_md_n_buckets ? fil_md_n_buckets*2 : 1024;
+	struct fil_md_node** buckets = calloc(n_buckets, sizeof(struct fil_md_node *));
+	size_t i;
+
+	if (!buckets) {
+		return -1;
+	}
+	for (i = 0; i < fil_md_n_buckets; i++) {
+		struct fil_md_node* node = fil_md_buckets[i];
+		while (node) {
+			struct fil_md_node* next = node->hash_next;
+			size_t b = _fil_md_hash(node->path, strlen(node->path), node->type) & (n_buckets - 1);
+			node->hash_next = buckets[b];
+			buckets[b] = node;
+			node = next;
+		}
+	}
+	free(fil_md_buckets);
+	fil_md_buckets = buckets;
+	fil_md_n_buckets = n_buckets;
+	return 0;
+}
+
+/* Add a node to the hash table, it must have buckets.  When it can't
+   grow the chains just get longer. */
+static void _fil_md_hash_add(struct fil_md_node* node)
+{
+	size_t b;
+
+	if (fil_md_n_hashed >= fil_md_n_buckets) {
+		_fil_md_grow_buckets();
+	}
+	b = _fil_md_hash(node->path, strlen(node->path), node->type) & (fil_md_n_buckets - 1);
+	node->hash_next = fil_md_buckets[b];
+	fil_md_buckets[b] = node;
+	fil_md_n_hashed++;
+}
+
+/* Link a node in the children of a directory */
+static void _fil_md_link(struct fil_md_node* node, struct fil_md_node* dir)
+{
+	node->parent = dir;
+	node->sibling_prev = NULL;
+	node->sibling_next = dir->children;
+	if (dir->children) {
+		dir->children->sibling_prev = node;
+	}
+	dir->children = node;
+}
+
+/* Free a node already out of the tree, the array and the hash table */
+static void _fil_md_free(struct fil_md_node* node)
+{
+	free(node->path);
+	free(node);
+}
+
+/* Remove a node from the hash table */
+static void _fil_md_hash_remove(struct fil_md_node* node)
+{
+	struct fil_md_node** prev;
+
+	prev = &fil_md_buckets[_fil_md_hash(node->path, strlen(node->path), node->type) & (fil_md_n_buckets - 1)];
+	while (*prev != node) {
+		prev = &(*prev)->hash_next;
+	}
+	*prev = node->hash_next;
+	fil_md_n_hashed--;
+}
+
+/* Unlink a node from its directory, the implicit directories left
+   empty are freed */
+static void _fil_md_unlink(struct fil_md_node* node)
+{
+	struct fil_md_node* dir = node->parent;
+
+	if (node->sibling_prev) {
+		node->sibling_prev->sibling_next = node->sibling_next;
+	} else {
+		dir->children = node->sibling_next;
+	}
+	if (node->sibling_next) {
+		node->sibling_next->sibling_prev = node->sibling_prev;
+	}
+	node->parent = node->sibling_next = node->sibling_prev = NULL;
+
+	if (dir != &fil_md_root && dir->implicit && !dir->children) {
+		_fil_md_unlink(dir);
+		_fil_md_hash_remove(dir);
+		_fil_md_free(dir);
+	}
+}
+
+/*
+        (pseudoPrivate) Return the directory node holding a path, the
+        missing directories are added as implicit nodes
+        return the node if successfull, NULL if error
+*/
+static struct fil_md_node* _fil_md_get_dir(
+	const char*	path	/* path of an entry */
+	)
+{
+	size_t len = _fil_md_dir_len(path);
+	struct fil_md_node *dir, *parent;
+
+	if (!len) {
+		return &fil_md_root;
+	}
+	if ((dir = _fil_md_find(path, len, OS_FILE_TYPE_DIR))) {
+		return dir;
+	}
+
+	if (!(dir = calloc(1, sizeof(struct fil_md_node))) || !(dir->path = strndup(path, len))) {
+		fprintf(stderr, "Error: unable to allocate memory for the catalog index\n");
+		free(dir);
+		return NULL;
+	}
+	dir->type = OS_FILE_TYPE_DIR;
+	dir->implicit = 1;
+	dir->index = (size_t) -1;
+	if (!(parent = _fil_md_get_dir(dir->path))) {
+		_fil_md_free(dir);
+		return NULL;
+	}
+	_fil_md_hash_add(dir);
+	_fil_md_link(dir, parent);
+	return dir;
+}
+
+/*
+        (pseudoPrivate) Add the node of the entry appended at the end of
+        metadata_json, an implicit directory node becomes the node of
+        the new directory entry
+        return the node if successfull, NULL if error
+*/
+static struct fil_md_node* _fil_md_insert(
+	const char*	path,	/* file path */
+	os_file_type_t	type,	/* file object type */
+	unsigned int	deleted	/* deleted flag of the entry */
+	)
+{
+	struct fil_md_node *node, *dir;
+
+	if (fil_md_n_nodes == fil_md_nodes_size) {
+		size_t size = fil_md_nodes_size ? fil_md_nodes_size*2 : 1024;
+		struct fil_md_node** nodes = realloc(fil_md_nodes, size*sizeof(struct fil_md_node *));
+		if (!nodes) {
+			fprintf(stderr, "Error: unable to allocate memory for the catalog index\n");
+			return NULL;
+		}
+		fil_md_nodes = nodes;
+		fil_md_nodes_size = size;
+	}
+
+	if (type == OS_FILE_TYPE_DIR && (node = _fil_md_find(path, strlen(path), type))) {
+		/* its files were seen first */
+		node->implicit = 0;
+		node->deleted = deleted;
+		node->index = fil_md_n_nodes;
+		fil_md_nodes[fil_md_n_nodes++] = node;
+		return node;
+	}
+
+	if (!fil_md_n_buckets && _fil_md_grow_buckets() < 0) {
+		fprintf(stderr, "Error: unable to allocate memory for the catalog index\n");
+		return NULL;
+	}
+	if (!(node = calloc(1, sizeof(struct fil_md_node))) || !(node->path = strdup(path))) {
+		fprintf(stderr, "Error: unable to allocate memory for the catalog index\n");
+		free(node);
+		return NULL;
+	}
+	if (!(dir = _fil_md_get_dir(path))) {
+		_fil_md_free(node);
+		return NULL;
+	}
+	node->type = type;
+	node->deleted = deleted;
+	_fil_md_hash_add(node);
+	node->index = fil_md_n_nodes;
+	fil_md_nodes[fil_md_n_nodes++] = node;
+	_fil_md_link(node, dir);
+	return node;
+}
+
+/*
+        (pseudoPrivate) Remove an entry from metadata_json and the index,
+        the last entry is moved in its slot.  A directory still holding
+        entries stays in the tree as an implicit directory.
+        return 0 if successfull, -1 if error
+*/
+static int _fil_md_remove(
+	struct fil_md_node*	node	/* node of the entry to remove */
+	)
+{
+	size_t last = fil_md_n_nodes - 1;
+
+	if (node->index != last) {
+		if (json_array_set(metadata_json, node->index, json_array_get(metadata_json, last)) < 0) {
+			fprintf(stderr, "error: unable to move a file element in the metadata\n");
+			return -1;
+		}
+		fil_md_nodes[node->index] = fil_md_nodes[last];
+		fil_md_nodes[node->index]->index = node->index;
+	}
+	if (json_array_remove(metadata_json, last) < 0) {
+		fprintf(stderr, "error: Unable to remove the file element for the metadata\n");
+		return -1;
+	}
+	fil_md_n_nodes--;
+
+	if (node->children) {
+		node->implicit = 1;
+		node->deleted = 0;
+		node->index = (size_t) -1;
+		return 0;
+	}
+	_fil_md_unlink(node);
+	_fil_md_hash_remove(node);
+	_fil_md_free(node);
+	return 0;
+}
+
+/* Drop the whole index */
+static void _fil_md_reset()
+{
+	size_t i;
+
+	for (i = 0; i < fil_md_n_buckets; i++) {
+		struct fil_md_node* node = fil_md_buckets[i];
+		while (node) {
+			struct fil_md_node* next = node->hash_next;
+			_fil_md_free(node);
+			node = next;
+		}
+	}
+	free(fil_md_nodes);
+	free(fil_md_buckets);
+	fil_md_nodes = NULL;
+	fil_md_buckets = NULL;
+	fil_md_n_nodes = fil_md_nodes_size = fil_md_n_buckets = fil_md_n_hashed = 0;
+	fil_md_root.children = NULL;
+}
+
+/* Forget the catalog, it is read again from the cluster connected,
+   a catalog loaded without one is not saved over the metadata object */
+static void _fil_md_unload()
+{
+	pthread_mutex_lock(&fil_catalog_mutex);
+	_fil_md_reset();
+	json_decref(metadata_json);
+	metadata_json = NULL;
+	fil_md_version = 0;
+	fil_md_next_id = 1;
+	pthread_mutex_unlock(&fil_catalog_mutex);
+}
+
+/* An entry is listed unless deleted, an implicit directory only while
+   it holds a listed entry */
+static int _fil_md_is_visible(struct fil_md_node* node)
+{
+	struct fil_md_node* child;
+
+	if (node->deleted) {
+		return 0;
+	}
+	if (!node->implicit) {
+		return 1;
+	}
+	for (child = node->children; child; child = child->sibling_next) {
+		if (_fil_md_is_visible(child)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+	Create a directory, its parent must exist
+	return 0 if successfull, -1 if error
+*/
+int fil_mkdir(
+	char*	dirpath	/* directory path like sbtest */
+	)
+{
+	size_t dir_len;
+	int ret;
+
+	if (!dirpath || !*dirpath) {
+		fprintf(stderr, "Error: uninitialized directory path can't be null\n");
+		return -1;
+	}
+
+	/* is the metadata json loaded? */
+	if (!metadata_json && _fil_load_metadata_json() < 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (_fil_md_lookup(dirpath, OS_FILE_TYPE_DIR) || _fil_md_lookup(dirpath, OS_FILE_TYPE_FILE)) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: %s already exists\n", dirpath);
+		return -1;
+	}
+	dir_len = _fil_md_dir_len(dirpath);
+	if (dir_len && !_fil_md_find(dirpath, dir_len, OS_FILE_TYPE_DIR)) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: the parent directory of %s does not exist\n", dirpath);
+		return -1;
+	}
+	ret = _fil_add_file_metadata(dirpath, OS_FILE_TYPE_DIR, 0, 0, NULL);
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	return ret;
+}
+
+/*
+	Remove an empty directory, files deleted but still opened do not
+	count
+	return 0 if successfull, -1 if error
+*/
+int fil_rmdir(
+	char*	dirpath	/* directory path like sbtest */
+	)
+{
+	struct fil_md_node *dir, *node;
+	int ret;
+
+	if (!dirpath) {
+		fprintf(stderr, "Error: uninitialized directory path can't be null\n");
+		return -1;
+	}
+
+	/* is the metadata json loaded? */
+	if (!metadata_json && _fil_load_metadata_json() < 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (!(dir = _fil_md_lookup(dirpath, OS_FILE_TYPE_DIR))) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: directory %s does not exist\n", dirpath);
+		return -1;
+	}
+	for (node = dir->children; node; node = node->sibling_next) {
+		if (_fil_md_is_visible(node)) {
+			pthread_mutex_unlock(&fil_catalog_mutex);
+			fprintf(stderr, "Error: directory %s is not empty\n", dirpath);
+			return -1;
+		}
+	}
+	ret = _fil_rm_file_metadata(dirpath, OS_FILE_TYPE_DIR);
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	return ret;
+}
+
+/*
+	List a directory, callback is called with the name and type of
+	each entry, in no particular order, until it returns non zero.
+	An empty or NULL path is the top directory.  The catalog is locked
+	during the listing, the callback can read it but must not add or
+	remove entries of the directory.
+	return the number of entries listed if successfull, -1 if error
+*/
+int fil_readdir(
+	const char*		dirpath,	/* directory path like sbtest */
+	fil_readdir_cb_t	callback,	/* called for each entry */
+	void*			arg	/* passed to callback */
+	)
+{
+	struct fil_md_node *dir, *node;
+	int n_entries = 0;
+
+	if (!callback) {
+		fprintf(stderr, "Error: uninitialized readdir callback can't be null\n");
+		return -1;
+	}
+
+	/* is the metadata json loaded? */
+	if (!metadata_json && _fil_load_metadata_json() < 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (!dirpath || !*dirpath) {
+		dir = &fil_md_root;
+	} else if (!(dir = _fil_md_find(dirpath, strlen(dirpath), OS_FILE_TYPE_DIR)) || !_fil_md_is_visible(dir)) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: directory %s does not exist\n", dirpath);
+		return -1;
+	}
+	for (node = dir->children; node; node = node->sibling_next) {
+		const char* name;
+
+		if (!_fil_md_is_visible(node)) {
+			continue;
+		}
+		name = strrchr(node->path, '/');
+		n_entries++;
+		if (callback(arg, name ? name + 1 : node->path, node->type)) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	return n_entries;
+}
+
+/*
+        (pseudoPrivate) Return the prefix of the object names of a file,
+        the caller must free the string.  Files have an id the objects
+        are named after, so renaming a file doesn't move its objects.
+        Files created before the ids keep the objects named after their
+        path, which is saved as their prefix when they are renamed.
+        return the prefix if successfull, NULL if error
+*/
+char* _fil_get_object_prefix(
+	json_t *jfile   /* json file element */
+	)
+{
+	json_t *jprefix, *jid, *jpath;
+	char *prefix = NULL;
+
+	jprefix = json_object_get(jfile,"prefix");
+	jid = json_object_get(jfile,"id");
+	jpath = json_object_get(jfile,"path");
+	if (json_is_string(jprefix)) {
+		prefix = strdup(json_string_value(jprefix));
+	} else if (json_is_integer(jid)) {
+		if (asprintf(&prefix,"ino.%llu",(unsigned long long) json_integer_value(jid)) < 0) {
+			prefix = NULL;
+		}
+	} else if (json_is_string(jpath)) {
+		prefix = strdup(json_string_value(jpath));
+	} else {
+		fprintf(stderr, "error: invalid metadata element, no path\n");
+		return NULL;
+	}
+	if (!prefix) {
+		fprintf(stderr, "Error: unable to allocate memory for an object name prefix\n");
+	}
+	return prefix;
+}
+
+/*
+	Rename a file, only its catalog entry changes, the objects keep
+	their names.  The file must not be opened and the new path must
+	not exist.
+	return 0 if successfull, -1 if error
+*/
+int fil_rename(
+	char* oldpath,   /* current path of the file */
+	char* newpath,   /* new path of the file */
+	os_file_type_t type /* file object type, seen enum def */
+	)
+{
+	struct fil_md_node *node, *dir;
+	json_t *jfile;
+	char *path;
+
+	if (!oldpath || !newpath || !*newpath) {
+		fprintf(stderr, "Error: uninitialized file path can't be null\n");
+		return -1;
+	}
+	if (type != OS_FILE_TYPE_FILE) {
+		fprintf(stderr, "Error: only files can be renamed, %s is not a file\n", oldpath);
+		return -1;
+	}
+
+	/* a deleted file not purged yet still holds the new path */
+	if (_fil_find_in_metadata(newpath,type) == -2) {
+		fil_purge_wait();
+		fil_purge_deleted();
+	}
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (!(node = _fil_md_lookup(oldpath,type)) || node->deleted) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: file %s does not exist\n", oldpath);
+		return -1;
+	}
+	if (node->n_ref) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: file %s is opened, it can't be renamed\n", oldpath);
+		return -1;
+	}
+	if (_fil_md_lookup(newpath,type) || _fil_md_lookup(newpath,OS_FILE_TYPE_DIR)) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: %s already exists\n", newpath);
+		return -1;
+	}
+	if (!(dir = _fil_md_get_dir(newpath))) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		return -1;
+	}
+	jfile = json_array_get(metadata_json,node->index);
+
+	/* objects of the files without id are named after the old path */
+	if (!json_is_integer(json_object_get(jfile,"id"))
+			&& !json_is_string(json_object_get(jfile,"prefix"))
+			&& json_object_set_new(jfile,"prefix",json_string(oldpath)) < 0) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "error: unable to set the prefix of file %s\n", oldpath);
+		return -1;
+	}
+	if (!(path = strdup(newpath))
+			|| json_object_set_new(jfile,"path",json_string(newpath)) < 0) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		free(path);
+		fprintf(stderr, "error: unable to set the path of file %s\n", oldpath);
+		return -1;
+	}
+
+	/* move the node, the new directory was found before the node left
+	   the old one so an implicit directory holding both isn't freed */
+	_fil_md_hash_remove(node);
+	free(node->path);
+	node->path = path;
+	_fil_md_hash_add(node);
+	if (dir != node->parent) {
+		_fil_md_unlink(node);
+		_fil_md_link(node, dir);
+	}
+	_fil_md_changed(oldpath,type);
+	_fil_md_changed(newpath,type);
+
+	/* update in ceph */
+	int ret = _fil_update_metadata_json();
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*      
+        (pseudoPrivate) Return the block size of the file json 
+        return the block_size if successfull (> 0), -1 if error 
+*/
+int _fil_get_block_size(
+	json_t *jfile   /* json file element */
+	) 
+{
+    json_t *j_block_size;
+
+    if (!json_is_object(jfile)) { 
+        return -1;
+    }
+
+    j_block_size = json_object_get(jfile,"block_size");
+    if(!json_is_integer(j_block_size)) {
+        fprintf(stderr, "error: block_size element returned is not an integer\n");
+        return -1;
+    }
+    return (unsigned int) json_integer_value(j_block_size);
+}
+
+/*      
+        (pseudoPrivate) Return the number of reference of the file json,
+        the references are the handles opened by this process
+        Returns: number of reference if successfull (>= 0), -1 if error 
+*/
+int _fil_get_n_ref(
+	json_t *jfile   /* json file element */
+	) 
+{
+    json_t *jpath, *jtype;
+    struct fil_md_node *node;
+    int n_ref;
+
+    if (!json_is_object(jfile)) { 
+        return -1;
+    }
+
+    jpath = json_object_get(jfile,"path");
+    jtype = json_object_get(jfile,"type");
+    if (!json_is_string(jpath) || !json_is_integer(jtype)) {
+        fprintf(stderr, "error: path or type element of a file is invalid\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&fil_catalog_mutex);
+    node = _fil_md_lookup(json_string_value(jpath),(os_file_type_t) json_integer_value(jtype));
+    n_ref = node ? (int) node->n_ref : -1;
+    pthread_mutex_unlock(&fil_catalog_mutex);
+
+    return n_ref;
+}
+
+
+/*      
+        (pseudoPrivate) Change the number of reference of a file
+        return 0 if successfull, -1 if error 
+*/
+int _fil_set_n_ref(
+	char* filepath,   /* file path like sbtest/sbtest.ibd */
+	os_file_type_t type,
+    int delta  /* typically 1 or -1 */
+	) 
+{
+    struct fil_md_node *node;
+
+    pthread_mutex_lock(&fil_catalog_mutex);
+    if (!(node = _fil_md_lookup(filepath,type))) {
+        pthread_mutex_unlock(&fil_catalog_mutex);
+        fprintf(stderr, "Error: file %s is not in the metadata\n", filepath);
+        return -1;
+    }
+
+    /* a file being deleted can't be opened, see _fil_delete_begin */
+    if (delta > 0 && node->deleted) {
+        pthread_mutex_unlock(&fil_catalog_mutex);
+        fprintf(stderr, "Error: file %s is deleted\n", filepath);
+        return -1;
+    }
+
+    /* sanity check */
+    if (delta < 0 && node->n_ref < (unsigned int) -delta) {
+        node->n_ref = 0;
+    } else {
+        node->n_ref += delta;
+    }
+    pthread_mutex_unlock(&fil_catalog_mutex);
+
+    /* 
+     * We don't need to update metadata on disk, n_ref is only
+     * meaningful for this process
+     */
+    return 0;
+}
+
+/*      
+        (pseudoPrivate) Increment the number of reference of a file
+        return 0 if successfull, -1 if error 
+*/
+int _fil_increment_n_ref(
+	char* filepath,   /* file path like sbtest/sbtest.ibd */
+	os_file_type_t type
+	) 
+{
+    return _fil_set_n_ref(filepath,type,1);
+}
+
+/*      
+        (pseudoPrivate) Decrement the number of reference of a file
+        return 0 if successfull, -1 if error 
+*/
+int _fil_decrement_n_ref(
+	char* filepath,   /* file path like sbtest/sbtest.ibd */
+	os_file_type_t type
+	) 
+{
+    return _fil_set_n_ref(filepath,type,-1);
+}
+
+
+/*
+ *     (pseudoPrivate) Return if the file is delete or not in the metadata 
+        Returns: 0 if not deleted, 1 if deleted and -1 on error
+*/
+unsigned int _fil_is_deleted(
+	json_t *file   /* json file element */
+	) 
+{
+    json_t *j_deleted;
+
+    if (!json_is_object(file)) { 
+        return -1;
+    }
+
+    j_deleted = json_object_get(file,"deleted");
+    if(!json_is_integer(j_deleted)) {
+        fprintf(stderr, "error: deleted element returned is not an integer\n");
+        return -1;
+    }
+    return (unsigned int) json_integer_value(j_deleted);
+}
+
+/*      
+        (pseudoPrivate) Update the size of a file after a write
+        return 0 if successfull, -1 if error 
+*/
+int _fil_update_size(
+	char* filepath,   /* file path like sbtest/sbtest.ibd */
+	os_file_type_t type, /* file object type, seen enum def */
+	size_t new_size /* new file size */
+	) 
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	struct fil_md_node *node = _fil_md_lookup(filepath,type);
+	json_t *file = node ? json_array_get(metadata_json,node->index) : NULL;
+	if (!file) {
+		fprintf(stderr, "Error extracting the file object from the metadata\n");
+	} else if (json_object_set_new(file,"size",json_integer(new_size)) < 0) {
+		fprintf(stderr, "Error updating the size of file object\n");
+	} else {
+		_fil_md_changed(filepath,type);
+		ret = _fil_update_metadata_json();
+	}
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*      
+        (pseudoPrivate) Set the deleted flag of a file in the metadata
+        return 0 if successfull, -1 if error 
+*/
+int _fil_set_deleted(
+	char* filepath,   /* file path like sbtest/sbtest.ibd */
+	os_file_type_t type
+	) 
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	struct fil_md_node *node = _fil_md_lookup(filepath,type);
+	json_t *file = node ? json_array_get(metadata_json,node->index) : NULL;
+	if (!file) {
+		fprintf(stderr, "Error extracting the file object from the metadata\n");
+	} else if (json_object_set_new(file,"deleted",json_integer(1)) < 0) {
+		fprintf(stderr, "Error setting deleted in the file object\n");
+	} else {
+		node->deleted = 1;
+		_fil_md_changed(filepath,type);
+		ret = _fil_update_metadata_json();
+	}
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+        (pseudoPrivate) Start the deletion of a file under the catalog
+        mutex.  A file opened by handles is flagged deleted in the catalog,
+        the close of its last handle deletes it.  Otherwise the entry is
+        flagged deleted in memory, so it can't be opened any more, and the
+        pool, the prefix of the object names and the block size are copied
+        out for the removal of the objects, see fil_delete_file
+        return 1 if the objects are to be removed, 0 if there is nothing
+        more to do, -1 if error
+*/
+int _fil_delete_begin(
+	char* filepath,   /* file path like sbtest/sbtest.ibd */
+	os_file_type_t type, /* file object type, seen enum def */
+	int* pool,	/* data pool of the file, see _fil_get_pool */
+	char** prefix,	/* prefix of the object names, to free */
+	int* block_size	/* block size of the file */
+	)
+{
+	struct fil_md_node *node;
+	json_t *file;
+	int ret = -1;
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (!(node = _fil_md_lookup(filepath,type))
+			|| !(file = json_array_get(metadata_json,node->index))) {
+		fprintf(stderr, "Error: file %s does not exist\n", filepath);
+	} else if (type != OS_FILE_TYPE_FILE) {
+		ret = 0;
+	} else if (node->n_ref) {
+		ret = _fil_set_deleted(filepath, type);
+	} else if ((*pool = _fil_get_pool(file)) >= 0
+			&& (*block_size = _fil_get_block_size(file)) > 0
+			&& (*prefix = _fil_get_object_prefix(file))) {
+		/* left to fil_purge_deleted if the removal fails */
+		node->deleted = 1;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	return ret;
+}
+
+/*      
+        Delete a file in rados, the removals are scheduled in the
+        FIL_IO_PURGE class
+        return 0 if successfull, -1 if error 
+*/
+int _fil_delete_rados_objects(
+    unsigned int pool,   /* data pool of the file, see _fil_get_pool */
+    const char* prefix,  /* prefix of the object names of the file */
+    const unsigned int block_size 
+    ) 
+{
+    
+    /* TODO, verify it is ok to remore */
+        
+    size_t pos = 0;
+    size_t eof_block = 0;
+    char* obj_name;
+    rados_ioctx_t io = fil_pools[pool].ioctxs[_fil_shard_of(prefix)];
+    fil_io_class_t prev = fil_set_io_class(FIL_IO_PURGE);
+
+    while (1) {
+        if (asprintf(&obj_name,"%s_%zu",prefix,pos) < 0) {
+            fprintf(stderr, "Error: unable to allocate memory for an object name\n");
+            fil_set_io_class(prev);
+            return -1;
+        }
+        /* the objects up to the recorded end of file are all removed,
+           holes included, see _fil_record_eof */
+        if (pos == 0 && _fil_get_eof_block(io, obj_name, &eof_block) < 0) {
+            free(obj_name);
+            fil_set_io_class(prev);
+            return -1;
+        }
+        if (!_fil_rados_remove_object(io, obj_name) || pos < eof_block) {
+            if (DEBUG) {
+                fprintf(stderr, "DEBUG: rados_remove object %s\n", obj_name);
+            }
+        } else {
+            if (DEBUG) {
+                fprintf(stderr, "DEBUG: done removing objects from rados\n");
+            }
+            free(obj_name);
+            break;
+        }
+        /* increasing the position by the block_size */
+        pos += block_size;
+        free(obj_name);
+    }
+    fil_set_io_class(prev);
+    return 0;
+}
+
+/*
+ * Deferred cleanup of the deleted files
+ *
+ * Files deleted while still opened are only flagged in the metadata.  If
+ * the process died before closing them, their objects are left behind.
+ * Loading the metadata only queues these files, a background thread
+ * removes their objects and entries so the catalog is usable right away.
+ */
+static pthread_mutex_t	fil_purge_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	fil_purge_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int	fil_purge_running = 0;
+
+/*
+        Remove the objects and the entries of the deleted files not
+        opened by this process
+        return the number of files purged if successfull, -1 if error
+*/
+int fil_purge_deleted()
+{
+	struct fil_purge_item {
+		char*		path;
+		char*		prefix;
+		os_file_type_t	type;
+		unsigned int	block_size;
+		int		pool;
+	} *items = NULL;
+	size_t n_items = 0;
+	size_t i;
+	int n_purged = 0;
+
+	/* collect the deleted files */
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (fil_md_n_nodes && !(items = calloc(fil_md_n_nodes, sizeof(struct fil_purge_item)))) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: unable to allocate memory to purge deleted files\n");
+		return -1;
+	}
+	for (i = 0; i < fil_md_n_nodes; i++) {
+		struct fil_md_node* node = fil_md_nodes[i];
+		if (node->deleted && !node->n_ref) {
+			json_t *file = json_array_get(metadata_json,i);
+			items[n_items].path = strdup(node->path);
+			items[n_items].prefix = _fil_get_object_prefix(file);
+			items[n_items].type = node->type;
+			items[n_items].block_size = _fil_get_block_size(file);
+			items[n_items].pool = _fil_get_pool(file);
+			if (items[n_items].path && items[n_items].prefix && items[n_items].pool >= 0) {
+				n_items++;
+			} else {
+				free(items[n_items].path);
+				free(items[n_items].prefix);
+			}
+		}
+	}
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	/* the objects are removed without holding the catalog */
+	for (i = 0; i < n_items; i++) {
+		if (items[i].type == OS_FILE_TYPE_FILE && (int) items[i].block_size > 0) {
+			_fil_delete_rados_objects(items[i].pool, items[i].prefix, items[i].block_size);
+		}
+	}
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	for (i = 0; i < n_items; i++) {
+		struct fil_md_node* node = _fil_md_lookup(items[i].path, items[i].type);
+		if (node && node->deleted && !node->n_ref && _fil_md_remove(node) == 0) {
+			_fil_md_changed(items[i].path, items[i].type);
+			n_purged++;
+		}
+		free(items[i].path);
+		free(items[i].prefix);
+	}
+	if (n_purged && _fil_update_metadata_json() < 0) {
+		n_purged = -1;
+	}
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	free(items);
+	return n_purged;
+}
+
+/* Wait until the background purge, if any, is done */
+void fil_purge_wait()
+{
+	pthread_mutex_lock(&fil_purge_mutex);
+	while (fil_purge_running) {
+		pthread_cond_wait(&fil_purge_cond, &fil_purge_mutex);
+	}
+	pthread_mutex_unlock(&fil_purge_mutex);
+}
+
+static void* _fil_purge_thread(void* arg)
+{
+	(void) arg;
+	fil_purge_deleted();
+
+	pthread_mutex_lock(&fil_purge_mutex);
+	fil_purge_running = 0;
+	pthread_cond_broadcast(&fil_purge_cond);
+	pthread_mutex_unlock(&fil_purge_mutex);
+	return NULL;
+}
+
+/* Start the background purge of the deleted files */
+static void _fil_purge_start()
+{
+	pthread_t thread;
+
+	pthread_mutex_lock(&fil_purge_mutex);
+	if (!fil_purge_running) {
+		fil_purge_running = 1;
+		if (pthread_create(&thread, NULL, _fil_purge_thread, NULL)) {
+			fil_purge_running = 0;
+		} else {
+			pthread_detach(thread);
+		}
+	}
+	pthread_mutex_unlock(&fil_purge_mutex);
+}
+
+/*
+ * Migration between pools
+ *
+ * The block objects of a file are copied to the new pool by parallel
+ * workers, each taking the next object until one is missing past the end
+ * of the file, with their size attribute.  The catalog is switched to the
+ * new pool once all the objects are copied, then the objects are removed
+ * from the old pool, so a failed migration leaves the file in its old
+ * pool.  The blocks written to the new pool are tracked, a failed
+ * migration removes them: the end of file is not recorded there when the
+ * first block was not copied.
+ */
+#ifndef FIL_MIGRATE_MAX_WORKERS
+#define FIL_MIGRATE_MAX_WORKERS 64
+#endif
+
+struct fil_migration {
+	FILErados_t*	fp;		/* file migrated */
+	unsigned int	dst;		/* index of the new pool in fil_pools */
+	size_t		next;		/* next block to copy */
+	size_t		last;		/* block holding the end of the file */
+	size_t		end;		/* first missing block past last, SIZE_MAX until found */
+	int		error;		/* 1 once a copy failed */
+	size_t*		copied;		/* blocks written to the new pool */
+	size_t		n_copied;
+	size_t		copied_size;	/* allocated entries of copied */
+	pthread_mutex_t	mutex;		/* protects next, end, error and copied */
+};
+
+/*
+        (pseudoPrivate) Track a block about to be written to the new pool
+        return 0 if successfull, -1 if error
+*/
+static int _fil_migrate_track(
+	struct fil_migration*	mig,		/* migration */
+	size_t			block		/* block number */
+	)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&mig->mutex);
+	if (mig->n_copied == mig->copied_size) {
+		size_t size = mig->copied_size ? 2*mig->copied_size : 64;
+		size_t *tmp = realloc(mig->copied, size*sizeof(size_t));
+		if (!tmp) {
+			fprintf(stderr, "Error: unable to allocate memory to migrate %s\n", mig->fp->metadata.name);
+			ret = -1;
+		} else {
+			mig->copied = tmp;
+			mig->copied_size = size;
+		}
+	}
+	if (ret == 0) {
+		mig->copied[mig->n_copied++] = block;
+	}
+	pthread_mutex_unlock(&mig->mutex);
+	return ret;
+}
+
+/*
+        (pseudoPrivate) Remove the blocks written to the new pool by a
+        failed migration
+        return 0 if successfull, -1 if error
+*/
+static int _fil_migrate_undo(
+	struct fil_migration*	mig		/* migration */
+	)
+{
+	FILErados_t* fp = mig->fp;
+	rados_ioctx_t dst = fil_pools[mig->dst].ioctxs[fp->shard];
+	fil_io_class_t prev = fil_set_io_class(FIL_IO_PURGE);
+	char *obj_name;
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < mig->n_copied; i++) {
+		if (!(obj_name = _fil_get_object_name(fp, mig->copied[i] * fp->metadata.block_size))) {
+			ret = -1;
+			continue;
+		}
+		if (_fil_rados_remove_object(dst, obj_name) < 0) {
+			ret = -1;
+		}
+		free(obj_name);
+	}
+	fil_set_io_class(prev);
+	return ret;
+}
+
+/*
+        (pseudoPrivate) Copy one block object to the new pool
+        return 1 if copied, 0 if the object is missing, -1 if error
+*/
+static int _fil_migrate_block(
+	struct fil_migration*	mig,		/* migration */
+	size_t			block,		/* block number */
+	char**			buf,		/* copy buffer, grown as needed */
+	size_t*			buf_len		/* size of the copy buffer */
+	)
+{
+	FILErados_t* fp = mig->fp;
+	rados_ioctx_t src = fil_pools[fp->pool].ioctxs[fp->shard];
+	rados_ioctx_t dst = fil_pools[mig->dst].ioctxs[fp->shard];
+	char size_str[24];
+	char *obj_name;
+	uint64_t obj_size;
+	time_t obj_mtime;
+	size_t file_size = 0;
+	ssize_t len;
+	int ret;
+
+	if (!(obj_name = _fil_get_object_name(fp, block * fp->metadata.block_size))) {
+		return -1;
+	}
+	if ((ret = rados_stat(src, obj_name, &obj_size, &obj_mtime)) < 0) {
+		if (ret != -ENOENT) {
+			fprintf(stderr, "Error %d: Could not stat %s\n%s\n", -ret, obj_name, strerror(-ret));
+		}
+		free(obj_name);
+		return ret == -ENOENT ? 0 : -1;
+	}
+	if (obj_size > *buf_len) {
+		char *tmp = realloc(*buf, obj_size);
+		if (!tmp) {
+			fprintf(stderr, "Error: unable to allocate memory to copy %s\n", obj_name);
+			free(obj_name);
+			return -1;
+		}
+		*buf = tmp;
+		*buf_len = obj_size;
+	}
+
+	len = obj_size ? _fil_rados_read_object(src, obj_name, *buf, obj_size, 0) : 0;
+	if (len < 0) {
+		free(obj_name);
+		return -1;
+	}
+	ret = rados_getxattr(src, obj_name, FIL_SIZE_XATTR, size_str, sizeof(size_str) - 1);
+	if (ret >= 0) {
+		size_str[ret] = '\0';
+		file_size = strtoull(size_str, NULL, 10);
+	} else if (ret != -ENODATA) {
+		fprintf(stderr, "Error %d: Could not get the size of %s\n%s\n", -ret, obj_name, strerror(-ret));
+		free(obj_name);
+		return -1;
+	}
+
+	if (_fil_migrate_track(mig, block) < 0) {
+		free(obj_name);
+		return -1;
+	}
+	ret = _fil_rados_write_full_object(dst, obj_name, *buf, len, file_size) < 0 ? -1 : 1;
+	if (ret > 0 && block == 0) {
+		/* see _fil_record_eof */
+		size_t eof_block;
+		char eof_str[24];
+
+		if (_fil_get_eof_block(src, obj_name, &eof_block) < 0) {
+			ret = -1;
+		} else if (eof_block) {
+			snprintf(eof_str, sizeof(eof_str), FIL_EOF_FORMAT, eof_block);
+			if ((ret = rados_setxattr(dst, obj_name, FIL_EOF_XATTR, eof_str, strlen(eof_str))) < 0) {
+				fprintf(stderr, "Error %d: Could not record the end of file on %s\n%s\n", -ret, obj_name, strerror(-ret));
+				ret = -1;
+			} else {
+				ret = 1;
+			}
+		}
+	}
+	free(obj_name);
+	return ret;
+}
+
+static void* _fil_migrate_worker(void* arg)
+{
+	struct fil_migration* mig = arg;
+	char *buf = NULL;
+	size_t buf_len = 0;
+	size_t block;
+	int ret;
+
+	fil_set_io_class(FIL_IO_IMPORT);
+	while (1) {
+		pthread_mutex_lock(&mig->mutex);
+		block = mig->next++;
+		if (mig->error || block >= mig->end) {
+			pthread_mutex_unlock(&mig->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&mig->mutex);
+
+		if ((ret = _fil_migrate_block(mig, block, &buf, &buf_len)) <= 0) {
+			pthread_mutex_lock(&mig->mutex);
+			if (ret < 0) {
+				mig->error = 1;
+			} else if (block > mig->last && block < mig->end) {
+				/* a missing block up to the end of file is a hole */
+				mig->end = block;
+			}
+			pthread_mutex_unlock(&mig->mutex);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+	Move the objects of a file to another pool with parallel copies, the
+	catalog then records the new pool.  The appends and the writes of
+	the handle are waited for, the handle must not be used by other
+	threads during the migration and the file must not be opened by
+	other handles.
+	return 0 if successfull, -1 if error
+*/
+int fil_migrate(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	pool_name,	/* new pool of the file */
+	unsigned int	parallelism	/* objects copied at once, 0 for 1 */
+	)
+{
+	pthread_t workers[FIL_MIGRATE_MAX_WORKERS];
+	struct fil_migration mig;
+	unsigned int n_workers, i;
+	unsigned int old;
+	json_t *file;
+	ssize_t size;
+	int dst;
+
+	if (!fp || !fp->metadata.name || !pool_name) {
+		fprintf(stderr, "Error: uninitialized file handle or pool name\n");
+		return -1;
+	}
+	if ((dst = _fil_pool_open(pool_name)) < 0) {
+		return -1;
+	}
+	if ((unsigned int) dst == fp->pool) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	file = _fil_get_json_metadata(fp->metadata.name,fp->metadata.type);
+	if (!file || _fil_get_n_ref(file) != 1) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		if (file) {
+			fprintf(stderr, "Error: file %s can't be migrated, it is opened by other handles\n", fp->metadata.name);
+		}
+		return -1;
+	}
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	if (fil_fsync(fp) < 0 || (size = fil_get_size(fp)) < 0) {
+		return -1;
+	}
+
+	mig.fp = fp;
+	mig.dst = dst;
+	mig.next = 0;
+	mig.last = size ? (size - 1)/fp->metadata.block_size : 0;
+	mig.end = SIZE_MAX;
+	mig.error = 0;
+	mig.copied = NULL;
+	mig.n_copied = 0;
+	mig.copied_size = 0;
+	pthread_mutex_init(&mig.mutex, NULL);
+
+	/* the calling thread is one of the workers */
+	n_workers = parallelism > FIL_MIGRATE_MAX_WORKERS ? FIL_MIGRATE_MAX_WORKERS : parallelism;
+	for (i = 1; i < n_workers; i++) {
+		if (pthread_create(&workers[i], NULL, _fil_migrate_worker, &mig)) {
+			break;
+		}
+	}
+	n_workers = i;
+	_fil_migrate_worker(&mig);
+	for (i = 1; i < n_workers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_mutex_destroy(&mig.mutex);
+
+	if (!mig.error) {
+		json_t *prev;
+
+		pthread_mutex_lock(&fil_catalog_mutex);
+		file = _fil_get_json_metadata(fp->metadata.name,fp->metadata.type);
+		prev = file ? json_incref(json_object_get(file,"pool")) : NULL;
+		if (!file || json_object_set_new(file,"pool",json_string(pool_name)) < 0) {
+			fprintf(stderr, "Error setting pool in the file object\n");
+			mig.error = 1;
+		} else {
+			_fil_md_changed(fp->metadata.name,fp->metadata.type);
+			if (_fil_update_metadata_json() < 0) {
+				/* back to the old pool */
+				if (prev) {
+					json_object_set(file,"pool",prev);
+				} else {
+					json_object_del(file,"pool");
+				}
+				mig.error = 1;
+			}
+		}
+		json_decref(prev);
+		pthread_mutex_unlock(&fil_catalog_mutex);
+	}
+	if (mig.error) {
+		/* the file stays in its old pool */
+		if (_fil_migrate_undo(&mig) < 0) {
+			fprintf(stderr, "Warning: objects of %s left in pool %s\n", fp->metadata.name, fil_pools[dst].name);
+		}
+		free(mig.copied);
+		return -1;
+	}
+	free(mig.copied);
+
+	old = fp->pool;
+	fp->pool = dst;
+	fp->ec_align = _fil_ec_align_of(fp);
+	if (_fil_delete_rados_objects(old, fp->metadata.prefix, fp->metadata.block_size) < 0) {
+		fprintf(stderr, "Warning: objects of %s left in pool %s\n", fp->metadata.name, fil_pools[old].name);
+	}
+	return 0;
+}
+
+/*
+ * Local metadata snapshot
+ *
+ * When a cache path is configured, the catalog last loaded or written
+ * is kept in a local file with the version, size and mtime of the
+ * metadata object it came from.  At startup, only the stat of the
+ * metadata object is fetched, if it matches the snapshot the catalog
+ * is parsed from the mapped file and the metadata object is not read.
+ * The snapshot is replaced with a rename so a crash leaves either the
+ * old or the new one, a snapshot that does not validate is ignored.
+ */
+#define FIL_MD_SNAPSHOT_MAGIC "FILMDSN1"
+
+struct fil_md_snapshot_header {
+	char		magic[8];	/* FIL_MD_SNAPSHOT_MAGIC */
+	uint64_t	version;	/* version of the metadata object */
+	uint64_t	size;		/* size of the metadata object */
+	int64_t		mtime;		/* mtime of the metadata object */
+	uint64_t	json_len;	/* length of the json text that follows */
+};
+
+/*
+	Set the path of the local metadata snapshot, NULL disables it.
+	Must be called before the catalog is first loaded.
+	return 0 if successfull, -1 if error
+*/
+int fil_metadata_cache_configure(
+	const char*	cache_path	/* local snapshot file, NULL to disable */
+	)
+{
+	char *path = NULL;
+
+	if (cache_path && !(path = strdup(cache_path))) {
+		fprintf(stderr, "Error: unable to allocate memory for the metadata cache path\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	free(fil_md_cache_path);
+	fil_md_cache_path = path;
+	pthread_mutex_unlock(&fil_catalog_mutex);
+	return 0;
+}
+
+/*
+	(pseudoPrivate) Write the local snapshot of the catalog, the json
+	is the content of the metadata object at the given version
+	return 0 if successfull, -1 if error
+*/
+int _fil_save_metadata_snapshot(
+	const char*	json,	/* json text of the catalog */
+	size_t		json_len,	/* length of the json text */
+	uint64_t	version,	/* version of the metadata object */
+	time_t		mtime	/* mtime of the metadata object */
+	)
+{
+	struct fil_md_snapshot_header header;
+	char *tmp_path;
+	FILE *f;
+	int ok;
+
+	if (!fil_md_cache_path) {
+		return 0;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FIL_MD_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = version;
+	header.size = json_len;
+	header.mtime = (int64_t) mtime;
+	header.json_len = json_len;
+
+	if (asprintf(&tmp_path, "%s.tmp.%ld", fil_md_cache_path, (long) getpid()) < 0) {
+		fprintf(stderr, "Error: unable to allocate memory for the metadata snapshot path\n");
+		return -1;
+	}
+	if (!(f = fopen(tmp_path, "wb"))) {
+		fprintf(stderr, "Error %d: cannot create the metadata snapshot %s\n%s\n", errno, tmp_path, strerror(errno));
+		free(tmp_path);
+		return -1;
+	}
+	ok = fwrite(&header, sizeof(header), 1, f) == 1
+		&& (json_len == 0 || fwrite(json, json_len, 1, f) == 1);
+	ok = (fclose(f) == 0) && ok;
+	if (!ok || rename(tmp_path, fil_md_cache_path) < 0) {
+		fprintf(stderr, "Error %d: cannot write the metadata snapshot %s\n%s\n", errno, fil_md_cache_path, strerror(errno));
+		unlink(tmp_path);
+		free(tmp_path);
+		return -1;
+	}
+	free(tmp_path);
+	return 0;
+}
+
+/*
+	(pseudoPrivate) Load the catalog from the local snapshot if it is
+	still current, only the stat of the metadata object is fetched
+	return 0 if loaded, 1 if the snapshot is missing or stale, -1 if error
+*/
+static int _fil_load_metadata_snapshot(
+	uint64_t* metadata_size_out /* size of the metadata object */
+	)
+{
+	struct fil_md_snapshot_header *header;
+	struct stat st;
+	rados_read_op_t	read_op;
+	rados_completion_t completion;
+	uint64_t	metadata_size = 0;
+	uint64_t	version;
+	time_t		metadata_mtime = 0;
+	int		stat_rval = 0;
+	int		fd, ret;
+	void		*map;
+
+	if ((fd = open(fil_md_cache_path, O_RDONLY)) < 0) {
+		return 1;
+	}
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*header)) {
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return 1;
+	}
+	header = (struct fil_md_snapshot_header *) map;
+	if (memcmp(header->magic, FIL_MD_SNAPSHOT_MAGIC, sizeof(header->magic))
+			|| header->json_len != (uint64_t) st.st_size - sizeof(*header)) {
+		munmap(map, st.st_size);
+		return 1;
+	}
+
+	/* the version is taken from the completion, the one of the io
+	   context can be changed by other threads */
+	if (!(read_op = rados_create_read_op())) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	if (rados_aio_create_completion(NULL, NULL, NULL, &completion) < 0) {
+		rados_release_read_op(read_op);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	rados_read_op_stat(read_op, &metadata_size, &metadata_mtime, &stat_rval);
+	ret = rados_aio_read_op_operate(read_op, rados_io_context, completion, METADATA_OBJECT_NAME, 0);
+	if (ret == 0) {
+		rados_aio_wait_for_complete(completion);
+		ret = rados_aio_get_return_value(completion);
+	}
+	version = rados_aio_get_version(completion);
+	rados_aio_release(completion);
+	rados_release_read_op(read_op);
+
+	if (ret < 0 || stat_rval < 0 || version != header->version
+			|| metadata_size != header->size
+			|| (int64_t) metadata_mtime != header->mtime) {
+		/* missing, changed by another process or error, read it */
+		munmap(map, st.st_size);
+		return 1;
+	}
+
+	metadata_json = json_loadb((char *) map + sizeof(*header), header->json_len, 0, &error_json);
+	munmap(map, st.st_size);
+	if (!metadata_json || !json_is_array(metadata_json)) {
+		json_decref(metadata_json);
+		metadata_json = NULL;
+		return 1;
+	}
+	fil_md_version = version;
+	*metadata_size_out = metadata_size;
+	return 0;
+}
+
+static int _fil_read_metadata_json(uint64_t* metadata_size_out);
+static int _fil_index_metadata_json(unsigned int* n_deleted);
+
+/* 	
+	(pseudoPrivate) Load the metadata in memory, the files deleted but
+	left behind are purged in the background
+	return 0 successful, -1 if error 
+*/
+int _fil_load_metadata_json() 
+{
+	int ret;
+	uint64_t metadata_size = 0;
+	unsigned int n_deleted = 0;
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+
+	/* Is it already loaded */
+	if (metadata_json) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		return 0;
+	}
+
+	FIL_PROBE1(metadata_load_entry, METADATA_OBJECT_NAME);
+	ret = _fil_read_metadata_json(&metadata_size);
+	if (ret == 0 && (ret = _fil_index_metadata_json(&n_deleted)) < 0) {
+		json_decref(metadata_json);
+		metadata_json = NULL;
+	}
+	FIL_PROBE3(metadata_load_return, METADATA_OBJECT_NAME, metadata_size, ret);
+
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	if (ret == 0 && n_deleted) {
+		_fil_purge_start();
+	}
+	return ret;
+}
+
+/*
+	(pseudoPrivate) Load the catalog from its json text, as if read
+	from the metadata object at version, to use the catalog without a
+	cluster, see fil_metadata_watch_loopback.  A catalog already
+	loaded is replaced, no file must be open.
+	return 0 successful, -1 if error
+*/
+int _fil_load_metadata_text(
+	const char*	json,	/* json text of the catalog */
+	size_t		json_len,	/* length of the json text */
+	uint64_t	version	/* version of the metadata object */
+	)
+{
+	json_t		*catalog, *old;
+	uint64_t	old_version;
+	unsigned int	n_deleted = 0;
+
+	if (!(catalog = json_loadb(json, json_len, 0, &error_json)) || !json_is_array(catalog)) {
+		fprintf(stderr, "Error: the catalog text is not a json array\n");
+		json_decref(catalog);
+		return -1;
+	}
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	old = metadata_json;
+	old_version = fil_md_version;
+	metadata_json = catalog;
+	fil_md_version = version;
+	if (_fil_index_metadata_json(&n_deleted) < 0) {
+		/* keep what we had */
+		metadata_json = old;
+		fil_md_version = old_version;
+		if (old) {
+			_fil_index_metadata_json(&n_deleted);
+		}
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		json_decref(catalog);
+		return -1;
+	}
+	pthread_mutex_unlock(&fil_catalog_mutex);
+	json_decref(old);
+	return 0;
+}
+
+/*
+	(pseudoPrivate) Read and parse the metadata object, called by
+	_fil_load_metadata_json, metadata_size is set to the object size.
+	The stat and the first FIL_METADATA_READ_HINT bytes are read by a
+	single operation, a larger object needs a second read.  A missing
+	object is an empty catalog.
+	return 0 successful, -1 if error
+*/
+static int _fil_read_metadata_json(
+	uint64_t* metadata_size_out /* size of the metadata object */
+	)
+{
+	rados_read_op_t	read_op;
+	uint64_t	metadata_size = 0;
+	time_t		metadata_mtime;
+	size_t		bytes_read = 0;
+	size_t		buf_len = FIL_METADATA_READ_HINT;
+	int		stat_rval = 0, read_rval = 0;
+	int		ret;
+	uint64_t	version;
+	rados_completion_t completion;
+	char		*bufmetadata;
+
+	if (!rados_io_context) {
+		fprintf(stderr, "Error: not connected to a cluster, see fil_rados_init\n");
+		return -1;
+	}
+
+	if (fil_md_cache_path && (ret = _fil_load_metadata_snapshot(metadata_size_out)) <= 0) {
+		return ret;
+	}
+
+	if (!(bufmetadata = (char *) _fil_buf_alloc(buf_len))) {
+		fprintf(stderr, "Error allocating memory for Metadata buffer\n");
+		return -1;
+	}
+
+	if (!(read_op = rados_create_read_op())) {
+		fprintf(stderr, "Error creating the metadata read operation\n");
+		_fil_buf_free(bufmetadata, buf_len);
+		return -1;
+	}
+	if (rados_aio_create_completion(NULL, NULL, NULL, &completion) < 0) {
+		fprintf(stderr, "Error creating the metadata read completion\n");
+		rados_release_read_op(read_op);
+		_fil_buf_free(bufmetadata, buf_len);
+		return -1;
+	}
+	rados_read_op_stat(read_op, &metadata_size, &metadata_mtime, &stat_rval);
+	rados_read_op_read(read_op, 0, buf_len, bufmetadata, &bytes_read, &read_rval);
+	ret = rados_aio_read_op_operate(read_op, rados_io_context, completion, METADATA_OBJECT_NAME, 0);
+	if (ret == 0) {
+		rados_aio_wait_for_complete(completion);
+		ret = rados_aio_get_return_value(completion);
+	}
+	version = rados_aio_get_version(completion);
+	rados_aio_release(completion);
+	rados_release_read_op(read_op);
+
+	if (ret == -ENOENT) {
+		/* first use of the pool */
+		_fil_buf_free(bufmetadata, buf_len);
+		*metadata_size_out = 0;
+		fil_md_version = 0;
+		metadata_json = json_array();
+		return metadata_json ? 0 : -1;
+	}
+	if (ret < 0 || stat_rval < 0 || read_rval < 0) {
+		fprintf(stderr, "Error reading metadata from rados\n");
+		_fil_buf_free(bufmetadata, buf_len);
+		return -1;
+	}
+	*metadata_size_out = metadata_size;
+
+	if (metadata_size > bytes_read) {
+		/* larger than the hint, read the rest */
+		char *buf;
+
+		if (!(buf = (char *) _fil_buf_alloc(metadata_size))) {
+			fprintf(stderr, "Error allocating memory for Metadata buffer\n");
+			_fil_buf_free(bufmetadata, buf_len);
+			return -1;
+		}
+		memcpy(buf, bufmetadata, bytes_read);
+		_fil_buf_free(bufmetadata, buf_len);
+		bufmetadata = buf;
+		buf_len = metadata_size;
+
+		if ((ret = rados_read(rados_io_context, METADATA_OBJECT_NAME, bufmetadata + bytes_read,
+				metadata_size - bytes_read, bytes_read)) < 0) {
+			fprintf(stderr, "Error reading metadata from rados\n");
+			_fil_buf_free(bufmetadata, buf_len);
+			return -1;
+		}
+		bytes_read += ret;
+	}
+
+	if (fil_md_cache_path && bytes_read == metadata_size) {
+		/* a failure only costs a download at the next start */
+		_fil_save_metadata_snapshot(bufmetadata, bytes_read, version, metadata_mtime);
+	}
+
+	/* parse in json, the buffer is not null terminated */
+	fil_md_version = version;
+	metadata_json = json_loadb(bufmetadata, bytes_read, 0, &error_json);
+	if(!metadata_json) {
+        fprintf(stderr, "Error loading json on line %d: %s\n", error_json.line, error_json.text);
+		_fil_buf_free(bufmetadata, buf_len);
+        return -1;
+	}
+	
+	/* Free the text buffer */
+	_fil_buf_free(bufmetadata, buf_len);
+
+	if(!json_is_array(metadata_json)) {
+        fprintf(stderr, "error: metadata_json is not an array\n");
+		json_decref(metadata_json);
+		metadata_json = NULL;
+        return -1;
+	}
+	return 0;
+}
+
+/*
+	(pseudoPrivate) Build the catalog index, only the path, type and
+	deleted flag of the entries are looked at, n_deleted is set to the
+	number of deleted files to purge
+	return 0 successful, -1 if error
+*/
+static int _fil_index_metadata_json(
+	unsigned int* n_deleted	/* number of deleted files found */
+	)
+{
+	size_t i;
+
+	_fil_md_reset();
+	*n_deleted = 0;
+
+	for (i = 0; i < json_array_size(metadata_json); i++) {
+		json_t *jfile, *jpath, *jtype, *jdeleted, *jid;
+
+		jfile = json_array_get(metadata_json, i);
+		jpath = json_object_get(jfile, "path");
+		jtype = json_object_get(jfile, "type");
+		jdeleted = json_object_get(jfile, "deleted");
+		jid = json_object_get(jfile, "id");
+		if (!json_is_string(jpath) || !json_is_integer(jtype) || !json_is_integer(jdeleted)) {
+			fprintf(stderr, "error for entry %zu, invalid path, type or deleted element\n", i + 1);
+			_fil_md_reset();
+			return -1;
+		}
+
+		if (!_fil_md_insert(json_string_value(jpath), (os_file_type_t) json_integer_value(jtype),
+				json_integer_value(jdeleted) == 1)) {
+			_fil_md_reset();
+			return -1;
+		}
+		if (json_integer_value(jdeleted) == 1) {
+			(*n_deleted)++;
+		}
+		if (json_is_integer(jid) && (unsigned long long) json_integer_value(jid) >= fil_md_next_id) {
+			fil_md_next_id = json_integer_value(jid) + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+	(pseudoPrivate) Write the metadata object and the local snapshot,
+	the mtime is set by the operation and the version is taken from
+	its completion so the snapshot matches the object written.  The
+	object must still be at the version the catalog was read from,
+	-ERANGE or -EOVERFLOW if it is not, -EEXIST if it was created
+	meanwhile.
+	return 0 if successful, a negative rados error if error
+*/
+static int _fil_write_metadata_object(
+	const char*	buffer,	/* json text of the catalog */
+	size_t		len,	/* length of the json text */
+	uint64_t	expected,	/* version read, 0 if there was no object */
+	uint64_t*	version_out	/* version of the object written */
+	)
+{
+	rados_write_op_t write_op;
+	rados_completion_t completion;
+	time_t mtime = time(NULL);
+	uint64_t version;
+	int ret;
+
+	if (!(write_op = rados_create_write_op())) {
+		return -ENOMEM;
+	}
+	if ((ret = rados_aio_create_completion(NULL, NULL, NULL, &completion)) < 0) {
+		rados_release_write_op(write_op);
+		return ret;
+	}
+	if (expected) {
+		rados_write_op_assert_version(write_op, expected);
+	} else {
+		rados_write_op_create(write_op, LIBRADOS_CREATE_EXCLUSIVE, NULL);
+	}
+	rados_write_op_write_full(write_op, buffer, len);
+	ret = rados_aio_write_op_operate(write_op, rados_io_context, completion, METADATA_OBJECT_NAME, &mtime, 0);
+	if (ret == 0) {
+		rados_aio_wait_for_complete(completion);
+		ret = rados_aio_get_return_value(completion);
+	}
+	version = rados_aio_get_version(completion);
+	rados_aio_release(completion);
+	rados_release_write_op(write_op);
+
+	if (ret == 0) {
+		*version_out = version;
+		if (fil_md_cache_path) {
+			_fil_save_metadata_snapshot(buffer, len, version, mtime);
+		}
+	}
+	return ret;
+}
+
+/* 	
+	(pseudoPrivate) Write the metadata to rados.  The object is only
+	replaced if no other client saved it since it was read, otherwise
+	the catalog is read again, the changes recorded by _fil_md_changed
+	are applied on top and the save is retried.
+	return 0 if successful, -1 if error
+*/
+int _fil_update_metadata_json() {
+	char *buffer;
+	size_t len = 0;
+	uint64_t prev_version;
+	unsigned int retries = 0;
+	int ret;
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+
+	/* Is it already loaded */
+	if (!metadata_json) {
+		/* no... so shouldn't save */
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		return -1;
+	}
+
+	FIL_PROBE1(metadata_update_entry, METADATA_OBJECT_NAME);
+	for (;;) {
+		buffer = json_dumps(metadata_json,JSON_COMPACT);
+		if (!buffer) {
+			ret = -ENOMEM;
+			fprintf(stderr, "Error dumping the internal metadata json\n");
+			break;
+		}
+		len = strlen(buffer);
+
+		prev_version = fil_md_version;
+		ret = _fil_write_metadata_object(buffer, len, prev_version, &fil_md_version);
+		free(buffer);
+		if ((ret != -ERANGE && ret != -EOVERFLOW && ret != -EEXIST)
+				|| retries++ == FIL_MD_UPDATE_RETRIES) {
+			break;
+		}
+		/* another client saved the catalog first */
+		if (_fil_md_rebase() < 0) {
+			break;
+		}
+	}
+	FIL_PROBE3(metadata_update_return, METADATA_OBJECT_NAME, len, ret);
+
+	/* the other clients apply the changes on top of prev_version */
+	if (ret == 0) {
+		_fil_md_publish_changes(prev_version);
+	}
+	_fil_md_clear_changes();
+
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	if (ret < 0) {
+		fprintf(stderr, "Error writing the metadata object to ceph\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Catalog coherence
+ *
+ * Each process keeps the whole catalog in memory.  To see the changes
+ * made by the others without reading the metadata object again, every
+ * catalog update is followed by a notification on the metadata object
+ * carrying the entries changed: the current json of the entries still
+ * present ("upsert") and the path and type of the ones gone ("remove"),
+ * with the version of the object before and after the update.  The other
+ * clients apply them to their index if they are at the version before,
+ * otherwise a notification was missed (or two clients wrote at the same
+ * time) and the catalog is read again.  The entries opened by this
+ * process keep their handle count through a reload.  A save only
+ * replaces the metadata object at the version the catalog was read
+ * from, a client saving after another one reads it again and applies
+ * its own changes on top, see _fil_update_metadata_json.  The new
+ * generation of a file goes through the same notifications, see
+ * _fil_gen_bump.
+ *
+ * With the loopback stand-in, used by tests, the notifications are given
+ * to a callback instead of rados and fil_metadata_receive plays the role
+ * of the watch.
+ */
+struct fil_md_change {
+	char*		path;
+	os_file_type_t	type;
+	unsigned int	created;	/* entry added by this client */
+};
+
+/* the changes and the watch are protected by the catalog mutex */
+static struct fil_md_change*	fil_md_changes = NULL;
+static size_t			fil_md_n_changes = 0;
+static size_t			fil_md_changes_size = 0;
+static unsigned int		fil_md_changes_lost = 0;	/* a change could not be recorded */
+static uint64_t			fil_md_watch_cookie;
+static uint64_t			fil_md_client_id;
+static fil_md_publish_cb_t	fil_md_loopback_cb = NULL;
+static void*			fil_md_loopback_arg = NULL;
+/* background reload after a missed notification or a watch error */
+static pthread_mutex_t		fil_md_reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		fil_md_reload_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int		fil_md_reload_running = 0;
+static unsigned int		fil_md_rewatch = 0;
+static pthread_t		fil_md_reload_thread;
+static int			fil_md_reload_joinable = 0;
+
+/* Record a changed entry for the next save and its notification,
+   catalog mutex held */
+static void _fil_md_changed(const char* path, os_file_type_t type)
+{
+	size_t i;
+
+	for (i = 0; i < fil_md_n_changes; i++) {
+		if (fil_md_changes[i].type == type && !strcmp(fil_md_changes[i].path, path)) {
+			return;
+		}
+	}
+	if (fil_md_n_changes == fil_md_changes_size) {
+		size_t size = fil_md_changes_size ? fil_md_changes_size*2 : 16;
+		struct fil_md_change* changes = realloc(fil_md_changes, size*sizeof(struct fil_md_change));
+		if (!changes) {
+			/* the other clients see a version gap and reload, a save
+			   after a conflict fails */
+			fprintf(stderr, "Error: unable to allocate memory for a catalog change\n");
+			fil_md_changes_lost = 1;
+			return;
+		}
+		fil_md_changes = changes;
+		fil_md_changes_size = size;
+	}
+	if (!(fil_md_changes[fil_md_n_changes].path = strdup(path))) {
+		fprintf(stderr, "Error: unable to allocate memory for a catalog change\n");
+		fil_md_changes_lost = 1;
+		return;
+	}
+	fil_md_changes[fil_md_n_changes].type = type;
+	fil_md_changes[fil_md_n_changes++].created = 0;
+}
+
+/* Record an entry added by this client, its id is given again when
+   another client saved first, see _fil_md_rebase, catalog mutex held */
+static void _fil_md_created(const char* path, os_file_type_t type)
+{
+	size_t i;
+
+	_fil_md_changed(path, type);
+	for (i = 0; i < fil_md_n_changes; i++) {
+		if (fil_md_changes[i].type == type && !strcmp(fil_md_changes[i].path, path)) {
+			fil_md_changes[i].created = 1;
+		}
+	}
+}
+
+/* Forget the recorded changes, catalog mutex held */
+static void _fil_md_clear_changes()
+{
+	size_t i;
+
+	for (i = 0; i < fil_md_n_changes; i++) {
+		free(fil_md_changes[i].path);
+	}
+	fil_md_n_changes = 0;
+	fil_md_changes_lost = 0;
+}
+
+/*
+        (pseudoPrivate) Gather the recorded changes, the json of the
+        entries still present in upsert and the path and type of the ones
+        gone in remove, catalog mutex held
+*/
+static void _fil_md_collect_changes(
+	json_t*		upsert,	/* array of entries */
+	json_t*		remove	/* array of paths and types */
+	)
+{
+	size_t i;
+
+	for (i = 0; i < fil_md_n_changes; i++) {
+		struct fil_md_node* node = _fil_md_lookup(fil_md_changes[i].path, fil_md_changes[i].type);
+		json_t* jremove;
+
+		if (node) {
+			json_array_append(upsert, json_array_get(metadata_json, node->index));
+		} else if ((jremove = json_object())) {
+			json_object_set_new(jremove, "path", json_string(fil_md_changes[i].path));
+			json_object_set_new(jremove, "type", json_integer(fil_md_changes[i].type));
+			json_array_append_new(remove, jremove);
+		}
+	}
+}
+
+/*
+        (pseudoPrivate) Apply changes gathered by _fil_md_collect_changes
+        to the catalog and its index, catalog mutex held
+        return 0 if successfull, -1 if error
+*/
+static int _fil_md_apply_changes(
+	json_t*		upsert,	/* array of entries */
+	json_t*		remove	/* array of paths and types */
+	)
+{
+	json_t *jentry;
+	size_t i;
+	int ret = 0;
+
+	json_array_foreach(remove, i, jentry) {
+		json_t *jpath = json_object_get(jentry, "path");
+		json_t *jtype = json_object_get(jentry, "type");
+		struct fil_md_node* node;
+
+		if (json_is_string(jpath) && json_is_integer(jtype)
+				&& (node = _fil_md_lookup(json_string_value(jpath), (os_file_type_t) json_integer_value(jtype)))
+				&& _fil_md_remove(node) < 0) {
+			ret = -1;
+		}
+	}
+	json_array_foreach(upsert, i, jentry) {
+		json_t *jpath = json_object_get(jentry, "path");
+		json_t *jtype = json_object_get(jentry, "type");
+		json_t *jdeleted = json_object_get(jentry, "deleted");
+		json_t *jid = json_object_get(jentry, "id");
+		struct fil_md_node* node;
+		os_file_type_t type;
+		unsigned int deleted;
+
+		if (!json_is_string(jpath) || !json_is_integer(jtype) || !json_is_integer(jdeleted)) {
+			fprintf(stderr, "Error: invalid entry in a catalog change\n");
+			ret = -1;
+			continue;
+		}
+		type = (os_file_type_t) json_integer_value(jtype);
+		deleted = json_integer_value(jdeleted) == 1;
+		if ((node = _fil_md_lookup(json_string_value(jpath), type))) {
+			if (json_array_set(metadata_json, node->index, jentry) < 0) {
+				ret = -1;
+				continue;
+			}
+			node->deleted = deleted;
+		} else if (json_array_append(metadata_json, jentry) < 0) {
+			ret = -1;
+			continue;
+		} else if (!_fil_md_insert(json_string_value(jpath), type, deleted)) {
+			json_array_remove(metadata_json, json_array_size(metadata_json) - 1);
+			ret = -1;
+			continue;
+		}
+		if (json_is_integer(jid) && (unsigned long long) json_integer_value(jid) >= fil_md_next_id) {
+			fil_md_next_id = json_integer_value(jid) + 1;
+		}
+	}
+	return ret;
+}
+
+static int _fil_md_reload(json_t* upsert, json_t* remove);
+
+/*
+        (pseudoPrivate) Take the id of a new file from the counter of the
+        pool, at least fil_md_next_id, catalog mutex held.  The catalog of
+        this client may be stale, the counter is not: it is changed by a
+        compare and swap, tried again while other clients take ids.
+        return 0 if successfull, -1 if error
+*/
+static int _fil_md_take_id(
+	unsigned long long*	id	/* out: id of the new file */
+	)
+{
+	rados_write_op_t	write_op;
+	char		cur_str[24], next_str[24];
+	unsigned long long	cur;
+	unsigned int	retries;
+	int		len, ret;
+
+	if (!rados_io_context) {
+		fprintf(stderr, "Error: not connected to a cluster, see fil_rados_init\n");
+		return -1;
+	}
+	for (retries = 0; retries <= FIL_MD_UPDATE_RETRIES; retries++) {
+		len = rados_getxattr(rados_io_context, FIL_MD_ID_OBJECT, FIL_MD_ID_XATTR, cur_str, sizeof(cur_str) - 1);
+		if (len < 0 && len != -ENOENT && len != -ENODATA) {
+			fprintf(stderr, "Error %d: Could not read the file id counter\n%s\n", -len, strerror(-len));
+			return -1;
+		}
+		cur_str[len > 0 ? len : 0] = '\0';
+		cur = strtoull(cur_str, NULL, 10);
+		*id = cur > fil_md_next_id ? cur : fil_md_next_id;
+		snprintf(next_str, sizeof(next_str), "%llu", *id + 1);
+
+		if (!(write_op = rados_create_write_op())) {
+			fprintf(stderr, "Error: unable to create the write operation of the file id counter\n");
+			return -1;
+		}
+		if (len == -ENOENT) {
+			rados_write_op_create(write_op, LIBRADOS_CREATE_EXCLUSIVE, NULL);
+		} else {
+			rados_write_op_cmpxattr(write_op, FIL_MD_ID_XATTR, LIBRADOS_CMPXATTR_OP_EQ,
+				cur_str, strlen(cur_str));
+		}
+		rados_write_op_setxattr(write_op, FIL_MD_ID_XATTR, next_str, strlen(next_str));
+		ret = rados_write_op_operate(write_op, rados_io_context, FIL_MD_ID_OBJECT, NULL, 0);
+		rados_release_write_op(write_op);
+		if (ret == 0) {
+			fil_md_next_id = *id + 1;
+			return 0;
+		}
+		if (ret != -ECANCELED && ret != -EEXIST) {
+			fprintf(stderr, "Error %d: Could not change the file id counter\n%s\n", -ret, strerror(-ret));
+			return -1;
+		}
+	}
+	fprintf(stderr, "Error: the file id counter keeps changing\n");
+	return -1;
+}
+
+/*
+        (pseudoPrivate) Read the catalog saved by another client and apply
+        the changes recorded since the last save on top, catalog mutex
+        held.  An entry changed by both keeps the version of this client.
+        The files created by this client get a new id, above the ids of
+        the catalog read: a client older than the id counter may have
+        taken theirs, and no object was written under it before the save.
+        return 0 if successfull, -1 if error
+*/
+static int _fil_md_rebase()
+{
+	json_t *upsert, *remove;
+	size_t i;
+	int ret = -1;
+
+	if (fil_md_changes_lost) {
+		fprintf(stderr, "Error: the catalog changes can't be applied to the catalog saved by another client\n");
+		return -1;
+	}
+	upsert = json_array();
+	remove = json_array();
+	if (upsert && remove) {
+		_fil_md_collect_changes(upsert, remove);
+		ret = _fil_md_reload(upsert, remove);
+	}
+	for (i = 0; ret == 0 && i < fil_md_n_changes; i++) {
+		struct fil_md_node* node;
+		unsigned long long id;
+		json_t* jfile;
+
+		if (!fil_md_changes[i].created || fil_md_changes[i].type != OS_FILE_TYPE_FILE
+				|| !(node = _fil_md_lookup(fil_md_changes[i].path, OS_FILE_TYPE_FILE))) {
+			continue;
+		}
+		jfile = json_array_get(metadata_json, node->index);
+		if (_fil_md_take_id(&id) < 0
+				|| json_object_set_new(jfile, "id", json_integer(id)) < 0) {
+			ret = -1;
+		}
+	}
+	if (ret < 0) {
+		fprintf(stderr, "Error: unable to apply the catalog changes to the catalog saved by another client\n");
+	}
+	json_decref(upsert);
+	json_decref(remove);
+	return ret;
+}
+
+/* completion of a notification, frees its text */
+static void _fil_md_notify_done(rados_completion_t completion, void* arg)
+{
+	free(arg);
+	rados_aio_release(completion);
+}
+
+/*
+        (pseudoPrivate) Send a notification on the metadata object, or to
+        the loopback callback, catalog mutex held.  The text is freed.
+*/
+static void _fil_md_notify(
+	char*	text	/* notification text */
+	)
+{
+	rados_completion_t completion;
+	int ret;
+
+	if (fil_md_watch_mode == FIL_MD_WATCH_LOOPBACK) {
+		fil_md_loopback_cb(fil_md_loopback_arg, text, strlen(text));
+		free(text);
+		return;
+	}
+	if ((ret = rados_aio_create_completion(text, _fil_md_notify_done, NULL, &completion)) < 0) {
+		fprintf(stderr, "Error %d: cannot send a catalog notification\n%s\n", -ret, strerror(-ret));
+		free(text);
+		return;
+	}
+	if ((ret = rados_aio_notify(rados_io_context, METADATA_OBJECT_NAME, completion,
+			text, strlen(text), FIL_MD_NOTIFY_TIMEOUT_MS, NULL, NULL)) < 0) {
+		fprintf(stderr, "Error %d: cannot send a catalog notification\n%s\n", -ret, strerror(-ret));
+		rados_aio_release(completion);
+		free(text);
+	}
+}
+
+/*
+        (pseudoPrivate) Send the changes recorded since the last update
+        of the metadata object, catalog mutex held.  The notification is
+        asynchronous, a watcher of this process may need the catalog.
+*/
+static void _fil_md_publish_changes(
+	uint64_t	prev_version	/* version of the object before the update */
+	)
+{
+	json_t *msg, *upsert, *remove;
+	char *text;
+
+	if (fil_md_watch_mode == FIL_MD_WATCH_NONE) {
+		return;
+	}
+	upsert = json_array();
+	remove = json_array();
+	msg = json_object();
+	if (!upsert || !remove || !msg) {
+		json_decref(upsert);
+		json_decref(remove);
+		json_decref(msg);
+		fprintf(stderr, "Error: unable to build the catalog change notification\n");
+		return;
+	}
+	json_object_set_new(msg, "client", json_integer((json_int_t) fil_md_client_id));
+	json_object_set_new(msg, "prev", json_integer((json_int_t) prev_version));
+	json_object_set_new(msg, "version", json_integer((json_int_t) fil_md_version));
+	json_object_set_new(msg, "upsert", upsert);
+	json_object_set_new(msg, "remove", remove);
+	_fil_md_collect_changes(upsert, remove);
+	text = json_dumps(msg, JSON_COMPACT);
+	json_decref(msg);
+	if (!text) {
+		fprintf(stderr, "Error: unable to build the catalog change notification\n");
+		return;
+	}
+	_fil_md_notify(text);
+}
+
+/*
+        (pseudoPrivate) Announce the new generation of a file to the
+        clients watching the catalog, see _fil_gen_bump
+*/
+static void _fil_md_publish_gen(
+	const char*	prefix,	/* prefix of the object names of the file */
+	uint64_t	gen	/* new generation */
+	)
+{
+	json_t *msg;
+	char gen_str[24];
+	char *text = NULL;
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (fil_md_watch_mode == FIL_MD_WATCH_NONE) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		return;
+	}
+	if ((msg = json_object())) {
+		json_object_set_new(msg, "client", json_integer((json_int_t) fil_md_client_id));
+		json_object_set_new(msg, "file", json_string(prefix));
+		/* as text, the json integers are signed */
+		snprintf(gen_str, sizeof(gen_str), "%llu", (unsigned long long) gen);
+		json_object_set_new(msg, "gen", json_string(gen_str));
+		text = json_dumps(msg, JSON_COMPACT);
+		json_decref(msg);
+	}
+	if (!text) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: unable to build the generation notification of %s\n", prefix);
+		return;
+	}
+	_fil_md_notify(text);
+	pthread_mutex_unlock(&fil_catalog_mutex);
+}
+
+/*
+        (pseudoPrivate) Read the catalog again and apply changes to it,
+        see _fil_md_apply_changes, the handle counts of the entries opened
+        by this process are kept.  The catalog is left as it was if it
+        can't be read.
+        return 0 if successfull, -1 if error
+*/
+static int _fil_md_reload(
+	json_t*		upsert,	/* entries to set, NULL if none */
+	json_t*		remove	/* entries to remove, NULL if none */
+	)
+{
+	struct fil_md_opened {
+		char*		path;
+		os_file_type_t	type;
+		unsigned int	n_ref;
+	} *opened = NULL;
+	size_t n_opened = 0;
+	json_t *old;
+	uint64_t old_version;
+	uint64_t metadata_size;
+	unsigned int n_deleted = 0;
+	size_t i;
+	int ret;
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (!(old = metadata_json)) {
+		/* loaded at the first use */
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		return 0;
+	}
+	if (fil_md_n_nodes && !(opened = calloc(fil_md_n_nodes, sizeof(struct fil_md_opened)))) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: unable to allocate memory to reload the catalog\n");
+		return -1;
+	}
+	for (i = 0; i < fil_md_n_nodes; i++) {
+		if (fil_md_nodes[i]->n_ref && (opened[n_opened].path = strdup(fil_md_nodes[i]->path))) {
+			opened[n_opened].type = fil_md_nodes[i]->type;
+			opened[n_opened++].n_ref = fil_md_nodes[i]->n_ref;
+		}
+	}
+
+	FIL_PROBE1(metadata_load_entry, METADATA_OBJECT_NAME);
+	old_version = fil_md_version;
+	metadata_json = NULL;
+	ret = _fil_read_metadata_json(&metadata_size);
+	if (ret == 0 && (ret = _fil_index_metadata_json(&n_deleted)) < 0) {
+		json_decref(metadata_json);
+		metadata_json = NULL;
+	}
+	if (ret < 0) {
+		/* keep what we had */
+		metadata_json = old;
+		fil_md_version = old_version;
+		_fil_index_metadata_json(&n_deleted);
+	} else {
+		json_decref(old);
+		if (upsert && remove) {
+			ret = _fil_md_apply_changes(upsert, remove);
+		}
+	}
+	FIL_PROBE3(metadata_load_return, METADATA_OBJECT_NAME, metadata_size, ret);
+
+	for (i = 0; i < n_opened; i++) {
+		struct fil_md_node* node = _fil_md_lookup(opened[i].path, opened[i].type);
+		if (node) {
+			node->n_ref = opened[i].n_ref;
+		}
+		free(opened[i].path);
+	}
+	free(opened);
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+        (pseudoPrivate) Read the catalog again, see _fil_md_reload
+        return 0 if successfull, -1 if error
+*/
+static int _fil_reload_metadata_json()
+{
+	return _fil_md_reload(NULL, NULL);
+}
 
-	if (json_object_set(file,"size",json_integer(new_size)) < 0) {
-		fprintf(stderr, "Error updating the size of file object\n");
-		return -1;
-	}
-	
-	if (json_array_set(metadata_json,index,file) < 0) {
-		fprintf(stderr, "Error updating the file object in the metadata\n");
-		return -1;
+static void _fil_watch_cb(void* arg, uint64_t notify_id, uint64_t cookie,
+	uint64_t notifier_id, void* data, size_t data_len);
+static void _fil_watch_err_cb(void* arg, uint64_t cookie, int err);
+
+/* Reload the catalog, and watch it again after an error */
+static void* _fil_md_reload_thread(void* arg)
+{
+	int ret;
+
+	(void) arg;
+	pthread_mutex_lock(&fil_md_reload_mutex);
+	while (fil_md_reload_running) {
+		unsigned int rewatch = fil_md_rewatch;
+
+		fil_md_rewatch = 0;
+		pthread_mutex_unlock(&fil_md_reload_mutex);
+
+		if (rewatch) {
+			pthread_mutex_lock(&fil_catalog_mutex);
+			if (fil_md_watch_mode == FIL_MD_WATCH_RADOS) {
+				rados_unwatch2(rados_io_context, fil_md_watch_cookie);
+				if ((ret = rados_watch2(rados_io_context, METADATA_OBJECT_NAME, &fil_md_watch_cookie,
+						_fil_watch_cb, _fil_watch_err_cb, NULL)) < 0) {
+					fprintf(stderr, "Error %d: cannot watch the metadata object again\n%s\n",
+						-ret, strerror(-ret));
+					fil_md_watch_mode = FIL_MD_WATCH_NONE;
+				}
+			}
+			pthread_mutex_unlock(&fil_catalog_mutex);
+		}
+		_fil_reload_metadata_json();
+
+		/* another reload may have been asked meanwhile */
+		pthread_mutex_lock(&fil_md_reload_mutex);
+		fil_md_reload_running--;
 	}
+	pthread_cond_broadcast(&fil_md_reload_cond);
+	pthread_mutex_unlock(&fil_md_reload_mutex);
+	return NULL;
+}
 
-	json_decref(file);
+/* Reload the catalog in the background, the watch callbacks can't do
+   I/O.  Asking for a reload while one runs makes it run once more. */
+static void _fil_md_schedule_reload(int rewatch)
+{
+	int ret;
 
-	if (_fil_update_metadata_json() < 0) {
-		return -1;
-	} else {
-		return 0;
+	pthread_mutex_lock(&fil_md_reload_mutex);
+	if (rewatch) {
+		fil_md_rewatch = 1;
 	}
-	
+	if (fil_md_reload_running) {
+		fil_md_reload_running = 2;
+		pthread_mutex_unlock(&fil_md_reload_mutex);
+		return;
+	}
+	/* the previous thread is done with the mutex, it is only exiting */
+	if (fil_md_reload_joinable) {
+		pthread_join(fil_md_reload_thread, NULL);
+		fil_md_reload_joinable = 0;
+	}
+	fil_md_reload_running = 1;
+	if ((ret = pthread_create(&fil_md_reload_thread, NULL, _fil_md_reload_thread, NULL))) {
+		fil_md_reload_running = 0;
+		pthread_mutex_unlock(&fil_md_reload_mutex);
+		fprintf(stderr, "Error %d: cannot start the catalog reload thread\n%s\n", ret, strerror(ret));
+		return;
+	}
+	fil_md_reload_joinable = 1;
+	pthread_mutex_unlock(&fil_md_reload_mutex);
 }
 
-/*      
-        (pseudoPrivate) Set the deleted flag of a file in the metadata
-        return 0 if successfull, -1 if error 
+/*
+	Apply a catalog change notification of another client, called by
+	the watch or, with the loopback stand-in, by the caller.  The
+	notifications of this client are ignored.  A notification not
+	following the version of the catalog makes it read again, in the
+	background for the watch.  A new generation of a file is given to
+	its handles, see _fil_gen_bump.
+	return 0 if successfull, -1 if error
 */
-int _fil_set_deleted(
-	char* filepath,   /* file path like sbtest/sbtest.ibd */
-	os_file_type_t type
-	) 
+int fil_metadata_receive(
+	const char*	msg,	/* notification text */
+	size_t		len	/* length of the text */
+	)
 {
-	/* TODO:  may need a mutex when used with multiple threads */
-	int index = _fil_find_in_metadata(filepath,type);
-	json_t *file = (json_t *) (intptr_t) json_array_get(metadata_json,index);
-	if (!file) {
-		fprintf(stderr, "Error extracting the file object from the metadata\n");
+	json_t *jmsg, *jupsert, *jremove, *jfile, *jgen;
+	json_error_t error;
+	uint64_t prev, version;
+	int ret = 0;
+
+	if (!(jmsg = json_loadb(msg, len, 0, &error)) || !json_is_object(jmsg)) {
+		fprintf(stderr, "Error: invalid catalog change notification\n");
+		json_decref(jmsg);
 		return -1;
 	}
-
-	if (json_object_set(file,"deleted",json_integer(1)) < 0) {
-		fprintf(stderr, "Error setting deleted in the file object\n");
-		return -1;
+	if ((uint64_t) json_integer_value(json_object_get(jmsg, "client")) == fil_md_client_id) {
+		json_decref(jmsg);
+		return 0;
 	}
-	
-	if (json_array_set(metadata_json,index,file) < 0) {
-		fprintf(stderr, "Error updating the file object in the metadata\n");
+	jfile = json_object_get(jmsg, "file");
+	jgen = json_object_get(jmsg, "gen");
+	if (json_is_string(jfile) && json_is_string(jgen)) {
+		/* new generation of a file, see _fil_gen_bump */
+		_fil_shared_set_gen(json_string_value(jfile), strtoull(json_string_value(jgen), NULL, 10));
+		json_decref(jmsg);
+		return 0;
+	}
+	if (!json_is_integer(json_object_get(jmsg, "prev"))
+			|| !json_is_integer(json_object_get(jmsg, "version"))) {
+		fprintf(stderr, "Error: invalid catalog change notification\n");
+		json_decref(jmsg);
 		return -1;
 	}
+	prev = json_integer_value(json_object_get(jmsg, "prev"));
+	version = json_integer_value(json_object_get(jmsg, "version"));
+	jupsert = json_object_get(jmsg, "upsert");
+	jremove = json_object_get(jmsg, "remove");
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (!metadata_json || version == fil_md_version) {
+		/* not loaded yet, or already read */
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		json_decref(jmsg);
+		return 0;
+	}
+	if (prev != fil_md_version) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		json_decref(jmsg);
+		if (fil_md_watch_mode == FIL_MD_WATCH_RADOS) {
+			_fil_md_schedule_reload(0);
+			return 0;
+		}
+		return _fil_reload_metadata_json();
+	}
 
-	json_decref(file);
+	ret = _fil_md_apply_changes(jupsert, jremove);
+	fil_md_version = version;
+	pthread_mutex_unlock(&fil_catalog_mutex);
+	json_decref(jmsg);
+
+	if (ret < 0) {
+		/* the index may not match the other clients anymore */
+		if (fil_md_watch_mode == FIL_MD_WATCH_RADOS) {
+			_fil_md_schedule_reload(0);
+		} else {
+			_fil_reload_metadata_json();
+		}
+	}
+	return ret;
+}
 
-	if (_fil_update_metadata_json() < 0) {
-		return -1;
-	} else {
-		return 0;
+/* Notification on the metadata object */
+static void _fil_watch_cb(void* arg, uint64_t notify_id, uint64_t cookie,
+	uint64_t notifier_id, void* data, size_t data_len)
+{
+	(void) arg;
+	(void) notifier_id;
+
+	/* ack first, the notifier waits for all the watchers */
+	rados_notify_ack(rados_io_context, METADATA_OBJECT_NAME, notify_id, cookie, NULL, 0);
+	if (data_len) {
+		fil_metadata_receive(data, data_len);
 	}
-	
 }
 
-/*      
-        Delete a file in rados
-        return 0 if successfull, -1 if error 
-*/
-int _fil_delete_rados_objects(
-    const char* filepath,  /* path of the file */
-    const unsigned int block_size 
-    ) 
+/* The watch was lost, notifications may have been missed */
+static void _fil_watch_err_cb(void* arg, uint64_t cookie, int err)
 {
-    
-    /* TODO, verify it is ok to remore */
-        
-    size_t pos = 0;
-    char* obj_name;
-    while (1) {
-        obj_name = (char *) (intptr_t) asprintf("%s_%zu",filepath,pos);
-        if (!rados_remove(rados_io_context,obj_name)) {
-            if (DEBUG) {
-                fprintf(stderr, "DEBUG: rados_remove object %s\n", obj_name);
-            }
-        } else {
-            if (DEBUG) {
-                fprintf(stderr, "DEBUG: done removing ojects from rados"); 
-            }
-            free(obj_name);
-            break;
-        }
-        /* increasing the position by the block_size */
-        pos += block_size;
-        free(obj_name);
-    }
-    return 0;
+	(void) arg;
+	(void) cookie;
+
+	fprintf(stderr, "Error %d: the watch of the metadata object was lost\n%s\n", -err, strerror(-err));
+	_fil_md_schedule_reload(1);
 }
 
-/* 	
-	(pseudoPrivate) Load the metadata in memory
-	return 0 successful, -1 if error 
+/*
+	Keep the catalog in sync with the other clients of the pool: the
+	changes made by this process are notified on the metadata object
+	and the notifications of the others are applied as they come
+	return 0 if successfull, -1 if error
 */
-int _fil_load_metadata_json() 
+int fil_metadata_watch()
 {
-	/* Is it already loaded */
-	if (metadata_json) {
-		return 0;
-	}
+	int ret;
 
-	/* test if ioctx is set */
-	struct rados_pool_stat_t pstat;
-	if (rados_ioctx_pool_stat(rados_io_context,&pstat) < 0) {
-		fprintf(stderr, "Error accessing Ceph, invalid IO context\n");
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (fil_md_watch_mode != FIL_MD_WATCH_NONE) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: the catalog is already watched\n");
 		return -1;
 	}
-
-	/* read the metadata object stat */
-	uint64_t	metadata_size;
-	time_t		metadata_mtime;
-	if (rados_stat(rados_io_context,METADATA_OBJECT_NAME,&metadata_size,&metadata_mtime)) {
-		fprintf(stderr, "Error stating Metadata\n");
+	fil_md_client_id = rados_get_instance_id(ceph_cluster);
+	if ((ret = rados_watch2(rados_io_context, METADATA_OBJECT_NAME, &fil_md_watch_cookie,
+			_fil_watch_cb, _fil_watch_err_cb, NULL)) < 0) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error %d: cannot watch the metadata object\n%s\n", -ret, strerror(-ret));
 		return -1;
 	}
+	fil_md_watch_mode = FIL_MD_WATCH_RADOS;
+	pthread_mutex_unlock(&fil_catalog_mutex);
 
-	/* Allocate the buffer for the metadata */	
-	char		*bufmetadata;
-	bufmetadata = (char *) (intptr_t) malloc(metadata_size);
-	if (!bufmetadata) {
-		fprintf(stderr, "Error allocating memory for Metadata buffer\n");
-		return -1;
-	}
+	/* what changed before the watch is seen through the version */
+	return _fil_reload_metadata_json();
+}
 
-	/* Read the metadata object */
-	if (rados_read(rados_io_context,METADATA_OBJECT_NAME,bufmetadata,metadata_size,0) < 0) {
-		fprintf(stderr, "Error reading metadata from rados\n");
-		free(bufmetadata);
+/*
+	Stand-in of fil_metadata_watch for tests: the notifications of this
+	process are given to publish instead of rados, the ones of other
+	clients are passed to fil_metadata_receive by the caller
+	return 0 if successfull, -1 if error
+*/
+int fil_metadata_watch_loopback(
+	fil_md_publish_cb_t	publish,	/* called with each notification */
+	void*			arg,	/* passed to publish */
+	uint64_t		client_id	/* id of this client in the notifications */
+	)
+{
+	if (!publish) {
+		fprintf(stderr, "Error: uninitialized publish callback can't be null\n");
 		return -1;
 	}
-
-	/* parse in json */
-	metadata_json = json_loads(bufmetadata, 0, &error_json);
-	if(!metadata_json) {
-        fprintf(stderr, "Error loading json on line %d: %s\n", error_json.line, error_json.text);
-		free(bufmetadata);
-        return -1;
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (fil_md_watch_mode != FIL_MD_WATCH_NONE) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: the catalog is already watched\n");
+		return -1;
 	}
-	
-	/* Free the text buffer */
-	free(bufmetadata);
-
-    /* Some files may have been deleted but kept open, we need to check and
-     * cleanup in case the application crashed
-     */
-    int i;
-    for(i = json_array_size(metadata_json) - 1;i >= 0;i--) {
-        /* going backward because we may have to remove elements */
-        char *file_path;
-        unsigned int block_size;
-        unsigned int deleted;
-            
-        json_t *jfile, *jdeleted, *jpath, *jblock_size;
-        jfile = json_array_get(metadata_json,i);
-        if (!jfile) {
-            fprintf(stderr, "Error retrieving metadata for file %d: %s\n", i, error_json.text);
-            return -1;
-        }
-        
-        jdeleted = (json_t *) (intptr_t) json_object_get(jfile,"deleted");
-		if(!json_is_integer(jdeleted)) {
-            fprintf(stderr, "error: deleted element returned is not an integer\n");
-            json_decref(jfile);
-            json_decref(jdeleted);
-            return -1;
-        } else {
-			deleted = (unsigned int) json_integer_value(jdeleted);
-            json_decref(jdeleted);
-            
-            if (deleted == 1) {
-                /* The file was deleted, we need to get the filepath
-                 * and block_size
-                 */
-                 
-                jpath = (json_t *) (intptr_t) json_object_get(jfile,"path");
-                if(!json_is_string(jpath)) {
-                    fprintf(stderr, "error: path element returned is not a string\n");
-                    json_decref(jfile);
-                    json_decref(jpath);
-                    return -1;
-                } else {
-                    file_path = strdup(json_string_value(jpath));
-                    json_decref(jpath);
-                }
-                
-                jblock_size = (json_t *) (intptr_t) json_object_get(jfile,"block_size");
-                if(!json_is_integer(jblock_size)) {
-                    fprintf(stderr, "error: block_size element returned is not an integer\n");
-                    json_decref(jblock_size);
-                    json_decref(jfile);
-                    return -1;
-                } else {
-                    block_size = (unsigned int) json_integer_value(jblock_size);
-                    json_decref(jblock_size);
-                }
-                
-                _fil_delete_rados_objects(file_path,block_size);
-                
-                json_decref(jfile);
-                
-                /* Now, removing the entry from the metadata object */
-                if (json_array_remove(metadata_json,i)) {
-                    fprintf(stderr, "error: Unable to remove the file element for the metadata\n");
-                    return -1;
-                }
-            } 
-                
-		}
-		json_decref(jfile);
-        
-    }
+	fil_md_loopback_cb = publish;
+	fil_md_loopback_arg = arg;
+	fil_md_client_id = client_id;
+	fil_md_watch_mode = FIL_MD_WATCH_LOOPBACK;
+	pthread_mutex_unlock(&fil_catalog_mutex);
 	return 0;
-	
 }
 
-
-/* 	
-	(pseudoPrivate) Load the metadata in memory
-	return 0 if successful, -1 if error
+/*
+	Stop the catalog notifications, wait for a reload in progress
 */
-int _fil_update_metadata_json() {
-	/* Is it already loaded */
-	if (!metadata_json) {
-		/* no... so shouldn't save */
-		return -1;
-	}
+void fil_metadata_unwatch()
+{
+	int watched;
 
-	/* test if ioctx is set */
-	struct rados_pool_stat_t pstat;
-	if (rados_ioctx_pool_stat(rados_io_context,&pstat) < 0) {
-		fprintf(stderr, "Error accessing Ceph, invalid IO context\n");
-		return -1;
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if ((watched = fil_md_watch_mode == FIL_MD_WATCH_RADOS)) {
+		rados_unwatch2(rados_io_context, fil_md_watch_cookie);
 	}
+	fil_md_watch_mode = FIL_MD_WATCH_NONE;
+	_fil_md_clear_changes();
+	pthread_mutex_unlock(&fil_catalog_mutex);
 
-	char *buffer;
-	buffer = json_dumps(metadata_json,JSON_COMPACT);
-
-	if (!buffer) {
-		fprintf(stderr, "Error dumping the internal metadata json\n");
-		return -1;
+	/* the callbacks in progress are done after the flush */
+	if (watched) {
+		rados_watch_flush(ceph_cluster);
 	}
-
-	if (rados_write_full(rados_io_context, METADATA_OBJECT_NAME, buffer, strlen(buffer)) < 0) {
-		fprintf(stderr, "Error writing the metadata object to ceph\n");
-		free(buffer);
-		return -1;
+	pthread_mutex_lock(&fil_md_reload_mutex);
+	while (fil_md_reload_running) {
+		pthread_cond_wait(&fil_md_reload_cond, &fil_md_reload_mutex);
 	}
-
-	free(buffer);
-	return 0;		
+	/* its buffer cache goes back to the pool when it exits */
+	if (fil_md_reload_joinable) {
+		pthread_join(fil_md_reload_thread, NULL);
+		fil_md_reload_joinable = 0;
+	}
+	pthread_mutex_unlock(&fil_md_reload_mutex);
 }
 
 /* 	
@@ -918,79 +8850,26 @@ int _fil_find_in_metadata(
 	os_file_type_t type /* file object type, seen enum def */
 	) 
 {
+	struct fil_md_node *node;
+	int ret;
+
 	/* is the metadata json loaded? */
-	if (!metadata_json) {
-		_fil_load_metadata_json();	
-	}
-	
-	/* TODO:  may need a mutex when used with multiple threads */
-	if(!json_is_array(metadata_json)) {
-        fprintf(stderr, "error: metadata_json is not an array\n");
-		json_decref(metadata_json);
-        return -3;
+	if (!metadata_json && _fil_load_metadata_json() < 0) {
+		return -3;
 	}
 
-    int i;
-    json_t *jdata, *jpath, *jtype, *jdeleted;
-	for(i = 0; i < json_array_size(metadata_json); i++) {
-		
-		jdata = (json_t *) (intptr_t) json_array_get(metadata_json, i);
-        if(!json_is_object(jdata)) {
-            fprintf(stderr, "error, file entry %d is not a json object\n", i + 1);
-            json_decref(metadata_json);
-            return -3;
-		}
-
-		jpath = (json_t *) (intptr_t) json_object_get(jdata, "path");
-		if(!json_is_string(jpath)) {
-			fprintf(stderr, "error for entry %d, fpath is not a string\n", i + 1);
-			json_decref(jdata);
-			json_decref(metadata_json);
-            return -3;
-        }
-		
-		jtype = (json_t *) (intptr_t) json_object_get(jdata,"type");
-		if(!json_is_number(jtype)) {
-            fprintf(stderr, "error for entry  %d: ftype is not a number\n", i + 1);
-			json_decref(jdata);
-			json_decref(jpath);
-            json_decref(metadata_json);
-            return -3;
-		}
-        
-		jdeleted = (json_t *) (intptr_t) json_object_get(jdata,"deleted");
-		if(!json_is_number(jtype)) {
-            fprintf(stderr, "error for entry  %d: jdeleted is not an integer\n", i + 1);
-			json_decref(jdata);
-			json_decref(jpath);
-            json_decref(metadata_json);
-            return -3;
-		}        
-
-        if (json_integer_value(jdeleted) == 1) {
-            json_decref(jpath);
-			json_decref(jdata);
-			json_decref(jtype);
-			json_decref(jdeleted);
-            return -2;
-        }
-
-		if ((strcmp(filepath,json_string_value(jpath)) == 0 ) && type == (os_file_type_t) json_integer_value(jtype)) {
-			json_decref(jpath);
-			json_decref(jdata);
-			json_decref(jtype);
-			json_decref(jdeleted);
-			return i;
-		}
-
-		json_decref(jdata);
+	pthread_mutex_lock(&fil_catalog_mutex);
+	node = _fil_md_lookup(filepath,type);
+	if (!node) {
+		ret = -1;
+	} else if (node->deleted) {
+		ret = -2;
+	} else {
+		ret = (int) node->index;
 	}
-	json_decref(jpath);
-	json_decref(jdata);
-	json_decref(jtype);
-	json_decref(jdeleted);
-	
-	return -1;
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	return ret;
 }
 	
 
@@ -1002,127 +8881,122 @@ int _fil_add_file_metadata(
 	char* filepath,   /* file path like sbtest/sbtest.ibd */
 	os_file_type_t type, /* file object type, seen enum def */
 	size_t size,  /* Size of the file */
-	size_t blockSize /* blockSize */
+	size_t blockSize, /* blockSize */
+	const char* pool_name /* data pool, NULL for the pool given to fil_rados_init */
 	) 
 {
 	/* is the metadata json loaded? */
-	if (!metadata_json) {
-		_fil_load_metadata_json();	
-	}
-	
-	if (_fil_find_in_metadata(filepath,type) >= 0) {
-        fprintf(stderr, "error: file %s can't be added, it already exists in metadata\n",filepath);
-		return -1;
-	}
-
-	if(!json_is_array(metadata_json)) {
-        fprintf(stderr, "error: metadata_json is not an array\n");
-		json_decref(metadata_json);
+	if (!metadata_json && _fil_load_metadata_json() < 0) {
 		return -1;
 	}
 
-	json_t *jsonObj = (json_t *) (intptr_t) json_object();
-	if (json_object_set_new(jsonObj,"type",json_integer(type)) < 0) {
-        fprintf(stderr, "error: unable to add type to new json object\n");
-        json_decref(jsonObj);
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (_fil_md_lookup(filepath,type)) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+        fprintf(stderr, "error: file %s can't be added, it already exists in metadata\n",filepath);
 		return -1;
 	}
-	if (json_object_set_new(jsonObj,"deleted",json_integer(0)) < 0) {
-        fprintf(stderr, "error: unable to add deleted to new json object\n");
-        json_decref(jsonObj);
+	unsigned long long id = 0;
+	if (type == OS_FILE_TYPE_FILE && _fil_md_take_id(&id) < 0) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
 		return -1;
 	}
-    if (json_object_set_new(jsonObj,"nref",json_integer(0)) < 0) {
-        fprintf(stderr, "error: unable to add nref to new json object\n");
-        json_decref(jsonObj);
+
+	json_t *jsonObj = json_object();
+	if (!jsonObj) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+        fprintf(stderr, "error: unable to create a new json object\n");
 		return -1;
 	}
-	if (json_object_set_new(jsonObj,"size",json_integer(size)) < 0) {
-        fprintf(stderr, "error: unable to add size to new json object\n");
+	if (json_object_set_new(jsonObj,"type",json_integer(type)) < 0
+			|| json_object_set_new(jsonObj,"deleted",json_integer(0)) < 0
+			|| json_object_set_new(jsonObj,"nref",json_integer(0)) < 0
+			|| json_object_set_new(jsonObj,"size",json_integer(size)) < 0
+			|| json_object_set_new(jsonObj,"block_size",json_integer(blockSize)) < 0
+			|| json_object_set_new(jsonObj,"path",json_string(filepath)) < 0
+			|| (type == OS_FILE_TYPE_FILE
+				&& json_object_set_new(jsonObj,"id",json_integer(id)) < 0)
+			|| (pool_name
+				&& json_object_set_new(jsonObj,"pool",json_string(pool_name)) < 0)) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+        fprintf(stderr, "error: unable to fill the new json object\n");
         json_decref(jsonObj);
 		return -1;
 	}
-	if (json_object_set_new(jsonObj,"block_size",json_integer(blockSize)) < 0) {
-        fprintf(stderr, "error: unable to add block_size to new json object\n");
-        json_decref(jsonObj);
+	if (json_array_append_new(metadata_json,jsonObj) < 0) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+        fprintf(stderr, "error: unable to add the new json object to the metadata json array\n");
 		return -1;
 	}
-	if (json_object_set_new(jsonObj,"path",json_string(filepath)) < 0) {
-        fprintf(stderr, "error: unable to add path to new json object\n");
-        json_decref(jsonObj);
-		return -1;
-	}	
-	if (json_array_append(metadata_json,jsonObj) < 0) {
-        fprintf(stderr, "error: unable to add the new json object to the metadata json array\n");
-        json_decref(jsonObj);
+	if (!_fil_md_insert(filepath,type,0)) {
+		json_array_remove(metadata_json,json_array_size(metadata_json) - 1);
+		pthread_mutex_unlock(&fil_catalog_mutex);
 		return -1;
 	}
-
-	/* we're done with jsonObj */
-	json_decref(jsonObj);
+	_fil_md_created(filepath,type);
 
 	/* update in ceph */
-	if (_fil_update_metadata_json() < 0) {
-		return -1;
-	}
+	int ret = _fil_update_metadata_json();
+	pthread_mutex_unlock(&fil_catalog_mutex);
 
-	return 0;
+	return ret < 0 ? -1 : 0;
 }
 
+/*
+	(pseudoPrivate) Remove a file from the metadata, deleted or not
+	return 0 if successfull -1 if error
+*/
 int _fil_rm_file_metadata(
         char* filepath,   /* file path like sbtest/sbtest.ibd */
         os_file_type_t type /* file object type, seen enum def */
         )
 {
-	
-	/* TODO:  may need a mutex when used with multiple threads */
-	int index = _fil_find_in_metadata(filepath,type);
-
-	if(index < 0) {
-		/* error should be reported to stderr in _fil_find_in_metadata */
-        return -1;
-	} else {
-		if (json_array_remove(metadata_json,index) < 0) {
-			fprintf(stderr, "error: unable to remove the file %s from the metadata json object\n",filepath);
-            return -1;	
-		}
-	}
-
-	/* update in ceph */
-	if (_fil_update_metadata_json() < 0) {
-		return -1;
+	struct fil_md_node *node;
+	int ret = -1;
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if (!(node = _fil_md_lookup(filepath,type))) {
+		fprintf(stderr, "error: file %s is not in the metadata\n",filepath);
+	} else if (_fil_md_remove(node) == 0) {
+		_fil_md_changed(filepath,type);
+		/* update in ceph */
+		ret = _fil_update_metadata_json();
 	}
+	pthread_mutex_unlock(&fil_catalog_mutex);
 
-	return 0;
+	return ret < 0 ? -1 : 0;
 }
 
 /* 	
- * (pseudoPrivate) Return the json metadata entry of a file.  The caller
- * is responsible to call json_decref on the object.
- * return json_t* or NULL if not successfull -1 if error
+ * (pseudoPrivate) Return the json metadata entry of a file, deleted or
+ * not.  The entry is borrowed from the metadata, the caller must not
+ * call json_decref on it.
+ * return json_t* or NULL if not successfull
 */
 json_t* _fil_get_json_metadata(
         char* filepath,   /* file path like sbtest/sbtest.ibd */
         os_file_type_t type /* file object type, seen enum def */
         )
 {
-	/* TODO:  may need a mutex when used with multiple threads */
-	int index = _fil_find_in_metadata(filepath,type);
-    json_t *file;
-    
-	if(index < 0) {
-		/* error should be reported to stderr in _fil_find_in_metadata */
-        return NULL;
-	} else {
-		file = json_array_get(metadata_json,index);
-		if (!file) {
-			fprintf(stderr, "Error extracting the file object from the metadata\n");
-			return NULL;
-		}
-    }
-    
-    return file;
+	struct fil_md_node *node;
+	json_t *file = NULL;
+
+	if (!metadata_json && _fil_load_metadata_json() < 0) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	if ((node = _fil_md_lookup(filepath,type))) {
+		file = json_array_get(metadata_json,node->index);
+	}
+	pthread_mutex_unlock(&fil_catalog_mutex);
+
+	if (!file) {
+		fprintf(stderr, "Error extracting the file object %s from the metadata\n", filepath);
+	}
+	return file;
 }
+
 /* 	
 	(pseudoPrivate) Allocate and initialize
 	the file descriptor, fp is allocated in fil_open or fil_create 
@@ -1134,85 +9008,60 @@ int _fil_get_file_metadata(
         FILErados_t*	fp  /* rados file FILE struct */
         )
 {
-	/* TODO:  may need a mutex when used with multiple threads */
-	int index = _fil_find_in_metadata(filepath,type);
-
-    json_t *jfile, *jpath, *jsize, *jblock_size, *jtype, *jdeleted, *jn_ref;
-	if(index < 0) {
-		/* error should be reported to stderr in _fil_find_in_metadata */
+    json_t *jfile, *jpath, *jsize, *jblock_size, *jtype, *jdeleted, *jcodec;
+    struct fil_md_node *node;
+    int pool;
+
+	pthread_mutex_lock(&fil_catalog_mutex);
+	node = _fil_md_lookup(filepath,type);
+	if(!node || node->deleted) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: file %s is not in the metadata\n", filepath);
         return -1;
-	} else {
-		jfile = json_array_get(metadata_json,index);
-		if (!jfile) {
-			fprintf(stderr, "Error extracting the file object from the metadata\n");
-			return -1;
-		}
-		
-		jpath = (json_t *) (intptr_t) json_object_get(jfile,"path");
-		if(!json_is_string(jpath)) {
-            fprintf(stderr, "error: path element returned is not a string\n");
-            json_decref(jfile);
-            return -1;
-        } else {
-			fp->metadata.name = strdup(json_string_value(jpath));
-		}
-		json_decref(jpath);
-
-		jtype = (json_t *) (intptr_t) json_object_get(jfile,"type");
-		if(!json_is_integer(jtype)) {
-            fprintf(stderr, "error: type element returned is not an integer\n");
-            json_decref(jfile);
-            return -1;
-        } else {
-			fp->metadata.type = (int) json_integer_value(jtype);
-		}
-		json_decref(jtype);
-
-		jdeleted = (json_t *) (intptr_t) json_object_get(jfile,"deleted");
-		if(!json_is_integer(jdeleted)) {
-            fprintf(stderr, "error: deleted element returned is not an integer\n");
-            json_decref(jfile);
-            json_decref(jdeleted);
-            return -1;
-        } else {
-			fp->metadata.deleted = (int) json_integer_value(jdeleted);
-		}
-		json_decref(jdeleted);
+	}
+	jfile = json_array_get(metadata_json,node->index);
+
+	jpath = json_object_get(jfile,"path");
+	jtype = json_object_get(jfile,"type");
+	jdeleted = json_object_get(jfile,"deleted");
+	jblock_size = json_object_get(jfile,"block_size");
+	jsize = json_object_get(jfile,"size");
+	if(!json_is_string(jpath) || !json_is_integer(jtype) || !json_is_integer(jdeleted)
+			|| !json_is_integer(jblock_size) || !json_is_integer(jsize)) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+        fprintf(stderr, "error: invalid metadata element for file %s\n", filepath);
+        return -1;
+    }
 
-		jblock_size = (json_t *) (intptr_t) json_object_get(jfile,"jblock_size");
-		if(!json_is_integer(jblock_size)) {
-            fprintf(stderr, "error: block_size element returned is not an integer\n");
-            json_decref(jfile);
-            json_decref(jblock_size);
-            return -1;
-        } else {
-			fp->metadata.block_size = (unsigned int) json_integer_value(jblock_size);
-		}
-		json_decref(jblock_size);
+	if (!(fp->metadata.name = strdup(json_string_value(jpath)))) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		fprintf(stderr, "Error: unable to allocate memory for file %s\n", filepath);
+		return -1;
+	}
+	fp->metadata.type = (os_file_type_t) json_integer_value(jtype);
+	fp->metadata.deleted = (unsigned int) json_integer_value(jdeleted);
+	fp->metadata.block_size = (unsigned int) json_integer_value(jblock_size);
+	fp->metadata.size = (size_t) json_integer_value(jsize);
+
+	/* codec is optional, files created before compression are not compressed */
+	jcodec = json_object_get(jfile,"codec");
+	if(json_is_integer(jcodec)) {
+		fp->metadata.codec = (fil_codec_t) json_integer_value(jcodec);
+	} else {
+		fp->metadata.codec = FIL_CODEC_NONE;
+	}
 
-		jsize = (json_t *) (intptr_t) json_object_get(jfile,"size");
-		if(!json_is_integer(jsize)) {
-            fprintf(stderr, "error: size element returned is not an integer\n");
-            json_decref(jfile);
-       		json_decref(jsize);
-            return -1;
-        } else {
-			fp->metadata.size = (size_t) json_integer_value(jsize);
-		}
-		json_decref(jsize);
+	if ((pool = _fil_get_pool(jfile)) < 0
+			|| !(fp->metadata.prefix = _fil_get_object_prefix(jfile))) {
+		pthread_mutex_unlock(&fil_catalog_mutex);
+		free(fp->metadata.name);
+		fp->metadata.name = NULL;
+		return -1;
+	}
+	fp->pool = pool;
 
-		jn_ref = (json_t *) (intptr_t) json_object_get(jfile,"nref");
-		if(!json_is_integer(jn_ref)) {
-            fprintf(stderr, "error: nref element returned is not an integer\n");
-			json_decref(jn_ref);
-            json_decref(jfile);
-            return -1;
-        } else {
-			fp->metadata.n_ref = (size_t) json_integer_value(jn_ref);
-		}
-		json_decref(jn_ref);
-	}	
-	json_decref(jfile);
+	fp->metadata.n_ref = node->n_ref;
+	pthread_mutex_unlock(&fil_catalog_mutex);
 
 	return 0;
 }
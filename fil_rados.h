@@ -1,4 +1,12 @@
+#ifndef FIL_RADOS_H
+#define FIL_RADOS_H
+
 #include <jansson.h>
+#include <rados/librados.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /* Structure to perform the role of a file handle with rados */
 /* Borrowed from os0file.h */
@@ -12,6 +20,15 @@ enum os_file_type {
 
 typedef enum os_file_type os_file_type_t;
 
+/* Compression codec of the block objects of a file */
+enum fil_codec {
+	FIL_CODEC_NONE = 0,			/* blocks stored raw */
+	FIL_CODEC_LZ4,				/* LZ4, needs HAVE_LZ4 */
+	FIL_CODEC_ZSTD				/* zstd, needs HAVE_ZSTD */
+};
+
+typedef enum fil_codec fil_codec_t;
+
 struct rados_file_metadata_entry {
 	char			*name;
 	os_file_type_t		type;
@@ -19,17 +36,148 @@ struct rados_file_metadata_entry {
 	unsigned long long	size; /* in MySQL: ib_int64_t */
 	unsigned int		deleted; /* 0 = not deleted, 1 = deleted */
 	unsigned int		n_ref; /* number of references to the file, important for deletions */
+	fil_codec_t		codec; /* compression of the block objects */
+	char			*prefix; /* prefix of the block object names */
 	/* could also have mtime, ctime, atime and perm, see struct os_file_stat_t in os0file.h */
 
 };
 
+/* Appends in flight on a handle, see fil_append */
+struct fil_append_state;
+/* Asynchronous requests in flight on a handle, see fil_aio_read */
+struct fil_aio_state;
+/* Blocks read ahead on a handle, see fil_advise */
+struct fil_ra_state;
+/* State shared by the handles of a file in this process */
+struct fil_file_shared;
+/* Record of the end of file in flight, see _fil_record_eof */
+struct fil_eof_record;
+
 struct rados_file_handle {
 	struct rados_file_metadata_entry  metadata;
 	unsigned long long	position; /* in MySQL: ib_int64_t */
+	unsigned int		size_known; /* 1 once the size has been derived from the objects */
+	unsigned int		size_dirty; /* 1 if the catalog size is behind metadata.size */
+	size_t			eof_block; /* end of file object recorded, see _fil_record_eof */
+	struct fil_eof_record	*eof_record; /* NULL if none in flight */
+	struct fil_append_state	*append; /* NULL until the first fil_append */
+	struct fil_aio_state	*aio; /* requests in flight */
+	struct fil_ra_state	*ra; /* NULL until the first fil_advise */
+	unsigned int		shard; /* cluster handle of the file, see fil_rados_init_sharded */
+	unsigned int		pool; /* data pool of the file, see fil_placement_add */
+	struct fil_file_shared	*shared; /* generation of the file, see _fil_gen_bump */
+	unsigned long long	gen_written; /* generation set by the first write of the handle, 0 if none */
+	size_t			ec_align; /* write alignment, 0 if none, see fil_ec_configure */
+	/* split a read / a write in blocks, see _fil_select_block_io */
+	ssize_t (*read_blocks)(struct rados_file_handle *fp, char *buf,
+		size_t len, size_t offset);
+	ssize_t (*write_blocks)(struct rados_file_handle *fp, const char *buf,
+		size_t len, size_t offset, size_t file_size);
 };
 
 typedef struct rados_file_handle FILErados_t;
 
+/* One extent of a vectored I/O, see fil_readv and fil_writev */
+struct fil_iovec {
+	void*		buf;	/* buffer where to read / to get data to write */
+	size_t		len;	/* number of bytes */
+	size_t		offset;	/* offset in the file */
+};
+
+/* Huge page backing of the buffer pool, see fil_bufpool_configure */
+#define FIL_BUFPOOL_HUGE_THP		1	/* madvise(MADV_HUGEPAGE) */
+#define FIL_BUFPOOL_HUGE_EXPLICIT	2	/* MAP_HUGETLB, needs reserved huge pages */
+
+int fil_bufpool_configure(
+	unsigned int	flags	/* huge page backing */
+	);
+
+void* _fil_buf_alloc(
+	size_t	size	/* size of the buffer */
+	);
+
+void _fil_buf_free(
+	void*	buf,	/* buffer from _fil_buf_alloc */
+	size_t	size	/* size given to _fil_buf_alloc */
+	);
+
+void _fil_bufpool_destroy();
+
+/* I/O classes of the scheduler, in priority order, see fil_sched_configure */
+enum fil_io_class {
+	FIL_IO_FOREGROUND = 0,			/* reads and writes of the application */
+	FIL_IO_LOG,				/* fil_append */
+	FIL_IO_FLUSH,				/* background flushes */
+	FIL_IO_PURGE,				/* removal of the objects of deleted files */
+	FIL_IO_IMPORT,				/* bulk import and export */
+	FIL_IO_N_CLASSES
+};
+
+typedef enum fil_io_class fil_io_class_t;
+
+int fil_sched_configure(
+	fil_io_class_t		io_class,	/* class to limit */
+	unsigned int		max_in_flight,	/* operations in flight, 0 = unlimited */
+	unsigned long long	bytes_per_sec,	/* bandwidth cap, 0 = unlimited */
+	unsigned long long	burst		/* bucket size in bytes, 0 = 100ms of bandwidth */
+	);
+
+int fil_sched_set_max_in_flight(
+	unsigned int	max_in_flight	/* operations in flight of all classes, 0 = unlimited */
+	);
+
+fil_io_class_t fil_set_io_class(
+	fil_io_class_t	io_class	/* class of the I/O of the calling thread */
+	);
+
+int _fil_sched_acquire(
+	size_t	bytes	/* bytes moved by the operation */
+	);
+
+void _fil_sched_release(
+	int	token	/* returned by _fil_sched_acquire */
+	);
+
+int fil_metadata_cache_configure(
+	const char*	cache_path	/* local snapshot file, NULL to disable */
+	);
+
+int _fil_save_metadata_snapshot(
+	const char*	json,	/* json text of the catalog */
+	size_t		json_len,	/* length of the json text */
+	uint64_t	version,	/* version of the metadata object */
+	time_t		mtime	/* mtime of the metadata object */
+	);
+
+int _fil_load_metadata_text(
+	const char*	json,	/* json text of the catalog */
+	size_t		json_len,	/* length of the json text */
+	uint64_t	version	/* version of the metadata object */
+	);
+
+/* Called with each catalog change notification of this process, see
+   fil_metadata_watch_loopback */
+typedef void (*fil_md_publish_cb_t)(
+	void*		arg,	/* argument given to fil_metadata_watch_loopback */
+	const char*	msg,	/* notification text */
+	size_t		len	/* length of the text */
+	);
+
+int fil_metadata_watch();
+
+int fil_metadata_watch_loopback(
+	fil_md_publish_cb_t	publish,	/* called with each notification */
+	void*			arg,	/* passed to publish */
+	uint64_t		client_id	/* id of this client in the notifications */
+	);
+
+int fil_metadata_receive(
+	const char*	msg,	/* notification text */
+	size_t		len	/* length of the text */
+	);
+
+void fil_metadata_unwatch();
+
 int fil_rados_init(
 	const char* cluster_name, /* name of the cluster */
 	const char* user_name, /* auth user for cephx */
@@ -37,6 +185,76 @@ int fil_rados_init(
 	const char* conf_file /* configuration file */
 	);
 
+/* Mapping of the I/O onto the shards, see fil_rados_init_sharded */
+#define FIL_SHARD_BY_FILE	0	/* by the object prefix of the file */
+#define FIL_SHARD_BY_THREAD	1	/* synchronous I/O by calling thread */
+
+int fil_rados_init_sharded(
+	const char* cluster_name, /* name of the cluster */
+	const char* user_name, /* auth user for cephx */
+	const char* pool_name, /* data pool */
+	const char* conf_file, /* configuration file */
+	unsigned int n_shards, /* number of cluster handles, 1 for a single one */
+	int mode /* FIL_SHARD_BY_FILE or FIL_SHARD_BY_THREAD */
+	);
+
+unsigned int _fil_shard_of(
+	const char*	prefix	/* prefix of the object names of the file */
+	);
+
+rados_ioctx_t _fil_ioctx(
+	FILErados_t*    fp	/* handle to a file */
+	);
+
+rados_ioctx_t _fil_file_ioctx(
+	FILErados_t*    fp	/* handle to a file */
+	);
+
+int _fil_pool_open(
+	const char*	pool_name	/* name of the pool */
+	);
+
+int _fil_get_pool(
+	json_t *jfile   /* json file element */
+	);
+
+int fil_placement_add(
+	const char*	pattern,	/* pattern of the path, NULL for any path */
+	os_file_type_t	type,		/* type of the file, OS_FILE_TYPE_UNKNOWN for any */
+	const char*	pool_name	/* data pool of the matching files */
+	);
+
+void fil_placement_clear();
+
+char* _fil_placement_of(
+	const char*	filepath,	/* path of the new file */
+	os_file_type_t	type		/* type of the new file */
+	);
+
+int fil_migrate(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	pool_name,	/* new pool of the file */
+	unsigned int	parallelism	/* objects copied at once, 0 for 1 */
+	);
+
+/* Writes on an erasure coded pool, see fil_ec_configure */
+#define FIL_EC_AUTO	0	/* whole blocks if the pool requires alignment */
+#define FIL_EC_ON	1	/* whole blocks, or whole stripes */
+#define FIL_EC_OFF	2	/* unaligned writes */
+
+int fil_ec_configure(
+	int		mode,	/* FIL_EC_AUTO, FIL_EC_ON or FIL_EC_OFF */
+	size_t		stripe_width	/* with FIL_EC_ON, 0 for whole objects */
+	);
+
+size_t _fil_ec_detect(
+	rados_ioctx_t	io	/* io context of the pool */
+	);
+
+size_t _fil_ec_align_of(
+	FILErados_t*    fp	/* handle to a file */
+	);
+
 void fil_rados_destroy();
 
 int fil_close(FILErados_t* fp);
@@ -55,6 +273,27 @@ int fil_delete_file(
 
 void fil_flush();
 
+/* Called by fil_readdir for each entry, return non zero to stop */
+typedef int (*fil_readdir_cb_t)(
+	void*		arg,	/* argument given to fil_readdir */
+	const char*	name,	/* name of the entry in the directory */
+	os_file_type_t	type	/* type of the entry */
+	);
+
+int fil_mkdir(
+	char*	dirpath	/* directory path like sbtest */
+	);
+
+int fil_rmdir(
+	char*	dirpath	/* directory path like sbtest */
+	);
+
+int fil_readdir(
+	const char*		dirpath,	/* directory path like sbtest */
+	fil_readdir_cb_t	callback,	/* called for each entry */
+	void*			arg	/* passed to callback */
+	);
+
 FILErados_t* fil_open( 
 	char* filepath,   /* file path like sbtest/sbtest.ibd */
 	os_file_type_t type /* file object type, seen enum def */
@@ -74,6 +313,175 @@ int fil_write(
 	size_t		offset  /* offset from where to start reading */
     );
     
+ssize_t fil_atomic_write_unit(
+	FILErados_t*    fp	/* handle to a file */
+	);
+
+int fil_write_atomic(
+	FILErados_t*    fp,	/* handle to a file */
+	void*		buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		offset	/* offset in the file */
+	);
+
+int fil_append(
+	FILErados_t*    fp,	/* handle to a file */
+	const void*	buf,	/* buffer where to get data to write */
+	size_t		len	/* number of bytes to append */
+	);
+
+int fil_append_sync(
+	FILErados_t*    fp	/* handle to a file */
+	);
+
+ssize_t fil_get_size(
+	FILErados_t*    fp	/* handle to a file */
+	);
+
+int fil_codec_supported(
+	fil_codec_t	codec	/* compression codec */
+	);
+
+int fil_set_compression(
+	FILErados_t*    fp,	/* handle to a file */
+	fil_codec_t	codec	/* compression codec */
+	);
+
+ssize_t fil_readv(
+	FILErados_t*		fp,	/* handle to a file */
+	const struct fil_iovec*	iov,	/* extents to read */
+	int			iovcnt	/* number of extents */
+	);
+
+ssize_t fil_writev(
+	FILErados_t*		fp,	/* handle to a file */
+	const struct fil_iovec*	iov,	/* extents to write */
+	int			iovcnt	/* number of extents */
+	);
+
+int fil_aio_merge_configure(
+	unsigned int	max_requests,	/* requests merged at most */
+	unsigned int	window_us	/* time a request may be held */
+	);
+
+void _fil_aio_merge_stop();
+
+/* Completion of an asynchronous request, result is the number of bytes
+   transferred or -1 for reads and writes, 0 or a negative error for
+   barriers */
+typedef void (*fil_aio_cb_t)(
+	void*		arg,	/* argument given with the request */
+	ssize_t		result	/* result of the request */
+	);
+
+int fil_aio_read(
+	FILErados_t*    fp,	/* handle to a file */
+	void*		buf,	/* buffer where to read */
+	size_t		len,	/* number of bytes to read */
+	size_t		offset,	/* offset from where to start reading */
+	fil_aio_cb_t	cb,	/* called when done */
+	void*		cb_arg	/* passed to cb */
+	);
+
+int fil_aio_write(
+	FILErados_t*    fp,	/* handle to a file */
+	const void*	buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		offset,	/* offset in the file */
+	fil_aio_cb_t	cb,	/* called when done */
+	void*		cb_arg	/* passed to cb */
+	);
+
+int fil_aio_fsync(
+	FILErados_t*    fp,	/* handle to a file */
+	fil_aio_cb_t	cb,	/* called when done */
+	void*		cb_arg	/* passed to cb */
+	);
+
+int fil_fsync(
+	FILErados_t*    fp	/* handle to a file */
+	);
+
+int fil_fdatasync(
+	FILErados_t*    fp	/* handle to a file */
+	);
+
+/* Access hints, see fil_advise */
+#define FIL_ADV_NORMAL		0	/* read ahead of sequential reads */
+#define FIL_ADV_SEQUENTIAL	1	/* read further ahead */
+#define FIL_ADV_RANDOM		2	/* no read ahead */
+#define FIL_ADV_WILLNEED	3	/* read the range now */
+#define FIL_ADV_DONTNEED	4	/* drop the range */
+
+int fil_advise(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		offset,	/* offset in the file */
+	size_t		len,	/* number of bytes, 0 for up to the end */
+	int		hint	/* FIL_ADV_* */
+	);
+
+/* Write policy of the local cache, see fil_local_cache_configure */
+#define FIL_LCACHE_WRITE_AROUND		0	/* the writes drop the blocks */
+#define FIL_LCACHE_WRITE_THROUGH	1	/* the blocks written as a whole are cached */
+
+int fil_local_cache_configure(
+	const char*		dir,	/* directory of the cache, NULL to close it */
+	unsigned long long	capacity,	/* bytes of the data file */
+	size_t			slot_size,	/* bytes of a slot, the largest object cached */
+	int			policy	/* FIL_LCACHE_WRITE_AROUND or FIL_LCACHE_WRITE_THROUGH */
+	);
+
+/* Operations of the ring entries, see fil_ring_submit */
+#define FIL_RING_READ	0	/* fil_aio_read */
+#define FIL_RING_WRITE	1	/* fil_aio_write */
+#define FIL_RING_FSYNC	2	/* fil_aio_fsync */
+
+/* Submission entry, see fil_ring_get_sqe */
+struct fil_sqe {
+	FILErados_t*	fp;	/* handle to a file */
+	int		opcode;	/* FIL_RING_READ, FIL_RING_WRITE or FIL_RING_FSYNC */
+	void*		buf;	/* buffer, valid until completed */
+	size_t		len;	/* number of bytes */
+	size_t		offset;	/* offset in the file */
+	uint64_t	user_data;	/* given back in the completion */
+};
+
+/* Completion entry, see fil_ring_reap */
+struct fil_cqe {
+	uint64_t	user_data;	/* of the submission entry */
+	ssize_t		result;	/* bytes or -1, 0 or a negative error for FIL_RING_FSYNC */
+};
+
+struct fil_ring;
+
+struct fil_ring* fil_ring_create(
+	unsigned int	entries	/* size of the rings */
+	);
+
+void fil_ring_destroy(
+	struct fil_ring*	ring	/* ring from fil_ring_create */
+	);
+
+struct fil_sqe* fil_ring_get_sqe(
+	struct fil_ring*	ring	/* ring from fil_ring_create */
+	);
+
+int fil_ring_submit(
+	struct fil_ring*	ring	/* ring from fil_ring_create */
+	);
+
+int fil_ring_reap(
+	struct fil_ring*	ring,	/* ring from fil_ring_create */
+	struct fil_cqe*		cqes,	/* where to copy the completions */
+	unsigned int		max,	/* size of cqes */
+	unsigned int		min_complete	/* completions to wait for */
+	);
+
+char* _fil_get_object_name(
+	FILErados_t*    fp,	/* handle to a file */
+	size_t		block_offset	/* offset of the beginning of the block */
+	);
+    
 int _fil_get_block_size(
 	json_t *file   /* json file element */
 	);
@@ -113,12 +521,144 @@ int _fil_set_deleted(
 	char* filepath,   /* file path like sbtest/sbtest.ibd */
 	os_file_type_t type
 	);
+
+int _fil_delete_begin(
+	char* filepath,   /* file path like sbtest/sbtest.ibd */
+	os_file_type_t type, /* file object type, seen enum def */
+	int* pool,	/* data pool of the file, see _fil_get_pool */
+	char** prefix,	/* prefix of the object names, to free */
+	int* block_size	/* block size of the file */
+	);
     
+ssize_t _fil_rados_read_object(
+	rados_ioctx_t	io,	/* io context of the object, see _fil_ioctx */
+	const char*	obj_name,	/* name of the rados object */
+	char*		buf,	/* buffer where to read */
+	size_t		len,	/* number of bytes to read */
+	size_t		offset  /* offset within the object */
+	);
+
+ssize_t _fil_rados_write_object(
+	rados_ioctx_t	io,	/* io context of the object, see _fil_ioctx */
+	const char*	obj_name,	/* name of the rados object */
+	const char*	buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		offset,  /* offset within the object */
+	size_t		file_size	/* new file size, 0 if not extending */
+	);
+
+void _fil_write_op_set_size(
+	rados_write_op_t	write_op,	/* compound write operation */
+	size_t			file_size	/* new size of the file */
+	);
+
+int _fil_derive_size(
+	FILErados_t*    fp	/* handle to a file */
+	);
+
+ssize_t _fil_rados_write_full_object(
+	rados_ioctx_t	io,	/* io context of the object, see _fil_ioctx */
+	const char*	obj_name,	/* name of the rados object */
+	const char*	buf,	/* new content of the object */
+	size_t		len,	/* length of the new content */
+	size_t		file_size	/* new file size, 0 if not extending */
+	);
+
+size_t _fil_block_object_size(
+	fil_codec_t	codec,	/* compression codec */
+	size_t		raw_len	/* uncompressed length of the block */
+	);
+
+size_t _fil_encode_block(
+	fil_codec_t	codec,	/* compression codec */
+	const char*	block,	/* uncompressed block */
+	size_t		raw_len,	/* uncompressed length of the block */
+	unsigned char*	obj_buf,	/* of _fil_block_object_size bytes */
+	size_t		obj_buf_len	/* size of obj_buf */
+	);
+
+ssize_t _fil_decode_block(
+	const unsigned char*	obj_buf,	/* object of the block */
+	size_t			obj_len,	/* length of the object */
+	char*			block,	/* where to uncompress the block */
+	size_t			block_size	/* size of block */
+	);
+
+int _fil_load_compressed_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	char*		block,	/* where to uncompress the block */
+	size_t*		raw_len	/* uncompressed length of the block */
+	);
+
+int _fil_is_zero(
+	const void*	buf,	/* buffer to check */
+	size_t		len	/* length of the buffer */
+	);
+
+size_t _fil_fill_hole(
+	char*		buf,	/* buffer of the block read */
+	size_t		len,	/* number of bytes requested */
+	size_t		bytes_read,	/* number of bytes actually read */
+	size_t		file_offset,	/* file offset of buf */
+	size_t		file_size	/* size of the file when the read was issued */
+	);
+
+ssize_t _fil_read_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	char*		buf,	/* buffer where to read */
+	size_t		len,	/* number of bytes to read */
+	size_t		offset  /* offset within the block */
+	);
+
+ssize_t _fil_ec_write_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	const char*	buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		offset,  /* offset within the block */
+	size_t		file_size	/* new file size, 0 if not extending */
+	);
+
+ssize_t _fil_write_block(
+	FILErados_t*    fp,	/* handle to a file */
+	const char*	obj_name,	/* name of the rados object */
+	const char*	buf,	/* buffer where to get data to write */
+	size_t		len,	/* number of bytes to write */
+	size_t		offset,  /* offset within the block */
+	size_t		file_size	/* new file size, 0 if not extending */
+	);
+
+int _fil_rados_remove_object(
+	rados_ioctx_t	io,	/* io context of the object, see _fil_ioctx */
+	const char*	obj_name	/* name of the rados object */
+	);
+
 int _fil_delete_rados_objects(
-    const char* filepath,  /* path of the file */
+    unsigned int pool,   /* data pool of the file, see _fil_get_pool */
+    const char* prefix,  /* prefix of the object names of the file */
     const unsigned int block_size 
     );
 
+void _fil_select_block_io(
+	FILErados_t*    fp	/* handle to a file */
+	);
+
+char* _fil_get_object_prefix(
+	json_t *file   /* json file element */
+	);
+
+int fil_rename(
+	char* oldpath,   /* current path of the file */
+	char* newpath,   /* new path of the file */
+	os_file_type_t type /* file object type, seen enum def */
+	);
+
+int fil_purge_deleted();
+
+void fil_purge_wait();
+
 int _fil_load_metadata_json();
 
 int _fil_update_metadata_json();
@@ -132,7 +672,8 @@ int _fil_add_file_metadata(
 	char* filepath,   /* file path like sbtest/sbtest.ibd */
 	os_file_type_t type, /* file object type, seen enum def */
 	size_t size,  /* Size of the file */
-	size_t blockSize /* blockSize */
+	size_t blockSize, /* blockSize */
+	const char* pool_name /* data pool, NULL for the pool given to fil_rados_init */
 	);
     
 int _fil_rm_file_metadata(
@@ -151,5 +692,9 @@ int _fil_get_file_metadata(
         os_file_type_t type, /* file object type, seen enum def */
         FILErados_t*	fp  /* rados file FILE struct */
         );
-        
 
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FIL_RADOS_H */
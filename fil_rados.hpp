@@ -0,0 +1,429 @@
+/* vim: ts=4 sts=4 sw=4 expandtab */
+/*
+ * C++ interface of radosfile, header only, over the fil_* functions.
+ *
+ * Needs C++20 (std::span).  Nothing is copied or allocated on top of the
+ * C functions: a File holds the FILErados_t pointer, the buffers are
+ * given as spans and an asynchronous request keeps its state in the
+ * Pending object the caller receives.
+ *
+ *   auto f = fil::File::open("sbtest/sbtest.ibd");
+ *   if (!f) { error f.error() }
+ *   auto n = f->read(std::as_writable_bytes(std::span(page)), offset);
+ *
+ *   fil::Pending w = f->write_async(std::as_bytes(std::span(page)), offset);
+ *   ...
+ *   auto r = w.get();
+ *
+ * With coroutines (C++20), co_read / co_write / co_fsync suspend the
+ * coroutine until the request is done, and hand it to the executor the
+ * caller gives to resume, see InlineExecutor:
+ *
+ *   auto n = co_await f->co_read(std::as_writable_bytes(std::span(page)), offset, pool);
+ */
+#ifndef FIL_RADOS_HPP
+#define FIL_RADOS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <condition_variable>
+#include <mutex>
+#include <span>
+#include <string>
+#include <utility>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define FIL_HAVE_COROUTINES 1
+#endif
+
+#include "fil_rados.h"
+
+namespace fil {
+
+/* Error of a call, the value returned by the C function, -1 or a
+   negative errno for the barriers */
+struct Error {
+	int	code;
+};
+
+/* Value or error of a call, in the manner of std::expected */
+template <class T>
+class Result {
+public:
+	Result(T value) noexcept : value_(std::move(value)), error_(0) {}
+	Result(Error error) noexcept : value_(), error_(error.code ? error.code : -1) {}
+
+	bool has_value() const noexcept { return error_ == 0; }
+	explicit operator bool() const noexcept { return has_value(); }
+
+	/* the value, only when has_value() */
+	T& value() & noexcept { return value_; }
+	const T& value() const & noexcept { return value_; }
+	T&& value() && noexcept { return std::move(value_); }
+	T& operator*() & noexcept { return value_; }
+	T* operator->() noexcept { return &value_; }
+
+	/* the error, only when !has_value() */
+	int error() const noexcept { return error_; }
+
+	T value_or(T other) const noexcept { return has_value() ? value_ : other; }
+
+private:
+	T	value_;
+	int	error_;
+};
+
+template <>
+class Result<void> {
+public:
+	Result() noexcept : error_(0) {}
+	Result(Error error) noexcept : error_(error.code ? error.code : -1) {}
+
+	bool has_value() const noexcept { return error_ == 0; }
+	explicit operator bool() const noexcept { return has_value(); }
+	int error() const noexcept { return error_; }
+
+private:
+	int	error_;
+};
+
+/* Result of fil_read / fil_write like calls, the size or -1 */
+inline Result<std::size_t> _result_of(ssize_t ret) noexcept
+{
+	if (ret < 0) {
+		return Error{(int) ret};
+	}
+	return (std::size_t) ret;
+}
+
+/* Result of calls returning 0 or -1 */
+inline Result<void> _status_of(int ret) noexcept
+{
+	if (ret < 0) {
+		return Error{ret};
+	}
+	return {};
+}
+
+/* Submit an asynchronous request, see fil_aio_read */
+enum class _aio_op { read, write, fsync };
+
+inline int _aio_submit(FILErados_t* fp, _aio_op op, void* buf, std::size_t len,
+	std::size_t offset, fil_aio_cb_t cb, void* cb_arg) noexcept
+{
+	switch (op) {
+	case _aio_op::read:
+		return fil_aio_read(fp, buf, len, offset, cb, cb_arg);
+	case _aio_op::write:
+		return fil_aio_write(fp, buf, len, offset, cb, cb_arg);
+	default:
+		return fil_aio_fsync(fp, cb, cb_arg);
+	}
+}
+
+class File;
+
+/* An asynchronous request in flight, in the manner of a future.  It is
+   created in place by File::read_async and friends and can neither be
+   copied nor moved since librados completes it by address.  Destroying
+   it waits for the request. */
+class Pending {
+public:
+	Pending(const Pending&) = delete;
+	Pending& operator=(const Pending&) = delete;
+
+	~Pending() { wait(); }
+
+	/* true once the request is done, get() does not wait then */
+	bool ready() const noexcept
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return done_;
+	}
+
+	/* wait for the request */
+	void wait() const noexcept
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [this] { return done_; });
+	}
+
+	/* wait for the request, return the bytes transferred, 0 for a
+	   barrier */
+	Result<std::size_t> get() const noexcept
+	{
+		wait();
+		return _result_of(result_);
+	}
+
+private:
+	friend class File;
+
+	Pending(FILErados_t* fp, _aio_op op, void* buf, std::size_t len,
+		std::size_t offset) noexcept
+	{
+		if (_aio_submit(fp, op, buf, len, offset, &Pending::complete, this) < 0) {
+			/* not submitted, cb is not called */
+			result_ = -1;
+			done_ = true;
+		}
+	}
+
+	/* in a librados thread, the waiter can destroy the object as soon
+	   as the mutex is released */
+	static void complete(void* arg, ssize_t result) noexcept
+	{
+		Pending* p = static_cast<Pending*>(arg);
+		std::lock_guard<std::mutex> lock(p->mutex_);
+		p->result_ = result;
+		p->done_ = true;
+		p->cond_.notify_all();
+	}
+
+	mutable std::mutex		mutex_;
+	mutable std::condition_variable	cond_;
+	bool				done_ = false;
+	ssize_t				result_ = 0;
+};
+
+#ifdef FIL_HAVE_COROUTINES
+
+/* Resumes a coroutine in the librados thread completing its request,
+   the coroutine must then not block until its next co_await.  Not a
+   default, since a blocking coroutine stalls the completions of every
+   request: any type with a post(std::coroutine_handle<>) noexcept
+   member can be given instead, e.g. one queueing the coroutine to a
+   pool of threads. */
+struct InlineExecutor {
+	void post(std::coroutine_handle<> h) const noexcept { h.resume(); }
+};
+
+/* co_await of an asynchronous request, see File::co_read.  It lives in
+   the frame of the coroutine, the request completes it by address. */
+template <class Executor>
+class IoAwaitable {
+public:
+	IoAwaitable(FILErados_t* fp, _aio_op op, void* buf, std::size_t len,
+		std::size_t offset, Executor ex) noexcept
+		: fp_(fp), op_(op), buf_(buf), len_(len), offset_(offset),
+		  ex_(std::move(ex)) {}
+
+	IoAwaitable(const IoAwaitable&) = delete;
+	IoAwaitable& operator=(const IoAwaitable&) = delete;
+
+	bool await_ready() const noexcept { return false; }
+
+	/* a request done before the submission returns, like those of the
+	   compressed and erasure coded files that are done synchronously,
+	   goes on in this thread rather than being posted from within the
+	   submission */
+	bool await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		handle_ = h;
+		if (_aio_submit(fp_, op_, buf_, len_, offset_, &IoAwaitable::complete, this) < 0) {
+			/* not submitted, go on at once */
+			result_ = -1;
+			return false;
+		}
+		/* once submitted, the completion may post the coroutine, and
+		   this be gone, as soon as the state is exchanged */
+		return state_.exchange(_submitted, std::memory_order_acq_rel) != _completed;
+	}
+
+	/* the bytes transferred, 0 for a barrier */
+	Result<std::size_t> await_resume() const noexcept { return _result_of(result_); }
+
+private:
+	enum { _submitting, _submitted, _completed };
+
+	static void complete(void* arg, ssize_t result) noexcept
+	{
+		IoAwaitable* a = static_cast<IoAwaitable*>(arg);
+		/* the frame, and the awaitable with it, may be gone as soon
+		   as the state is exchanged */
+		Executor ex(std::move(a->ex_));
+		std::coroutine_handle<> h = a->handle_;
+		a->result_ = result;
+		if (a->state_.exchange(_completed, std::memory_order_acq_rel) == _submitting) {
+			/* await_suspend goes on itself */
+			return;
+		}
+		ex.post(h);
+	}
+
+	FILErados_t*		fp_;
+	_aio_op			op_;
+	void*			buf_;
+	std::size_t		len_;
+	std::size_t		offset_;
+	Executor		ex_;
+	std::coroutine_handle<>	handle_;
+	ssize_t			result_ = 0;
+	std::atomic<int>	state_{_submitting};
+};
+
+#endif /* FIL_HAVE_COROUTINES */
+
+/* An open file, closed when destroyed, move only */
+class File {
+public:
+	File() noexcept = default;
+	/* take a handle from fil_open */
+	explicit File(FILErados_t* fp) noexcept : fp_(fp) {}
+
+	File(const File&) = delete;
+	File& operator=(const File&) = delete;
+	File(File&& other) noexcept : fp_(std::exchange(other.fp_, nullptr)) {}
+	File& operator=(File&& other) noexcept
+	{
+		if (this != &other) {
+			close();
+			fp_ = std::exchange(other.fp_, nullptr);
+		}
+		return *this;
+	}
+	~File() { close(); }
+
+	/* open an existing file, see fil_open */
+	static Result<File> open(const char* path,
+		os_file_type_t type = OS_FILE_TYPE_FILE) noexcept
+	{
+		FILErados_t* fp = fil_open(const_cast<char*>(path), type);
+		if (!fp) {
+			return Error{-1};
+		}
+		return File(fp);
+	}
+	static Result<File> open(const std::string& path,
+		os_file_type_t type = OS_FILE_TYPE_FILE) noexcept
+	{
+		return open(path.c_str(), type);
+	}
+
+	/* open a file, created with block_size if it does not exist, see
+	   fil_open_create */
+	static Result<File> create(const char* path, std::size_t block_size,
+		os_file_type_t type = OS_FILE_TYPE_FILE) noexcept
+	{
+		FILErados_t* fp = fil_open_create(const_cast<char*>(path), type, block_size);
+		if (!fp) {
+			return Error{-1};
+		}
+		return File(fp);
+	}
+	static Result<File> create(const std::string& path, std::size_t block_size,
+		os_file_type_t type = OS_FILE_TYPE_FILE) noexcept
+	{
+		return create(path.c_str(), block_size, type);
+	}
+
+	/* close now rather than when destroyed, see fil_close */
+	Result<void> close() noexcept
+	{
+		if (!fp_) {
+			return {};
+		}
+		return _status_of(fil_close(std::exchange(fp_, nullptr)));
+	}
+
+	explicit operator bool() const noexcept { return fp_ != nullptr; }
+	FILErados_t* get() const noexcept { return fp_; }
+	/* give up the handle, the caller closes it */
+	FILErados_t* release() noexcept { return std::exchange(fp_, nullptr); }
+
+	/* see fil_read, less than buf.size() at the end of the file */
+	Result<std::size_t> read(std::span<std::byte> buf, std::size_t offset) noexcept
+	{
+		return _result_of(fil_read(fp_, buf.data(), buf.size(), offset));
+	}
+
+	/* see fil_write */
+	Result<std::size_t> write(std::span<const std::byte> buf, std::size_t offset) noexcept
+	{
+		return _result_of(fil_write(fp_, const_cast<std::byte*>(buf.data()),
+			buf.size(), offset));
+	}
+
+	/* see fil_write_atomic */
+	Result<std::size_t> write_atomic(std::span<const std::byte> buf,
+		std::size_t offset) noexcept
+	{
+		return _result_of(fil_write_atomic(fp_, const_cast<std::byte*>(buf.data()),
+			buf.size(), offset));
+	}
+
+	/* see fil_append */
+	Result<std::size_t> append(std::span<const std::byte> buf) noexcept
+	{
+		return _result_of(fil_append(fp_, buf.data(), buf.size()));
+	}
+
+	/* see fil_append_sync */
+	Result<void> append_sync() noexcept
+	{
+		return _status_of(fil_append_sync(fp_));
+	}
+
+	/* see fil_fsync */
+	Result<void> fsync() noexcept { return _status_of(fil_fsync(fp_)); }
+
+	/* see fil_fdatasync */
+	Result<void> fdatasync() noexcept { return _status_of(fil_fdatasync(fp_)); }
+
+	/* see fil_get_size */
+	Result<std::size_t> size() noexcept { return _result_of(fil_get_size(fp_)); }
+
+	/* see fil_aio_read, buf must stay valid until the request is done */
+	Pending read_async(std::span<std::byte> buf, std::size_t offset) noexcept
+	{
+		return Pending(fp_, _aio_op::read, buf.data(), buf.size(), offset);
+	}
+
+	/* see fil_aio_write, buf must stay valid until the request is done */
+	Pending write_async(std::span<const std::byte> buf, std::size_t offset) noexcept
+	{
+		return Pending(fp_, _aio_op::write, const_cast<std::byte*>(buf.data()),
+			buf.size(), offset);
+	}
+
+	/* see fil_aio_fsync */
+	Pending fsync_async() noexcept
+	{
+		return Pending(fp_, _aio_op::fsync, nullptr, 0, 0);
+	}
+
+#ifdef FIL_HAVE_COROUTINES
+	/* co_await-able fil_aio_read, buf must stay valid until resumed,
+	   ex resumes the coroutine, see InlineExecutor */
+	template <class Executor>
+	IoAwaitable<Executor> co_read(std::span<std::byte> buf, std::size_t offset,
+		Executor ex) noexcept
+	{
+		return IoAwaitable<Executor>(fp_, _aio_op::read, buf.data(), buf.size(),
+			offset, std::move(ex));
+	}
+
+	/* co_await-able fil_aio_write, buf must stay valid until resumed */
+	template <class Executor>
+	IoAwaitable<Executor> co_write(std::span<const std::byte> buf, std::size_t offset,
+		Executor ex) noexcept
+	{
+		return IoAwaitable<Executor>(fp_, _aio_op::write,
+			const_cast<std::byte*>(buf.data()), buf.size(), offset, std::move(ex));
+	}
+
+	/* co_await-able fil_aio_fsync */
+	template <class Executor>
+	IoAwaitable<Executor> co_fsync(Executor ex) noexcept
+	{
+		return IoAwaitable<Executor>(fp_, _aio_op::fsync, nullptr, 0, 0, std::move(ex));
+	}
+#endif /* FIL_HAVE_COROUTINES */
+
+private:
+	FILErados_t*	fp_ = nullptr;
+};
+
+} /* namespace fil */
+
+#endif /* FIL_RADOS_HPP */
@@ -1,10 +1,777 @@
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "fil_rados.h"
 
+/* Tests of the logic that runs without a cluster */
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+/* Header of the block objects of compressed files */
+static void test_block_header() {
+    char block[4096], out[4096];
+    unsigned char obj[2*4096];
+    fil_codec_t codecs[] = { FIL_CODEC_NONE, FIL_CODEC_LZ4, FIL_CODEC_ZSTD };
+    size_t i, k, len;
+
+    for (i = 0; i < sizeof(block); i++) {
+        block[i] = (char) (i % 7);
+    }
+    for (k = 0; k < sizeof(codecs)/sizeof(codecs[0]); k++) {
+        if (!fil_codec_supported(codecs[k])) {
+            continue;
+        }
+        CHECK(_fil_block_object_size(codecs[k], sizeof(block)) <= sizeof(obj));
+
+        /* whole block, uncompressed length and payload length */
+        len = _fil_encode_block(codecs[k], block, sizeof(block), obj, sizeof(obj));
+        CHECK(!memcmp(obj, "FILZ", 4));
+        CHECK(obj[8] == 0x00 && obj[9] == 0x10 && obj[10] == 0 && obj[11] == 0);
+        CHECK(len == 16 + (obj[12] | obj[13] << 8 | obj[14] << 16 | (size_t) obj[15] << 24));
+        CHECK(codecs[k] == FIL_CODEC_NONE || obj[4] == codecs[k]);
+        CHECK(_fil_decode_block(obj, len, out, sizeof(out)) == (ssize_t) sizeof(block));
+        CHECK(!memcmp(out, block, sizeof(block)));
+
+        /* short block at the end of a file */
+        len = _fil_encode_block(codecs[k], block, 100, obj, sizeof(obj));
+        CHECK(_fil_decode_block(obj, len, out, sizeof(out)) == 100 && !memcmp(out, block, 100));
+
+        /* truncated object, larger than the block, not a block */
+        CHECK(_fil_decode_block(obj, len - 1, out, sizeof(out)) == -1);
+        CHECK(_fil_decode_block(obj, len, out, 50) == -1);
+        obj[0] = 'X';
+        CHECK(_fil_decode_block(obj, len, out, sizeof(out)) == -1);
+    }
+
+    /* data that doesn't compress is stored raw */
+    srand(1);
+    for (i = 0; i < sizeof(block); i++) {
+        block[i] = (char) rand();
+    }
+    len = _fil_encode_block(FIL_CODEC_NONE, block, sizeof(block), obj, sizeof(obj));
+    CHECK(obj[4] == FIL_CODEC_NONE && len == 16 + sizeof(block));
+    CHECK(!memcmp(obj + 16, block, sizeof(block)));
+}
+
+/* Zero detection of the blocks written as holes */
+static void test_is_zero() {
+    static char buf[4096 + 64];
+    size_t start, len, i;
+
+    CHECK(_fil_is_zero(buf, 0) == 1);
+    /* every alignment, the lengths around the vector widths */
+    for (start = 0; start < 64; start++) {
+        for (len = 1; len <= 300; len++) {
+            CHECK(_fil_is_zero(buf + start, len) == 1);
+            for (i = 0; i < len; i += (len > 70 ? 13 : 1)) {
+                buf[start + i] = 1;
+                CHECK(_fil_is_zero(buf + start, len) == 0);
+                buf[start + i] = 0;
+            }
+            /* the last byte, the tail after the vectors */
+            buf[start + len - 1] = (char) 0x80;
+            CHECK(_fil_is_zero(buf + start, len) == 0);
+            buf[start + len - 1] = 0;
+        }
+    }
+    /* a byte past the length is not looked at */
+    buf[100] = 1;
+    CHECK(_fil_is_zero(buf, 100) == 1);
+    buf[100] = 0;
+    CHECK(_fil_is_zero(buf, sizeof(buf)) == 1);
+    buf[sizeof(buf) - 1] = 1;
+    CHECK(_fil_is_zero(buf, sizeof(buf)) == 0);
+}
+
+/* Size classes of the buffer pool, powers of two from 4 KiB to 64 MiB */
+static void test_bufpool() {
+    char *a, *b, *c;
+    char *bufs[40];
+    size_t size;
+    int i, j;
+
+    /* a buffer is reused by the next request of its class */
+    a = _fil_buf_alloc(1);
+    CHECK(a && (uintptr_t) a % 4096 == 0);
+    memset(a, 1, 4096);
+    _fil_buf_free(a, 1);
+    CHECK((b = _fil_buf_alloc(4096)) == a);
+    c = _fil_buf_alloc(4097);
+    CHECK(c && c != a && (uintptr_t) c % 8192 == 0);
+    memset(c, 2, 8192);
+    _fil_buf_free(c, 4097);
+    CHECK(_fil_buf_alloc(8192) == c);
+    _fil_buf_free(c, 8192);
+    _fil_buf_free(b, 4096);
+
+    /* each class is aligned on its size */
+    for (size = 4096; size <= 4*1024*1024; size *= 2) {
+        a = _fil_buf_alloc(size - 1);
+        CHECK(a && (uintptr_t) a % size == 0);
+        memset(a, 3, size);
+        _fil_buf_free(a, size - 1);
+    }
+
+    /* more live buffers than a thread keeps, all distinct */
+    for (j = 0; j < 2; j++) {
+        for (i = 0; i < 40; i++) {
+            CHECK((bufs[i] = _fil_buf_alloc(16384)) != NULL);
+            memset(bufs[i], i, 16384);
+        }
+        for (i = 0; i < 40; i++) {
+            CHECK(bufs[i][0] == i && bufs[i][16383] == i);
+        }
+        for (i = 0; i < 40; i++) {
+            _fil_buf_free(bufs[i], 16384);
+        }
+    }
+
+    /* past the largest class, mapped on its own */
+    size = 64*1024*1024 + 1;
+    CHECK((a = _fil_buf_alloc(size)) != NULL);
+    a[0] = a[size - 1] = 1;
+    _fil_buf_free(a, size);
+
+    /* the pool can be used again after it is destroyed */
+    _fil_bufpool_destroy();
+    CHECK((a = _fil_buf_alloc(4096)) != NULL);
+    memset(a, 4, 4096);
+    _fil_buf_free(a, 4096);
+    _fil_bufpool_destroy();
+}
+
+static double now_sec() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile int sched_acquired;
+
+static void* sched_waiter(void* arg) {
+    int token;
+
+    (void) arg;
+    fil_set_io_class(FIL_IO_PURGE);
+    token = _fil_sched_acquire(0);
+    sched_acquired = 1;
+    _fil_sched_release(token);
+    return NULL;
+}
+
+/* Token bucket and operation slots of the I/O scheduler */
+static void test_sched() {
+    pthread_t thread;
+    double start, elapsed;
+    int tokens[4];
+    int i;
+
+    /* nothing configured, nothing accounted */
+    CHECK(_fil_sched_acquire(1 << 20) == 0);
+    CHECK(fil_sched_configure(FIL_IO_N_CLASSES, 1, 0, 0) == -1);
+
+    /* 10 MB/s with a 1 MB burst: the burst goes at once, the bucket
+       then refills at the rate */
+    CHECK(fil_sched_configure(FIL_IO_IMPORT, 0, 10000000, 1000000) == 0);
+    CHECK(fil_set_io_class(FIL_IO_IMPORT) == FIL_IO_FOREGROUND);
+    start = now_sec();
+    tokens[0] = _fil_sched_acquire(1000000);
+    CHECK(now_sec() - start < 0.05);
+    for (i = 1; i < 4; i++) {
+        tokens[i] = _fil_sched_acquire(1000000);
+    }
+    elapsed = now_sec() - start;
+    CHECK(elapsed > 0.18 && elapsed < 2);
+    for (i = 0; i < 4; i++) {
+        CHECK(tokens[i] == FIL_IO_IMPORT + 1);
+        _fil_sched_release(tokens[i]);
+    }
+    /* the foreground is not limited */
+    fil_set_io_class(FIL_IO_FOREGROUND);
+    start = now_sec();
+    for (i = 0; i < 4; i++) {
+        _fil_sched_release(_fil_sched_acquire(1000000));
+    }
+    CHECK(now_sec() - start < 0.05);
+    CHECK(fil_sched_configure(FIL_IO_IMPORT, 0, 0, 0) == 0);
+
+    /* one operation in flight, the next waits for its release */
+    CHECK(fil_sched_configure(FIL_IO_PURGE, 1, 0, 0) == 0);
+    fil_set_io_class(FIL_IO_PURGE);
+    tokens[0] = _fil_sched_acquire(0);
+    sched_acquired = 0;
+    CHECK(pthread_create(&thread, NULL, sched_waiter, NULL) == 0);
+    usleep(50000);
+    CHECK(!sched_acquired);
+    _fil_sched_release(tokens[0]);
+    pthread_join(thread, NULL);
+    CHECK(sched_acquired);
+    CHECK(fil_sched_configure(FIL_IO_PURGE, 0, 0, 0) == 0);
+    fil_set_io_class(FIL_IO_FOREGROUND);
+    CHECK(_fil_sched_acquire(1 << 20) == 0);
+}
+
+/* Submission and completion accounting of the rings, with entries that
+   complete at once as they have no handle */
+static void test_ring() {
+    struct fil_ring* ring;
+    struct fil_sqe* sqe;
+    struct fil_cqe cqes[8];
+    int i;
+
+    CHECK(fil_ring_create(0) == NULL);
+    CHECK((ring = fil_ring_create(4)) != NULL);
+    CHECK(fil_ring_submit(ring) == 0);
+    CHECK(fil_ring_reap(ring, cqes, 8, 8) == 0);
+
+    /* the submission ring holds 4 entries */
+    for (i = 0; i < 4; i++) {
+        CHECK((sqe = fil_ring_get_sqe(ring)) != NULL);
+        sqe->opcode = FIL_RING_READ;
+        sqe->user_data = i;
+    }
+    CHECK(fil_ring_get_sqe(ring) == NULL);
+    CHECK(fil_ring_submit(ring) == 4);
+
+    /* the slots are taken until reaped, the next entries stay queued */
+    for (i = 4; i < 8; i++) {
+        CHECK((sqe = fil_ring_get_sqe(ring)) != NULL);
+        sqe->opcode = FIL_RING_FSYNC;
+        sqe->user_data = i;
+    }
+    CHECK(fil_ring_get_sqe(ring) == NULL);
+    CHECK(fil_ring_submit(ring) == 0);
+
+    /* in order of completion, at most max */
+    CHECK(fil_ring_reap(ring, cqes, 3, 1) == 3);
+    for (i = 0; i < 3; i++) {
+        CHECK(cqes[i].user_data == (uint64_t) i && cqes[i].result == -1);
+    }
+    CHECK(fil_ring_submit(ring) == 3);
+    CHECK(fil_ring_get_sqe(ring) != NULL);
+    CHECK(fil_ring_get_sqe(ring) != NULL);
+    CHECK(fil_ring_get_sqe(ring) != NULL);
+    CHECK(fil_ring_get_sqe(ring) == NULL);
+
+    /* waiting for more than in flight returns what is there */
+    CHECK(fil_ring_reap(ring, cqes, 8, 8) == 4);
+    CHECK(cqes[0].user_data == 3);
+    for (i = 1; i < 4; i++) {
+        CHECK(cqes[i].user_data == (uint64_t) i + 3 && cqes[i].result == -1);
+    }
+    CHECK(fil_ring_submit(ring) == 4);
+    CHECK(fil_ring_reap(ring, cqes, 8, 0) == 4);
+    CHECK(cqes[0].user_data == 7);
+    CHECK(fil_ring_reap(ring, cqes, 8, 1) == 0);
+    fil_ring_destroy(ring);
+}
+
+static void md_publish(void* arg, const char* msg, size_t len) {
+    (void) arg;
+    (void) msg;
+    (void) len;
+}
+
+static int md_list(void* arg, const char* name, os_file_type_t type) {
+    (void) type;
+    strcat((char*) arg, name);
+    strcat((char*) arg, ",");
+    return 0;
+}
+
+static const char* md_names(const char* dirpath) {
+    static char names[256];
+
+    names[0] = '\0';
+    CHECK(fil_readdir(dirpath, md_list, names) >= 0);
+    return names;
+}
+
+static int md_receive(const char* msg) {
+    return fil_metadata_receive(msg, strlen(msg));
+}
+
+/* Catalog change notifications applied in order, a gap reloads the
+   catalog, which fails and keeps it without a cluster */
+static void test_metadata_loopback() {
+    const char* catalog =
+        "[{\"type\":1,\"deleted\":0,\"size\":0,\"block_size\":4096,\"path\":\"a\",\"id\":1}]";
+
+    CHECK(_fil_load_metadata_text("{}", 2, 1) == -1);
+    CHECK(_fil_load_metadata_text(catalog, strlen(catalog), 5) == 0);
+    CHECK(fil_metadata_watch_loopback(md_publish, NULL, 1) == 0);
+    CHECK(fil_metadata_watch_loopback(md_publish, NULL, 1) == -1);
+    CHECK(!strcmp(md_names(""), "a,"));
+
+    /* from another client, at the version we have */
+    CHECK(md_receive("{\"client\":2,\"prev\":5,\"version\":6,"
+        "\"upsert\":[{\"type\":1,\"deleted\":0,\"size\":0,\"block_size\":4096,\"path\":\"d/b\",\"id\":2}],"
+        "\"remove\":[{\"path\":\"a\",\"type\":1}]}") == 0);
+    CHECK(!strcmp(md_names(""), "d,"));
+    CHECK(!strcmp(md_names("d"), "b,"));
+
+    /* our own change, a change already read */
+    CHECK(md_receive("{\"client\":1,\"prev\":6,\"version\":7,"
+        "\"remove\":[{\"path\":\"d/b\",\"type\":1}]}") == 0);
+    CHECK(md_receive("{\"client\":2,\"prev\":5,\"version\":6,"
+        "\"remove\":[{\"path\":\"d/b\",\"type\":1}]}") == 0);
+    CHECK(!strcmp(md_names("d"), "b,"));
+
+    /* a change was missed, the reload fails and the catalog is kept */
+    CHECK(md_receive("{\"client\":2,\"prev\":10,\"version\":11,"
+        "\"remove\":[{\"path\":\"d/b\",\"type\":1}]}") == -1);
+    CHECK(!strcmp(md_names("d"), "b,"));
+
+    /* the next change in order still applies */
+    CHECK(md_receive("{\"client\":2,\"prev\":6,\"version\":7,"
+        "\"upsert\":[{\"type\":1,\"deleted\":1,\"size\":0,\"block_size\":4096,\"path\":\"d/b\",\"id\":2},"
+        "{\"type\":1,\"deleted\":0,\"size\":0,\"block_size\":4096,\"path\":\"c\",\"id\":3}]}") == 0);
+    CHECK(!strcmp(md_names(""), "c,"));
+
+    CHECK(md_receive("{\"client\":2,") == -1);
+    CHECK(md_receive("{\"client\":2,\"version\":8}") == -1);
+    fil_metadata_unwatch();
+}
+
+/*
+ * Tests against a cluster, run when FIL_TEST_POOL names a pool they may
+ * write to, with FIL_TEST_CLUSTER, FIL_TEST_USER and FIL_TEST_CONF.  The
+ * migrations are tested when FIL_TEST_POOL2 names a second pool.  The
+ * files go in a directory of their own, the tests playing another client
+ * rewrite the catalog object of the pool.
+ */
+extern rados_ioctx_t rados_io_context;
+extern const char *METADATA_OBJECT_NAME;
+
+static char test_dir[64];
+
+static const char* env_or(const char* name, const char* value) {
+    return getenv(name) ? getenv(name) : value;
+}
+
+/* Path of a test file, valid until the fourth next call */
+static char* tpath(const char* name) {
+    static char paths[4][256];
+    static int next;
+    char* path = paths[next++ % 4];
+
+    snprintf(path, sizeof(paths[0]), "%s/%s", test_dir, name);
+    return path;
+}
+
+/* Add a file to the catalog object as another client would, with the
+   id following the largest one of the catalog, or without id as the
+   files created before the ids were */
+static json_int_t other_client_create(const char* path, int with_id) {
+    json_t *catalog, *jfile;
+    json_error_t error;
+    json_int_t id = 0;
+    uint64_t size;
+    time_t mtime;
+    char *buf, *text;
+    size_t i;
+    int n;
+
+    CHECK(rados_stat(rados_io_context, METADATA_OBJECT_NAME, &size, &mtime) == 0);
+    CHECK((buf = malloc(size + 1)));
+    CHECK((n = rados_read(rados_io_context, METADATA_OBJECT_NAME, buf, size, 0)) == (int) size);
+    CHECK((catalog = json_loadb(buf, n, 0, &error)) && json_is_array(catalog));
+    json_array_foreach(catalog, i, jfile) {
+        if (json_integer_value(json_object_get(jfile, "id")) > id) {
+            id = json_integer_value(json_object_get(jfile, "id"));
+        }
+    }
+    id++;
+    CHECK((jfile = json_object()));
+    json_object_set_new(jfile, "type", json_integer(OS_FILE_TYPE_FILE));
+    json_object_set_new(jfile, "deleted", json_integer(0));
+    json_object_set_new(jfile, "nref", json_integer(0));
+    json_object_set_new(jfile, "size", json_integer(0));
+    json_object_set_new(jfile, "block_size", json_integer(4096));
+    json_object_set_new(jfile, "path", json_string(path));
+    if (with_id) {
+        json_object_set_new(jfile, "id", json_integer(id));
+    }
+    CHECK(json_array_append_new(catalog, jfile) == 0);
+    CHECK((text = json_dumps(catalog, JSON_COMPACT)));
+    CHECK(rados_write_full(rados_io_context, METADATA_OBJECT_NAME, text, strlen(text)) == 0);
+    free(text);
+    free(buf);
+    json_decref(catalog);
+    return id;
+}
+
+/* A file created after another client saved the catalog gets an id of
+   its own, not the one the other client took meanwhile */
+static void test_catalog_conflict() {
+    FILErados_t *first, *mine, *other;
+    char buf[8];
+
+    CHECK((first = fil_open_create(tpath("first"), OS_FILE_TYPE_FILE, 4096)));
+    CHECK(fil_close(first) == 0);
+    other_client_create(tpath("other"), 1);
+
+    CHECK((mine = fil_open_create(tpath("mine"), OS_FILE_TYPE_FILE, 4096)));
+    CHECK((other = fil_open(tpath("other"), OS_FILE_TYPE_FILE)));
+    CHECK(strcmp(mine->metadata.prefix, other->metadata.prefix) != 0);
+    CHECK(fil_write(other, "OTHER", 5, 0) == 5);
+    CHECK(fil_write(mine, "MINE", 4, 0) == 4);
+    CHECK(fil_read(other, buf, 5, 0) == 5 && !memcmp(buf, "OTHER", 5));
+    CHECK(fil_close(mine) == 0);
+    CHECK(fil_close(other) == 0);
+
+    CHECK(fil_delete_file(tpath("first"), OS_FILE_TYPE_FILE) == 0);
+    CHECK(fil_delete_file(tpath("mine"), OS_FILE_TYPE_FILE) == 0);
+    CHECK(fil_delete_file(tpath("other"), OS_FILE_TYPE_FILE) == 0);
+}
+
+/* The ids come from the counter of the pool, even when the catalog of
+   this client is behind */
+static void test_file_ids() {
+    FILErados_t *fp;
+    char counter[24];
+    int len;
+
+    CHECK(rados_setxattr(rados_io_context, "metadata.next_id", "fil_next_id", "100000", 6) == 0);
+    CHECK((fp = fil_open_create(tpath("ids"), OS_FILE_TYPE_FILE, 4096)));
+    CHECK(strcmp(fp->metadata.prefix, "ino.100000") == 0);
+    CHECK(fil_close(fp) == 0);
+    CHECK((len = rados_getxattr(rados_io_context, "metadata.next_id", "fil_next_id",
+        counter, sizeof(counter) - 1)) > 0);
+    counter[len] = '\0';
+    CHECK(strcmp(counter, "100001") == 0);
+    CHECK(fil_delete_file(tpath("ids"), OS_FILE_TYPE_FILE) == 0);
+}
+
+/* A renamed file keeps its objects, named after its id, or after its
+   first path for the files without id */
+static void test_rename() {
+    FILErados_t *fp;
+    char obj[300], prefix[256], buf[8];
+    uint64_t size;
+    time_t mtime;
+
+    CHECK((fp = fil_open_create(tpath("new"), OS_FILE_TYPE_FILE, 4096)));
+    CHECK(fil_write(fp, "DATA", 4, 0) == 4);
+    snprintf(prefix, sizeof(prefix), "%s", fp->metadata.prefix);
+    CHECK(fil_close(fp) == 0);
+    CHECK(fil_rename(tpath("new"), tpath("renamed"), OS_FILE_TYPE_FILE) == 0);
+    CHECK(fil_open(tpath("new"), OS_FILE_TYPE_FILE) == NULL);
+    CHECK((fp = fil_open(tpath("renamed"), OS_FILE_TYPE_FILE)));
+    CHECK(strcmp(fp->metadata.prefix, prefix) == 0);
+    CHECK(fil_read(fp, buf, 4, 0) == 4 && !memcmp(buf, "DATA", 4));
+    CHECK(fil_close(fp) == 0);
+    CHECK(fil_delete_file(tpath("renamed"), OS_FILE_TYPE_FILE) == 0);
+
+    /* the objects of a file without id are named after its path */
+    snprintf(obj, sizeof(obj), "%s_0", tpath("legacy"));
+    CHECK(rados_write_full(rados_io_context, obj, "OLD", 3) == 0);
+    other_client_create(tpath("legacy"), 0);
+    /* saving the catalog reads the entry of the other client */
+    CHECK(fil_mkdir(tpath("dir")) == 0);
+    CHECK(fil_rmdir(tpath("dir")) == 0);
+    CHECK(fil_rename(tpath("legacy"), tpath("moved"), OS_FILE_TYPE_FILE) == 0);
+    CHECK(fil_rename(tpath("moved"), tpath("moved again"), OS_FILE_TYPE_FILE) == 0);
+    CHECK((fp = fil_open(tpath("moved again"), OS_FILE_TYPE_FILE)));
+    CHECK(strcmp(fp->metadata.prefix, tpath("legacy")) == 0);
+    CHECK(fil_read(fp, buf, 3, 0) == 3 && !memcmp(buf, "OLD", 3));
+    CHECK(fil_close(fp) == 0);
+    CHECK(fil_delete_file(tpath("moved again"), OS_FILE_TYPE_FILE) == 0);
+    fil_purge_wait();
+    CHECK(rados_stat(rados_io_context, obj, &size, &mtime) == -ENOENT);
+}
+
+/* The end of file recorded by a handle is not lowered by another one
+   opened before the file grew, and the purge finds all the objects */
+static void test_eof_record() {
+    FILErados_t *a, *b, *c;
+    struct fil_iovec iov;
+    char obj[300], page[4096];
+    uint64_t size;
+    time_t mtime;
+
+    CHECK((a = fil_open_create(tpath("eof"), OS_FILE_TYPE_FILE, 4096)));
+    CHECK((b = fil_open(tpath("eof"), OS_FILE_TYPE_FILE)));
+    CHECK(fil_write(a, "A", 1, 10*4096) == 1);
+    CHECK(fil_write(b, "B", 1, 2*4096) == 1);
+    CHECK((c = fil_open(tpath("eof"), OS_FILE_TYPE_FILE)));
+    CHECK(fil_get_size(c) == 10*4096 + 1);
+    CHECK(fil_close(c) == 0);
+
+    /* the vectored writes and the appends record it once written */
+    iov.buf = "V";
+    iov.len = 1;
+    iov.offset = 20*4096;
+    CHECK(fil_writev(b, &iov, 1) == 1);
+    memset(page, 'P', sizeof(page));
+    CHECK(fil_append(b, page, sizeof(page)) == sizeof(page) && fil_append_sync(b) == 0);
+    CHECK((c = fil_open(tpath("eof"), OS_FILE_TYPE_FILE)));
+    CHECK(fil_get_size(c) == 21*4096 + 1);
+    snprintf(obj, sizeof(obj), "%s_%d", c->metadata.prefix, 21*4096);
+    CHECK(fil_close(c) == 0);
+    CHECK(fil_close(b) == 0);
+    CHECK(fil_close(a) == 0);
+    CHECK(fil_delete_file(tpath("eof"), OS_FILE_TYPE_FILE) == 0);
+    fil_purge_wait();
+    CHECK(rados_stat(rados_io_context, obj, &size, &mtime) == -ENOENT);
+}
+
+/* Vectored reads and writes, across blocks, the overlapping extents
+   of a write are written in the order given */
+static void test_vectored() {
+    FILErados_t *fp;
+    struct fil_iovec iov[3];
+    char buf[8], head[4], tail[4];
+
+    CHECK((fp = fil_open_create(tpath("vec"), OS_FILE_TYPE_FILE, 4096)));
+    CHECK(fil_write(fp, "......", 6, 0) == 6);
+    iov[0].buf = "AAAA";
+    iov[0].len = 4;
+    iov[0].offset = 2;
+    iov[1].buf = "BB";
+    iov[1].len = 2;
+    iov[1].offset = 1;
+    iov[2].buf = "CCCC";
+    iov[2].len = 4;
+    iov[2].offset = 4096 - 2;
+    CHECK(fil_writev(fp, iov, 3) == 10);
+
+    iov[0].buf = buf;
+    iov[0].len = 6;
+    iov[0].offset = 0;
+    iov[1].buf = head;
+    iov[1].len = 2;
+    iov[1].offset = 4096 - 2;
+    iov[2].buf = tail;
+    iov[2].len = 4;
+    iov[2].offset = 4096;
+    /* stops at the end of the file */
+    CHECK(fil_readv(fp, iov, 3) == 10);
+    CHECK(!memcmp(buf, ".BBAAA", 6));
+    CHECK(!memcmp(head, "CC", 2));
+    CHECK(!memcmp(tail, "CC", 2));
+    CHECK(fil_close(fp) == 0);
+    CHECK(fil_delete_file(tpath("vec"), OS_FILE_TYPE_FILE) == 0);
+}
+
+/* An atomic write is held by a block, it may extend the file */
+static void test_write_atomic() {
+    FILErados_t *fp, *other;
+    char page[4096], buf[4096], zero[4096];
+
+    CHECK((fp = fil_open_create(tpath("atomic"), OS_FILE_TYPE_FILE, 4096)));
+    CHECK(fil_atomic_write_unit(fp) == 4096);
+    memset(page, 'W', sizeof(page));
+    memset(zero, 0, sizeof(zero));
+    CHECK(fil_write_atomic(fp, page, sizeof(page), 4096) == sizeof(page));
+    CHECK(fil_write_atomic(fp, "XY", 2, 4096 + 10) == 2);
+    memcpy(page + 10, "XY", 2);
+    /* a write crossing a block boundary is refused */
+    CHECK(fil_write_atomic(fp, page, 100, 2*4096 - 50) == -1);
+    CHECK(fil_write_atomic(fp, page, 0, 0) == -1);
+
+    CHECK((other = fil_open(tpath("atomic"), OS_FILE_TYPE_FILE)));
+    CHECK(fil_get_size(other) == 2*4096);
+    CHECK(fil_read(other, buf, sizeof(buf), 0) == sizeof(buf) && !memcmp(buf, zero, sizeof(buf)));
+    CHECK(fil_read(other, buf, sizeof(buf), 4096) == sizeof(buf) && !memcmp(buf, page, sizeof(buf)));
+    CHECK(fil_close(other) == 0);
+    CHECK(fil_close(fp) == 0);
+    CHECK(fil_delete_file(tpath("atomic"), OS_FILE_TYPE_FILE) == 0);
+}
+
+/* The appends land in order across the blocks, a lost one is reported
+   when the handle is closed */
+static void test_append() {
+    FILErados_t *fp, *other;
+    char chunk[1000], buf[5000], obj[300];
+    int i;
+
+    CHECK((fp = fil_open_create(tpath("log"), OS_FILE_TYPE_FILE, 4096)));
+    for (i = 0; i < 5; i++) {
+        memset(chunk, 'a' + i, sizeof(chunk));
+        CHECK(fil_append(fp, chunk, sizeof(chunk)) == sizeof(chunk));
+    }
+    CHECK(fil_append_sync(fp) == 0);
+    CHECK(fil_get_size(fp) == sizeof(buf));
+    CHECK((other = fil_open(tpath("log"), OS_FILE_TYPE_FILE)));
+    CHECK(fil_get_size(other) == sizeof(buf));
+    CHECK(fil_read(other, buf, sizeof(buf), 0) == sizeof(buf));
+    for (i = 0; i < (int) sizeof(buf); i++) {
+        CHECK(buf[i] == 'a' + i / 1000);
+    }
+    CHECK(fil_close(other) == 0);
+    CHECK(fil_close(fp) == 0);
+    CHECK(fil_delete_file(tpath("log"), OS_FILE_TYPE_FILE) == 0);
+
+    /* an append past osd_max_object_size, 128 MB by default, fails */
+    CHECK((fp = fil_open_create(tpath("big log"), OS_FILE_TYPE_FILE, 1UL << 30)));
+    CHECK(fil_write(fp, "L", 1, 0) == 1);
+    snprintf(obj, sizeof(obj), "%s_0", fp->metadata.prefix);
+    CHECK(fil_close(fp) == 0);
+    CHECK(rados_setxattr(rados_io_context, obj, "fil_size", "134217728", 9) == 0);
+    CHECK((fp = fil_open(tpath("big log"), OS_FILE_TYPE_FILE)));
+    CHECK(fil_append(fp, "Y", 1) == 1);
+    CHECK(fil_close(fp) == -1);
+    CHECK(fil_delete_file(tpath("big log"), OS_FILE_TYPE_FILE) == 0);
+}
+
+/* Generation of a file, odd while a handle writes it */
+static unsigned long long file_gen(const char* obj) {
+    char gen[24];
+    int len;
+
+    CHECK((len = rados_getxattr(rados_io_context, obj, "fil_gen", gen, sizeof(gen) - 1)) > 0);
+    gen[len] = '\0';
+    return strtoull(gen, NULL, 10);
+}
+
+/* The local cache serves the blocks read at the generation of the file,
+   not the ones written by another client since */
+static void test_local_cache() {
+    FILErados_t *fp;
+    char dir[] = "/tmp/fil_rados_test.XXXXXX";
+    char obj[2][300], page[4096], buf[4096], path[64], value[24];
+    unsigned long long gen;
+    int i;
+
+    CHECK(mkdtemp(dir) != NULL);
+    CHECK(fil_local_cache_configure(dir, 16*4096, 4096, FIL_LCACHE_WRITE_AROUND) == 0);
+    CHECK((fp = fil_open_create(tpath("cached"), OS_FILE_TYPE_FILE, 4096)));
+    memset(page, 'C', sizeof(page));
+    CHECK(fil_write(fp, page, sizeof(page), 0) == sizeof(page));
+    CHECK(fil_write(fp, page, sizeof(page), 4096) == sizeof(page));
+    for (i = 0; i < 2; i++) {
+        snprintf(obj[i], sizeof(obj[i]), "%s_%d", fp->metadata.prefix, i*4096);
+    }
+    CHECK((gen = file_gen(obj[0])) & 1);
+    CHECK(fil_close(fp) == 0);
+    CHECK(file_gen(obj[0]) == (gen & ~1ULL));
+
+    /* a block changed without a new generation is served from the cache */
+    CHECK((fp = fil_open(tpath("cached"), OS_FILE_TYPE_FILE)));
+    CHECK(fil_read(fp, buf, sizeof(buf), 4096) == sizeof(buf) && !memcmp(buf, page, sizeof(buf)));
+    CHECK(rados_write(rados_io_context, obj[1], "X", 1, 0) == 0);
+    CHECK(fil_read(fp, buf, sizeof(buf), 4096) == sizeof(buf) && buf[0] == 'C');
+    CHECK(fil_close(fp) == 0);
+
+    /* not while another client writes the file */
+    snprintf(value, sizeof(value), "%llu", gen);
+    CHECK(rados_setxattr(rados_io_context, obj[0], "fil_gen", value, strlen(value)) == 0);
+    CHECK((fp = fil_open(tpath("cached"), OS_FILE_TYPE_FILE)));
+    CHECK(fil_read(fp, buf, sizeof(buf), 4096) == sizeof(buf) && buf[0] == 'X');
+    CHECK(fil_close(fp) == 0);
+    /* nor once it closed the file, at the new generation */
+    snprintf(value, sizeof(value), "%llu", (gen + 1) & ~1ULL);
+    CHECK(rados_setxattr(rados_io_context, obj[0], "fil_gen", value, strlen(value)) == 0);
+    CHECK((fp = fil_open(tpath("cached"), OS_FILE_TYPE_FILE)));
+    CHECK(fil_read(fp, buf, sizeof(buf), 4096) == sizeof(buf) && buf[0] == 'X');
+    CHECK(rados_write(rados_io_context, obj[1], "Y", 1, 0) == 0);
+    CHECK(fil_read(fp, buf, sizeof(buf), 4096) == sizeof(buf) && buf[0] == 'X');
+    CHECK(fil_close(fp) == 0);
+
+    CHECK(fil_delete_file(tpath("cached"), OS_FILE_TYPE_FILE) == 0);
+    CHECK(fil_local_cache_configure(NULL, 0, 0, FIL_LCACHE_WRITE_AROUND) == 0);
+    snprintf(path, sizeof(path), "%s/index", dir);
+    CHECK(unlink(path) == 0);
+    snprintf(path, sizeof(path), "%s/data", dir);
+    CHECK(unlink(path) == 0);
+    CHECK(rmdir(dir) == 0);
+}
+
+/* A migration copies the blocks, holes kept, a failed one leaves none
+   of them in the new pool, even without the end of file recorded */
+static void test_migrate(const char* pool) {
+    FILErados_t *fp;
+    rados_ioctx_t dst;
+    char obj[4][300], page[4096], buf[4096], zero[4096];
+    uint64_t size;
+    time_t mtime;
+    int i;
+
+    CHECK(rados_ioctx_create(rados_ioctx_get_cluster(rados_io_context), pool, &dst) == 0);
+    CHECK((fp = fil_open_create(tpath("mig"), OS_FILE_TYPE_FILE, 4096)));
+    memset(page, 'M', sizeof(page));
+    memset(zero, 0, sizeof(zero));
+    for (i = 0; i < 4; i++) {
+        if (i != 1) {
+            CHECK(fil_write(fp, page, sizeof(page), i*4096) == sizeof(page));
+        }
+        snprintf(obj[i], sizeof(obj[i]), "%s_%d", fp->metadata.prefix, i*4096);
+    }
+
+    /* a file written before the end of file was recorded, the size
+       attribute of its last block can't be read by the copy */
+    CHECK(fil_get_size(fp) == 4*4096);
+    CHECK(rados_rmxattr(rados_io_context, obj[0], "fil_eof") == 0);
+    CHECK(rados_setxattr(rados_io_context, obj[3], "fil_size", "000000000000000000000000016384", 30) == 0);
+    CHECK(fil_migrate(fp, pool, 1) == -1);
+    for (i = 0; i < 4; i++) {
+        CHECK(rados_stat(dst, obj[i], &size, &mtime) == -ENOENT);
+    }
+    CHECK(fil_read(fp, buf, sizeof(buf), 2*4096) == sizeof(buf) && !memcmp(buf, page, sizeof(buf)));
+
+    CHECK(rados_setxattr(rados_io_context, obj[3], "fil_size", "16384", 5) == 0);
+    CHECK(rados_setxattr(rados_io_context, obj[0], "fil_eof", "00000000000000012288", 20) == 0);
+    CHECK(fil_migrate(fp, pool, 4) == 0);
+    for (i = 0; i < 4; i++) {
+        CHECK(rados_stat(rados_io_context, obj[i], &size, &mtime) == -ENOENT);
+        CHECK(rados_stat(dst, obj[i], &size, &mtime) == (i == 1 ? -ENOENT : 0));
+    }
+    CHECK(fil_read(fp, buf, sizeof(buf), 4096) == sizeof(buf) && !memcmp(buf, zero, sizeof(buf)));
+    CHECK(fil_read(fp, buf, sizeof(buf), 3*4096) == sizeof(buf) && !memcmp(buf, page, sizeof(buf)));
+    CHECK(fil_close(fp) == 0);
+
+    CHECK(fil_delete_file(tpath("mig"), OS_FILE_TYPE_FILE) == 0);
+    fil_purge_wait();
+    for (i = 0; i < 4; i++) {
+        CHECK(rados_stat(dst, obj[i], &size, &mtime) == -ENOENT);
+    }
+    rados_ioctx_destroy(dst);
+}
+
+static void test_cluster() {
+    snprintf(test_dir, sizeof(test_dir), "fil_rados_test.%d", (int) getpid());
+    CHECK(fil_rados_init(env_or("FIL_TEST_CLUSTER", "ceph"), env_or("FIL_TEST_USER", "admin"),
+        getenv("FIL_TEST_POOL"), env_or("FIL_TEST_CONF", "/etc/ceph/ceph.conf")) == 0);
+    CHECK(fil_mkdir(test_dir) == 0);
+    test_catalog_conflict();
+    test_file_ids();
+    test_rename();
+    test_eof_record();
+    test_vectored();
+    test_write_atomic();
+    test_append();
+    test_local_cache();
+    if (getenv("FIL_TEST_POOL2")) {
+        test_migrate(getenv("FIL_TEST_POOL2"));
+    }
+    CHECK(fil_rmdir(test_dir) == 0);
+    fil_purge_wait();
+    fil_rados_destroy();
+}
+
 int main() {
+    test_block_header();
+    test_is_zero();
+    test_bufpool();
+    test_sched();
+    test_ring();
+    test_metadata_loopback();
+    if (getenv("FIL_TEST_POOL")) {
+        test_cluster();
+    }
     printf("ok\n");
     exit(0);
 }
@@ -0,0 +1,79 @@
+/* vim: ts=4 sts=4 sw=4 expandtab */
+/*
+ * Static tracepoints (USDT / SystemTap SDT) for radosfile.
+ *
+ * Build with -DHAVE_SYS_SDT_H (systemtap-sdt-dev installed) to get the
+ * probes, otherwise they compile to nothing.  When built in, an unattached
+ * probe is a single nop, so they are safe to leave in production builds.
+ *
+ * Provider is "radosfile", the probes and their arguments are:
+ *
+ *   fil_read_entry          (path, offset, len)
+ *   fil_read_return         (path, offset, len, result)
+ *   fil_write_entry         (path, offset, len)
+ *   fil_write_return        (path, offset, len, result)
+ *   rados_read_entry        (object, offset, len)
+ *   rados_read_return       (object, offset, len, result)
+ *   rados_write_entry       (object, offset, len)
+ *   rados_write_return      (object, offset, len, result)
+ *   fil_readv_entry         (path, iovcnt)
+ *   fil_readv_return        (path, iovcnt, result)
+ *   fil_writev_entry        (path, iovcnt)
+ *   fil_writev_return       (path, iovcnt, result)
+ *   fil_append_entry        (path, offset, len)
+ *   fil_append_return       (path, offset, len, result)
+ *   fil_append_sync_entry   (path, in_flight)
+ *   fil_append_sync_return  (path, result)
+ *   fil_fsync_entry         (path, datasync)
+ *   fil_fsync_return        (path, result)
+ *   fil_aio_dispatch        (path, n_requests, n_ops)
+ *   rados_readop_entry      (object, n_extents, len)
+ *   rados_readop_return     (object, n_extents, len, result)
+ *   rados_writeop_entry     (object, n_extents, len)
+ *   rados_writeop_return    (object, n_extents, len, result)
+ *   rados_hole_entry        (object, offset, len)
+ *   rados_hole_return       (object, offset, len, result)
+ *   rados_remove_entry      (object)
+ *   rados_remove_return     (object, result)
+ *   metadata_update_entry   (object)
+ *   metadata_update_return  (object, len, result)
+ *   metadata_load_entry     (object)
+ *   metadata_load_return    (object, len, result)
+ *
+ * e.g. with bpftrace:
+ *   bpftrace -e 'usdt:./libradosfile.so:radosfile:rados_read_entry
+ *                { @start[tid] = nsecs; @obj[tid] = str(arg0); }
+ *                usdt:./libradosfile.so:radosfile:rados_read_return
+ *                { @lat[@obj[tid]] = hist(nsecs - @start[tid]); }'
+ */
+#ifndef FIL_RADOS_TRACE_H
+#define FIL_RADOS_TRACE_H
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define FIL_PROBE1(name, a1) \
+	STAP_PROBE1(radosfile, name, a1)
+#define FIL_PROBE2(name, a1, a2) \
+	STAP_PROBE2(radosfile, name, a1, a2)
+#define FIL_PROBE3(name, a1, a2, a3) \
+	STAP_PROBE3(radosfile, name, a1, a2, a3)
+#define FIL_PROBE4(name, a1, a2, a3, a4) \
+	STAP_PROBE4(radosfile, name, a1, a2, a3, a4)
+
+#else
+
+/* the arguments are referenced but never evaluated */
+#define FIL_PROBE1(name, a1) \
+	do { if (0) { (void) (a1); } } while (0)
+#define FIL_PROBE2(name, a1, a2) \
+	do { if (0) { (void) (a1); (void) (a2); } } while (0)
+#define FIL_PROBE3(name, a1, a2, a3) \
+	do { if (0) { (void) (a1); (void) (a2); (void) (a3); } } while (0)
+#define FIL_PROBE4(name, a1, a2, a3, a4) \
+	do { if (0) { (void) (a1); (void) (a2); (void) (a3); (void) (a4); } } while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* FIL_RADOS_TRACE_H */